@@ -12,6 +12,7 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace ra2yrcpp::asio_utils;
 namespace lib = websocketpp::lib;
@@ -49,16 +50,29 @@ struct IOService::IOService_impl {
   void reset() { guard_.reset(); }
 };
 
-IOService::IOService()
-    : service_(std::make_unique<IOService_impl>()), main_thread_() {
-  main_thread_ = std::make_unique<std::thread>(
-      [](IOService_impl* srv) { srv->run(); }, service_.get());
+IOService::IOService(const std::size_t num_threads,
+                     std::function<void()> on_start)
+    : service_(std::make_unique<IOService_impl>()) {
+  const std::size_t n = num_threads > 0U ? num_threads : 1U;
+  util::AtomicVariable<std::size_t> started(0U);
+  for (std::size_t i = 0U; i < n; i++) {
+    threads_.emplace_back([this, &started, on_start]() {
+      if (on_start != nullptr) {
+        on_start();
+      }
+      started.update([](auto* v) { (*v)++; });
+      service_->run();
+    });
+  }
+  started.wait(n);
 }
 
 IOService::~IOService() {
   service_->reset();
-  main_thread_->join();
-  dprintf("exit main thread");
+  for (auto& t : threads_) {
+    t.join();
+  }
+  dprintf("exit io threads");
 }
 
 void IOService::post(std::function<void()> fn, const bool wait) {
@@ -70,6 +84,8 @@ void IOService::post(std::function<void()> fn, const bool wait) {
   }
 }
 
+std::size_t IOService::num_threads() const { return threads_.size(); }
+
 void* IOService::get_service() {
   return reinterpret_cast<void*>(&service_->service_);
 }
@@ -81,17 +97,24 @@ AsioSocket::AsioSocket(std::shared_ptr<IOService> srv)
       socket_(std::make_unique<AsioSocket::socket_impl>(
           *reinterpret_cast<ios_t*>(srv->get_service()))) {}
 
+AsioSocket::AsioSocket(IOService* srv)
+    : socket_(std::make_unique<AsioSocket::socket_impl>(
+          *reinterpret_cast<ios_t*>(srv->get_service()))) {}
+
 AsioSocket::~AsioSocket() {
   lib::error_code ec;
-  auto& s = *socket_.get();
-
-  s.shutdown(lib::asio::socket_base::shutdown_both, ec);
+  shutdown();
+  socket_->close(ec);
   if (ec) {
-    eprintf("socket shutdown failed: ", ec.message());
+    eprintf("socket close failed: ", ec.message());
   }
-  s.close(ec);
+}
+
+void AsioSocket::shutdown() {
+  lib::error_code ec;
+  socket_->shutdown(lib::asio::socket_base::shutdown_both, ec);
   if (ec) {
-    eprintf("socket close failed: ", ec.message());
+    eprintf("socket shutdown failed: ", ec.message());
   }
 }
 
@@ -99,6 +122,7 @@ void AsioSocket::connect(const std::string host, const std::string port) {
   socket_->connect(
       lib::asio::ip::tcp::endpoint{lib::asio::ip::address_v4::from_string(host),
                                    static_cast<u16>(std::stoi(port))});
+  socket_->set_option(lib::asio::ip::tcp::no_delay(true));
 }
 
 std::size_t AsioSocket::write(const std::string& buffer) {
@@ -112,6 +136,30 @@ std::size_t AsioSocket::write(const std::string& buffer) {
   return count;
 }
 
+std::size_t AsioSocket::write(
+    std::initializer_list<std::string_view> buffers) {
+  std::vector<lib::asio::const_buffer> b;
+  b.reserve(buffers.size());
+  for (const auto& v : buffers) {
+    b.emplace_back(v.data(), v.size());
+  }
+  lib::error_code ec;
+  std::size_t count = lib::asio::write(*socket_.get(), b, ec);
+  if (ec) {
+    throw std::runtime_error(fmt::format("failed to write: {}", ec.message()));
+  }
+  return count;
+}
+
+std::size_t AsioSocket::read_some(void* dst, const std::size_t size) {
+  lib::error_code ec;
+  std::size_t count = socket_->read_some(lib::asio::buffer(dst, size), ec);
+  if (ec) {
+    throw std::runtime_error(fmt::format("failed to read: {}", ec.message()));
+  }
+  return count;
+}
+
 std::string AsioSocket::read() {
   lib::error_code ec;
   std::string rsp;
@@ -3,32 +3,44 @@
 #include <cstddef>
 
 #include <functional>
+#include <initializer_list>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
 namespace ra2yrcpp {
 namespace asio_utils {
 
 class IOService {
  public:
-  IOService();
+  /// @param num_threads number of threads running the service
+  /// @param on_start function to invoke in each thread before it starts
+  /// running the service. The constructor returns after all threads have
+  /// invoked it.
+  explicit IOService(const std::size_t num_threads = 1U,
+                     std::function<void()> on_start = nullptr);
   ~IOService();
   void post(std::function<void()> fn, const bool wait = true);
   void* get_service();
+  std::size_t num_threads() const;
 
  private:
   struct IOService_impl;
 
   std::unique_ptr<IOService_impl> service_;
-  std::unique_ptr<std::thread> main_thread_;
+  std::vector<std::thread> threads_;
 };
 
 struct AsioSocket {
   AsioSocket();
   explicit AsioSocket(std::shared_ptr<IOService> srv);
+  /// Create socket for service that's owned by the caller.
+  explicit AsioSocket(IOService* srv);
   ~AsioSocket();
 
+  /// Connect to given host. Disables Nagle's algorithm.
   void connect(const std::string host, const std::string port);
   /// Synchronously write the buffer to the socket
   ///
@@ -36,6 +48,23 @@ struct AsioSocket {
   /// @exception std::runtime_error on write failure
   std::size_t write(const std::string& buffer);
 
+  /// Synchronously write all buffers to the socket with a single gather
+  /// write.
+  ///
+  /// @return amount of bytes transferred.
+  /// @exception std::runtime_error on write failure
+  std::size_t write(std::initializer_list<std::string_view> buffers);
+
+  /// Synchronously read at most size bytes from the socket.
+  ///
+  /// @return amount of bytes read
+  /// @exception std::runtime_error on read failure, or if the connection was
+  /// closed
+  std::size_t read_some(void* dst, const std::size_t size);
+
+  /// Shutdown both directions of the connection. Unblocks pending reads.
+  void shutdown();
+
   /// Synchronously read from the socket.
   /// @exception std::runtime_error on read failure
   std::string read();
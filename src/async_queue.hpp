@@ -1,10 +1,13 @@
 #pragma once
+#include "config.hpp"
 #include "logging.hpp"
+#include "ring_buffer.hpp"
 #include "utility/time.hpp"
 
 #include <cstdint>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <functional>
@@ -12,6 +15,7 @@
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -127,8 +131,186 @@ class AsyncQueue : public AsyncContainer {
 
   std::size_t size() const { return q_.size(); }
 
+  ///
+  /// Invoke fn with pointer to the underlying container while holding the
+  /// queue lock. Useful for reading container specific statistics.
+  ///
+  template <typename Fn>
+  auto apply(Fn fn) {
+    std::unique_lock<std::mutex> l(a_.get()->m);
+    return fn(&q_);
+  }
+
+ private:
+  QueueT q_;
+  std::size_t max_size_;
+};
+
+///
+/// AsyncQueue variant backed by a random access container. Items matching a
+/// predicate are extracted in a single pass, and the remaining items are
+/// compacted in place, keeping their relative order.
+///
+/// Producers and consumers wait on separate condition variables, so that
+/// pushing an item only wakes up consumers and popping only wakes up
+/// producers.
+///
+/// QueueT must provide emplace(), operator[] (0 being the oldest item),
+/// pop_back() and size().
+///
+template <typename T, typename QueueT = ring_buffer::RingBuffer<T>>
+class AsyncRandomAccessQueue {
+ public:
+  using queue_t = QueueT;
+
+  explicit AsyncRandomAccessQueue(std::size_t max_size = 0U)
+      : max_size_(max_size), changes_(0U), lock_waits_(0U) {}
+
+  explicit AsyncRandomAccessQueue(QueueT q, std::size_t max_size = 0U)
+      : q_(std::move(q)),
+        max_size_(max_size),
+        changes_(0U),
+        lock_waits_(0U) {}
+
+  AsyncRandomAccessQueue(const AsyncRandomAccessQueue&) = delete;
+  AsyncRandomAccessQueue& operator=(const AsyncRandomAccessQueue&) = delete;
+
+  void push(T t) { emplace(std::move(t)); }
+
+  ///
+  /// Put an item to the queue. If the queue is bounded, block until free space
+  /// is available.
+  ///
+  void emplace(T&& t) {
+    {
+      auto l = lock();
+      if (max_size_ > 0U && q_.size() >= max_size_) {
+        not_full_.wait(l, [&] { return q_.size() < max_size_; });
+      }
+      q_.emplace(std::move(t));
+      changes_++;
+    }
+    not_empty_.notify_all();
+  }
+
+  ///
+  /// Wake up consumers waiting for items, so that they re-evaluate their
+  /// predicates. Used when an item that didn't match a predicate may now
+  /// match it.
+  ///
+  void notify() {
+    {
+      auto l = lock();
+      changes_++;
+    }
+    not_empty_.notify_all();
+  }
+
+  ///
+  /// Pop items matching predicate, oldest first. If count < 1, pop all
+  /// matching items. If timeout > 0, block up to that amount until the queue
+  /// is non-empty, or until count items have been popped.
+  ///
+  template <typename Pred = std::nullptr_t>
+  std::vector<T> pop(const std::size_t count = 1,
+                     const duration_t timeout = 0.0s,
+                     Pred predicate = nullptr) {
+    std::vector<T> res;
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::min(timeout, cfg::MAX_TIMEOUT));
+    auto l = lock();
+    while (true) {
+      if (timeout > 0.0s &&
+          !not_empty_.wait_until(l, deadline, [&] { return !q_.empty(); })) {
+        break;
+      }
+      const std::size_t n = extract(count, predicate, &res);
+      if (n > 0U) {
+        not_full_.notify_all();
+      }
+      if (count < 1 || res.size() >= count || timeout <= 0.0s) {
+        break;
+      }
+      // Wait for new or changed items
+      const u64 c = changes_;
+      if (!not_empty_.wait_until(l, deadline,
+                                 [&] { return changes_ != c; })) {
+        break;
+      }
+    }
+    return res;
+  }
+
+  bool empty() {
+    auto l = lock();
+    return q_.empty();
+  }
+
+  std::size_t size() {
+    auto l = lock();
+    return q_.size();
+  }
+
+  ///
+  /// Invoke fn with pointer to the underlying container while holding the
+  /// queue lock.
+  ///
+  template <typename Fn>
+  auto apply(Fn fn) {
+    auto l = lock();
+    return fn(&q_);
+  }
+
+  /// Number of times the queue lock was contended.
+  std::size_t lock_waits() const { return lock_waits_.load(); }
+
  private:
+  std::unique_lock<std::mutex> lock() {
+    std::unique_lock<std::mutex> l(m_, std::try_to_lock);
+    if (!l.owns_lock()) {
+      lock_waits_++;
+      l.lock();
+    }
+    return l;
+  }
+
+  /// Move up to count (all if < 1) matching items to res in one pass. Returns
+  /// number of items moved.
+  template <typename Pred>
+  std::size_t extract(const std::size_t count, Pred& predicate,
+                      std::vector<T>* res) {
+    const std::size_t n = q_.size();
+    const std::size_t n0 = res->size();
+    std::size_t w = 0U;
+    for (std::size_t i = 0U; i < n; i++) {
+      auto& it = q_[i];
+      bool take = count < 1 || res->size() < count;
+      if constexpr (!std::is_same_v<Pred, std::nullptr_t>) {
+        take = take && predicate(it);
+      }
+      if (take) {
+        res->emplace_back(std::move(it));
+      } else {
+        if (w != i) {
+          q_[w] = std::move(it);
+        }
+        w++;
+      }
+    }
+    while (q_.size() > w) {
+      q_.pop_back();
+    }
+    return res->size() - n0;
+  }
+
+  std::mutex m_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
   QueueT q_;
   std::size_t max_size_;
+  /// Incremented on each push and notify()
+  u64 changes_;
+  std::atomic<std::size_t> lock_waits_;
 };
 };  // namespace async_queue
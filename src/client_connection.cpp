@@ -7,6 +7,13 @@ ClientConnection::ClientConnection(std::string host, std::string port)
 
 void ClientConnection::send_data(vecu8&& bytes) { send_data(bytes); }
 
+void ClientConnection::read_message(
+    const std::function<void(std::string_view)>& fn) {
+  auto data = read_data();
+  fn(std::string_view(reinterpret_cast<const char*>(data.data()),
+                      data.size()));
+}
+
 void ClientConnection::stop() {}
 
 util::AtomicVariable<ra2yrcpp::connection::State>& ClientConnection::state() {
@@ -3,8 +3,10 @@
 #include "types.h"
 #include "utility/sync.hpp"
 
+#include <functional>
 #include <mutex>
 #include <string>
+#include <string_view>
 
 namespace ra2yrcpp::connection {
 
@@ -30,6 +32,14 @@ class ClientConnection {
   /// @exception std::runtime_error on read failure
   /// @exception ra2yrcpp::protocol_error
   virtual vecu8 read_data() = 0;
+  ///
+  /// Read a message and pass it to fn. The view is only valid during the
+  /// call. Transports that can avoid copying the message override this, others
+  /// use read_data().
+  ///
+  /// @exception std::runtime_error on read failure
+  /// @exception ra2yrcpp::protocol_error
+  virtual void read_message(const std::function<void(std::string_view)>& fn);
   virtual void stop();
   util::AtomicVariable<ra2yrcpp::connection::State>& state();
 
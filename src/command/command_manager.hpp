@@ -3,9 +3,14 @@
 #include "async_queue.hpp"
 #include "config.hpp"
 #include "logging.hpp"
+#include "mpsc_queue.hpp"
 #include "ring_buffer.hpp"
 #include "types.h"
+#include "utility/intrusive_ptr.hpp"
+#include "utility/perfect_hash.hpp"
+#include "utility/sharded_registry.hpp"
 #include "utility/sync.hpp"
+#include "utility/thread_pool.hpp"
 
 #include <fmt/chrono.h>
 
@@ -15,15 +20,18 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <exception>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <shared_mutex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -39,6 +47,15 @@ enum class ResultCode { NONE = 0, OK, ERROR };
 
 enum class CommandType { DESTROY_QUEUE = 1, CREATE_QUEUE, SHUTDOWN, USER };
 
+template <typename T>
+class CommandPool;
+
+template <typename T>
+class PendingCommands;
+
+/// Command id of built-in commands, which have no handler.
+constexpr u32 no_command = ~0U;
+
 template <typename T>
 class Command {
  public:
@@ -46,29 +63,37 @@ class Command {
   using handler_t = std::function<void(Command<T>*)>;
 
   struct BaseData {
-    std::string name;
+    u32 command_id;  // index of the handler, no_command for built-ins
     u64 queue_id;
     u64 task_id;
     u64 queue_size;  // built-int arg
     CommandType type;
+    bool serial;  // must not run concurrently with other commands
     BaseData() = delete;
   };
 
   Command() = delete;
-
-  Command(BaseData B, handler_t handler, T&& data,
+  Command(const Command&) = delete;
+  Command& operator=(const Command&) = delete;
+
+  /// @param B command metadata
+  /// @param handler pointer to the command function. Must outlive the command.
+  /// @param data command arguments
+  /// @param done_callback invoked after successful command function execution
+  Command(const BaseData& B, const handler_t* handler, T&& data,
           handler_t done_callback = nullptr)
       : base_data_(B),
         handler_(handler),
-        command_data_(data),
+        command_data_(std::move(data)),
         result_code_(ResultCode::NONE),
         pending_(false),
         discard_result_(false),
-        done_callback_(done_callback) {}
+        done_callback_(std::move(done_callback)),
+        refs_(0U) {}
 
   // TODO(shmocz): could set error/result just here
   void run() {
-    handler_(this);
+    (*handler_)(this);
     if (done_callback_) {
       done_callback_(this);
     }
@@ -79,6 +104,10 @@ class Command {
 
   CommandType type() const { return base_data_.type; }
 
+  bool serial() const { return base_data_.serial; }
+
+  u32 command_id() const { return base_data_.command_id; }
+
   u64 queue_id() const { return base_data_.queue_id; }
 
   u64 task_id() const { return base_data_.task_id; }
@@ -91,7 +120,7 @@ class Command {
 
   std::atomic_bool& discard_result() { return discard_result_; }
 
-  handler_t& handler() { return handler_; }
+  const handler_t* handler() const { return handler_; }
 
   std::string& error_message() { return error_message_; }
 
@@ -115,12 +144,64 @@ class Command {
       eprintf("async command: {}", e.what());
       set_error(e.what());
     }
-    pending_.store(false);
+    if (pending_tracker_ != nullptr) {
+      // May release the last reference to this object
+      auto t = pending_tracker_;
+      t->complete(this);
+    } else {
+      pending_.store(false);
+    }
+  }
+
+  /// Set the tracker which is notified about completion of the async part of
+  /// this command. Must be set before the command is executed.
+  void set_pending_tracker(std::shared_ptr<PendingCommands<T>> t) {
+    pending_tracker_ = std::move(t);
   }
 
+  void add_ref() { refs_.fetch_add(1U, std::memory_order_relaxed); }
+
+  /// Drop a reference. The last reference returns the object to it's pool, or
+  /// deletes it if it doesn't belong to one.
+  void release() {
+    if (refs_.fetch_sub(1U, std::memory_order_acq_rel) == 1U) {
+      if (pool_ != nullptr) {
+        pool_->recycle(this);
+      } else {
+        delete this;
+      }
+    }
+  }
+
+  std::size_t use_count() const { return refs_.load(); }
+
  private:
+  friend class CommandPool<T>;
+
+  /// Reinitialize recycled object. Keeps previously allocated buffers where
+  /// possible.
+  void reset(const BaseData& B, const handler_t* handler, T&& data,
+             handler_t done_callback) {
+    base_data_ = B;
+    handler_ = handler;
+    command_data_ = std::move(data);
+    result_code_.store(ResultCode::NONE);
+    pending_.store(false);
+    discard_result_.store(false);
+    error_message_.clear();
+    done_callback_ = std::move(done_callback);
+  }
+
+  /// Release resources held by the command data and callbacks.
+  void clear() {
+    command_data_ = T();
+    done_callback_ = nullptr;
+    async_handler_ = nullptr;
+    pending_tracker_ = nullptr;
+  }
+
   BaseData base_data_;
-  handler_t handler_;
+  const handler_t* handler_;
   T command_data_;
   util::AtomicVariable<ResultCode> result_code_;
   util::AtomicVariable<bool> pending_;
@@ -128,86 +209,317 @@ class Command {
   std::string error_message_;
   handler_t done_callback_;
   handler_t async_handler_;
+  std::atomic<std::size_t> refs_;
+  std::shared_ptr<CommandPool<T>> pool_;
+  std::shared_ptr<PendingCommands<T>> pending_tracker_;
 };
 
-/// Executes command handlers in single thread.
+///
+/// Tracks commands whose async part hasn't completed yet, keyed by task id.
+/// Holds a reference to each tracked command, so that the command stays valid
+/// until the async handler has been run. The pending flag is checked and
+/// cleared under the same lock, so a command can't be left in the tracker if
+/// it completes concurrently with add().
+///
+template <typename T>
+class PendingCommands {
+ public:
+  using command_t = Command<T>;
+  using command_ptr_t = utility::IntrusivePtr<command_t>;
+  using callback_t = std::function<void(command_t*)>;
+
+  /// @param on_complete invoked after the pending flag of a command has been
+  /// cleared
+  explicit PendingCommands(callback_t on_complete = nullptr)
+      : on_complete_(std::move(on_complete)) {}
+
+  /// Start tracking cmd, if it's still pending.
+  /// @return true if the command was added
+  bool add(const command_ptr_t& cmd) {
+    std::unique_lock<std::mutex> l(mut_);
+    if (!cmd->pending().get()) {
+      return false;
+    }
+    cmds_.try_emplace(cmd->task_id(), cmd);
+    return true;
+  }
+
+  /// Clear pending flag of cmd and stop tracking it.
+  void complete(command_t* cmd) {
+    command_ptr_t ref;
+    {
+      std::unique_lock<std::mutex> l(mut_);
+      cmd->pending().store(false);
+      auto it = cmds_.find(cmd->task_id());
+      if (it != cmds_.end()) {
+        ref = std::move(it->second);
+        cmds_.erase(it);
+      }
+      if (on_complete_ != nullptr) {
+        on_complete_(cmd);
+      }
+    }
+  }
+
+  std::size_t size() {
+    std::unique_lock<std::mutex> l(mut_);
+    return cmds_.size();
+  }
+
+  /// Drop references to all tracked commands, and stop invoking the
+  /// completion callback.
+  void clear() {
+    std::unordered_map<u64, command_ptr_t> c;
+    {
+      std::unique_lock<std::mutex> l(mut_);
+      c.swap(cmds_);
+      on_complete_ = nullptr;
+    }
+  }
+
+ private:
+  std::mutex mut_;
+  std::unordered_map<u64, command_ptr_t> cmds_;
+  callback_t on_complete_;
+};
+
+///
+/// Recycles Command objects, so that allocating a new command object and it's
+/// synchronization primitives isn't needed for every request. Commands return
+/// to the pool when their last reference is dropped. Each outstanding command
+/// keeps the pool alive.
+///
+template <typename T>
+class CommandPool : public std::enable_shared_from_this<CommandPool<T>> {
+ public:
+  using command_t = Command<T>;
+  using command_ptr_t = utility::IntrusivePtr<command_t>;
+  using handler_t = typename command_t::handler_t;
+
+  struct Stats {
+    std::size_t created;  // objects allocated
+    std::size_t reused;   // objects taken from the free list
+    std::size_t free;     // objects currently in the free list
+  };
+
+  /// @param max_free maximum number of objects kept for reuse
+  explicit CommandPool(const std::size_t max_free = cfg::COMMAND_POOL_SIZE)
+      : max_free_(max_free), created_(0U), reused_(0U) {
+    free_.reserve(max_free_);
+  }
+
+  CommandPool(const CommandPool&) = delete;
+  CommandPool& operator=(const CommandPool&) = delete;
+
+  ~CommandPool() {
+    for (auto* c : free_) {
+      delete c;
+    }
+  }
+
+  command_ptr_t acquire(const typename command_t::BaseData& B,
+                        const handler_t* handler, T&& data,
+                        handler_t done_callback = nullptr) {
+    command_t* c = nullptr;
+    {
+      std::unique_lock<std::mutex> l(mut_);
+      if (!free_.empty()) {
+        c = free_.back();
+        free_.pop_back();
+      }
+    }
+    if (c != nullptr) {
+      c->reset(B, handler, std::move(data), std::move(done_callback));
+      reused_++;
+    } else {
+      c = new command_t(B, handler, std::move(data), std::move(done_callback));
+      created_++;
+    }
+    c->pool_ = this->shared_from_this();
+    return command_ptr_t(c);
+  }
+
+  Stats stats() {
+    std::unique_lock<std::mutex> l(mut_);
+    return {created_.load(), reused_.load(), free_.size()};
+  }
+
+ private:
+  friend class Command<T>;
+
+  void recycle(command_t* c) {
+    // Drop the pool reference last, since it may destroy the pool.
+    auto keep = std::move(c->pool_);
+    c->clear();
+    {
+      std::unique_lock<std::mutex> l(mut_);
+      if (free_.size() < max_free_) {
+        free_.push_back(c);
+        return;
+      }
+    }
+    delete c;
+  }
+
+  const std::size_t max_free_;
+  std::atomic<std::size_t> created_;
+  std::atomic<std::size_t> reused_;
+  std::mutex mut_;
+  std::vector<command_t*> free_;
+};
+
+/// Command handler with it's execution constraints.
+template <typename T>
+struct CommandEntry {
+  using handler_t = typename Command<T>::handler_t;
+
+  CommandEntry(handler_t handler = nullptr,  // NOLINT
+               const bool serial = false)
+      : handler(handler), serial(serial) {}
+
+  handler_t handler;
+  /// If set, the command is never executed concurrently with other commands.
+  bool serial;
+};
+
+/// Executes command handlers in a pool of worker threads.
 /// Commands are std::function objects that accept T* as their parameter.
+///
+/// Built-in commands are executed by a dispatcher thread, which forwards USER
+/// commands to a per-queue strand. Commands of the same queue are executed in
+/// submission order, while commands of different queues may run in parallel.
 template <typename T>
 class CommandManager {
  public:
   using command_t = Command<T>;
-  using command_ptr_t = std::shared_ptr<command_t>;
+  using pool_t = CommandPool<T>;
+  using command_ptr_t = typename pool_t::command_ptr_t;
   using handler_t = typename Command<T>::handler_t;
+  using entry_t = CommandEntry<T>;
   // TODO: use worker_util
-  using result_q_t =
-      async_queue::AsyncQueue<command_ptr_t,
-                              ring_buffer::RingBuffer<command_ptr_t>>;
-  using results_q_t = std::map<u64, std::shared_ptr<result_q_t>>;
-
-  class QueueCompare {
-   public:
-    bool operator()(command_ptr_t left, command_ptr_t right) {
-      return left->type() >= right->type();
-    }
-  };
-
-  explicit CommandManager(const duration_t results_acquire_timeout =
-                              cfg::COMMAND_RESULTS_ACQUIRE_TIMEOUT)
-      : results_acquire_timeout_(results_acquire_timeout),
-        command_counter_(0U) {}
+  using result_q_t = async_queue::AsyncRandomAccessQueue<
+      command_ptr_t, ring_buffer::RingBuffer<command_ptr_t>>;
+  using results_q_t = utility::ShardedRegistry<u64, result_q_t>;
+  using work_queue_t = mpsc_queue::MPSCQueue<command_ptr_t>;
+
+  explicit CommandManager(
+      const duration_t results_acquire_timeout =
+          cfg::COMMAND_RESULTS_ACQUIRE_TIMEOUT,
+      const std::size_t num_workers = cfg::COMMAND_WORKER_THREADS)
+      : num_workers_(num_workers),
+        command_counter_(0U),
+        handler_table_(std::make_shared<HandlerTable>()),
+        cmd_pool_(std::make_shared<pool_t>()),
+        pending_(std::make_shared<PendingCommands<T>>([this](command_t* c) {
+          // Wake up consumers waiting for the result
+          if (auto q = results_queue(c->queue_id())) {
+            q->notify();
+          }
+        })),
+        results_queue_(results_acquire_timeout) {}
+
+  ~CommandManager() {
+    // Break reference cycles between the tracker and it's commands
+    pending_->clear();
+  }
 
   void create_queue(const u64 id, const std::size_t max_size = -1u) {
-    auto [l, q] = aq_results_queue();
-    if (q->find(id) != q->end()) {
+    // TODO(shmocz) avoid referencing queue_t
+    if (!results_queue_.insert(
+            id, std::make_shared<result_q_t>(
+                    typename result_q_t::queue_t(max_size)))) {
       eprintf("existing queue_id={}", id);
-      return;
     }
-    // TODO(shmocz) avoid referencing queue_t
-    q->try_emplace(id, std::make_shared<result_q_t>(
-                           typename result_q_t::queue_t(max_size)));
   }
 
-  void destroy_queue(const u64 id) {
-    auto [l, q] = aq_results_queue();
-    q->erase(id);
+  void destroy_queue(const u64 id) { (void)results_queue_.erase(id); }
+
+  /// Get results queue by id, or nullptr if it doesn't exist. Never blocks.
+  std::shared_ptr<result_q_t> results_queue(const u64 id) const {
+    return results_queue_.find(id);
   }
 
-  auto aq_results_queue() {
-    try {
-      return util::acquire(&results_queue_, &mut_results_,
-                           results_acquire_timeout_);
-    } catch (const std::exception& e) {
-      throw std::runtime_error(
-          fmt::format("failed to acquire results queue within {}: {}",
-                      results_acquire_timeout_, e.what()));
+  /// Results queue registry. Lookups and iteration don't block on queue
+  /// creation or destruction.
+  const results_q_t& results_queues() const { return results_queue_; }
+
+  u32 add_command(const std::string name, handler_t handler,
+                  const bool serial = false) {
+    return add_command(name, entry_t(handler, serial));
+  }
+
+  ///
+  /// Register command handler. Commands get dense ids in registration order.
+  /// Re-registering an existing name replaces the handler and keeps the id.
+  /// Can be called while commands are being executed, but rebuilds the lookup
+  /// table, so use add_commands() to register many commands at once.
+  ///
+  /// @return id of the command
+  ///
+  u32 add_command(const std::string name, entry_t entry) {
+    std::unique_lock<std::mutex> l(mut_handlers_);
+    const u32 id = register_command(name, std::move(entry));
+    publish_handlers();
+    return id;
+  }
+
+  ///
+  /// Register multiple command handlers, building the lookup table only once.
+  ///
+  template <typename Map>
+  void add_commands(const Map& commands) {
+    std::unique_lock<std::mutex> l(mut_handlers_);
+    for (const auto& [name, entry] : commands) {
+      (void)register_command(name, entry_t(entry));
     }
+    publish_handlers();
   }
 
-  void add_command(const std::string name, handler_t handler) {
-    handlers_[name] = handler;
+  ///
+  /// Get id of a command by it's name or protobuf type URL (only the part after
+  /// the last slash is used).
+  ///
+  /// @return command id, or no_command if the command doesn't exist
+  ///
+  u32 command_id(std::string_view name) const {
+    const auto p = name.rfind('/');
+    if (p != std::string_view::npos) {
+      name.remove_prefix(p + 1U);
+    }
+    const auto H = std::atomic_load(&handler_table_);
+    const auto* id = H->ids.find(name);
+    return id != nullptr ? *id : no_command;
   }
 
-  command_ptr_t make_command(const std::string name, T&& data,
-                             const u64 queue_id,
+  command_ptr_t make_command(const u32 id, T&& data, const u64 queue_id,
                              handler_t done_callback = nullptr) {
-    std::unique_lock<std::mutex> l(command_counter_mut_);
-    typename command_t::BaseData B = {name, queue_id, ++command_counter_, 0U,
-                                      CommandType::USER};
-    handler_t handler = nullptr;
-
-    auto C = std::make_shared<command_t>(B, handlers_.at(name), std::move(data),
-                                         done_callback);
+    const auto H = std::atomic_load(&handler_table_);
+    if (id >= H->entries.size()) {
+      throw std::out_of_range(fmt::format("no such command id {}", id));
+    }
+    auto& e = *H->entries[id];
+    typename command_t::BaseData B = {
+        id, queue_id, next_task_id(), 0U, CommandType::USER, e.serial};
+    auto C = cmd_pool_->acquire(B, &e.handler, std::move(data),
+                                std::move(done_callback));
+    C->set_pending_tracker(pending_);
     return C;
   }
 
-  command_ptr_t make_async_command(const std::string name, T&& data,
-                                   const u64 queue_id) {
-    std::unique_lock<std::mutex> l(command_counter_mut_);
-    typename command_t::BaseData B = {name, queue_id, ++command_counter_, 0U,
-                                      CommandType::USER};
+  command_ptr_t make_command(const std::string& name, T&& data,
+                             const u64 queue_id,
+                             handler_t done_callback = nullptr) {
+    const u32 id = command_id(name);
+    if (id == no_command) {
+      throw std::out_of_range(fmt::format("no such command {}", name));
+    }
+    return make_command(id, std::move(data), queue_id,
+                        std::move(done_callback));
+  }
 
-    auto C =
-        std::make_shared<command_t>(B, handlers_.at(name), std::move(data));
+  command_ptr_t make_async_command(const std::string& name, T&& data,
+                                   const u64 queue_id) {
+    auto C = make_command(name, std::move(data), queue_id);
     C->set_async_handler([](auto*) {});
     return C;
   }
@@ -220,30 +532,30 @@ class CommandManager {
   /// @return the same shared_ptr to Command object
   command_ptr_t make_builtin_command(const u64 queue_id, const u64 queue_size,
                                      CommandType t) {
-    typename command_t::BaseData B{"", queue_id, 0U, queue_size, t};
-    auto C = std::make_shared<command_t>(B, nullptr, T());
-    std::unique_lock<std::mutex> l(command_counter_mut_);
-    command_counter_++;
-    return C;
+    typename command_t::BaseData B{no_command, queue_id, 0U,
+                                   queue_size, t,        false};
+    (void)next_task_id();
+    return cmd_pool_->acquire(B, nullptr, T());
   }
 
+  /// Command object allocation statistics.
+  typename pool_t::Stats pool_stats() { return cmd_pool_->stats(); }
+
   /// Push command message into work queue to be executed
   ///
   /// @param c shared_ptr to the Command object
   /// @return the same shared_ptr to Command object
   command_ptr_t enqueue_command(command_ptr_t c) {
-    std::unique_lock<std::mutex> k(work_queue_mut_);
-    // TODO(shmocz): use uptr
-    work_queue_.push(c);
-    work_queue_cv_.notify_all();
+    emplace_command(command_ptr_t(c));
     return c;
   }
 
+  /// Push command into work queue without locking. Built-in commands are put
+  /// to a separate lane, which the dispatcher drains before any USER commands.
   void emplace_command(command_ptr_t&& c) {
-    std::unique_lock<std::mutex> k(work_queue_mut_);
-    // TODO(shmocz): use uptr
-    work_queue_.emplace(std::move(c));
-    work_queue_cv_.notify_all();
+    auto& q = c->type() == CommandType::USER ? work_user_ : work_builtin_;
+    q.emplace(std::move(c));
+    worker_parker_.unpark();
   }
 
   /// Built-in command functions
@@ -285,8 +597,6 @@ class CommandManager {
     emplace_user_command(std::move(cmd));
   }
 
-  // TODO(shmocz): could create internal command to clear the pending_tasks
-  // vector in thread safe fashion.
   void emplace_user_command(command_ptr_t&& cmd) {
     cmd->result_code().store(ResultCode::NONE);
     try {
@@ -297,67 +607,57 @@ class CommandManager {
       cmd->set_error(e.what());
     }
 
-    // TODO(shmocz): race condition for pending check? command added many times?
-    auto [l, rq] = aq_results_queue();
-    // TODO(shmocz): pending flag might become cleared right after entering the
-    // block below, causing it to be never cleared again
-    if (cmd->pending().get()) {
-      std::unique_lock<decltype(pending_commands_mut_)> lp(
-          pending_commands_mut_);
-      pending_commands_.push_back(cmd->task_id());
-    }
+    // Keep async commands alive until completion, even if the result is
+    // discarded.
+    (void)pending_->add(cmd);
 
     if (cmd->discard_result()) {
       return;
     }
 
     const u64 queue_id = cmd->queue_id();
-    try {
-      results_queue_.at(queue_id)->emplace(std::move(cmd));
-    } catch (const std::out_of_range& e) {
+    auto q = results_queue(queue_id);
+    if (q == nullptr) {
       eprintf("queue {} not found, result discarded", queue_id);
+      return;
     }
+    q->emplace(std::move(cmd));
   }
 
-  std::vector<u64>& pending_commands() { return pending_commands_; }
+  /// Number of commands whose async part hasn't completed.
+  std::size_t pending_count() { return pending_->size(); }
 
   std::vector<command_ptr_t> flush_results(const u64 id,
                                            const duration_t timeout = 0.0s,
                                            const std::size_t count = 0U) {
-    auto [l, rq] = aq_results_queue();
-
-    if (rq->find(id) == rq->end()) {
+    auto q = results_queue(id);
+    if (q == nullptr) {
       throw std::out_of_range(fmt::format("no such queue {}", id));
     }
-    std::shared_ptr<result_q_t>& q = rq->at(id);
-
-    l.unlock();
     // pop all non pending results
-    auto res =
-        q->pop(count, timeout, [](auto& c) { return !c->pending().get(); });
-    std::unique_lock<decltype(pending_commands_mut_)> lk(pending_commands_mut_);
-    auto& p = pending_commands();
-    p.erase(std::remove_if(p.begin(), p.end(),
-                           [&res](u64 task_id) {
-                             return std::find_if(res.begin(), res.end(),
-                                                 [&task_id](auto& d) {
-                                                   return d->task_id() ==
-                                                          task_id;
-                                                 }) != res.end();
-                           }),
-            p.end());
-    return res;
+    return q->pop(count, timeout, [](auto& c) { return !c->pending().get(); });
+  }
+
+  /// Pop result of the given command, waiting up to timeout for it to
+  /// complete. Results of other commands are left to the queue.
+  /// @return the result, or empty vector on timeout
+  /// @exception std::out_of_range if the queue doesn't exist
+  std::vector<command_ptr_t> flush_result(const u64 id, const u64 task_id,
+                                          const duration_t timeout) {
+    auto q = results_queue(id);
+    if (q == nullptr) {
+      throw std::out_of_range(fmt::format("no such queue {}", id));
+    }
+    return q->pop(1U, timeout, [task_id](auto& c) {
+      return c->task_id() == task_id && !c->pending().get();
+    });
   }
 
   void worker() {
     dprintf("Spawn worker");
 
     while (active_) {
-      // Wait for work
-      std::unique_lock<std::mutex> k(work_queue_mut_);
-      work_queue_cv_.wait(k, [this] { return work_queue_.size() > 0u; });
-      command_ptr_t cmd = work_queue_.top();
-      work_queue_.pop();
+      command_ptr_t cmd = pop_work();
       switch (cmd->type()) {
         case CommandType::CREATE_QUEUE: {
           create_queue(cmd->queue_id(), cmd->queue_size());
@@ -365,14 +665,14 @@ class CommandManager {
         } break;
         case CommandType::DESTROY_QUEUE: {
           destroy_queue(cmd->queue_id());
+          strands_.erase(cmd->queue_id());
           cmd->result_code().store(ResultCode::OK);
         } break;
         case CommandType::SHUTDOWN:
           active_ = false;
           break;
         case CommandType::USER: {
-          k.unlock();
-          emplace_user_command(std::move(cmd));
+          dispatch_user_command(std::move(cmd));
         } break;
         default:
           throw std::runtime_error("Unknown command type");
@@ -385,6 +685,7 @@ class CommandManager {
     if (worker_thread_ != nullptr) {
       throw std::runtime_error("command manager worker thread already exists");
     }
+    pool_ = std::make_unique<utility::ThreadPool>(num_workers_);
     worker_thread_ = std::make_unique<std::thread>([this]() {
       try {
         this->worker();
@@ -397,23 +698,102 @@ class CommandManager {
   void shutdown() {
     enqueue_command(make_builtin_command(0U, 0U, CommandType::SHUTDOWN));
     worker_thread_->join();
+    // Finishes remaining USER commands
+    strands_.clear();
+    pool_ = nullptr;
   }
 
  private:
+  /// Immutable snapshot of the registered commands. Replaced as a whole on
+  /// registration, so that lookups never block.
+  struct HandlerTable {
+    utility::PerfectHashTable<u32> ids;
+    /// Handler of each command id
+    std::vector<const entry_t*> entries;
+  };
+
+  /// Add or replace a handler. mut_handlers_ must be held.
+  u32 register_command(const std::string& name, entry_t entry) {
+    auto [it, inserted] = handler_ids_.try_emplace(
+        name, static_cast<u32>(handler_entries_.size()));
+    const auto* e = &handlers_.emplace_back(std::move(entry));
+    if (inserted) {
+      handler_entries_.push_back(e);
+    } else {
+      handler_entries_[it->second] = e;
+    }
+    return it->second;
+  }
+
+  /// Build a new lookup table and publish it. mut_handlers_ must be held.
+  void publish_handlers() {
+    std::vector<std::pair<std::string, u32>> items(handler_ids_.begin(),
+                                                   handler_ids_.end());
+    auto H = std::make_shared<HandlerTable>();
+    H->ids = utility::PerfectHashTable<u32>(std::move(items));
+    H->entries = handler_entries_;
+    std::atomic_store(&handler_table_,
+                      std::shared_ptr<const HandlerTable>(std::move(H)));
+  }
+
+  /// Take next command from the work queue, parking the worker thread until
+  /// one is available. Built-in commands take precedence.
+  command_ptr_t pop_work() {
+    command_ptr_t cmd;
+    while (!work_builtin_.try_pop(&cmd) && !work_user_.try_pop(&cmd)) {
+      worker_parker_.park();
+    }
+    return cmd;
+  }
+
+  u64 next_task_id() {
+    return command_counter_.fetch_add(1U, std::memory_order_relaxed) + 1U;
+  }
+
+  /// Schedule USER command to the strand of it's queue. Serial commands wait
+  /// for all other commands to finish before executing and vice versa.
+  void dispatch_user_command(command_ptr_t&& cmd) {
+    auto& s = strands_[cmd->queue_id()];
+    if (s == nullptr) {
+      s = std::make_shared<utility::Strand>(pool_.get());
+    }
+    // Pass the reference as raw pointer, so that the task fits into
+    // std::function's small object buffer.
+    s->post([this, p = cmd.detach()]() {
+      command_ptr_t c(p, false);
+      if (c->serial()) {
+        std::unique_lock<util::WriterPreferringMutex> l(exec_mut_);
+        emplace_user_command(std::move(c));
+      } else {
+        std::shared_lock<util::WriterPreferringMutex> l(exec_mut_);
+        emplace_user_command(std::move(c));
+      }
+    });
+  }
+
   std::atomic_bool active_{true};
-  duration_t results_acquire_timeout_;
-  std::size_t command_counter_;
-  std::mutex command_counter_mut_;
+  std::size_t num_workers_;
+  std::atomic<u64> command_counter_;
   std::unique_ptr<std::thread> worker_thread_;
-  std::priority_queue<command_ptr_t, std::vector<command_ptr_t>, QueueCompare>
-      work_queue_;
-  std::mutex pending_commands_mut_;
-  std::vector<u64> pending_commands_;
-  std::map<std::string, handler_t> handlers_;
-  std::condition_variable work_queue_cv_;
-  std::mutex work_queue_mut_;
+  work_queue_t work_builtin_;
+  work_queue_t work_user_;
+  util::Parker worker_parker_;
+  std::unique_ptr<utility::ThreadPool> pool_;
+  // Accessed only by the dispatcher thread
+  std::map<u64, std::shared_ptr<utility::Strand>> strands_;
+  // Serial commands take this exclusively, others shared. Writer preferring,
+  // so that a stream of non-serial commands can't starve serial ones.
+  util::WriterPreferringMutex exec_mut_;
+  // Registered handlers. Replaced handlers are kept, since commands may still
+  // reference them. deque keeps references to the handlers valid.
+  std::deque<entry_t> handlers_;
+  std::map<std::string, u32> handler_ids_;
+  std::vector<const entry_t*> handler_entries_;
+  std::mutex mut_handlers_;
+  std::shared_ptr<const HandlerTable> handler_table_;
+  std::shared_ptr<pool_t> cmd_pool_;
+  std::shared_ptr<PendingCommands<T>> pending_;
   results_q_t results_queue_;
-  std::timed_mutex mut_results_;
 };
 }  // namespace command
 
@@ -7,6 +7,7 @@
 #include <functional>
 #include <string>
 #include <utility>
+#include <vector>
 
 namespace ra2yrcpp {
 class InstrumentationService;
@@ -17,12 +18,27 @@ namespace ra2yrcpp {
 namespace gpb = google::protobuf;
 
 namespace command {
+///
+/// Collects deferred work (e.g. gameloop callbacks) of commands executed as
+/// part of a batch, so that the work can be submitted as a single unit.
+///
+struct WorkBatch {
+  using work_t = std::function<void()>;
+
+  std::vector<work_t> items;
+  /// Submits work to it's eventual executor. Set by the first deferred item.
+  std::function<void(work_t)> submit;
+};
+
 struct ISArg {
   void* instrumentation_service;
   gpb::Any M;
+  /// If set, deferred work is appended here instead of being submitted.
+  WorkBatch* batch = nullptr;
 };
 
 using iservice_cmd = Command<ISArg>;
+using iservice_cmd_entry = CommandEntry<ISArg>;
 
 ///
 /// Wrapper which takes a command function compatible with a supplied
@@ -42,7 +58,7 @@ using iservice_cmd = Command<ISArg>;
 ///
 template <typename T>
 struct ISCommand {
-  explicit ISCommand(iservice_cmd* c) : c(c) {
+  explicit ISCommand(iservice_cmd* c) : c(c), serialized_result_(false) {
     c->command_data()->M.UnpackTo(&command_data_);
   }
 
@@ -54,6 +70,9 @@ struct ISCommand {
   auto& command_data() { return command_data_; }
 
   void save_command_result() {
+    if (serialized_result_) {
+      return;
+    }
     // replace result, but only if pending is not set
     if (!c->pending().get()) {
       auto& p = c->command_data()->M;
@@ -65,11 +84,27 @@ struct ISCommand {
 
   ///
   /// Mark this command as async. Allocate the command result and set the
-  /// pending flag.
+  /// pending flag. The result is then owned by the async handler, and isn't
+  /// overwritten even if the handler completes before this object is destroyed.
   ///
   void async() {
     save_command_result();
     c->pending().store(true);
+    serialized_result_ = true;
+  }
+
+  ///
+  /// Set the command result in serialized form, e.g. to reuse already
+  /// serialized data. command_data() is ignored after this.
+  ///
+  /// @param bytes serialized message of type T
+  ///
+  void set_serialized_result(std::string&& bytes) {
+    auto* p = M();
+    p->set_type_url(std::string("type.googleapis.com/")
+                        .append(T::descriptor()->full_name()));
+    *p->mutable_value() = std::move(bytes);
+    serialized_result_ = true;
   }
 
   auto* I() {
@@ -81,32 +116,55 @@ struct ISCommand {
 
   iservice_cmd* c;
   T command_data_;
+  bool serialized_result_;
 };
 
+///
+/// @param fn command function
+/// @param async if set, mark the command as async
+/// @param serial if set, the command is never executed concurrently with other
+/// commands
+///
 template <typename MessageT>
-std::pair<std::string, iservice_cmd::handler_t> get_cmd(
-    std::function<void(ISCommand<MessageT>*)> fn, bool async = false) {
-  return {MessageT().GetTypeName(), [=](iservice_cmd* c) {
-            ISCommand<MessageT> Q(c);
-            if (async) {
-              Q.async();
-            }
-            try {
-              dprintf("exec {} ", MessageT().GetTypeName());
-              fn(&Q);
-            } catch (...) {
-              Q.M()->Clear();
-              throw;
-            }
-          }};
+std::pair<std::string, iservice_cmd_entry> get_cmd(
+    std::function<void(ISCommand<MessageT>*)> fn, bool async = false,
+    bool serial = false) {
+  // Avoids constructing a message just to get it's name
+  const std::string name = MessageT::descriptor()->full_name();
+  return {name,
+          iservice_cmd_entry(
+              [=](iservice_cmd* c) {
+                ISCommand<MessageT> Q(c);
+                if (async) {
+                  Q.async();
+                }
+                try {
+                  dprintf("exec {} ", name);
+                  fn(&Q);
+                } catch (...) {
+                  Q.M()->Clear();
+                  throw;
+                }
+              },
+              serial)};
 }
 
 template <typename MessageT>
-std::pair<std::string, iservice_cmd::handler_t> get_async_cmd(
+std::pair<std::string, iservice_cmd_entry> get_async_cmd(
     std::function<void(ISCommand<MessageT>*)> fn) {
   return get_cmd(fn, true);
 }
 
+///
+/// Command that modifies global state (e.g. installs hooks), and thus must not
+/// run concurrently with other commands.
+///
+template <typename MessageT>
+std::pair<std::string, iservice_cmd_entry> get_serial_cmd(
+    std::function<void(ISCommand<MessageT>*)> fn) {
+  return get_cmd(fn, false, true);
+}
+
 ///
 /// Unpacks the message stored in cmd->result() to appropriate message type, and
 /// returns pointer to the result and instance of the message.
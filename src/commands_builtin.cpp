@@ -7,17 +7,25 @@
 #include "hook.hpp"
 #include "instrumentation_service.hpp"
 #include "process.hpp"
+#include "protocol/protocol.hpp"
 #include "types.h"
 #include "util_string.hpp"
 
+#include <fmt/core.h>
 #include <xbyak/xbyak.h>
 
 #include <cstddef>
 
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <utility>
 #include <vector>
 
 using ra2yrcpp::command::get_cmd;
+using ra2yrcpp::command::get_serial_cmd;
 
 /// Adds two unsigned integers, and returns result in EAX
 struct TestProgram : Xbyak::CodeGenerator {
@@ -39,9 +47,154 @@ static void test_cb(hook::Hook*, void* data, X86Regs*) {
   I->store_value<vecu8>("test_key", s.begin(), s.end());
 }
 
+using batch_cmd_t = ra2yrcpp::command::ISCommand<
+    ra2yrproto::commands::CommandBatch>;
+
+/// Copy results of batched commands to B in submission order.
+static void store_batch_results(ra2yrproto::commands::CommandBatch* B,
+                                std::vector<ra2yrcpp::command_ptr_t>* cmds) {
+  for (std::size_t i = 0U; i < cmds->size(); i++) {
+    auto& c = (*cmds)[i];
+    if (c == nullptr) {
+      continue;
+    }
+    auto* r = B->mutable_results(static_cast<int>(i));
+    r->set_command_id(c->task_id());
+    r->mutable_result()->Swap(&c->command_data()->M);
+    if (c->result_code().get() == ra2yrcpp::command::ResultCode::ERROR) {
+      r->set_result_code(ra2yrcpp::RESPONSE_ERROR);
+      r->set_error_message(c->error_message());
+    } else {
+      r->set_result_code(ra2yrcpp::RESPONSE_OK);
+    }
+  }
+}
+
+///
+/// Completion state of a batch that has deferred work or async commands. The
+/// results are stored once the deferred work has been executed, and the async
+/// part of every command has completed.
+///
+struct BatchState {
+  std::mutex mut;
+  ra2yrcpp::command::iservice_cmd* C = nullptr;
+  std::vector<ra2yrcpp::command_ptr_t> cmds;
+  bool ready = false;
+  bool done = false;
+
+  /// Complete the batch command, if it's ready. Completes it only once.
+  void try_finish() {
+    {
+      std::unique_lock<std::mutex> l(mut);
+      if (done || !ready) {
+        return;
+      }
+      for (auto& c : cmds) {
+        if (c != nullptr && c->pending().get()) {
+          return;
+        }
+      }
+      done = true;
+    }
+    C->run_async_handler();
+  }
+
+  /// Mark the deferred work executed, and complete the batch if possible.
+  void set_ready() {
+    {
+      std::unique_lock<std::mutex> l(mut);
+      ready = true;
+    }
+    try_finish();
+  }
+};
+
+///
+/// Execute commands of a batch in order. Deferred (gameloop) work of the
+/// commands is submitted as a single unit, so that it's executed in the same
+/// frame. Serial commands and nested batches are rejected. Results of all
+/// commands, including the async ones, are stored by store_batch_results
+/// after every command has completed.
+///
+static void run_command_batch(batch_cmd_t* Q) {
+  auto& M = Q->I()->cmd_manager();
+  auto* C = Q->c;
+  auto& args = Q->command_data();
+  auto batch = std::make_shared<ra2yrcpp::command::WorkBatch>();
+  auto state = std::make_shared<BatchState>();
+  // Notified when the async part of a batched command completes, instead of
+  // the command manager, so that results go only to the batch.
+  auto tracker = std::make_shared<
+      ra2yrcpp::command::PendingCommands<ra2yrcpp::command::ISArg>>(
+      [w = std::weak_ptr<BatchState>(state)](auto*) {
+        if (auto st = w.lock()) {
+          st->try_finish();
+        }
+      });
+  std::vector<ra2yrcpp::command_ptr_t> cmds;
+  cmds.reserve(args.commands_size());
+
+  for (auto& a : *args.mutable_commands()) {
+    auto* r = args.add_results();
+    const auto id = M.command_id(a.type_url());
+    if (id == ra2yrcpp::command::no_command || id == C->command_id()) {
+      r->set_result_code(ra2yrcpp::RESPONSE_ERROR);
+      r->set_error_message(fmt::format("invalid command {}", a.type_url()));
+      cmds.emplace_back(nullptr);
+      continue;
+    }
+    auto c = M.make_command(
+        id, ra2yrcpp::command::ISArg{Q->I(), std::move(a), batch.get()},
+        C->queue_id());
+    c->set_pending_tracker(tracker);
+    try {
+      if (c->serial()) {
+        throw std::runtime_error("serial commands can't be batched");
+      }
+      c->run();
+      c->result_code().store(ra2yrcpp::command::ResultCode::OK);
+    } catch (const std::exception& e) {
+      c->set_error(e.what());
+    }
+    cmds.emplace_back(std::move(c));
+  }
+  args.clear_commands();
+
+  const bool pending =
+      std::any_of(cmds.begin(), cmds.end(), [](const auto& c) {
+        return c != nullptr && c->pending().get();
+      });
+  if (batch->items.empty() && !pending) {
+    store_batch_results(&args, &cmds);
+    return;
+  }
+
+  Q->async();
+  {
+    std::unique_lock<std::mutex> l(state->mut);
+    state->C = C;
+    state->cmds = cmds;
+  }
+  // Keeps the batch state alive until completion
+  C->set_async_handler([state, R = args](auto* c) mutable {
+    store_batch_results(&R, &state->cmds);
+    c->command_data()->M.PackFrom(R);
+  });
+  if (batch->items.empty()) {
+    state->set_ready();
+    return;
+  }
+  batch->submit([batch, state]() {
+    for (auto& w : batch->items) {
+      w();
+    }
+    state->set_ready();
+  });
+}
+
 // TODO(shmocz): ditch the old hook/cb test functions to use the common
 // functions
-std::map<std::string, ra2yrcpp::cmd_t::handler_t> get_commands_nn() {
+std::map<std::string, ra2yrcpp::cmd_entry_t> get_commands_nn() {
   return {
       get_cmd<ra2yrproto::commands::StoreValue>([](auto* Q) {
         // NB: ensure correct radix
@@ -52,21 +205,41 @@ std::map<std::string, ra2yrcpp::cmd_t::handler_t> get_commands_nn() {
       }),
       get_cmd<ra2yrproto::commands::GetSystemState>([](auto* Q) {
         auto* state = Q->command_data().mutable_state();
+        auto add_connection = [state](const int socket_id, const auto& ts) {
+          auto* conn = state->add_connections();
+          conn->set_socket_id(socket_id);
+          duration_t dur = ts.time_since_epoch();
+          conn->set_timestamp(dur.count());
+        };
         auto* srv = Q->I()->ws_server_.get();
-        srv->service_->post([state, srv]() {
+        {
+          std::unique_lock<std::mutex> l(srv->mut_conns_);
           for (const auto& [socket_id, c] : srv->ws_conns) {
-            auto* conn = state->add_connections();
-            conn->set_socket_id(socket_id);
-            duration_t dur = c.timestamp.time_since_epoch();
-            conn->set_timestamp(dur.count());
+            add_connection(socket_id, c.timestamp);
+          }
+        }
+        if (auto* tcp = Q->I()->tcp_server_.get()) {
+          for (const auto& [socket_id, ts] : tcp->connections()) {
+            add_connection(socket_id, ts);
           }
-        });
-        auto [l, rq] = Q->I()->cmd_manager().aq_results_queue();
-        for (const auto& [k, v] : *rq) {
-          state->add_queues()->set_queue_id(k);
         }
+        if (auto* shm = Q->I()->shm_server_.get()) {
+          for (const auto& [socket_id, ts] : shm->connections()) {
+            add_connection(socket_id, ts);
+          }
+        }
+        auto& rq = Q->I()->cmd_manager().results_queues();
+        rq.for_each([state](const auto& k, const auto& v) {
+          auto* q = state->add_queues();
+          q->set_queue_id(k);
+          q->set_evicted_results(
+              v->apply([](auto* c) { return c->evicted(); }));
+          q->set_lock_waits(v->lock_waits());
+        });
+        state->set_queue_registry_waits(rq.stats().update_waits);
         state->set_directory(process::getcwd());
       }),
+      get_cmd<ra2yrproto::commands::CommandBatch>(run_command_batch),
       get_cmd<ra2yrproto::commands::GetValue>([](auto* Q) {
         // NB: ensure correct radix
         // FIXME: proper locking
@@ -75,7 +248,7 @@ std::map<std::string, ra2yrcpp::cmd_t::handler_t> get_commands_nn() {
         c.set_value(ra2yrcpp::to_string(
             *reinterpret_cast<vecu8*>(Q->I()->get_value(c.key(), false))));
       }),
-      get_cmd<ra2yrproto::commands::HookableCommand>([](auto* Q) {
+      get_serial_cmd<ra2yrproto::commands::HookableCommand>([](auto* Q) {
         static TestProgram t;
         auto t_addr = t.get_code();
         t_addr(3, 3);
@@ -85,7 +258,7 @@ std::map<std::string, ra2yrcpp::cmd_t::handler_t> get_commands_nn() {
         res.set_address_test_callback(reinterpret_cast<u64>(&test_cb));
         res.set_code_size(t.entry_size);
       }),
-      get_cmd<ra2yrproto::commands::AddCallback>([](auto* Q) {
+      get_serial_cmd<ra2yrproto::commands::AddCallback>([](auto* Q) {
         auto& a = Q->command_data();
         Q->I()
             ->hooks()
@@ -94,7 +267,7 @@ std::map<std::string, ra2yrcpp::cmd_t::handler_t> get_commands_nn() {
                 reinterpret_cast<hook::Hook::hook_cb_t>(a.callback_address()),
                 Q->I(), "", 0u);
       }),
-      get_cmd<ra2yrproto::commands::CreateHooks>([](auto* Q) {
+      get_serial_cmd<ra2yrproto::commands::CreateHooks>([](auto* Q) {
 // TODO(shmocz): put these to utility function and share code with
 // Hook code.
 #ifdef _WIN32
@@ -122,7 +295,7 @@ std::map<std::string, ra2yrcpp::cmd_t::handler_t> get_commands_nn() {
       })};
 }
 
-std::map<std::string, ra2yrcpp::command::iservice_cmd::handler_t>
+std::map<std::string, ra2yrcpp::command::iservice_cmd_entry>
 ra2yrcpp::commands_builtin::get_commands() {
   return get_commands_nn();
 }
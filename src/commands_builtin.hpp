@@ -8,7 +8,7 @@
 namespace ra2yrcpp {
 namespace commands_builtin {
 
-std::map<std::string, ra2yrcpp::command::iservice_cmd::handler_t>
+std::map<std::string, ra2yrcpp::command::iservice_cmd_entry>
 get_commands();
 
 }  // namespace commands_builtin
@@ -227,7 +227,7 @@ auto place_building() {
   });
 }
 
-std::map<std::string, ra2yrcpp::command::iservice_cmd::handler_t>
+std::map<std::string, ra2yrcpp::command::iservice_cmd_entry>
 ra2yrcpp::commands_game::get_commands() {
   return {
       unit_order(),     //
@@ -9,10 +9,12 @@
 #include "hooks_yr.hpp"
 #include "logging.hpp"
 #include "protocol/helpers.hpp"
+#include "protocol/protocol.hpp"
 #include "ra2/abi.hpp"
 #include "ra2/common.hpp"
 #include "ra2/state_parser.hpp"
 #include "ra2/yrpp_export.hpp"
+#include "state_soa.hpp"
 #include "types.h"
 
 #include <fmt/core.h>
@@ -20,9 +22,12 @@
 #include <algorithm>
 #include <map>
 #include <stdexcept>
+#include <string>
+#include <utility>
 
 using ra2yrcpp::command::get_async_cmd;
 using ra2yrcpp::command::get_cmd;
+using ra2yrcpp::command::get_serial_cmd;
 using ra2yrcpp::command::message_result;
 
 using ra2yrcpp::hooks_yr::ensure_storage_value;
@@ -98,7 +103,7 @@ auto unit_command() {
 }
 
 auto create_callbacks() {
-  return get_cmd<ra2yrproto::commands::CreateCallbacks>([](auto* Q) {
+  return get_serial_cmd<ra2yrproto::commands::CreateCallbacks>([](auto* Q) {
     auto [lk_s, s] = Q->I()->aq_storage();
     // Create main game data structure
     // TODO(shmocz): initialize elsewhere
@@ -142,11 +147,32 @@ auto get_game_state() {
       Q->I()->lock_storage();
     }
 
-    Q->command_data().mutable_state()->CopyFrom(D->sv.game_state());
+    auto F = ra2yrcpp::hooks_yr::get_frame(Q->I());
     if (D->cfg.single_step()) {
       D->game_paused.store(false);
     }
     Q->I()->unlock_storage();
+    // Embed the shared serialized state instead of copying the message. If
+    // only some fields were requested, project them from the serialized state.
+    std::string res;
+    ra2yrcpp::serialize_game_state(*F, Q->command_data(), &res);
+    Q->set_serialized_result(std::move(res));
+  });
+}
+
+auto subscribe_game_state() {
+  return get_cmd<ra2yrproto::commands::SubscribeGameState>([](auto* Q) {
+    auto [mut, s] = Q->I()->aq_storage();
+    auto& args = Q->command_data();
+    auto* P = ra2yrcpp::hooks_yr::get_publisher(Q->I());
+    // Frames are pushed to the connection that sent the command
+    const auto connection_id = static_cast<int>(Q->c->queue_id());
+    if (args.unsubscribe()) {
+      P->unsubscribe(connection_id, args.subscription_id());
+    } else {
+      args.set_subscription_id(
+          P->subscribe(connection_id, args.interval(), args.delta()));
+    }
   });
 }
 
@@ -154,9 +180,13 @@ auto inspect_configuration() {
   return get_cmd<ra2yrproto::commands::InspectConfiguration>([](auto* Q) {
     auto [mut, s] = Q->I()->aq_storage();
     auto& res = Q->command_data();
-    auto* cfg = &ra2yrcpp::hooks_yr::get_data(Q->I())->cfg;
+    auto* D = ra2yrcpp::hooks_yr::get_data(Q->I());
+    auto* cfg = &D->cfg;
     cfg->MergeFrom(Q->command_data().config());
     res.mutable_config()->CopyFrom(*cfg);
+    if (D->recorder != nullptr) {
+      D->recorder->stats(res.mutable_recorder());
+    }
   });
 }
 
@@ -297,6 +327,13 @@ auto read_value() {
   return get_cmd<ra2yrproto::commands::ReadValue>([](auto* Q) {
     auto [mut, s] = Q->I()->aq_storage();
     auto& A = Q->command_data();
+    auto* sv = &get_data(Q->I())->sv;
+    if (!A.fields().paths().empty()) {
+      // Copy only the requested fields
+      A.clear_data();
+      ra2yrcpp::protocol::copy_fields(A.mutable_data(), *sv, A.fields());
+      return;
+    }
     // find the first field that's been set
     auto sf = ra2yrcpp::protocol::find_set_fields(A.data());
     if (sf.empty()) {
@@ -306,24 +343,31 @@ auto read_value() {
     auto* D = A.mutable_data();
 
     if (fld->name() == "map_data_soa") {
-      convert_map_data(D->mutable_map_data_soa(),
-                       get_data(Q->I())->sv.mutable_map_data());
+      convert_map_data(D->mutable_map_data_soa(), sv->mutable_map_data());
+    } else if (fld->name() == "objects_soa") {
+      ra2yrcpp::to_soa(sv->game_state().objects(), D->mutable_objects_soa());
+    } else if (fld->name() == "houses_soa") {
+      ra2yrcpp::to_soa(sv->game_state().houses(), D->mutable_houses_soa());
+    } else if (fld->name() == "factories_soa") {
+      ra2yrcpp::to_soa(sv->game_state().factories(),
+                       D->mutable_factories_soa());
     } else {
       // TODO(shmocz): use oneof
-      ra2yrcpp::protocol::copy_field(D, &get_data(Q->I())->sv, fld);
+      ra2yrcpp::protocol::copy_field(D, sv, fld);
     }
   });
 }
 
 }  // namespace cmd
 
-std::map<std::string, ra2yrcpp::command::iservice_cmd::handler_t>
+std::map<std::string, ra2yrcpp::command::iservice_cmd_entry>
 commands_yr::get_commands() {
   return {
       cmd::click_event(),            //
       cmd::unit_command(),           //
       cmd::create_callbacks(),       //
       cmd::get_game_state(),         //
+      cmd::subscribe_game_state(),   //
       cmd::inspect_configuration(),  //
       cmd::mission_clicked(),        //
       cmd::add_event(),              //
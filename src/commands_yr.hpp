@@ -6,7 +6,7 @@
 
 namespace commands_yr {
 
-std::map<std::string, ra2yrcpp::command::iservice_cmd::handler_t>
+std::map<std::string, ra2yrcpp::command::iservice_cmd_entry>
 get_commands();
 
 }  // namespace commands_yr
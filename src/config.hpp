@@ -24,6 +24,71 @@ constexpr char INIT_NAME[] = "init_iservice";
 constexpr unsigned int EVENT_BUFFER_SIZE = 600;
 constexpr unsigned int RESULT_QUEUE_SIZE = 32U;
 constexpr duration_t COMMAND_RESULTS_ACQUIRE_TIMEOUT = 5.0s;
+// Number of threads executing USER commands in CommandManager.
+constexpr unsigned int COMMAND_WORKER_THREADS = 4U;
+// Number of threads processing requests of all connections in WebsocketServer.
+constexpr unsigned int SERVER_WORKER_THREADS = 4U;
+// Number of threads processing requests that wait for command results, such
+// as POLL_BLOCKING. Kept apart from the workers, so that waiting requests
+// don't delay the others.
+constexpr unsigned int SERVER_BLOCKING_THREADS = 8U;
+// Number of threads running the asio service in InstrumentationService.
+constexpr unsigned int SERVER_IO_THREADS = 1U;
+// Port of the length-prefixed TCP listener. 0 disables the listener.
+constexpr unsigned int TCP_SERVER_PORT = 0U;
+// Name of the shared memory transport's region. Empty disables the transport.
+constexpr char SHM_TRANSPORT_NAME[] = "";
+// Maximum number of shared memory connections.
+constexpr unsigned int SHM_MAX_CONNECTIONS = 4U;
+// Capacity of a shared memory connection's request and response rings.
+constexpr unsigned int SHM_REQUEST_RING_SIZE = 1U << 18U;
+constexpr unsigned int SHM_RESPONSE_RING_SIZE = 1U << 22U;
+// How many times a shared memory ring is checked before blocking on it.
+constexpr unsigned int SHM_SPIN_COUNT = 2000U;
+// Interval for checking the state of a shared memory connection when idle.
+constexpr duration_t SHM_POLL_INTERVAL = 0.25s;
+// How long to wait for a shared memory connection to be accepted, or for free
+// space in it's rings.
+constexpr duration_t SHM_TIMEOUT = 5.0s;
+// Maximum number of pushed messages queued for a connection. When full, the
+// oldest message is dropped.
+constexpr unsigned int PUSH_QUEUE_SIZE = 4U;
+// Pushed messages are kept queued while a connection has this many bytes of
+// unsent data.
+constexpr unsigned int PUSH_MAX_PENDING_BYTES = 1U << 24U;
+// Maximum number of game state frames waiting to be published to subscribers.
+// When full, the oldest frame is dropped.
+constexpr unsigned int PUBLISH_QUEUE_SIZE = 4U;
+// Number of frames pushed to a delta subscription between full frames.
+constexpr unsigned int SUBSCRIPTION_KEYFRAME_INTERVAL = 60U;
+// Number of frames in a compressed block of a game state record. The first
+// frame of a block is stored in full, and the rest as deltas.
+constexpr unsigned int RECORD_BLOCK_FRAMES = 256U;
+// Uncompressed size after which a record block is written regardless of it's
+// number of frames.
+constexpr unsigned int RECORD_BLOCK_MAX_SIZE = 1U << 24U;
+// Number of threads compressing game state record blocks.
+constexpr unsigned int RECORD_COMPRESSION_THREADS = 2U;
+// Maximum number of game state frames waiting to be recorded. See
+// ra2yrcpp::record::Recorder for what happens when it's full.
+constexpr unsigned int RECORD_QUEUE_SIZE = 16U;
+// How often the recorder checks for new frames if it's not woken up.
+constexpr duration_t RECORD_POLL_INTERVAL = 0.1s;
+// Maximum number of tunnel packets waiting to be recorded. When full, new
+// packets are dropped.
+constexpr unsigned int TRAFFIC_QUEUE_SIZE = 4096U;
+// How often queued tunnel packets are written to the traffic record.
+constexpr duration_t TRAFFIC_FLUSH_INTERVAL = 0.1s;
+// Maximum number of bytes written to the traffic record at once.
+constexpr unsigned int TRAFFIC_BATCH_SIZE = 1U << 20U;
+// Maximum number of pushed messages a client keeps until they're read.
+constexpr unsigned int CLIENT_PUSH_QUEUE_SIZE = 64U;
+// How long to wait for connections to close on server shutdown.
+constexpr duration_t SERVER_SHUTDOWN_TIMEOUT = 5.0s;
+// Maximum number of finished Command objects kept for reuse.
+constexpr unsigned int COMMAND_POOL_SIZE = 256U;
+// Size of the initial arena block used for a single request's response.
+constexpr unsigned int REQUEST_ARENA_BLOCK_SIZE = 4096U;
 // General purpose "maximum" timeout value to avoid overflow in wait_for() etc.
 constexpr duration_t MAX_TIMEOUT = (60 * 60 * 24) * 1.0s;
 constexpr duration_t WEBSOCKET_READ_TIMEOUT = 5.0s;
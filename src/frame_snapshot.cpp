@@ -0,0 +1,58 @@
+#include "frame_snapshot.hpp"
+
+#include "errors.hpp"
+#include "protocol/helpers.hpp"
+#include "protocol/protocol.hpp"
+
+#include <utility>
+#include <vector>
+
+using namespace ra2yrcpp;
+using ra2yrproto::ra2yr::GameState;
+
+FrameSnapshot::FrameSnapshot(const GameState& G)
+    : current_frame_(G.current_frame()) {
+  if (!G.SerializeToString(&bytes_)) {
+    throw ra2yrcpp::protocol_error("failed to serialize GameState");
+  }
+}
+
+const std::string& FrameSnapshot::bytes() const { return bytes_; }
+
+u32 FrameSnapshot::current_frame() const { return current_frame_; }
+
+const GameState& FrameSnapshot::state() const {
+  std::call_once(parsed_, [this]() {
+    auto S = std::make_unique<GameState>();
+    if (!S->ParseFromString(bytes_)) {
+      throw ra2yrcpp::protocol_error("failed to parse GameState");
+    }
+    state_ = std::move(S);
+  });
+  return *state_;
+}
+
+std::string FrameSnapshot::project(
+    const google::protobuf::FieldMask& mask) const {
+  const auto* D = GameState::descriptor();
+  std::vector<u32> numbers;
+  for (const auto& p : mask.paths()) {
+    const auto* f = D->FindFieldByName(p);
+    if (f == nullptr) {
+      break;
+    }
+    numbers.push_back(static_cast<u32>(f->number()));
+  }
+  std::string res;
+  if (numbers.size() == static_cast<std::size_t>(mask.paths_size())) {
+    ra2yrcpp::project_fields(bytes_, numbers, &res);
+    return res;
+  }
+  // Nested paths, or invalid ones which copy_fields() rejects
+  GameState S;
+  ra2yrcpp::protocol::copy_fields(&S, state(), mask);
+  if (!S.SerializeToString(&res)) {
+    throw ra2yrcpp::protocol_error("failed to serialize GameState");
+  }
+  return res;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "ra2yrproto/ra2yr.pb.h"
+
+#include "types.h"
+
+#include <google/protobuf/field_mask.pb.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace ra2yrcpp {
+
+///
+/// Immutable game state frame. The state is serialized once when the snapshot
+/// is created, and the snapshot is shared by reference between the recorder,
+/// GetGameState and subscribers, so the cost of a frame doesn't depend on the
+/// number of it's consumers. The message is parsed back from the serialized
+/// form only if some consumer asks for it.
+///
+class FrameSnapshot {
+ public:
+  /// @exception ra2yrcpp::protocol_error if serialization fails
+  explicit FrameSnapshot(const ra2yrproto::ra2yr::GameState& G);
+  FrameSnapshot(const FrameSnapshot&) = delete;
+  FrameSnapshot& operator=(const FrameSnapshot&) = delete;
+
+  /// Serialized GameState.
+  const std::string& bytes() const;
+  u32 current_frame() const;
+  /// Get the state as message. Parsed on first call. Thread safe.
+  const ra2yrproto::ra2yr::GameState& state() const;
+  ///
+  /// Serialize the fields of the state selected by mask. If the mask contains
+  /// only top-level fields, they're copied from the serialized state without
+  /// parsing it.
+  ///
+  /// @exception std::invalid_argument if the mask is invalid
+  ///
+  std::string project(const google::protobuf::FieldMask& mask) const;
+
+ private:
+  std::string bytes_;
+  u32 current_frame_;
+  mutable std::once_flag parsed_;
+  mutable std::unique_ptr<ra2yrproto::ra2yr::GameState> state_;
+};
+
+using frame_ptr = std::shared_ptr<const FrameSnapshot>;
+
+}  // namespace ra2yrcpp
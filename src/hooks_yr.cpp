@@ -3,7 +3,6 @@
 #include "ra2yrproto/commands_yr.pb.h"
 #include "ra2yrproto/ra2yr.pb.h"
 
-#include "auto_thread.hpp"
 #include "config.hpp"
 #include "hook.hpp"
 #include "instrumentation_service.hpp"
@@ -13,6 +12,7 @@
 #include "ra2/state_context.hpp"
 #include "ra2/state_parser.hpp"
 #include "ra2/yrpp_export.hpp"
+#include "traffic_record.hpp"
 #include "utility/serialize.hpp"
 
 #include <fmt/core.h>
@@ -26,6 +26,7 @@
 #include <array>
 #include <cstdlib>
 #include <exception>
+#include <fstream>
 #include <iostream>
 #include <iterator>
 #include <memory>
@@ -110,6 +111,7 @@ struct CBExitGameLoop final
     auto [mut, s] = I->aq_storage();
     get_data(I)->sv.mutable_game_state()->set_stage(
         ra2yrproto::ra2yr::STAGE_EXIT_GAME);
+    get_data(I)->frame = nullptr;
 
     auto [lk, hhooks] = I->aq_hooks();
     auto* callbacks = get_callbacks(I);
@@ -136,6 +138,8 @@ struct CBExitGameLoop final
         callbacks->erase(k);
       }
     }
+    // Write remaining frames and the index of the record
+    get_data(I)->recorder = nullptr;
 
     // Flush output in case the process is not terminated gracefully.
     std::cerr << std::flush;
@@ -164,30 +168,18 @@ struct CBUpdateLoadProgress final : public MyCB<CBUpdateLoadProgress> {
     }
     sv->mutable_game_state()->set_stage(
         ra2yrproto::ra2yr::LoadStage::STAGE_LOADING);
+    data()->frame = nullptr;
   }
 };
 
 struct CBSaveState final : public MyCB<CBSaveState> {
-  ra2yrcpp::protocol::MessageOstream out;
-  utility::worker_util<std::shared_ptr<ra2yrproto::ra2yr::GameState>> work;
   ra2yrproto::ra2yr::GameState* initial_state;
   std::vector<ra2::Cell> cells;
 
   static constexpr char key_name[] = "save_state";
   static constexpr char key_target[] = "on_frame_update";
 
-  explicit CBSaveState(std::shared_ptr<std::ostream> record_stream)
-      : out(record_stream, true),
-        work([this](const auto& w) { this->serialize_state(*w.get()); }, 10U),
-        initial_state(nullptr) {}
-
-  void serialize_state(const ra2yrproto::ra2yr::GameState& G) {
-    if (out.os != nullptr) {
-      if (!out.write(G)) {
-        throw std::runtime_error("write_message");
-      }
-    }
-  }
+  CBSaveState() : initial_state(nullptr) {}
 
   void update_MapData(
       ra2yrproto::ra2yr::MapData* M,
@@ -197,8 +189,7 @@ struct CBSaveState final : public MyCB<CBSaveState> {
     }
   }
 
-  std::shared_ptr<ra2yrproto::ra2yr::GameState> state_to_protobuf(
-      const bool do_type_classes = false) {
+  ra2yrcpp::frame_ptr state_to_protobuf(const bool do_type_classes = false) {
     auto* sval = &data()->sv;
     auto* gbuf = sval->mutable_game_state();
 
@@ -255,21 +246,30 @@ struct CBSaveState final : public MyCB<CBSaveState> {
     ra2::parse_EventLists(gbuf, sval->mutable_event_buffer(),
                           cfg::EVENT_BUFFER_SIZE);
 
-    return std::make_shared<ra2yrproto::ra2yr::GameState>(*gbuf);
+    // Serialize once for all consumers of the frame
+    return std::make_shared<const ra2yrcpp::FrameSnapshot>(*gbuf);
   }
 
   void exec() override {
     // enables event debug logs
     // *reinterpret_cast<char*>(0xa8ed74) = 1;
     auto st = state_to_protobuf(type_classes()->empty());
-    work.push(st);
+    data()->frame = st;
+    auto& P = data()->publisher;
+    if (P != nullptr && P->active()) {
+      P->publish(st);
+    }
+    auto& R = data()->recorder;
+    if (R != nullptr) {
+      R->push(st, configuration()->record_drop_policy());
+    }
   }
 };
 
 template <typename D>
 struct CBTunnel : public MyCB<D> {
  public:
-  using writer_t = std::shared_ptr<ra2yrcpp::protocol::MessageOstream>;
+  using writer_t = std::shared_ptr<ra2yrcpp::traffic::TrafficRecorder>;
 
   struct packet_buffer {
     void* data;
@@ -287,14 +287,7 @@ struct CBTunnel : public MyCB<D> {
   void write_packet(const u32 source, const u32 dest, const void* buf,
                     std::size_t len) {
     // dprintf("source={} dest={}, buf={}, len={}", source, dest, buf, len);
-    ra2yrproto::ra2yr::TunnelPacket P;
-    P.set_source(source);
-    P.set_destination(dest);
-    P.mutable_data()->assign(static_cast<const char*>(buf), len);
-    if (!out->write(P)) {
-      throw std::runtime_error(
-          fmt::format("{} write_packet failed", D::key_name));
-    }
+    out->push(source, dest, buf, len);
   }
 
   virtual packet_buffer buffer() = 0;
@@ -355,6 +348,25 @@ ra2yrcpp::hooks_yr::GameDataYR* ra2yrcpp::hooks_yr::get_data(
   return ensure_storage_value<ra2yrcpp::hooks_yr::GameDataYR>(I, "game_data");
 }
 
+ra2yrcpp::StatePublisher* ra2yrcpp::hooks_yr::get_publisher(
+    ra2yrcpp::InstrumentationService* I) {
+  auto* D = get_data(I);
+  if (D->publisher == nullptr) {
+    D->publisher = std::make_unique<ra2yrcpp::StatePublisher>(I);
+  }
+  return D->publisher.get();
+}
+
+ra2yrcpp::frame_ptr ra2yrcpp::hooks_yr::get_frame(
+    ra2yrcpp::InstrumentationService* I) {
+  auto* D = get_data(I);
+  if (D->frame == nullptr) {
+    D->frame = std::make_shared<const ra2yrcpp::FrameSnapshot>(
+        D->sv.game_state());
+  }
+  return D->frame;
+}
+
 // TODO(shmocz): ensure thread safety
 void ra2yrcpp::hooks_yr::init_callbacks(ra2yrcpp::hooks_yr::GameDataYR* D) {
   if (D->callbacks_initialized) {
@@ -367,29 +379,28 @@ void ra2yrcpp::hooks_yr::init_callbacks(ra2yrcpp::hooks_yr::GameDataYR* D) {
   };
 
   if (std::getenv("RA2YRCPP_RECORD_TRAFFIC") != nullptr) {
-    const std::string traffic_out = fmt::format("traffic.{}.pb.gz", t);
+    const std::string traffic_out = fmt::format("traffic.{}.bin", t);
     iprintf("record traffic to {}", traffic_out);
 
-    auto out = std::make_shared<ra2yrcpp::protocol::MessageOstream>(
+    auto out = std::make_shared<ra2yrcpp::traffic::TrafficRecorder>(
         std::make_shared<std::ofstream>(
-            traffic_out, std::ios_base::out | std::ios_base::binary),
-        true);
+            traffic_out, std::ios_base::out | std::ios_base::binary));
     f(std::make_unique<CBTunnelRecvFrom>(out));
     f(std::make_unique<CBTunnelSendTo>(out));
   }
   f(std::make_unique<CBExitGameLoop>());
   f(std::make_unique<CBGameCommand>());
 
-  std::shared_ptr<std::ofstream> record_out = nullptr;
-
   if (std::getenv("RA2YRCPP_RECORD_PATH") != nullptr) {
     const std::string record_path = std::getenv("RA2YRCPP_RECORD_PATH");
     D->cfg.set_record_filename(record_path);
     iprintf("record state to {}", record_path);
-    record_out = std::make_shared<std::ofstream>(
-        record_path, std::ios_base::out | std::ios_base::binary);
+    D->recorder = std::make_unique<ra2yrcpp::record::Recorder>(
+        std::make_unique<ra2yrcpp::record::RecordWriter>(
+            std::make_shared<std::ofstream>(
+                record_path, std::ios_base::out | std::ios_base::binary)));
   }
-  f(std::make_unique<CBSaveState>(record_out));
+  f(std::make_unique<CBSaveState>());
   f(std::make_unique<CBUpdateLoadProgress>());
   f(std::make_unique<CBDebugPrint>());
 }
@@ -5,9 +5,12 @@
 
 #include "async_queue.hpp"
 #include "command/is_command.hpp"
+#include "frame_snapshot.hpp"
 #include "instrumentation_service.hpp"
 #include "ra2/abi.hpp"
 #include "ra2/state_context.hpp"
+#include "state_publisher.hpp"
+#include "state_record.hpp"
 #include "types.h"
 #include "utility/sync.hpp"
 
@@ -18,6 +21,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace util_command {
@@ -44,6 +48,13 @@ struct GameDataYR {
   cb_map_t callbacks;
   bool callbacks_initialized{false};
   util::AtomicVariable<bool> game_paused{false};
+  /// Created on first subscription
+  std::unique_ptr<ra2yrcpp::StatePublisher> publisher{nullptr};
+  /// Snapshot of sv.game_state(). Reset if the state is modified outside
+  /// frame updates.
+  ra2yrcpp::frame_ptr frame{nullptr};
+  /// Created if RA2YRCPP_RECORD_PATH is set
+  std::unique_ptr<ra2yrcpp::record::Recorder> recorder{nullptr};
 };
 
 struct CBYR : public ra2yrcpp::ISCallback {
@@ -65,6 +76,13 @@ struct CBYR : public ra2yrcpp::ISCallback {
 
 ra2yrcpp::hooks_yr::GameDataYR* get_data(ra2yrcpp::InstrumentationService* I);
 
+/// Get state publisher, creating it if needed. Storage must be locked.
+ra2yrcpp::StatePublisher* get_publisher(ra2yrcpp::InstrumentationService* I);
+
+/// Get snapshot of the current game state, creating it if needed. Storage must
+/// be locked.
+ra2yrcpp::frame_ptr get_frame(ra2yrcpp::InstrumentationService* I);
+
 /// Get all currently active callback objects.
 cb_map_t* get_callbacks(ra2yrcpp::InstrumentationService* I);
 
@@ -80,13 +98,18 @@ struct MyCB : public B {
 };
 
 // TODO(shmocz): reduce calls to this
+/// Get value from storage, creating it if needed. Locks the storage, since
+/// commands calling this may run concurrently with StoreValue.
 template <typename T, typename... ArgsT>
 T* ensure_storage_value(ra2yrcpp::InstrumentationService* I,
                         const std::string key, ArgsT... args) {
-  if (I->storage().find(key) == I->storage().end()) {
+  auto [lk, s] = I->aq_storage();
+  auto it = s->find(key);
+  if (it == s->end()) {
     I->store_value<T>(key, args...);
+    it = s->find(key);
   }
-  return static_cast<T*>(I->storage().at(key).get());
+  return static_cast<T*>(it->second.get());
 }
 
 void init_callbacks(ra2yrcpp::hooks_yr::GameDataYR* D);
@@ -131,7 +154,15 @@ void get_gameloop_command(ra2yrcpp::command::ISCommand<T>* Q,
   auto* cb = ra2yrcpp::hooks_yr::CBGameCommand::get(Q->I());
   auto* cmd = Q->c;
   cmd->set_async_handler([cb, fn](auto*) { fn(cb); });
-  cb->put_work([cmd]() { cmd->run_async_handler(); });
+  CBGameCommand::work_t work = [cmd]() { cmd->run_async_handler(); };
+  // Batched commands are submitted together by the batch command
+  auto* B = cmd->command_data()->batch;
+  if (B != nullptr) {
+    B->submit = [cb](auto w) { cb->put_work(std::move(w)); };
+    B->items.emplace_back(std::move(work));
+  } else {
+    cb->put_work(std::move(work));
+  }
 }
 
 struct YRHook {
@@ -3,18 +3,26 @@
 #include "protocol/protocol.hpp"
 
 #include "client_connection.hpp"
+#include "config.hpp"
 #include "errors.hpp"
+#include "logging.hpp"
 #include "protocol/helpers.hpp"
 
 #include <fmt/core.h>
 
+#include <exception>
 #include <stdexcept>
+#include <string_view>
+#include <utility>
 
 using namespace instrumentation_client;
 
 InstrumentationClient::InstrumentationClient(
     std::shared_ptr<ra2yrcpp::connection::ClientConnection> conn)
-    : conn_(conn) {}
+    : conn_(conn),
+      request_id_(0U),
+      reading_(false),
+      pushes_(cfg::CLIENT_PUSH_QUEUE_SIZE) {}
 
 ra2yrproto::PollResults InstrumentationClient::poll_blocking(
     const duration_t timeout, const u64 queue_id) {
@@ -40,19 +48,22 @@ void InstrumentationClient::send_data(const vecu8& data) {
 }
 
 ra2yrproto::Response InstrumentationClient::send_message(const vecu8& data) {
-  send_data(data);
-
-  auto resp = conn_->read_data();
-  if (resp.size() == 0U) {
-    throw std::runtime_error("empty response, likely connection closed");
+  {
+    // Responses to messages without a request id can't be told apart, so
+    // only one such message is in flight at a time.
+    std::unique_lock<std::mutex> l(mut_);
+    cv_.wait(l, [this]() { return responses_.count(0U) == 0U; });
+    (void)responses_.try_emplace(0U, nullptr);
   }
-
-  ra2yrproto::Response R;
-  if (!R.ParseFromArray(resp.data(), resp.size())) {
-    throw std::runtime_error(
-        fmt::format("failed to parse response, size={}", resp.size()));
+  try {
+    send_data(data);
+  } catch (...) {
+    std::unique_lock<std::mutex> l(mut_);
+    (void)responses_.erase(0U);
+    cv_.notify_all();
+    throw;
   }
-  return R;
+  return wait_response(0U);
 }
 
 ra2yrproto::Response InstrumentationClient::send_message(
@@ -63,8 +74,123 @@ ra2yrproto::Response InstrumentationClient::send_message(
 
 ra2yrproto::Response InstrumentationClient::send_command(
     const gpb::Message& cmd, ra2yrproto::CommandType type) {
-  auto C = ra2yrcpp::create_command(cmd, type);
-  return send_message(C);
+  // Without a request id, the command is executed in order with other such
+  // commands of this connection.
+  return send_message(ra2yrcpp::create_command(cmd, type));
+}
+
+u64 InstrumentationClient::send_command_async(const gpb::Message& cmd,
+                                              ra2yrproto::CommandType type) {
+  return send_command_async(ra2yrcpp::create_command(cmd, type));
+}
+
+u64 InstrumentationClient::send_command_async(ra2yrproto::Command C) {
+  const u64 request_id = ++request_id_;
+  C.set_request_id(request_id);
+  add_request(request_id);
+  try {
+    send_data(ra2yrcpp::to_vecu8(C));
+  } catch (...) {
+    std::unique_lock<std::mutex> l(mut_);
+    (void)responses_.erase(request_id);
+    throw;
+  }
+  return request_id;
+}
+
+ra2yrproto::Response InstrumentationClient::wait_response(
+    const u64 request_id) {
+  std::unique_lock<std::mutex> l(mut_);
+  while (true) {
+    auto it = responses_.find(request_id);
+    if (it == responses_.end()) {
+      throw std::runtime_error(
+          fmt::format("unknown request id {}", request_id));
+    }
+    if (it->second != nullptr) {
+      auto R = std::move(*it->second);
+      responses_.erase(it);
+      if (request_id == 0U) {
+        // Let the next message without a request id be sent
+        cv_.notify_all();
+      }
+      return R;
+    }
+    try {
+      read_next(&l);
+    } catch (...) {
+      (void)responses_.erase(request_id);
+      cv_.notify_all();
+      throw;
+    }
+  }
+}
+
+ra2yrproto::Response InstrumentationClient::wait_push() {
+  std::unique_lock<std::mutex> l(mut_);
+  while (pushes_.empty()) {
+    read_next(&l);
+  }
+  auto R = std::move(pushes_.front());
+  pushes_.pop();
+  return R;
+}
+
+void InstrumentationClient::read_next(std::unique_lock<std::mutex>* l) {
+  // Only one thread reads at a time, others wait for their message to be
+  // stored.
+  if (reading_) {
+    cv_.wait(*l);
+    return;
+  }
+  reading_ = true;
+  l->unlock();
+  ra2yrproto::Response R;
+  std::exception_ptr err;
+  try {
+    R = read_response();
+  } catch (...) {
+    err = std::current_exception();
+  }
+  l->lock();
+  reading_ = false;
+  cv_.notify_all();
+  if (err) {
+    std::rethrow_exception(err);
+  }
+  if (R.subscription_id() != 0U) {
+    pushes_.push(std::move(R));
+    return;
+  }
+  auto r = responses_.find(R.request_id());
+  if (r == responses_.end() || r->second != nullptr) {
+    wrprintf("unexpected response, request_id={}", R.request_id());
+    return;
+  }
+  r->second = std::make_unique<ra2yrproto::Response>(std::move(R));
+}
+
+void InstrumentationClient::add_request(const u64 request_id) {
+  std::unique_lock<std::mutex> l(mut_);
+  if (!responses_.try_emplace(request_id, nullptr).second) {
+    throw std::runtime_error(
+        fmt::format("request {} already in flight", request_id));
+  }
+}
+
+ra2yrproto::Response InstrumentationClient::read_response() {
+  ra2yrproto::Response R;
+  // Parse in place, if the transport allows it
+  conn_->read_message([&R](std::string_view resp) {
+    if (resp.size() == 0U) {
+      throw std::runtime_error("empty response, likely connection closed");
+    }
+    if (!R.ParseFromArray(resp.data(), static_cast<int>(resp.size()))) {
+      throw std::runtime_error(
+          fmt::format("failed to parse response, size={}", resp.size()));
+    }
+  });
+  return R;
 }
 
 ra2yrcpp::connection::ClientConnection* InstrumentationClient::connection() {
@@ -1,9 +1,14 @@
 #pragma once
 #include "ra2yrproto/core.pb.h"
 
+#include "ring_buffer.hpp"
 #include "types.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
 
 namespace ra2yrcpp::connection {
 class ClientConnection;
@@ -31,7 +36,9 @@ class InstrumentationClient {
   void send_data(const vecu8& data);
 
   ///
-  /// Send encoded message to server and read response back.
+  /// Send encoded message to server and read response back. The message must
+  /// not have a request id. Only one such message is in flight at a time, so
+  /// concurrent calls wait for the previous response to be read.
   /// @exception std::runtime_error on read/write failure.
   /// @exception ra2yrcpp::protocol_error on message serialization failure.
   ///
@@ -40,13 +47,48 @@ class InstrumentationClient {
   ra2yrproto::Response send_message(const gpb::Message& M);
 
   ///
-  /// Send a command of given type to server and read response. This can block
-  /// if there's nothing to be read.
+  /// Send a command of given type to server and read response. The command
+  /// has no request id, so it's executed in order with other commands sent
+  /// with this function. This can block if there's nothing to be read.
   ///
   /// @exception std::runtime_error on read/write failure.
   ///
   ra2yrproto::Response send_command(const gpb::Message& cmd,
                                     ra2yrproto::CommandType type);
+
+  ///
+  /// Send a command with a new request id without waiting for the response.
+  /// Any number of commands can be in flight, and the server may complete
+  /// them in any order.
+  ///
+  /// @return request id, used to get the response with wait_response()
+  /// @exception std::runtime_error on write failure.
+  ///
+  u64 send_command_async(const gpb::Message& cmd,
+                         ra2yrproto::CommandType type);
+  /// Same as above, but for a prepared command, e.g. a blocking one. The
+  /// request id of C is overwritten.
+  u64 send_command_async(ra2yrproto::Command C);
+
+  ///
+  /// Wait for response to the given request. Responses to other requests that
+  /// are read meanwhile are stored until they're waited for. Can be called
+  /// concurrently from multiple threads.
+  ///
+  /// @exception std::runtime_error on read failure, or if the request id is
+  /// unknown.
+  ///
+  ra2yrproto::Response wait_response(const u64 request_id);
+
+  ///
+  /// Wait for the next message pushed by the server to a subscription (e.g.
+  /// SubscribeGameState). Pushed messages that haven't been waited for are
+  /// kept up to cfg::CLIENT_PUSH_QUEUE_SIZE, dropping the oldest ones. Can be
+  /// called concurrently with wait_response().
+  ///
+  /// @exception std::runtime_error on read failure
+  ///
+  ra2yrproto::Response wait_push();
   /// @exception std::system_error for internal server error
   ra2yrproto::PollResults poll_blocking(const duration_t timeout,
                                         const u64 queue_id = (u64)-1);
@@ -60,7 +102,25 @@ class InstrumentationClient {
   void disconnect();
 
  private:
+  /// Register a request, whose response will be stored once read.
+  /// @exception std::runtime_error if the request is already in flight
+  void add_request(const u64 request_id);
+  /// Read next message and store it, or wait until another thread has done
+  /// so. Called with mut_ held.
+  void read_next(std::unique_lock<std::mutex>* l);
+  /// Read and parse a response. Called without holding mut_.
+  ra2yrproto::Response read_response();
+
   std::shared_ptr<ra2yrcpp::connection::ClientConnection> conn_;
+  std::atomic<u64> request_id_;
+  std::mutex mut_;
+  std::condition_variable cv_;
+  /// Set when some thread is reading from the connection
+  bool reading_;
+  /// Pending requests. Value is set when the response has been read.
+  std::map<u64, std::unique_ptr<ra2yrproto::Response>> responses_;
+  /// Pushed messages that haven't been waited for
+  ring_buffer::RingBuffer<ra2yrproto::Response> pushes_;
 };
 
 }  // namespace instrumentation_client
@@ -7,14 +7,16 @@
 #include "config.hpp"
 #include "logging.hpp"
 #include "protocol/helpers.hpp"
-#include "util_string.hpp"
 
 #include <fmt/core.h>
 #include <google/protobuf/any.pb.h>
+#include <google/protobuf/arena.h>
 
 #include <exception>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <tuple>
 #include <utility>
 
@@ -35,9 +37,8 @@ void ISCallback::add_to_hook(hook::Hook* h,
 
 std::vector<process::thread_id_t>
 InstrumentationService::get_connection_threads() {
-  std::vector<process::thread_id_t> res;
-  res.push_back(io_service_tid_.get());
-  return res;
+  std::unique_lock<std::mutex> l(mut_io_service_tids_);
+  return io_service_tids_;
 }
 
 void InstrumentationService::create_hook(const std::string& name,
@@ -58,19 +59,31 @@ cmd_manager_t& InstrumentationService::cmd_manager() { return cmd_manager_; }
 
 hooks_t& InstrumentationService::hooks() { return hooks_; }
 
-static ra2yrproto::TextResponse text_response(const std::string message) {
-  ra2yrproto::TextResponse E;
-  E.mutable_message()->assign(message);
+RequestContext::RequestContext()
+    : request_id(0U),
+      arena([this]() {
+        gpb::ArenaOptions o;
+        o.initial_block = initial_block;
+        o.initial_block_size = sizeof(initial_block);
+        return o;
+      }()) {}
+
+static ra2yrproto::TextResponse* text_response(gpb::Arena* arena,
+                                               const std::string& message) {
+  auto* E = gpb::Arena::CreateMessage<ra2yrproto::TextResponse>(arena);
+  E->mutable_message()->assign(message);
   return E;
 }
 
-ra2yrproto::PollResults InstrumentationService::flush_results(
-    const u64 queue_id, const duration_t delay) {
-  auto results = cmd_manager().flush_results(queue_id, delay, 0);
-  ra2yrproto::PollResults P;
-  auto* PR = P.mutable_result();
-  while (!results.empty()) {
-    auto& item = results.back();
+ra2yrproto::PollResults* InstrumentationService::flush_results(
+    const u64 queue_id, const duration_t delay, RequestContext* ctx,
+    const u64 task_id) {
+  ctx->results = task_id != 0U
+                     ? cmd_manager().flush_result(queue_id, task_id, delay)
+                     : cmd_manager().flush_results(queue_id, delay, 0);
+  auto* P = gpb::Arena::CreateMessage<ra2yrproto::PollResults>(&ctx->arena);
+  auto* PR = P->mutable_result();
+  for (auto& item : ctx->results) {
 #ifdef DEBUG_SPTR
     const auto uc = item.use_count();
     if (uc > 1) {
@@ -81,14 +94,15 @@ ra2yrproto::PollResults InstrumentationService::flush_results(
 #endif
     auto* res = PR->add_results();
     res->set_command_id(item->task_id());
-    res->mutable_result()->CopyFrom(item->command_data()->M);
+    // Reference the result instead of copying it. The arena doesn't take
+    // ownership, and ctx keeps the command alive.
+    res->unsafe_arena_set_allocated_result(&item->command_data()->M);
     if (item->result_code().get() == ra2yrcpp::command::ResultCode::ERROR) {
       res->set_result_code(ra2yrcpp::RESPONSE_ERROR);
       res->set_error_message(item->error_message());
     } else {
       res->set_result_code(ra2yrcpp::RESPONSE_OK);
     }
-    results.pop_back();
   }
 
   return P;
@@ -97,18 +111,22 @@ ra2yrproto::PollResults InstrumentationService::flush_results(
 std::tuple<command_hdl_t, ra2yrproto::RunCommandAck> ra2yrcpp::handle_cmd(
     InstrumentationService* I, int queue_id, ra2yrproto::Command* cmd,
     bool discard_result, cmd_t::handler_t done_callback) {
-  // TODO: reduce amount of copies we make
-  auto client_cmd = cmd->command();
-  // Get trailing portion of protobuf type url
-  auto name = ra2yrcpp::split_string(client_cmd.type_url(), "/").back();
+  const auto id = I->cmd_manager().command_id(cmd->command().type_url());
+  if (id == ra2yrcpp::command::no_command) {
+    throw std::out_of_range(
+        fmt::format("no such command {}", cmd->command().type_url()));
+  }
   ra2yrproto::RunCommandAck ack;
 
+  // Move the payload to avoid copying it
   auto c = I->cmd_manager().make_command(
-      name, ra2yrcpp::command::ISArg{reinterpret_cast<void*>(I), client_cmd},
+      id,
+      ra2yrcpp::command::ISArg{reinterpret_cast<void*>(I),
+                               std::move(*cmd->mutable_command())},
       queue_id, done_callback);
   ack.set_id(c->task_id());
   c->discard_result().store(discard_result);
-  auto w = command_hdl_t(c);
+  auto w = command_hdl_t(c->task_id());
   I->cmd_manager().emplace_command(std::move(c));
 
   // write status back
@@ -116,32 +134,39 @@ std::tuple<command_hdl_t, ra2yrproto::RunCommandAck> ra2yrcpp::handle_cmd(
   return std::make_tuple(w, ack);
 }
 
-// TODO: return just Response body/msg, not the whole Response
-ra2yrproto::Response InstrumentationService::process_request(
-    const int socket_id, vecu8* bytes, bool* is_json) {
-  // read command from message
+gpb::Message* InstrumentationService::process_request(
+    const int socket_id, std::string_view bytes, bool* is_json,
+    RequestContext* ctx) {
+  // Not allocated from the arena, since the payload is moved to the command,
+  // which outlives the request.
   ra2yrproto::Command cmd;
-  if (!cmd.ParseFromArray(bytes->data(), bytes->size())) {
-    if (!ra2yrcpp::protocol::from_json(*bytes, &cmd)) {
+  if (!cmd.ParseFromArray(bytes.data(), static_cast<int>(bytes.size()))) {
+    if (!ra2yrcpp::protocol::from_json(bytes, &cmd)) {
       throw std::runtime_error("Message parse error");
     } else {
       *is_json = true;
     }
   }
+  ctx->request_id = cmd.request_id();
 
   // execute parsed command & write result
   switch (cmd.command_type()) {
     case ra2yrproto::CLIENT_COMMAND: {
       auto [cptr, ack] = handle_cmd(this, socket_id, &cmd);
       if (cmd.blocking()) {
+        // Only wait for this command, so that concurrent blocking requests
+        // of the connection don't take each other's results
         const u64 queue_id = (u64)socket_id;
         const auto timeout = cfg::POLL_BLOCKING_TIMEOUT;
-        return ra2yrcpp::make_response(flush_results(queue_id, timeout));
+        return flush_results(queue_id, timeout, ctx, cptr);
       }
-      return ra2yrcpp::make_response(ra2yrproto::RunCommandAck(ack));
+      auto* A =
+          gpb::Arena::CreateMessage<ra2yrproto::RunCommandAck>(&ctx->arena);
+      A->CopyFrom(ack);
+      return A;
     }
     case ra2yrproto::POLL: {
-      return ra2yrcpp::make_response(flush_results(socket_id));
+      return flush_results(socket_id, cfg::POLL_RESULTS_TIMEOUT, ctx);
     }
     case ra2yrproto::POLL_BLOCKING: {
       ra2yrproto::PollResults R;
@@ -154,10 +179,10 @@ ra2yrproto::Response InstrumentationService::process_request(
               ? duration_t(static_cast<double>((u32)R.args().timeout()) /
                            1000.0)
               : cfg::POLL_BLOCKING_TIMEOUT;
-      return ra2yrcpp::make_response(flush_results(queue_id, timeout));
+      return flush_results(queue_id, timeout, ctx);
     }
     case ra2yrproto::SHUTDOWN:
-      return make_response(text_response(on_shutdown_(this)));
+      return text_response(&ctx->arena, on_shutdown_(this));
     default:
       throw std::runtime_error("unknown command: " +
                                std::to_string(cmd.command_type()));
@@ -171,32 +196,112 @@ std::string InstrumentationService::on_shutdown() {
   return "";
 }
 
-static vecu8 on_receive_bytes(InstrumentationService* I, const int socket_id,
-                              vecu8* bytes) {
-  ra2yrproto::Response R;
+/// Process request and write the serialized response to out.
+static void on_receive_bytes(InstrumentationService* I, const int socket_id,
+                             std::string_view bytes, std::string* out) {
+  RequestContext ctx;
   bool is_json = false;
+  gpb::Message* body = nullptr;
+  auto code = RESPONSE_OK;
   try {
-    R = I->process_request(socket_id, bytes, &is_json);
-    R.set_code(RESPONSE_OK);
+    body = I->process_request(socket_id, bytes, &is_json, &ctx);
   } catch (const std::exception& e) {
     eprintf("{}", e.what());
-    R = ra2yrcpp::make_response(text_response(e.what()), RESPONSE_ERROR);
+    body = text_response(&ctx.arena, e.what());
+    code = RESPONSE_ERROR;
   }
   if (is_json) {
-    return ra2yrcpp::to_bytes(ra2yrcpp::protocol::to_json(R));
+    *out = ra2yrcpp::protocol::to_json(
+        ra2yrcpp::make_response(std::move(*body), code, ctx.request_id));
+    return;
   }
-  return to_vecu8(R);
+  ra2yrcpp::serialize_response(*body, code, ctx.request_id, out);
 }
 
-static void on_accept(InstrumentationService* I, const int socket_id) {
+InstrumentationService::PushQueue::PushQueue()
+    : messages(cfg::PUSH_QUEUE_SIZE), sending(false) {}
+
+void InstrumentationService::on_accept(const int socket_id) {
   // Create result queue
   // TODO(shmocz): can block here
-  (void)I->cmd_manager().execute_create_queue(socket_id,
-                                              cfg::RESULT_QUEUE_SIZE);
+  (void)cmd_manager().execute_create_queue(socket_id, cfg::RESULT_QUEUE_SIZE);
+  std::unique_lock<std::mutex> l(mut_push_queues_);
+  push_queues_[socket_id] = std::make_shared<PushQueue>();
+}
+
+void InstrumentationService::on_close(const int socket_id) {
+  {
+    std::unique_lock<std::mutex> l(mut_push_queues_);
+    (void)push_queues_.erase(socket_id);
+  }
+  {
+    std::unique_lock<std::mutex> l(mut_close_callbacks_);
+    for (auto& [id, cb] : close_callbacks_) {
+      try {
+        cb(socket_id);
+      } catch (const std::exception& e) {
+        eprintf("close callback {}: {}", id, e.what());
+      }
+    }
+  }
+  (void)cmd_manager().execute_destroy_queue(socket_id);
+}
+
+u64 InstrumentationService::add_close_callback(std::function<void(int)> cb) {
+  std::unique_lock<std::mutex> l(mut_close_callbacks_);
+  const u64 id = next_close_callback_++;
+  close_callbacks_[id] = std::move(cb);
+  return id;
+}
+
+void InstrumentationService::remove_close_callback(const u64 id) {
+  std::unique_lock<std::mutex> l(mut_close_callbacks_);
+  (void)close_callbacks_.erase(id);
+}
+
+bool InstrumentationService::push(const int connection_id,
+                                  std::shared_ptr<const std::string> msg) {
+  // Held while posting, so that nothing is posted after the destructor has
+  // cleared the queues.
+  std::unique_lock<std::mutex> lk(mut_push_queues_);
+  auto it = push_queues_.find(connection_id);
+  if (it == push_queues_.end()) {
+    return false;
+  }
+  auto q = it->second;
+  std::unique_lock<std::mutex> l(q->mut);
+  q->messages.push(std::move(msg));
+  if (!q->sending) {
+    q->sending = true;
+    pool_->post([this, connection_id, q]() { send_pushed(connection_id, q); });
+  }
+  return true;
 }
 
-static void on_close(InstrumentationService* I, const int socket_id) {
-  (void)I->cmd_manager().execute_destroy_queue(socket_id);
+void InstrumentationService::send_pushed(const int connection_id,
+                                         std::shared_ptr<PushQueue> q) {
+  auto send = [this, connection_id](auto msg) {
+    return ws_server_->push(connection_id, msg) ||
+           (tcp_server_ != nullptr && tcp_server_->push(connection_id, msg)) ||
+           (shm_server_ != nullptr && shm_server_->push(connection_id, msg));
+  };
+  std::unique_lock<std::mutex> l(q->mut);
+  while (!q->messages.empty()) {
+    auto msg = q->messages.front();
+    l.unlock();
+    const bool sent = send(msg);
+    l.lock();
+    if (!sent) {
+      // Retried on next push(). Meanwhile the queue keeps only the newest
+      // messages.
+      break;
+    }
+    // The message may have been dropped while it was being sent
+    if (!q->messages.empty() && q->messages.front() == msg) {
+      q->messages.pop();
+    }
+  }
+  q->sending = false;
 }
 
 InstrumentationService::InstrumentationService(
@@ -205,7 +310,7 @@ InstrumentationService::InstrumentationService(
     std::function<void(InstrumentationService*)> extra_init)
     : opts_(opt),
       on_shutdown_(on_shutdown),
-      io_service_tid_(0U),
+      next_close_callback_(1U),
       ws_server_(nullptr) {
   cmd_manager_.start();
 
@@ -213,26 +318,56 @@ InstrumentationService::InstrumentationService(
     extra_init(this);
   }
 
-  // Create and start io_service manager
-  io_service_ = std::make_unique<ra2yrcpp::asio_utils::IOService>();
-  // Retrieve io_service thread id, so we know to not suspend it
-  io_service_->post(
-      [this]() { io_service_tid_.store(process::get_current_tid()); });
-  io_service_tid_.wait_pred([](auto v) { return v != 0U; });
+  // Create and start io_service manager. Retrieve io_service thread ids, so we
+  // know to not suspend them.
+  io_service_ = std::make_unique<ra2yrcpp::asio_utils::IOService>(
+      opts_.server.io_threads, [this]() {
+        std::unique_lock<std::mutex> l(mut_io_service_tids_);
+        io_service_tids_.push_back(process::get_current_tid());
+      });
 
   {
-    WebsocketServer::Callbacks cb{nullptr, nullptr, nullptr};
-    cb.accept = [this](int id) { on_accept(this, id); };
-    cb.close = [this](int id) { on_close(this, id); };
-    cb.receive = [this](int id, auto* msg) {
-      // TODO(shmocz): avoid copy
-      vecu8 bt = to_bytes(*msg);
-      auto resp = on_receive_bytes(this, id, &bt);
-      return to_string(resp);
+    WebsocketServer::Callbacks cb{nullptr, nullptr, nullptr, nullptr};
+    cb.accept = [this](int id) { on_accept(id); };
+    cb.close = [this](int id) { on_close(id); };
+    cb.receive = [this](int id, std::string_view msg, std::string* out) {
+      on_receive_bytes(this, id, msg, out);
+    };
+    // Requests with an id may complete in any order
+    cb.ordered = [](int, std::string_view msg) {
+      return ra2yrcpp::peek_request_id(msg) == 0U;
+    };
+    // Waits for command results run in their own pool, so that they don't
+    // occupy the workers
+    cb.executor = [this](int, std::string_view msg) {
+      return ra2yrcpp::is_blocking_request(msg) ? blocking_pool_.get()
+                                                : nullptr;
     };
+    blocking_pool_ =
+        std::make_unique<utility::ThreadPool>(opts_.server.blocking_threads);
+    pool_ = std::make_unique<utility::ThreadPool>(opts_.server.worker_threads);
     ws_server_ = ra2yrcpp::websocket_server::create_server(
-        opts_.server, io_service_.get(), cb);
+        opts_.server, io_service_.get(), pool_.get(), cb);
     ws_server_->start();
+    if (opts_.tcp_port > 0U) {
+      tcp_server_ = std::make_unique<tcp_server::TcpServer>(
+          tcp_server::TcpServer::Options{
+              opts_.server.host, opts_.tcp_port, opts_.server.max_connections,
+              opts_.server.allowed_hosts_regex},
+          io_service_.get(), pool_.get(), cb);
+      tcp_server_->start();
+    }
+    if (!opts_.shm_name.empty()) {
+      shm_server_ = std::make_unique<shm_server::ShmServer>(
+          shm_server::ShmServer::Options{
+              opts_.shm_name, cfg::SHM_MAX_CONNECTIONS,
+              cfg::SHM_REQUEST_RING_SIZE, cfg::SHM_RESPONSE_RING_SIZE},
+          pool_.get(), cb, [this]() {
+            std::unique_lock<std::mutex> l(mut_io_service_tids_);
+            io_service_tids_.push_back(process::get_current_tid());
+          });
+      shm_server_->start();
+    }
   }
 }
 
@@ -261,7 +396,17 @@ InstrumentationService::aq_storage() {
 }
 
 InstrumentationService::~InstrumentationService() {
+  {
+    std::unique_lock<std::mutex> l(mut_push_queues_);
+    push_queues_.clear();
+  }
   ws_server_->shutdown();
+  if (tcp_server_ != nullptr) {
+    tcp_server_->shutdown();
+  }
+  if (shm_server_ != nullptr) {
+    shm_server_->shutdown();
+  }
   cmd_manager_.shutdown();
 }
 
@@ -271,12 +416,10 @@ const InstrumentationService::Options& InstrumentationService::opts() const {
 
 ra2yrcpp::InstrumentationService* InstrumentationService::create(
     InstrumentationService::Options O,
-    std::map<std::string, cmd_t::handler_t> commands,
+    std::map<std::string, cmd_entry_t> commands,
     std::function<std::string(ra2yrcpp::InstrumentationService*)> on_shutdown,
     std::function<void(InstrumentationService*)> extra_init) {
   auto* I = new ra2yrcpp::InstrumentationService(O, on_shutdown, extra_init);
-  for (auto& [name, fn] : commands) {
-    I->cmd_manager().add_command(name, fn);
-  }
+  I->cmd_manager().add_commands(commands);
   return I;
 }
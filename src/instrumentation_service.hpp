@@ -6,10 +6,16 @@
 #include "config.hpp"
 #include "hook.hpp"
 #include "process.hpp"
+#include "ring_buffer.hpp"
+#include "shm_server.hpp"
+#include "tcp_server.hpp"
 #include "types.h"
 #include "utility/sync.hpp"
+#include "utility/thread_pool.hpp"
 #include "websocket_server.hpp"
 
+#include <google/protobuf/arena.h>
+
 #include <cstddef>
 #include <cstdint>
 
@@ -18,6 +24,7 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -47,16 +54,42 @@ using storage_t =
     std::map<std::string, std::unique_ptr<void, std::function<void(void*)>>>;
 using ra2yrcpp::websocket_server::WebsocketServer;
 using cmd_t = ra2yrcpp::command::iservice_cmd;
+using cmd_entry_t = ra2yrcpp::command::iservice_cmd_entry;
 using cmd_manager_t = ra2yrcpp::command::CommandManager<cmd_t::data_t>;
 using command_ptr_t = cmd_manager_t::command_ptr_t;
 using hooks_t = std::map<std::uintptr_t, hook::Hook>;
-using command_hdl_t = command_ptr_t::weak_type;
+// Identifies a submitted command (task id)
+using command_hdl_t = u64;
+
+///
+/// State of a single request. Response messages are allocated from the arena.
+/// Flushed results are referenced by the response without copying, so the
+/// commands are kept here until the response has been serialized.
+///
+struct RequestContext {
+  RequestContext();
+  RequestContext(const RequestContext&) = delete;
+  RequestContext& operator=(const RequestContext&) = delete;
+
+  std::vector<command_ptr_t> results;
+  /// Client supplied id of the request, echoed in the response.
+  u64 request_id;
+  /// Initial arena block. Arena allocations assume 8 byte alignment.
+  alignas(std::max_align_t) char initial_block[cfg::REQUEST_ARENA_BLOCK_SIZE];
+  // Declared last, so that it's destroyed before the results
+  gpb::Arena arena;
+};
 
 class InstrumentationService {
  public:
   struct Options {
     WebsocketServer::Options server;
     bool no_init_hooks;
+    /// Port of the length-prefixed TCP listener. 0 disables the listener.
+    unsigned tcp_port;
+    /// Name of the shared memory region for same-host clients. Empty disables
+    /// the shared memory transport.
+    std::string shm_name;
   };
 
   /// @param opt options
@@ -107,39 +140,112 @@ class InstrumentationService {
   const InstrumentationService::Options& opts() const;
   static ra2yrcpp::InstrumentationService* create(
       InstrumentationService::Options O,
-      std::map<std::string, cmd_t::handler_t> commands,
+      std::map<std::string, cmd_entry_t> commands,
       std::function<std::string(ra2yrcpp::InstrumentationService*)>
           on_shutdown = nullptr,
       std::function<void(InstrumentationService*)> extra_init = nullptr);
-  ra2yrproto::Response process_request(const int socket_id, vecu8* bytes,
-                                       bool* is_json);
+  ///
+  /// Parse and execute a request.
+  ///
+  /// @param socket_id id of the client connection
+  /// @param bytes request message, either binary or JSON
+  /// @param is_json set if the request was in JSON format
+  /// @param ctx request state. Owns the returned message.
+  /// @return response body
+  ///
+  gpb::Message* process_request(const int socket_id, std::string_view bytes,
+                                bool* is_json, RequestContext* ctx);
   std::string on_shutdown();
+  ///
+  /// Send a message to a connection outside of the request/response cycle.
+  /// Messages are queued per connection and sent in order by the thread pool.
+  /// If cfg::PUSH_QUEUE_SIZE messages are already queued, the oldest one is
+  /// dropped, so that a slow client never blocks the caller.
+  ///
+  /// @param connection_id id of the client connection
+  /// @param msg serialized message, e.g. by serialize_push()
+  /// @return false if the connection doesn't exist
+  ///
+  bool push(const int connection_id, std::shared_ptr<const std::string> msg);
+
+  ///
+  /// Register a function to be called with the id of each closed connection,
+  /// before the id can be reused by a new connection.
+  ///
+  /// @return id for remove_close_callback()
+  ///
+  u64 add_close_callback(std::function<void(int)> cb);
+  /// Remove a close callback. Returns after running invocations of it have
+  /// finished.
+  void remove_close_callback(const u64 id);
 
  private:
-  ra2yrproto::PollResults flush_results(
-      const u64 queue_id, const duration_t delay = cfg::POLL_RESULTS_TIMEOUT);
+  /// Messages waiting to be pushed to a connection.
+  struct PushQueue {
+    PushQueue();
+    std::mutex mut;
+    ring_buffer::RingBuffer<std::shared_ptr<const std::string>> messages;
+    /// Set while a task sending the messages is scheduled
+    bool sending;
+  };
+
+  /// Send queued messages of a connection until the queue is empty, or the
+  /// transport has too much unsent data.
+  void send_pushed(const int connection_id, std::shared_ptr<PushQueue> q);
+  void on_accept(const int connection_id);
+  void on_close(const int connection_id);
+
+  /// Pop results of a queue into ctx. If task_id is set, wait only for the
+  /// result of that command.
+  ra2yrproto::PollResults* flush_results(const u64 queue_id,
+                                         const duration_t delay,
+                                         RequestContext* ctx,
+                                         const u64 task_id = 0U);
 
   Options opts_;
   std::function<std::string(InstrumentationService*)> on_shutdown_;
   cmd_manager_t cmd_manager_;
   hooks_t hooks_;
   std::mutex mut_hooks_;
+  /// Declared before storage_, which may contain objects pushing messages.
+  std::map<int, std::shared_ptr<PushQueue>> push_queues_;
+  std::mutex mut_push_queues_;
+  /// Declared before storage_, which may contain objects removing callbacks.
+  std::map<u64, std::function<void(int)>> close_callbacks_;
+  u64 next_close_callback_;
+  std::mutex mut_close_callbacks_;
   storage_t storage_;
   std::recursive_mutex mut_storage_;
   std::unique_ptr<ra2yrcpp::asio_utils::IOService> io_service_;
-  util::AtomicVariable<process::thread_id_t> io_service_tid_;
+  std::vector<process::thread_id_t> io_service_tids_;
+  std::mutex mut_io_service_tids_;
 
  public:
   std::unique_ptr<WebsocketServer> ws_server_;
+  std::unique_ptr<tcp_server::TcpServer> tcp_server_;
+  std::unique_ptr<shm_server::ShmServer> shm_server_;
+
+ private:
+  /// Executes requests waiting for command results. Destroyed after pool_,
+  /// since requests are moved from pool_ to this pool.
+  std::unique_ptr<utility::ThreadPool> blocking_pool_;
+  /// Executes requests of all connections. Declared last, so that pending
+  /// requests finish before the servers are destroyed.
+  std::unique_ptr<utility::ThreadPool> pool_;
 };
 
+/// Submit a client command for execution. The command payload is moved out of
+/// cmd.
 std::tuple<command_hdl_t, ra2yrproto::RunCommandAck> handle_cmd(
     InstrumentationService* I, int queue_id, ra2yrproto::Command* cmd,
     bool discard_result = false, cmd_t::handler_t done_callback = nullptr);
 
 const InstrumentationService::Options default_options{
     {cfg::SERVER_ADDRESS, cfg::SERVER_PORT, cfg::MAX_CLIENTS,
-     cfg::ALLOWED_HOSTS_REGEX},
-    true};
+     cfg::ALLOWED_HOSTS_REGEX, cfg::SERVER_IO_THREADS,
+     cfg::SERVER_WORKER_THREADS, cfg::SERVER_BLOCKING_THREADS},
+    true,
+    cfg::TCP_SERVER_PORT,
+    cfg::SHM_TRANSPORT_NAME};
 
 }  // namespace ra2yrcpp
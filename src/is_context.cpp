@@ -151,11 +151,9 @@ ra2yrcpp::InstrumentationService* is_context::make_is(
     cmds[name] = fn;
   }
   auto* I = ra2yrcpp::InstrumentationService::create(
-      O, std::map<std::string, ra2yrcpp::cmd_t::handler_t>(), on_shutdown,
+      O, std::map<std::string, ra2yrcpp::cmd_entry_t>(), on_shutdown,
       [cmds](auto* t) {
-        for (auto& [name, fn] : cmds) {
-          t->cmd_manager().add_command(name, fn);
-        }
+        t->cmd_manager().add_commands(cmds);
 
         if (!t->opts().no_init_hooks) {
           ra2yrproto::commands::CreateHooks C1;
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace mpmc_queue {
+
+///
+/// Bounded lock-free multi-producer multi-consumer FIFO queue (Vyukov's
+/// array based algorithm). Capacity is rounded up to a power of two. Neither
+/// operation blocks or allocates: try_push() fails if the queue is full, and
+/// try_pop() fails if it's empty.
+///
+/// A thread that pushes can also pop, e.g. to evict the oldest item when the
+/// queue is full.
+///
+template <typename T>
+class MPMCQueue {
+  struct Slot {
+    std::atomic<std::size_t> seq;
+    T value;
+  };
+
+ public:
+  explicit MPMCQueue(const std::size_t capacity)
+      : mask_(round_up(capacity) - 1U),
+        slots_(std::make_unique<Slot[]>(mask_ + 1U)),
+        head_(0U),
+        tail_(0U) {
+    for (std::size_t i = 0U; i <= mask_; i++) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MPMCQueue(const MPMCQueue&) = delete;
+  MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+  /// Move *v to the back of the queue. *v is left unchanged if the queue is
+  /// full.
+  /// @return false if the queue is full
+  bool try_push(T* v) {
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+    Slot* s = nullptr;
+    while (true) {
+      s = &slots_[pos & mask_];
+      const auto seq = s->seq.load(std::memory_order_acquire);
+      const auto diff =
+          static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1U,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+    s->value = std::move(*v);
+    s->seq.store(pos + 1U, std::memory_order_release);
+    return true;
+  }
+
+  /// Pop the oldest item into dst.
+  /// @return false if the queue is empty
+  bool try_pop(T* dst) {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    Slot* s = nullptr;
+    while (true) {
+      s = &slots_[pos & mask_];
+      const auto seq = s->seq.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::intptr_t>(seq) -
+                        static_cast<std::intptr_t>(pos + 1U);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1U,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    *dst = std::move(s->value);
+    s->value = T();
+    s->seq.store(pos + mask_ + 1U, std::memory_order_release);
+    return true;
+  }
+
+  /// Approximate number of items in the queue.
+  std::size_t size() const {
+    const auto t = tail_.load(std::memory_order_acquire);
+    const auto h = head_.load(std::memory_order_acquire);
+    return h > t ? h - t : 0U;
+  }
+
+  std::size_t capacity() const { return mask_ + 1U; }
+
+ private:
+  static std::size_t round_up(const std::size_t v) {
+    std::size_t r = 1U;
+    while (r < v) {
+      r <<= 1U;
+    }
+    return r;
+  }
+
+  const std::size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  alignas(64) std::atomic<std::size_t> head_;
+  alignas(64) std::atomic<std::size_t> tail_;
+};
+
+}  // namespace mpmc_queue
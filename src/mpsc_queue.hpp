@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace mpsc_queue {
+
+///
+/// Unbounded lock-free multi-producer single-consumer FIFO queue (Vyukov's
+/// node based algorithm). push() may be called from any thread, while
+/// try_pop() must only be called from a single consumer thread.
+///
+/// A push that is in progress may be invisible to the consumer for a short
+/// while, so try_pop() can return false even though an item is about to
+/// appear. Consumers that park should be woken up by producers after push().
+///
+template <typename T>
+class MPSCQueue {
+  struct Node {
+    std::atomic<Node*> next{nullptr};
+    T value;
+
+    Node() = default;
+
+    explicit Node(T&& v) : value(std::move(v)) {}
+  };
+
+ public:
+  MPSCQueue() : head_(new Node()), tail_(head_.load()) {}
+
+  MPSCQueue(const MPSCQueue&) = delete;
+  MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+  ~MPSCQueue() {
+    T t;
+    while (try_pop(&t)) {
+    }
+    delete tail_;
+  }
+
+  void push(T t) { emplace(std::move(t)); }
+
+  void emplace(T&& t) {
+    auto* n = new Node(std::move(t));
+    Node* prev = head_.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+
+  /// Pop the oldest item into dst. Returns false if no item was available.
+  bool try_pop(T* dst) {
+    Node* tail = tail_;
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return false;
+    }
+    *dst = std::move(next->value);
+    next->value = T();
+    tail_ = next;
+    delete tail;
+    return true;
+  }
+
+  /// Returns true if no items are visible to the consumer. Consumer only.
+  bool empty() const {
+    return tail_->next.load(std::memory_order_acquire) == nullptr;
+  }
+
+ private:
+  alignas(64) std::atomic<Node*> head_;
+  alignas(64) Node* tail_;
+};
+
+}  // namespace mpsc_queue
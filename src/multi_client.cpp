@@ -30,8 +30,17 @@ namespace connection = ra2yrcpp::connection;
 AutoPollClient::AutoPollClient(
     std::shared_ptr<ra2yrcpp::asio_utils::IOService> io_service,
     AutoPollClient::Options o)
+    : AutoPollClient(
+          [io_service, o]() -> std::shared_ptr<connection::ClientConnection> {
+            return std::make_shared<connection::ClientWebsocketConnection>(
+                o.host, o.port, io_service.get());
+          },
+          o) {}
+
+AutoPollClient::AutoPollClient(connection_factory_t factory,
+                               AutoPollClient::Options o)
     : opt_(o),
-      io_service_(io_service),
+      factory_(factory),
       state_(State::NONE),
       poll_thread_active_(false) {}
 
@@ -52,9 +61,7 @@ void AutoPollClient::start() {
         fmt::format("invalid state: {}", static_cast<int>(*v)));
   }
   for (auto i : t) {
-    auto conn = std::make_unique<InstrumentationClient>(
-        std::make_shared<connection::ClientWebsocketConnection>(
-            opt_.host, opt_.port, io_service_.get()));
+    auto conn = std::make_unique<InstrumentationClient>(factory_());
     conn->connect();
 
     // send initial "handshake" message
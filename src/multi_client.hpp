@@ -9,6 +9,7 @@
 #include "utility/sync.hpp"
 
 #include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -56,10 +57,17 @@ class AutoPollClient {
     duration_t command_timeout;
   };
 
+  using connection_factory_t =
+      std::function<std::shared_ptr<connection::ClientConnection>()>;
+
+  /// Use websocket connections to host and port given in options.
   /// @exception std::exception on failed connection
   explicit AutoPollClient(
       std::shared_ptr<ra2yrcpp::asio_utils::IOService> io_service,
       AutoPollClient::Options o);
+  /// Use connections created by factory, e.g. ClientShmConnection for clients
+  /// on the same host.
+  AutoPollClient(connection_factory_t factory, AutoPollClient::Options o);
   ~AutoPollClient();
 
   /// Establishes connection to InstrumentationService.
@@ -85,7 +93,7 @@ class AutoPollClient {
 
  private:
   const Options opt_;
-  std::shared_ptr<ra2yrcpp::asio_utils::IOService> io_service_;
+  connection_factory_t factory_;
   util::AtomicVariable<connection::State, std::recursive_mutex> state_;
   std::atomic_bool poll_thread_active_;
   ResultMap results_;
@@ -10,12 +10,15 @@
 #include <google/protobuf/io/zero_copy_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/message.h>
+#include <google/protobuf/util/field_mask_util.h>
 #include <google/protobuf/util/json_util.h>
 
 #include <fstream>
 #include <functional>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #undef GetMessage
@@ -29,6 +32,13 @@ bool ra2yrcpp::protocol::write_message(const gpb::Message* M,
   return M->SerializeToCodedStream(is) && !is->HadError();
 }
 
+bool ra2yrcpp::protocol::write_message(std::string_view bytes,
+                                       gpb::io::CodedOutputStream* is) {
+  is->WriteVarint32(static_cast<u32>(bytes.size()));
+  is->WriteRaw(bytes.data(), static_cast<int>(bytes.size()));
+  return !is->HadError();
+}
+
 bool ra2yrcpp::protocol::read_message(gpb::Message* M,
                                       gpb::io::CodedInputStream* is) {
   u32 length;
@@ -90,6 +100,19 @@ bool MessageOstream::write(const gpb::Message& M) {
   return false;
 }
 
+bool MessageOstream::write(std::string_view bytes) {
+  if (os == nullptr) {
+    return false;
+  }
+
+  if (gzip) {
+    gpb::io::CodedOutputStream co(s_g.get());
+    return write_message(bytes, &co);
+  }
+  gpb::io::CodedOutputStream co(s_o.get());
+  return write_message(bytes, &co);
+}
+
 bool MessageIstream::read(gpb::Message* M) {
   if (is == nullptr) {
     return false;
@@ -118,7 +141,6 @@ gpb::Message* ra2yrcpp::protocol::create_command_message(
 void ra2yrcpp::protocol::dump_messages(const std::string path,
                                        const gpb::Message& M,
                                        std::function<void(gpb::Message*)> cb) {
-  bool ok = true;
   auto ii = std::make_shared<std::ifstream>(
       path, std::ios_base::in | std::ios_base::binary);
   ra2yrcpp::protocol::MessageBuilder B(M.GetTypeName());
@@ -130,8 +152,7 @@ void ra2yrcpp::protocol::dump_messages(const std::string path,
     cb = [](auto* M) { fmt::print("{}\n", ra2yrcpp::protocol::to_json(*M)); };
   }
 
-  while (ok) {
-    ok = MS.read(B.m);
+  while (MS.read(B.m)) {
     cb(B.m);
   }
 }
@@ -154,6 +175,10 @@ bool ra2yrcpp::protocol::from_json(const vecu8& bytes, gpb::Message* m) {
   return false;
 }
 
+bool ra2yrcpp::protocol::from_json(std::string_view bytes, gpb::Message* m) {
+  return gpb::util::JsonStringToMessage(std::string(bytes), m).ok();
+}
+
 std::string ra2yrcpp::protocol::to_json(const gpb::Message& m) {
   std::string res;
   gpb::util::MessageToJsonString(m, &res);
@@ -173,3 +198,15 @@ void ra2yrcpp::protocol::copy_field(gpb::Message* dst, gpb::Message* src,
   dst->GetReflection()->MutableMessage(dst, f)->CopyFrom(
       src->GetReflection()->GetMessage(*src, f));
 }
+
+void ra2yrcpp::protocol::copy_fields(gpb::Message* dst, const gpb::Message& src,
+                                     const gpb::FieldMask& mask) {
+  using gpb::util::FieldMaskUtil;
+  for (const auto& p : mask.paths()) {
+    if (!FieldMaskUtil::GetFieldDescriptors(src.GetDescriptor(), p, nullptr)) {
+      throw std::invalid_argument(
+          fmt::format("invalid path {} for {}", p, src.GetTypeName()));
+    }
+  }
+  FieldMaskUtil::MergeMessageTo(src, mask, FieldMaskUtil::MergeOptions(), dst);
+}
@@ -6,6 +6,7 @@
 #include <google/protobuf/any.pb.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/dynamic_message.h>
+#include <google/protobuf/field_mask.pb.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/gzip_stream.h>
 #include <google/protobuf/io/zero_copy_stream.h>
@@ -19,6 +20,7 @@
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace ra2yrcpp::protocol {
@@ -51,6 +53,8 @@ struct MessageIstream : public MessageStream {
 struct MessageOstream : public MessageStream {
   MessageOstream(std::shared_ptr<std::ostream> os, bool gzip);
   bool write(const gpb::Message& M);
+  /// Write an already serialized message.
+  bool write(std::string_view bytes);
 
   std::shared_ptr<std::ostream> os;
   std::shared_ptr<gpb::io::ZeroCopyOutputStream> s_o;
@@ -58,6 +62,7 @@ struct MessageOstream : public MessageStream {
 };
 
 bool write_message(const gpb::Message* M, gpb::io::CodedOutputStream* os);
+bool write_message(std::string_view bytes, gpb::io::CodedOutputStream* os);
 bool read_message(gpb::Message* M, gpb::io::CodedInputStream* os);
 
 /// Dynamically set the field "args" of B's Message by parsing the JSON string
@@ -77,6 +82,7 @@ std::string message_type(const gpb::Any& m);
 std::string message_type(const gpb::Message& m);
 
 bool from_json(const vecu8& bytes, gpb::Message* m);
+bool from_json(std::string_view bytes, gpb::Message* m);
 std::string to_json(const gpb::Message& m);
 
 template <typename T>
@@ -114,6 +120,17 @@ void fill_repeated_empty(gpb::RepeatedPtrField<T>* dst, const std::size_t n) {
 void copy_field(gpb::Message* dst, gpb::Message* src,
                 const gpb::FieldDescriptor* f);
 
+///
+/// Copy the fields selected by mask from src to dst, which must be of the same
+/// type. Paths may refer to fields of singular submessages, e.g.
+/// "game_state.objects".
+///
+/// @exception std::invalid_argument if a path doesn't refer to a field of the
+/// message type
+///
+void copy_fields(gpb::Message* dst, const gpb::Message& src,
+                 const gpb::FieldMask& mask);
+
 /// Truncate RepeatedPtrField to given size. If length of dst
 /// is less than n, no truncation is performed.
 ///
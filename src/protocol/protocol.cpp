@@ -11,11 +11,15 @@
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/gzip_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <google/protobuf/message.h>
 #include <google/protobuf/util/json_util.h>
+#include <google/protobuf/wire_format_lite.h>
 
+#include <algorithm>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace ra2yrcpp;
 
@@ -30,15 +34,350 @@ vecu8 ra2yrcpp::to_vecu8(const gpb::Message& msg) {
 }
 
 ra2yrproto::Response ra2yrcpp::make_response(
-    const gpb::Message&& body, const ra2yrproto::ResponseCode code) {
+    const gpb::Message&& body, const ra2yrproto::ResponseCode code,
+    const u64 request_id) {
   ra2yrproto::Response r;
   r.set_code(code);
+  r.set_request_id(request_id);
   if (!r.mutable_body()->PackFrom(body)) {
     throw std::runtime_error("Could not pack message body");
   }
   return r;
 }
 
+namespace {
+constexpr char type_url_prefix[] = "type.googleapis.com/";
+constexpr u32 wire_varint = 0U;
+constexpr u32 wire_length_delimited = 2U;
+
+constexpr u32 make_tag(const int field, const u32 wire_type) {
+  return (static_cast<u32>(field) << 3U) | wire_type;
+}
+
+// Tags of the well known Any fields
+constexpr u32 tag_any_type_url = make_tag(1, wire_length_delimited);
+constexpr u32 tag_any_value = make_tag(2, wire_length_delimited);
+}  // namespace
+
+/// Write Response with a body of given type and size to out, which is resized
+/// to fit the message. write_body writes the serialized body.
+template <typename BufferT, typename WriteBody>
+static void write_response(const std::string& name, const std::size_t body_size,
+                           WriteBody write_body,
+                           const ra2yrproto::ResponseCode code,
+                           const u64 request_id, const u64 subscription_id,
+                           BufferT* out) {
+  using gpb::io::CodedOutputStream;
+  static const auto* D = ra2yrproto::Response::descriptor();
+  static const u32 tag_code =
+      make_tag(D->FindFieldByName("code")->number(), wire_varint);
+  static const u32 tag_body =
+      make_tag(D->FindFieldByName("body")->number(), wire_length_delimited);
+  static const u32 tag_request_id =
+      make_tag(D->FindFieldByName("request_id")->number(), wire_varint);
+  static const u32 tag_subscription_id =
+      make_tag(D->FindFieldByName("subscription_id")->number(), wire_varint);
+
+  const std::size_t url_size = sizeof(type_url_prefix) - 1U + name.size();
+  const std::size_t any_size =
+      CodedOutputStream::VarintSize32(tag_any_type_url) +
+      CodedOutputStream::VarintSize64(url_size) + url_size +
+      CodedOutputStream::VarintSize32(tag_any_value) +
+      CodedOutputStream::VarintSize64(body_size) + body_size;
+  std::size_t total = CodedOutputStream::VarintSize32(tag_body) +
+                      CodedOutputStream::VarintSize64(any_size) + any_size;
+  if (code != RESPONSE_OK) {
+    total += CodedOutputStream::VarintSize32(tag_code) +
+             CodedOutputStream::VarintSize32SignExtended(code);
+  }
+  if (request_id != 0U) {
+    total += CodedOutputStream::VarintSize32(tag_request_id) +
+             CodedOutputStream::VarintSize64(request_id);
+  }
+  if (subscription_id != 0U) {
+    total += CodedOutputStream::VarintSize32(tag_subscription_id) +
+             CodedOutputStream::VarintSize64(subscription_id);
+  }
+
+  out->resize(total);
+  {
+    gpb::io::ArrayOutputStream as(out->data(), static_cast<int>(total));
+    CodedOutputStream os(&as);
+    if (code != RESPONSE_OK) {
+      os.WriteTag(tag_code);
+      os.WriteVarint32SignExtended(code);
+    }
+    os.WriteTag(tag_body);
+    os.WriteVarint64(any_size);
+    os.WriteTag(tag_any_type_url);
+    os.WriteVarint64(url_size);
+    os.WriteRaw(type_url_prefix, sizeof(type_url_prefix) - 1U);
+    os.WriteString(name);
+    os.WriteTag(tag_any_value);
+    os.WriteVarint64(body_size);
+    write_body(&os);
+    if (request_id != 0U) {
+      os.WriteTag(tag_request_id);
+      os.WriteVarint64(request_id);
+    }
+    if (subscription_id != 0U) {
+      os.WriteTag(tag_subscription_id);
+      os.WriteVarint64(subscription_id);
+    }
+    if (os.HadError() || static_cast<std::size_t>(os.ByteCount()) != total) {
+      throw ra2yrcpp::protocol_error(
+          fmt::format("failed to serialize response {}", name));
+    }
+  }
+}
+
+/// Write Response with given body to out.
+template <typename BufferT>
+static void write_response(const gpb::Message& body,
+                           const ra2yrproto::ResponseCode code,
+                           const u64 request_id, BufferT* out) {
+  const std::size_t body_size = body.ByteSizeLong();
+  write_response(
+      body.GetDescriptor()->full_name(), body_size,
+      [&body](gpb::io::CodedOutputStream* os) {
+        // Sizes were cached by ByteSizeLong()
+        body.SerializeWithCachedSizes(os);
+      },
+      code, request_id, 0U, out);
+}
+
+vecu8 ra2yrcpp::serialize_response(const gpb::Message& body,
+                                   const ra2yrproto::ResponseCode code,
+                                   const u64 request_id) {
+  vecu8 res;
+  write_response(body, code, request_id, &res);
+  return res;
+}
+
+void ra2yrcpp::serialize_response(const gpb::Message& body,
+                                  const ra2yrproto::ResponseCode code,
+                                  const u64 request_id, std::string* out) {
+  write_response(body, code, request_id, out);
+}
+
+void ra2yrcpp::serialize_push(const std::string& type_name,
+                              std::string_view body, const u64 subscription_id,
+                              std::string* out) {
+  write_response(
+      type_name, body.size(),
+      [&body](gpb::io::CodedOutputStream* os) {
+        os->WriteRaw(body.data(), static_cast<int>(body.size()));
+      },
+      RESPONSE_OK, 0U, subscription_id, out);
+}
+
+void ra2yrcpp::serialize_field(const int number, std::string_view value,
+                               std::string* out) {
+  out->clear();
+  out->reserve(value.size() + 2U * MAX_LENGTH_PREFIX_SIZE);
+  write_record(static_cast<u32>(number), value, out);
+}
+
+std::size_t ra2yrcpp::write_length_prefix(u8* dst, const u64 length) {
+  return static_cast<std::size_t>(
+      gpb::io::CodedOutputStream::WriteVarint64ToArray(length, dst) - dst);
+}
+
+std::size_t ra2yrcpp::read_length_prefix(const u8* data,
+                                         const std::size_t size,
+                                         u64* length) {
+  u64 v = 0U;
+  for (std::size_t i = 0U; i < std::min(size, MAX_LENGTH_PREFIX_SIZE); i++) {
+    v |= static_cast<u64>(data[i] & 0x7FU) << (7U * i);
+    if ((data[i] & 0x80U) == 0U) {
+      *length = v;
+      return i + 1U;
+    }
+  }
+  if (size >= MAX_LENGTH_PREFIX_SIZE) {
+    throw ra2yrcpp::protocol_error("invalid length prefix");
+  }
+  return 0U;
+}
+
+bool ra2yrcpp::read_varint_field(std::string_view bytes, const u32 number,
+                                 u64* value) {
+  using gpb::internal::WireFormatLite;
+  const u32 tag = make_tag(static_cast<int>(number), wire_varint);
+  gpb::io::CodedInputStream is(reinterpret_cast<const u8*>(bytes.data()),
+                               static_cast<int>(bytes.size()));
+  while (u32 t = is.ReadTag()) {
+    if (t == tag) {
+      if (!is.ReadVarint64(value)) {
+        return false;
+      }
+    } else if (!WireFormatLite::SkipField(&is, t)) {
+      return false;
+    }
+  }
+  return is.ConsumedEntireMessage();
+}
+
+u64 ra2yrcpp::peek_request_id(std::string_view bytes) {
+  static const auto number =
+      static_cast<u32>(ra2yrproto::Command::descriptor()
+                           ->FindFieldByName("request_id")
+                           ->number());
+  u64 request_id = 0U;
+  return read_varint_field(bytes, number, &request_id) ? request_id : 0U;
+}
+
+bool ra2yrcpp::is_blocking_request(std::string_view bytes) {
+  using ra2yrproto::Command;
+  u64 type = 0U;
+  u64 blocking = 0U;
+  if (!read_varint_field(bytes, Command::kCommandTypeFieldNumber, &type)) {
+    return false;
+  }
+  switch (type) {
+    case ra2yrproto::POLL:
+    case ra2yrproto::POLL_BLOCKING:
+      return true;
+    case ra2yrproto::CLIENT_COMMAND:
+      return read_varint_field(bytes, Command::kBlockingFieldNumber,
+                               &blocking) &&
+             blocking != 0U;
+    default:
+      return false;
+  }
+}
+
+std::vector<FieldSpan> ra2yrcpp::field_spans(std::string_view bytes) {
+  using gpb::internal::WireFormatLite;
+  std::vector<FieldSpan> res;
+  gpb::io::CodedInputStream is(reinterpret_cast<const u8*>(bytes.data()),
+                               static_cast<int>(bytes.size()));
+  while (true) {
+    const auto begin = static_cast<std::size_t>(is.CurrentPosition());
+    const u32 tag = is.ReadTag();
+    if (tag == 0U) {
+      break;
+    }
+    if (!WireFormatLite::SkipField(&is, tag)) {
+      throw ra2yrcpp::protocol_error("malformed message");
+    }
+    const u32 number = WireFormatLite::GetTagFieldNumber(tag);
+    const auto end = static_cast<std::size_t>(is.CurrentPosition());
+    if (!res.empty() && res.back().number == number) {
+      res.back().end = end;
+    } else {
+      res.push_back({number, begin, end});
+    }
+  }
+  if (!is.ConsumedEntireMessage()) {
+    throw ra2yrcpp::protocol_error("malformed message");
+  }
+  std::sort(res.begin(), res.end(),
+            [](const auto& a, const auto& b) { return a.number < b.number; });
+  for (std::size_t i = 1U; i < res.size(); i++) {
+    if (res[i - 1U].number == res[i].number) {
+      throw ra2yrcpp::protocol_error(
+          fmt::format("field {} is not contiguous", res[i].number));
+    }
+  }
+  return res;
+}
+
+std::vector<std::string_view> ra2yrcpp::split_records(std::string_view bytes) {
+  using gpb::internal::WireFormatLite;
+  std::vector<std::string_view> res;
+  gpb::io::CodedInputStream is(reinterpret_cast<const u8*>(bytes.data()),
+                               static_cast<int>(bytes.size()));
+  while (u32 tag = is.ReadTag()) {
+    u32 size = 0U;
+    if (WireFormatLite::GetTagWireType(tag) !=
+            WireFormatLite::WIRETYPE_LENGTH_DELIMITED ||
+        !is.ReadVarint32(&size) || !is.Skip(static_cast<int>(size))) {
+      throw ra2yrcpp::protocol_error("malformed record");
+    }
+    const auto end = static_cast<std::size_t>(is.CurrentPosition());
+    res.push_back(bytes.substr(end - size, size));
+  }
+  if (!is.ConsumedEntireMessage()) {
+    throw ra2yrcpp::protocol_error("malformed record");
+  }
+  return res;
+}
+
+void ra2yrcpp::write_record(const u32 number, std::string_view payload,
+                            std::string* out) {
+  using gpb::io::CodedOutputStream;
+  const u32 tag = make_tag(static_cast<int>(number), wire_length_delimited);
+  u8 prefix[2U * MAX_LENGTH_PREFIX_SIZE];
+  u8* p = CodedOutputStream::WriteTagToArray(tag, prefix);
+  p = CodedOutputStream::WriteVarint64ToArray(payload.size(), p);
+  out->append(reinterpret_cast<const char*>(prefix), p - prefix);
+  out->append(payload);
+}
+
+void ra2yrcpp::diff_fields(std::string_view prev, std::string_view cur,
+                           std::string* changed, std::vector<u32>* cleared) {
+  const auto a = field_spans(prev);
+  const auto b = field_spans(cur);
+  auto view = [](std::string_view s, const FieldSpan& f) {
+    return s.substr(f.begin, f.end - f.begin);
+  };
+  changed->clear();
+  cleared->clear();
+  std::size_t i = 0U;
+  for (const auto& f : b) {
+    for (; i < a.size() && a[i].number < f.number; i++) {
+      cleared->push_back(a[i].number);
+    }
+    const bool same = i < a.size() && a[i].number == f.number &&
+                      view(prev, a[i]) == view(cur, f);
+    if (i < a.size() && a[i].number == f.number) {
+      i++;
+    }
+    if (!same) {
+      changed->append(view(cur, f));
+    }
+  }
+  for (; i < a.size(); i++) {
+    cleared->push_back(a[i].number);
+  }
+}
+
+void ra2yrcpp::apply_field_diff(gpb::Message* M, std::string_view changed,
+                                const std::vector<u32>& cleared) {
+  const auto* D = M->GetDescriptor();
+  const auto* R = M->GetReflection();
+  auto clear = [&](const u32 number) {
+    if (const auto* f = D->FindFieldByNumber(static_cast<int>(number))) {
+      R->ClearField(M, f);
+    }
+  };
+  for (const auto n : cleared) {
+    clear(n);
+  }
+  // Changed fields replace the old values instead of being merged to them
+  for (const auto& f : field_spans(changed)) {
+    clear(f.number);
+  }
+  gpb::io::CodedInputStream is(reinterpret_cast<const u8*>(changed.data()),
+                               static_cast<int>(changed.size()));
+  if (!M->MergeFromCodedStream(&is)) {
+    throw ra2yrcpp::protocol_error(
+        fmt::format("failed to apply difference to {}", M->GetTypeName()));
+  }
+}
+
+void ra2yrcpp::project_fields(std::string_view bytes,
+                              const std::vector<u32>& numbers,
+                              std::string* out) {
+  out->clear();
+  for (const auto& f : field_spans(bytes)) {
+    if (std::find(numbers.begin(), numbers.end(), f.number) != numbers.end()) {
+      out->append(bytes.substr(f.begin, f.end - f.begin));
+    }
+  }
+}
+
 ra2yrproto::Command ra2yrcpp::create_command(const gpb::Message& cmd,
                                              ra2yrproto::CommandType type) {
   ra2yrproto::Command C;
@@ -4,6 +4,12 @@
 
 #include "types.h"
 
+#include <cstddef>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
 namespace ra2yrcpp {
 
 namespace gpb = google::protobuf;
@@ -18,7 +24,166 @@ vecu8 to_vecu8(const gpb::Message& msg);
 
 ra2yrproto::Response make_response(
     const gpb::Message&& body,
-    const ra2yrproto::ResponseCode code = RESPONSE_OK);
+    const ra2yrproto::ResponseCode code = RESPONSE_OK,
+    const u64 request_id = 0U);
+
+///
+/// Serialize a Response with the given body. Equivalent to serializing the
+/// result of make_response(), but the body is written directly into the output
+/// buffer instead of being serialized to Any first.
+///
+/// @param body response body
+/// @param code response code
+/// @param request_id id of the request this is a response to. Omitted if 0.
+/// @exception yrclient::protocol_error on serialization failure
+///
+vecu8 serialize_response(const gpb::Message& body,
+                         const ra2yrproto::ResponseCode code = RESPONSE_OK,
+                         const u64 request_id = 0U);
+
+/// Serialize Response into out, replacing it's contents. Allows writing
+/// directly into an outgoing message buffer.
+void serialize_response(const gpb::Message& body,
+                        const ra2yrproto::ResponseCode code,
+                        const u64 request_id, std::string* out);
+
+///
+/// Serialize a Response for a message pushed to a subscriber. The body is
+/// given in serialized form, so that it can be shared by all subscribers
+/// without serializing it again.
+///
+/// @param type_name full name of the body's message type
+/// @param body serialized body
+/// @param subscription_id id of the subscription the message belongs to
+/// @param out destination buffer, whose contents are replaced
+/// @exception yrclient::protocol_error on serialization failure
+///
+void serialize_push(const std::string& type_name, std::string_view body,
+                    const u64 subscription_id, std::string* out);
+
+///
+/// Serialize a message containing only the given length-delimited field, e.g.
+/// a submessage, whose value is given in serialized form. Allows embedding an
+/// already serialized message without parsing it.
+///
+/// @param number field number
+/// @param value serialized value of the field
+/// @param out destination buffer, whose contents are replaced
+///
+void serialize_field(const int number, std::string_view value,
+                     std::string* out);
+
+/// Maximum size of a varint encoded length prefix.
+constexpr std::size_t MAX_LENGTH_PREFIX_SIZE = 10U;
+
+///
+/// Write varint encoded length prefix of a message.
+/// @param dst destination buffer of at least MAX_LENGTH_PREFIX_SIZE bytes
+/// @param length message length
+/// @return number of bytes written
+///
+std::size_t write_length_prefix(u8* dst, const u64 length);
+
+///
+/// Read varint encoded length prefix of a message.
+/// @param data input buffer
+/// @param size number of bytes available in data
+/// @param length destination for the decoded length
+/// @return number of bytes consumed, or 0 if data doesn't yet contain a
+/// complete prefix
+/// @exception ra2yrcpp::protocol_error if the prefix is too long
+///
+std::size_t read_length_prefix(const u8* data, const std::size_t size,
+                               u64* length);
+
+///
+/// Read the last value of a varint field of a serialized message without
+/// parsing the other fields. value is left unchanged if the field isn't set.
+///
+/// @return false if bytes isn't a valid serialized message
+///
+bool read_varint_field(std::string_view bytes, const u32 number, u64* value);
+
+///
+/// Read request_id of a serialized Command without parsing the other fields.
+/// Returns 0 if the id isn't set, or if bytes isn't a valid binary Command.
+///
+u64 peek_request_id(std::string_view bytes);
+
+///
+/// Check if a serialized Command waits for command results, i.e. it's a POLL,
+/// POLL_BLOCKING or blocking CLIENT_COMMAND. Doesn't parse the other fields.
+/// Returns false if bytes isn't a valid binary Command.
+///
+bool is_blocking_request(std::string_view bytes);
+
+/// Consecutive records of a top-level field in a serialized message.
+struct FieldSpan {
+  u32 number;
+  std::size_t begin;
+  std::size_t end;
+};
+
+///
+/// Split serialized message to top-level fields, sorted by field number.
+/// Records of each field must be contiguous, which holds for messages
+/// serialized by this library.
+///
+/// @exception ra2yrcpp::protocol_error if the message is malformed, or records
+/// of a field aren't contiguous
+///
+std::vector<FieldSpan> field_spans(std::string_view bytes);
+
+///
+/// Return payloads of consecutive length-delimited records, e.g. the elements
+/// of a repeated message field.
+///
+/// @exception ra2yrcpp::protocol_error if bytes contains other kind of records
+///
+std::vector<std::string_view> split_records(std::string_view bytes);
+
+/// Append a length-delimited record of the given field number to out.
+void write_record(const u32 number, std::string_view payload,
+                  std::string* out);
+
+///
+/// Compute the difference of two serialized messages of the same type at the
+/// granularity of top-level fields, without parsing them. Fields whose
+/// encoding differs are copied to changed in serialized form, and fields
+/// present only in prev are added to cleared. Repeated fields are compared as
+/// a whole. See field_spans() for requirements on the messages.
+///
+/// @param prev previous message
+/// @param cur current message
+/// @param changed destination for the changed fields, whose contents are
+/// replaced
+/// @param cleared destination for numbers of the cleared fields
+/// @exception ra2yrcpp::protocol_error if either message is malformed
+///
+void diff_fields(std::string_view prev, std::string_view cur,
+                 std::string* changed, std::vector<u32>* cleared);
+
+///
+/// Apply a difference computed by diff_fields() to the message it was computed
+/// from, so that it becomes equal to the current message.
+///
+/// @exception ra2yrcpp::protocol_error if changed is malformed
+///
+void apply_field_diff(gpb::Message* M, std::string_view changed,
+                      const std::vector<u32>& cleared);
+
+///
+/// Copy the given top-level fields of a serialized message to out without
+/// parsing the message. The result is the serialized message with all other
+/// fields cleared.
+///
+/// @param bytes serialized message
+/// @param numbers numbers of the fields to copy
+/// @param out destination buffer, whose contents are replaced
+/// @exception ra2yrcpp::protocol_error if the message is malformed
+///
+void project_fields(std::string_view bytes, const std::vector<u32>& numbers,
+                    std::string* out);
 
 ///
 /// Create command message.
@@ -8,7 +8,10 @@
 #include "is_context.hpp"
 #include "multi_client.hpp"
 #include "protocol/helpers.hpp"
+#include "protocol/protocol.hpp"
 #include "ra2yrcppcli.hpp"
+#include "state_record.hpp"
+#include "traffic_record.hpp"
 #include "types.h"
 #include "utility/time.hpp"
 #include "win32/windows_utils.hpp"
@@ -19,14 +22,23 @@
 
 #include <cstdio>
 
+#include <algorithm>
 #include <chrono>
 #include <exception>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
 using namespace ra2yrcppcli;
 using namespace std::chrono_literals;
 namespace gpb = google::protobuf;
@@ -95,6 +107,79 @@ void easy_setup(const std::string path_dll,
   }
 }
 
+/// Disable newline translation, which would corrupt binary output on
+/// Windows.
+void set_binary_mode(std::FILE* f) {
+#ifdef _WIN32
+  (void)_setmode(_fileno(f), _O_BINARY);
+#else
+  (void)f;
+#endif
+}
+
+///
+/// Write frames of a game state record in the given range to out, either as
+/// lines of JSON, or as an uncompressed stream of length prefixed GameState
+/// messages. Only the blocks containing the range are read from block
+/// compressed records, and they're decoded and converted by num_threads
+/// threads. Plain gzip streams written by older versions are read from the
+/// beginning by a single thread.
+///
+void dump_record(const std::string& path, const u32 first, const u32 last,
+                 const bool binary, const unsigned num_threads,
+                 std::FILE* out) {
+  auto write = [out](std::string_view s) {
+    if (std::fwrite(s.data(), 1U, s.size(), out) != s.size()) {
+      throw std::runtime_error("failed to write output");
+    }
+  };
+  auto append_binary = [](std::string_view state, std::string* dst) {
+    u8 prefix[ra2yrcpp::MAX_LENGTH_PREFIX_SIZE];
+    dst->append(reinterpret_cast<const char*>(prefix),
+                ra2yrcpp::write_length_prefix(prefix, state.size()));
+    dst->append(state);
+  };
+  auto append_json = [](const gpb::Message& M, std::string* dst) {
+    dst->append(ra2yrcpp::protocol::to_json(M));
+    dst->push_back('\n');
+  };
+
+  if (!ra2yrcpp::record::is_record_file(path)) {
+    std::string buf;
+    ra2yrcpp::protocol::dump_messages(
+        path, ra2yrproto::ra2yr::GameState(), [&](auto* M) {
+          auto* F = M->GetDescriptor()->FindFieldByName("current_frame");
+          const auto frame = M->GetReflection()->GetUInt32(*M, F);
+          if (frame < first || frame > last) {
+            return;
+          }
+          buf.clear();
+          if (binary) {
+            append_binary(M->SerializeAsString(), &buf);
+          } else {
+            append_json(*M, &buf);
+          }
+          write(buf);
+        });
+    return;
+  }
+  ra2yrcpp::record::RecordReader R(path);
+  R.convert_frames(
+      first, last,
+      [&](const u32, std::string_view state, std::string* dst) {
+        if (binary) {
+          append_binary(state, dst);
+          return;
+        }
+        thread_local ra2yrproto::ra2yr::GameState G;
+        if (!G.ParseFromArray(state.data(), static_cast<int>(state.size()))) {
+          throw std::runtime_error("failed to parse GameState");
+        }
+        append_json(G, dst);
+      },
+      write, num_threads);
+}
+
 int main(int argc, char* argv[]) {
   argparse::ArgumentParser A(argv[0]);
 
@@ -174,19 +259,62 @@ int main(int argc, char* argv[]) {
       "input file");
   record_command.add_argument("gzip").help("process gzip compressed file");
   record_command.add_argument("input-file").help("input file");
+  record_command.add_argument("--from-frame")
+      .help("first frame to extract")
+      .default_value(0u)
+      .scan<'u', unsigned>();
+  record_command.add_argument("--to-frame")
+      .help("last frame to extract")
+      .default_value(std::numeric_limits<unsigned>::max())
+      .scan<'u', unsigned>();
+  record_command.add_argument("--threads")
+      .help("number of decoding threads. Set 0 to decode in the main thread")
+      .default_value(std::max(std::thread::hardware_concurrency(), 1U))
+      .scan<'u', unsigned>();
+  record_command.add_argument("--format")
+      .help(
+          "output format: json (one object per line) or binary (length "
+          "prefixed messages)")
+      .default_value(std::string("json"));
+  record_command.add_argument("-o", "--output")
+      .help("output file. Use - for standard output")
+      .default_value(std::string("-"));
 
   A.add_subparser(record_command);
 
   A.parse_args(argc, argv);
 
   if (A.is_subcommand_used("record")) {
-    const std::string input = record_command.get<std::string>("-i");
+    const std::string input = record_command.get<std::string>("input-file");
     auto mode = record_command.get<std::string>("mode");
     if (mode == "record") {
-      ra2yrcpp::protocol::dump_messages(input, ra2yrproto::ra2yr::GameState());
+      const auto format = record_command.get<std::string>("--format");
+      if (format != "json" && format != "binary") {
+        throw std::invalid_argument(fmt::format("invalid format {}", format));
+      }
+      const bool binary = format == "binary";
+      const auto output = record_command.get<std::string>("--output");
+      // Closed, and the output flushed, also if conversion fails
+      std::unique_ptr<std::FILE, decltype(&std::fclose)> file(nullptr,
+                                                              &std::fclose);
+      std::FILE* out = stdout;
+      if (output != "-") {
+        file.reset(std::fopen(output.c_str(), binary ? "wb" : "w"));
+        if (file == nullptr) {
+          throw std::runtime_error(fmt::format("failed to open {}", output));
+        }
+        out = file.get();
+      } else if (binary) {
+        set_binary_mode(stdout);
+      }
+      dump_record(input, record_command.get<unsigned>("--from-frame"),
+                  record_command.get<unsigned>("--to-frame"), binary,
+                  record_command.get<unsigned>("--threads"), out);
+      std::fflush(out);
     } else if (mode == "traffic") {
-      ra2yrcpp::protocol::dump_messages(input,
-                                        ra2yrproto::ra2yr::TunnelPacket());
+      ra2yrcpp::traffic::read_traffic(input, [](const auto& P) {
+        fmt::print("{}\n", ra2yrcpp::protocol::to_json(P));
+      });
     }
   }
 
@@ -2,33 +2,117 @@
 
 #include <cstddef>
 
+#include <algorithm>
+#include <stdexcept>
 #include <utility>
 #include <vector>
 
 namespace ring_buffer {
 
+///
+/// Fixed capacity FIFO queue backed by a power-of-two sized circular array.
+/// Pushing to a full buffer evicts the oldest element in O(1) time. Unbounded
+/// buffers (max_size = -1) grow by doubling the backing array.
+///
 template <typename T>
 class RingBuffer {
  public:
-  explicit RingBuffer(const std::size_t max_size = -1u) : max_size_(max_size) {}
+  /// Upper bound for the initial allocation of unbounded or very large
+  /// buffers.
+  static constexpr std::size_t max_preallocation = 1024U;
+
+  explicit RingBuffer(const std::size_t max_size = -1u)
+      : max_size_(max_size), head_(0U), size_(0U), evicted_(0U) {
+    buf_.resize(round_up(std::min(max_size_, max_preallocation)));
+  }
 
   void push(T t) { emplace(std::move(t)); }
 
   void emplace(T&& t) {
-    if (size() >= max_size_) {
-      q_.erase(q_.begin());
+    if (max_size_ == 0U) {
+      // Nothing can be stored, so the item is evicted right away
+      evicted_++;
+      return;
+    }
+    if (size_ >= max_size_) {
+      pop();
+      evicted_++;
+    } else if (size_ == buf_.size()) {
+      grow();
     }
-    q_.emplace_back(std::move(t));
+    buf_[index(size_)] = std::move(t);
+    size_++;
+  }
+
+  /// Remove the oldest item.
+  /// @exception std::out_of_range if the buffer is empty
+  void pop() {
+    check_not_empty();
+    buf_[head_] = T();
+    head_ = index(1U);
+    size_--;
+  }
+
+  /// Remove the newest item.
+  /// @exception std::out_of_range if the buffer is empty
+  void pop_back() {
+    check_not_empty();
+    buf_[index(size_ - 1U)] = T();
+    size_--;
   }
 
-  void pop() { q_.pop_back(); }
+  /// Return reference to the oldest item.
+  T& front() { return buf_[head_]; }
+
+  /// Return reference to the newest item.
+  T& back() { return buf_[index(size_ - 1U)]; }
+
+  /// Return reference to i'th oldest item.
+  T& operator[](const std::size_t i) { return buf_[index(i)]; }
+
+  std::size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0U; }
+
+  std::size_t capacity() const { return buf_.size(); }
 
-  T& front() { return q_.back(); }
+  std::size_t max_size() const { return max_size_; }
 
-  std::size_t size() const { return q_.size(); }
+  /// Total number of items dropped due to the buffer being full.
+  std::size_t evicted() const { return evicted_; }
 
  private:
-  std::vector<T> q_;
+  static std::size_t round_up(const std::size_t n) {
+    std::size_t c = 1U;
+    while (c < n) {
+      c <<= 1U;
+    }
+    return c;
+  }
+
+  void check_not_empty() const {
+    if (size_ == 0U) {
+      throw std::out_of_range("pop from empty RingBuffer");
+    }
+  }
+
+  std::size_t index(const std::size_t i) const {
+    return (head_ + i) & (buf_.size() - 1U);
+  }
+
+  void grow() {
+    std::vector<T> b(buf_.size() * 2U);
+    for (std::size_t i = 0U; i < size_; i++) {
+      b[i] = std::move(buf_[index(i)]);
+    }
+    buf_.swap(b);
+    head_ = 0U;
+  }
+
+  std::vector<T> buf_;
   std::size_t max_size_;
+  std::size_t head_;
+  std::size_t size_;
+  std::size_t evicted_;
 };
 }  // namespace ring_buffer
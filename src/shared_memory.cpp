@@ -0,0 +1,299 @@
+#include "shared_memory.hpp"
+
+#include "errors.hpp"
+#include "logging.hpp"
+
+#include <chrono>
+
+#ifdef _WIN32
+#include "win32/windows_utils.hpp"
+#elif __linux__
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <ctime>
+#endif
+
+using namespace ra2yrcpp::shm;
+
+static std::string os_name(const std::string& name) {
+#ifdef _WIN32
+  return "Local\\ra2yrcpp_" + name;
+#elif __linux__
+  return "/ra2yrcpp_" + name;
+#else
+#error Not implemented
+#endif
+}
+
+SharedMemory::SharedMemory(std::string name, const std::size_t size)
+    : name_(name), owner_(true), handle_(nullptr), data_(nullptr), size_(0U) {
+  const auto n = os_name(name_);
+#ifdef _WIN32
+  handle_ = windows_utils::create_file_mapping(n, size);
+  if (handle_ == nullptr) {
+    throw ra2yrcpp::system_error("CreateFileMapping");
+  }
+  data_ = static_cast<u8*>(windows_utils::map_view_of_file(handle_, &size_));
+  if (data_ == nullptr) {
+    windows_utils::close_handle(handle_);
+    throw ra2yrcpp::system_error("MapViewOfFile");
+  }
+#elif __linux__
+  // Replace leftovers of a crashed process
+  (void)shm_unlink(n.c_str());
+  const int fd = shm_open(n.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    throw ra2yrcpp::system_error("shm_open");
+  }
+  if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    const int err = errno;
+    close(fd);
+    (void)shm_unlink(n.c_str());
+    throw ra2yrcpp::system_error("ftruncate", err);
+  }
+  auto* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    const int err = errno;
+    (void)shm_unlink(n.c_str());
+    throw ra2yrcpp::system_error("mmap", err);
+  }
+  data_ = static_cast<u8*>(p);
+  size_ = size;
+#else
+#error Not implemented
+#endif
+}
+
+SharedMemory::SharedMemory(std::string name)
+    : name_(name), owner_(false), handle_(nullptr), data_(nullptr), size_(0U) {
+  const auto n = os_name(name_);
+#ifdef _WIN32
+  handle_ = windows_utils::open_file_mapping(n);
+  if (handle_ == nullptr) {
+    throw ra2yrcpp::system_error("OpenFileMapping");
+  }
+  data_ = static_cast<u8*>(windows_utils::map_view_of_file(handle_, &size_));
+  if (data_ == nullptr) {
+    windows_utils::close_handle(handle_);
+    throw ra2yrcpp::system_error("MapViewOfFile");
+  }
+#elif __linux__
+  const int fd = shm_open(n.c_str(), O_RDWR, 0600);
+  if (fd < 0) {
+    throw ra2yrcpp::system_error("shm_open");
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0) {
+    const int err = errno;
+    close(fd);
+    throw ra2yrcpp::system_error("fstat", err);
+  }
+  size_ = static_cast<std::size_t>(st.st_size);
+  auto* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw ra2yrcpp::system_error("mmap");
+  }
+  data_ = static_cast<u8*>(p);
+#else
+#error Not implemented
+#endif
+}
+
+SharedMemory::~SharedMemory() {
+#ifdef _WIN32
+  windows_utils::unmap_view_of_file(data_);
+  windows_utils::close_handle(handle_);
+#elif __linux__
+  if (munmap(data_, size_) != 0) {
+    eprintf("munmap: {}", ra2yrcpp::get_error_message(errno));
+  }
+  if (owner_) {
+    (void)shm_unlink(os_name(name_).c_str());
+  }
+#else
+#error Not implemented
+#endif
+}
+
+u8* SharedMemory::data() { return data_; }
+
+std::size_t SharedMemory::size() const { return size_; }
+
+const std::string& SharedMemory::name() const { return name_; }
+
+MappedFile::MappedFile(const std::string& path)
+    : handle_(nullptr), data_(nullptr), size_(0U) {
+#ifdef _WIN32
+  auto* file = windows_utils::open_file_read(path, &size_);
+  if (file == nullptr) {
+    throw ra2yrcpp::system_error("CreateFile " + path);
+  }
+  if (size_ == 0U) {
+    windows_utils::close_handle(file);
+    return;
+  }
+  handle_ = windows_utils::create_file_mapping_read(file);
+  windows_utils::close_handle(file);
+  if (handle_ == nullptr) {
+    throw ra2yrcpp::system_error("CreateFileMapping " + path);
+  }
+  data_ = static_cast<u8*>(windows_utils::map_view_of_file_read(handle_));
+  if (data_ == nullptr) {
+    windows_utils::close_handle(handle_);
+    throw ra2yrcpp::system_error("MapViewOfFile " + path);
+  }
+#elif __linux__
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw ra2yrcpp::system_error("open " + path);
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0) {
+    const int err = errno;
+    close(fd);
+    throw ra2yrcpp::system_error("fstat " + path, err);
+  }
+  size_ = static_cast<std::size_t>(st.st_size);
+  if (size_ == 0U) {
+    close(fd);
+    return;
+  }
+  auto* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw ra2yrcpp::system_error("mmap " + path);
+  }
+  // Blocks are mostly read front to back
+  (void)madvise(p, size_, MADV_SEQUENTIAL);
+  data_ = static_cast<u8*>(p);
+#else
+#error Not implemented
+#endif
+}
+
+MappedFile::~MappedFile() {
+  if (data_ == nullptr) {
+    return;
+  }
+#ifdef _WIN32
+  windows_utils::unmap_view_of_file(data_);
+  windows_utils::close_handle(handle_);
+#elif __linux__
+  if (munmap(data_, size_) != 0) {
+    eprintf("munmap: {}", ra2yrcpp::get_error_message(errno));
+  }
+#else
+#error Not implemented
+#endif
+}
+
+const u8* MappedFile::data() const { return data_; }
+
+std::size_t MappedFile::size() const { return size_; }
+
+#ifdef __linux__
+static_assert(sizeof(sem_t) <= Doorbell::storage_size);
+#endif
+
+Doorbell::Doorbell(void* storage, std::string name, const bool create)
+    : handle_(nullptr), owner_(create) {
+#ifdef _WIN32
+  (void)storage;
+  const auto n = os_name(name);
+  handle_ =
+      create ? windows_utils::create_event(n) : windows_utils::open_event(n);
+  if (handle_ == nullptr) {
+    throw ra2yrcpp::system_error(create ? "CreateEvent" : "OpenEvent");
+  }
+#elif __linux__
+  (void)name;
+  handle_ = storage;
+  if (create && sem_init(static_cast<sem_t*>(handle_), 1, 0) != 0) {
+    throw ra2yrcpp::system_error("sem_init");
+  }
+#else
+#error Not implemented
+#endif
+}
+
+Doorbell::~Doorbell() {
+#ifdef _WIN32
+  windows_utils::close_handle(handle_);
+#elif __linux__
+  if (owner_) {
+    (void)sem_destroy(static_cast<sem_t*>(handle_));
+  }
+#else
+#error Not implemented
+#endif
+}
+
+void Doorbell::ring() {
+#ifdef _WIN32
+  if (windows_utils::set_event(handle_) == 0) {
+    throw ra2yrcpp::system_error("SetEvent");
+  }
+#elif __linux__
+  if (sem_post(static_cast<sem_t*>(handle_)) != 0) {
+    throw ra2yrcpp::system_error("sem_post");
+  }
+#else
+#error Not implemented
+#endif
+}
+
+bool Doorbell::wait(const duration_t timeout) {
+#ifdef _WIN32
+  return windows_utils::wait_for_object(
+      handle_, static_cast<unsigned long>(
+                   std::chrono::duration<double, std::milli>(timeout).count()));
+#elif __linux__
+  timespec ts{};
+  clock_gettime(CLOCK_REALTIME, &ts);
+  const auto ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count() +
+      ts.tv_nsec;
+  ts.tv_sec += static_cast<time_t>(ns / 1000000000);
+  ts.tv_nsec = static_cast<long>(ns % 1000000000);  // NOLINT
+  while (sem_timedwait(static_cast<sem_t*>(handle_), &ts) != 0) {
+    if (errno == ETIMEDOUT) {
+      return false;
+    }
+    if (errno != EINTR) {
+      throw ra2yrcpp::system_error("sem_timedwait");
+    }
+  }
+  return true;
+#else
+#error Not implemented
+#endif
+}
+
+u32 ra2yrcpp::shm::current_pid() {
+#ifdef _WIN32
+  return static_cast<u32>(
+      windows_utils::get_pid(windows_utils::get_current_process_handle()));
+#elif __linux__
+  return static_cast<u32>(getpid());
+#else
+#error Not implemented
+#endif
+}
+
+bool ra2yrcpp::shm::process_alive(const u32 pid) {
+#ifdef _WIN32
+  return windows_utils::process_alive(pid);
+#elif __linux__
+  return kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH;
+#else
+#error Not implemented
+#endif
+}
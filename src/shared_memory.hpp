@@ -0,0 +1,103 @@
+#pragma once
+#include "types.h"
+
+#include <cstddef>
+
+#include <string>
+
+namespace ra2yrcpp::shm {
+
+///
+/// Named shared memory mapping, that can be opened by other processes on the
+/// same host. Backed by shm_open() on Linux and by a pagefile backed file
+/// mapping on Windows.
+///
+class SharedMemory {
+ public:
+  /// Create a new zero-filled mapping. The name is removed when the object is
+  /// destroyed, but the memory stays valid for processes that still have it
+  /// mapped.
+  /// @param name name of the mapping, without platform specific prefixes
+  /// @param size size in bytes
+  /// @exception ra2yrcpp::system_error on failure
+  SharedMemory(std::string name, const std::size_t size);
+  /// Open an existing mapping.
+  /// @exception ra2yrcpp::system_error on failure
+  explicit SharedMemory(std::string name);
+  ~SharedMemory();
+  SharedMemory(const SharedMemory&) = delete;
+  SharedMemory& operator=(const SharedMemory&) = delete;
+
+  u8* data();
+  std::size_t size() const;
+  const std::string& name() const;
+
+ private:
+  std::string name_;
+  bool owner_;
+  void* handle_;
+  u8* data_;
+  std::size_t size_;
+};
+
+///
+/// Read-only mapping of a whole file. Can be read from multiple threads.
+///
+class MappedFile {
+ public:
+  /// @exception ra2yrcpp::system_error if the file can't be opened or mapped
+  explicit MappedFile(const std::string& path);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  /// Null if the file is empty.
+  const u8* data() const;
+  std::size_t size() const;
+
+ private:
+  void* handle_;
+  u8* data_;
+  std::size_t size_;
+};
+
+///
+/// Wakes up a thread, possibly of another process, blocked in wait(). Rings
+/// that happen while no one is waiting are remembered, so a subsequent wait()
+/// returns immediately.
+///
+/// On Linux the doorbell is a process shared semaphore placed in the given
+/// storage, and on Windows a named auto-reset event.
+///
+class Doorbell {
+ public:
+  /// Bytes of shared memory required for storage.
+  static constexpr std::size_t storage_size = 32U;
+
+  /// @param storage shared memory for the doorbell's state
+  /// @param name name unique to the doorbell, used by named kernel objects
+  /// @param create initialize a new doorbell instead of opening existing one
+  /// @exception ra2yrcpp::system_error on failure
+  Doorbell(void* storage, std::string name, const bool create);
+  ~Doorbell();
+  Doorbell(const Doorbell&) = delete;
+  Doorbell& operator=(const Doorbell&) = delete;
+
+  void ring();
+  /// Wait until the doorbell is rung.
+  /// @return false on timeout
+  bool wait(const duration_t timeout);
+
+ private:
+  void* handle_;
+  bool owner_;
+};
+
+/// Id of the current process.
+u32 current_pid();
+
+/// Return true unless the process with given id is known to have exited.
+/// Used to detect peers that died without cleaning up.
+bool process_alive(const u32 pid);
+
+}  // namespace ra2yrcpp::shm
@@ -0,0 +1,296 @@
+#include "shm_channel.hpp"
+
+#include "config.hpp"
+#include "errors.hpp"
+#include "utility/scope_guard.hpp"
+
+#include <fmt/core.h>
+
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+using namespace ra2yrcpp::shm;
+
+namespace {
+enum RecordFlags : u32 { PAD = 1U, MORE = 2U };
+
+constexpr u32 align_up(const u32 v, const u32 a) {
+  return (v + a - 1U) & ~(a - 1U);
+}
+
+u32 ceil_pow2(const u32 v) {
+  u32 r = 4096U;
+  while (r < v) {
+    r <<= 1U;
+  }
+  return r;
+}
+}  // namespace
+
+Bell::Bell(BellHeader* h, std::string name, const bool create)
+    : h_(h), d_(h->storage, name, create) {}
+
+void Bell::notify() {
+  // Pairs with the increment of waiters in wait(): either the waiter sees the
+  // new state, or we see the waiter.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (h_->waiters.load() > 0U) {
+    d_.ring();
+  }
+}
+
+bool Bell::wait(const std::function<bool()>& pred, const duration_t timeout) {
+  for (unsigned i = 0U; i < cfg::SHM_SPIN_COUNT; i++) {
+    if (pred()) {
+      return true;
+    }
+  }
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (true) {
+    h_->waiters.fetch_add(1U);
+    utility::scope_guard g = [this]() { h_->waiters.fetch_sub(1U); };
+    if (pred()) {
+      return true;
+    }
+    const auto left = std::chrono::duration_cast<duration_t>(
+        deadline - std::chrono::steady_clock::now());
+    if (left <= duration_t(0.0)) {
+      return false;
+    }
+    // Wake up periodically, in case pred() depends on something that doesn't
+    // ring the bell.
+    (void)d_.wait(std::min(left, cfg::SHM_POLL_INTERVAL));
+  }
+}
+
+Region::Region(std::string name, const u32 num_slots, const u32 request_size,
+               const u32 response_size) {
+  const u32 req_cap = ceil_pow2(request_size);
+  const u32 resp_cap = ceil_pow2(response_size);
+  const u32 num_bells = 1U + 3U * num_slots;
+  const u32 bells_offset = align_up(sizeof(RegionHeader), 64U);
+  const u32 slots_offset =
+      align_up(bells_offset + num_bells * sizeof(BellHeader), 64U);
+  u32 data_offset =
+      align_up(slots_offset + num_slots * sizeof(SlotHeader), 4096U);
+  mem_ = std::make_unique<SharedMemory>(
+      name, data_offset + num_slots * (req_cap + resp_cap));
+
+  auto* h = new (mem_->data()) RegionHeader();
+  h->version = REGION_VERSION;
+  h->num_slots = num_slots;
+  h->num_bells = num_bells;
+  h->bells_offset = bells_offset;
+  h->slots_offset = slots_offset;
+  for (u32 i = 0U; i < num_bells; i++) {
+    (void)new (at(bells_offset + i * sizeof(BellHeader))) BellHeader();
+  }
+  for (u32 i = 0U; i < num_slots; i++) {
+    auto* s = new (at(slots_offset + i * sizeof(SlotHeader))) SlotHeader();
+    auto init = [&data_offset](RingHeader* r, const u32 cap, const u32 data,
+                               const u32 space) {
+      r->capacity = cap;
+      r->data_offset = data_offset;
+      r->data_bell = data;
+      r->space_bell = space;
+      data_offset += cap;
+    };
+    init(&s->requests, req_cap, server_bell, 3U + 3U * i);
+    init(&s->responses, resp_cap, 1U + 3U * i, 2U + 3U * i);
+  }
+  open_bells(true);
+  h->open.store(1U);
+  // Publish the region to clients
+  std::atomic_thread_fence(std::memory_order_release);
+  h->magic = REGION_MAGIC;
+}
+
+Region::Region(std::string name)
+    : mem_(std::make_unique<SharedMemory>(name)) {
+  if (mem_->size() < sizeof(RegionHeader)) {
+    throw ra2yrcpp::protocol_error(
+        fmt::format("shared memory {} too small", name));
+  }
+  auto* h = header();
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (h->magic != REGION_MAGIC || h->version != REGION_VERSION) {
+    throw ra2yrcpp::protocol_error(
+        fmt::format("invalid shared memory region {}", name));
+  }
+  const auto size = mem_->size();
+  bool ok = h->num_bells == 1U + 3U * h->num_slots &&
+            h->bells_offset + std::size_t(h->num_bells) * sizeof(BellHeader) <=
+                size &&
+            h->slots_offset + std::size_t(h->num_slots) * sizeof(SlotHeader) <=
+                size;
+  for (u32 i = 0U; ok && i < h->num_slots; i++) {
+    for (const auto* r : {&slot(i)->requests, &slot(i)->responses}) {
+      ok = ok && std::size_t(r->data_offset) + r->capacity <= size &&
+           r->data_bell < h->num_bells && r->space_bell < h->num_bells;
+    }
+  }
+  if (!ok) {
+    throw ra2yrcpp::protocol_error(
+        fmt::format("corrupted shared memory region {}", name));
+  }
+  open_bells(false);
+}
+
+void Region::open_bells(const bool create) {
+  const auto n = header()->num_bells;
+  for (u32 i = 0U; i < n; i++) {
+    bells_.push_back(std::make_unique<Bell>(
+        reinterpret_cast<BellHeader*>(
+            at(header()->bells_offset + i * sizeof(BellHeader))),
+        fmt::format("{}_bell{}", mem_->name(), i), create));
+  }
+}
+
+RegionHeader* Region::header() {
+  return reinterpret_cast<RegionHeader*>(mem_->data());
+}
+
+SlotHeader* Region::slot(const u32 index) {
+  return reinterpret_cast<SlotHeader*>(
+      at(header()->slots_offset + index * sizeof(SlotHeader)));
+}
+
+Bell* Region::bell(const u32 index) { return bells_.at(index).get(); }
+
+u8* Region::at(const u32 offset) { return mem_->data() + offset; }
+
+u32 Region::num_slots() { return header()->num_slots; }
+
+Ring::Ring(Region* r, RingHeader* h)
+    : h_(h),
+      data_(r->at(h->data_offset)),
+      data_bell_(r->bell(h->data_bell)),
+      space_bell_(r->bell(h->space_bell)) {}
+
+void Ring::reset() {
+  h_->head.store(0U);
+  h_->tail.store(0U);
+}
+
+bool Ring::empty() const {
+  return h_->head.load(std::memory_order_acquire) ==
+         h_->tail.load(std::memory_order_relaxed);
+}
+
+bool Ring::writable(const std::size_t size) const {
+  const u32 used = h_->head.load(std::memory_order_relaxed) -
+                   h_->tail.load(std::memory_order_acquire);
+  if (size > h_->capacity / 2U - sizeof(Record)) {
+    return used == 0U;
+  }
+  // The record may need to be preceded by at most the same amount of padding
+  const u32 rec = align_up(static_cast<u32>(sizeof(Record) + size), 8U);
+  return h_->capacity - used >= 2U * rec;
+}
+
+void Ring::write(std::string_view msg, const std::function<bool()>& stop) {
+  const u32 max_size = h_->capacity / 2U - sizeof(Record);
+  const auto* p = reinterpret_cast<const u8*>(msg.data());
+  std::size_t left = msg.size();
+  do {
+    const auto n = static_cast<u32>(std::min<std::size_t>(left, max_size));
+    left -= n;
+    put(p, n, left > 0U ? MORE : 0U, stop);
+    p += n;
+  } while (left > 0U);
+}
+
+void Ring::put(const u8* data, const u32 size, const u32 flags,
+               const std::function<bool()>& stop) {
+  const u32 rec = align_up(sizeof(Record) + size, 8U);
+  const u32 mask = h_->capacity - 1U;
+  u32 head = h_->head.load(std::memory_order_relaxed);
+  // Records are contiguous, so skip the end of the data area if needed
+  const u32 to_end = h_->capacity - (head & mask);
+  if (rec > to_end) {
+    wait_space(to_end, stop);
+    const Record pad{static_cast<u32>(to_end - sizeof(Record)), PAD};
+    std::memcpy(data_ + (head & mask), &pad, sizeof(pad));
+    head += to_end;
+    h_->head.store(head, std::memory_order_release);
+  }
+  wait_space(rec, stop);
+  auto* dst = data_ + (head & mask);
+  const Record r{size, flags};
+  std::memcpy(dst, &r, sizeof(r));
+  std::memcpy(dst + sizeof(r), data, size);
+  h_->head.store(head + rec, std::memory_order_release);
+  data_bell_->notify();
+}
+
+void Ring::wait_space(const u32 size, const std::function<bool()>& stop) {
+  auto has_space = [this, size]() {
+    return h_->capacity - (h_->head.load(std::memory_order_relaxed) -
+                           h_->tail.load(std::memory_order_acquire)) >=
+           size;
+  };
+  if (!space_bell_->wait([&]() { return has_space() || stop(); },
+                         cfg::SHM_TIMEOUT) ||
+      !has_space()) {
+    throw std::runtime_error(stop() ? "connection closed"
+                                    : "timeout waiting for free space");
+  }
+}
+
+void Ring::consume(const u32 size) {
+  h_->tail.store(h_->tail.load(std::memory_order_relaxed) + size,
+                 std::memory_order_release);
+  space_bell_->notify();
+}
+
+bool Ring::read(const std::function<void(std::string_view)>& fn,
+                const std::function<bool()>& stop, const duration_t timeout) {
+  const u32 mask = h_->capacity - 1U;
+  bool split = false;
+  buf_.clear();
+  while (true) {
+    if (empty() &&
+        (!data_bell_->wait([&]() { return !empty() || stop(); },
+                           split ? cfg::SHM_TIMEOUT : timeout) ||
+         empty())) {
+      if (split) {
+        throw std::runtime_error("incomplete message");
+      }
+      return false;
+    }
+    const u32 tail = h_->tail.load(std::memory_order_relaxed);
+    const u32 available = h_->head.load(std::memory_order_acquire) - tail;
+    const u32 off = tail & mask;
+    Record r;
+    std::memcpy(&r, data_ + off, sizeof(r));
+    const u32 rec = align_up(sizeof(Record) + r.size, 8U);
+    if (r.size > h_->capacity || rec > h_->capacity - off || rec > available) {
+      throw ra2yrcpp::protocol_error(
+          fmt::format("invalid record, size={}", r.size));
+    }
+    if ((r.flags & PAD) != 0U) {
+      consume(rec);
+      continue;
+    }
+    std::string_view v(reinterpret_cast<const char*>(data_ + off + sizeof(r)),
+                       r.size);
+    if (!split && (r.flags & MORE) == 0U) {
+      // Release the record only after fn is done with it
+      utility::scope_guard g = [this, rec]() { consume(rec); };
+      fn(v);
+      return true;
+    }
+    buf_.append(v);
+    consume(rec);
+    split = true;
+    if ((r.flags & MORE) == 0U) {
+      fn(buf_);
+      return true;
+    }
+  }
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include "shared_memory.hpp"
+#include "types.h"
+
+#include <cstddef>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ra2yrcpp::shm {
+
+constexpr u32 REGION_MAGIC = 0x59524132U;
+constexpr u32 REGION_VERSION = 2U;
+
+/// Life cycle of a connection slot. A client takes ownership of a slot by
+/// setting its client_pid, and then claims it by moving it from FREE to
+/// CLAIMED. The server opens a CLAIMED slot, unless the client gave up
+/// waiting and returned it to FREE. Either side may set CLOSING, after which
+/// the server returns the slot to FREE and clears client_pid. Slots of clients
+/// that have exited are closed by the server.
+enum SlotState : u32 { FREE = 0U, CLAIMED, OPEN, CLOSING };
+
+// Everything below is shared between processes that may have different
+// pointer sizes, so only fixed size types are used.
+static_assert(std::atomic<u32>::is_always_lock_free);
+
+struct BellHeader {
+  /// Number of threads blocked on the bell
+  std::atomic<u32> waiters;
+  u32 reserved;
+  alignas(8) u8 storage[Doorbell::storage_size];
+};
+
+struct RingHeader {
+  /// Write position, only modified by the producer
+  alignas(64) std::atomic<u32> head;
+  /// Read position, only modified by the consumer
+  alignas(64) std::atomic<u32> tail;
+  /// Size of the data area. A power of two.
+  alignas(64) u32 capacity;
+  /// Offset of the data area from start of the region
+  u32 data_offset;
+  /// Index of the bell rung after writing
+  u32 data_bell;
+  /// Index of the bell rung after reading
+  u32 space_bell;
+};
+
+struct SlotHeader {
+  alignas(64) std::atomic<u32> state;
+  /// Process id of the client owning the slot, 0 if none
+  std::atomic<u32> client_pid;
+  /// Client to server messages
+  RingHeader requests;
+  /// Server to client messages
+  RingHeader responses;
+};
+
+struct RegionHeader {
+  u32 magic;
+  u32 version;
+  u32 num_slots;
+  u32 num_bells;
+  u32 bells_offset;
+  u32 slots_offset;
+  /// Cleared when the server shuts down
+  std::atomic<u32> open;
+};
+
+///
+/// Process local handle to a bell in shared memory. Ringing is skipped when
+/// there are no waiters, so that exchanging messages between busy threads
+/// needs no system calls.
+///
+class Bell {
+ public:
+  Bell(BellHeader* h, std::string name, const bool create);
+  /// Ring the bell if someone's waiting on it.
+  void notify();
+  /// Wait until pred() returns true, spinning briefly before blocking. The
+  /// waker must make pred() true before calling notify().
+  /// @return final value of pred()
+  bool wait(const std::function<bool()>& pred, const duration_t timeout);
+
+ private:
+  BellHeader* h_;
+  Doorbell d_;
+};
+
+///
+/// Shared memory region with a fixed number of connection slots. Each slot
+/// has a request ring read by the server, and a response ring read by the
+/// client. Writes to any request ring ring the server bell, so that a single
+/// server thread can wait for all slots.
+///
+/// Layout: RegionHeader, BellHeader[num_bells], SlotHeader[num_slots] and the
+/// data areas of the rings.
+///
+class Region {
+ public:
+  static constexpr u32 server_bell = 0U;
+
+  /// Create a new region.
+  /// @param name name of the shared memory
+  /// @param num_slots maximum number of connections
+  /// @param request_size capacity of request rings, rounded up to power of 2
+  /// @param response_size capacity of response rings, rounded up to power of 2
+  /// @exception ra2yrcpp::system_error if the shared memory couldn't be created
+  Region(std::string name, const u32 num_slots, const u32 request_size,
+         const u32 response_size);
+  /// Open an existing region.
+  /// @exception ra2yrcpp::system_error if the shared memory couldn't be opened
+  /// @exception ra2yrcpp::protocol_error on invalid header
+  explicit Region(std::string name);
+
+  RegionHeader* header();
+  SlotHeader* slot(const u32 index);
+  Bell* bell(const u32 index);
+  u8* at(const u32 offset);
+  u32 num_slots();
+
+ private:
+  void open_bells(const bool create);
+
+  std::unique_ptr<SharedMemory> mem_;
+  std::vector<std::unique_ptr<Bell>> bells_;
+};
+
+///
+/// Process local handle to a single producer, single consumer message ring in
+/// a Region. Messages are stored as 8-byte aligned records with a header.
+/// Messages that don't fit in half of the capacity are split to multiple
+/// records.
+///
+class Ring {
+ public:
+  Ring(Region* r, RingHeader* h);
+  /// Reset to empty state. Neither side may use the ring meanwhile.
+  void reset();
+  bool empty() const;
+  /// Return true if a message of given size can be written without waiting
+  /// for the reader. Messages that need to be split are writable only when
+  /// the ring is empty.
+  bool writable(const std::size_t size) const;
+  /// Write a message, waiting for space if the ring is full. Only one thread
+  /// may write at a time.
+  /// @param stop checked while waiting. Writing is aborted if it returns true.
+  /// @exception std::runtime_error if aborted or timed out
+  void write(std::string_view msg, const std::function<bool()>& stop);
+  /// Read the next message and call fn with it. Unless the message was split,
+  /// the view points directly to shared memory and is only valid during the
+  /// call. Only one thread may read at a time.
+  /// @param stop checked while waiting. Reading is aborted if it returns true.
+  /// @param timeout how long to wait for the start of a message
+  /// @return false if no message was available
+  /// @exception std::runtime_error if aborted in the middle of a message
+  /// @exception ra2yrcpp::protocol_error on corrupted record
+  bool read(const std::function<void(std::string_view)>& fn,
+            const std::function<bool()>& stop, const duration_t timeout);
+
+ private:
+  struct Record {
+    u32 size;
+    u32 flags;
+  };
+
+  void put(const u8* data, const u32 size, const u32 flags,
+           const std::function<bool()>& stop);
+  void wait_space(const u32 size, const std::function<bool()>& stop);
+  void consume(const u32 size);
+
+  RingHeader* h_;
+  u8* data_;
+  Bell* data_bell_;
+  Bell* space_bell_;
+  /// Buffer for reassembling split messages
+  std::string buf_;
+};
+
+}  // namespace ra2yrcpp::shm
@@ -0,0 +1,122 @@
+#include "shm_connection.hpp"
+
+#include "config.hpp"
+#include "shm_channel.hpp"
+
+#include <fmt/core.h>
+
+#include <exception>
+#include <stdexcept>
+
+using namespace ra2yrcpp::connection;
+using ra2yrcpp::shm::Region;
+using ra2yrcpp::shm::Ring;
+
+ClientShmConnection::ClientShmConnection(std::string name)
+    : ClientConnection(name, ""), slot_(nullptr), stopped_(false) {}
+
+ClientShmConnection::~ClientShmConnection() { stop(); }
+
+void ClientShmConnection::connect() {
+  state_.store(State::CONNECTING);
+  try {
+    region_ = std::make_unique<Region>(host);
+  } catch (const std::exception& e) {
+    state_.store(State::CLOSED);
+    throw std::runtime_error(fmt::format("failed to connect: {}", e.what()));
+  }
+  const u32 pid = shm::current_pid();
+  for (u32 i = 0U; slot_ == nullptr && i < region_->num_slots(); i++) {
+    auto* s = region_->slot(i);
+    u32 owner = 0U;
+    if (!s->client_pid.compare_exchange_strong(owner, pid)) {
+      continue;
+    }
+    u32 expected = shm::FREE;
+    if (s->state.compare_exchange_strong(expected, shm::CLAIMED)) {
+      slot_ = s;
+    } else {
+      s->client_pid.store(0U);
+    }
+  }
+  if (slot_ == nullptr) {
+    state_.store(State::CLOSED);
+    throw std::runtime_error("no free shared memory slots");
+  }
+
+  auto* h = region_->header();
+  region_->bell(Region::server_bell)->notify();
+  (void)region_->bell(slot_->responses.data_bell)
+      ->wait(
+          [this, h]() {
+            return slot_->state.load() != shm::CLAIMED || h->open.load() == 0U;
+          },
+          cfg::SHM_TIMEOUT);
+  // Give up, unless the server opens the slot meanwhile
+  u32 expected = shm::CLAIMED;
+  if (slot_->state.compare_exchange_strong(expected, shm::FREE)) {
+    slot_->client_pid.store(0U);
+  }
+  if (expected != shm::OPEN) {
+    slot_ = nullptr;
+    state_.store(State::CLOSED);
+    throw std::runtime_error("shared memory connection was not accepted");
+  }
+  requests_ = std::make_unique<Ring>(region_.get(), &slot_->requests);
+  responses_ = std::make_unique<Ring>(region_.get(), &slot_->responses);
+  state_.store(State::OPEN);
+}
+
+bool ClientShmConnection::closed() {
+  return stopped_ || slot_->state.load() != shm::OPEN ||
+         region_->header()->open.load() == 0U;
+}
+
+void ClientShmConnection::send_data(const vecu8& bytes) {
+  std::unique_lock<std::mutex> l(mut_write_);
+  if (requests_ == nullptr) {
+    throw std::runtime_error("not connected");
+  }
+  if (closed()) {
+    throw std::runtime_error("connection closed");
+  }
+  requests_->write(std::string_view(reinterpret_cast<const char*>(bytes.data()),
+                                    bytes.size()),
+                   [this]() { return closed(); });
+}
+
+void ClientShmConnection::read_message(
+    const std::function<void(std::string_view)>& fn) {
+  std::unique_lock<std::mutex> l(mut_read_);
+  if (responses_ == nullptr) {
+    throw std::runtime_error("not connected");
+  }
+  while (!responses_->read(fn, [this]() { return closed(); },
+                           cfg::SHM_POLL_INTERVAL)) {
+    if (closed()) {
+      throw std::runtime_error("connection closed");
+    }
+  }
+}
+
+vecu8 ClientShmConnection::read_data() {
+  vecu8 res;
+  read_message([&res](std::string_view msg) {
+    res.assign(reinterpret_cast<const u8*>(msg.data()),
+               reinterpret_cast<const u8*>(msg.data()) + msg.size());
+  });
+  return res;
+}
+
+void ClientShmConnection::stop() {
+  if (!stopped_.exchange(true) && slot_ != nullptr) {
+    u32 expected = shm::OPEN;
+    if (slot_->state.compare_exchange_strong(expected, shm::CLOSING)) {
+      region_->bell(Region::server_bell)->notify();
+    }
+    // Wake up our own reader and writer
+    region_->bell(slot_->responses.data_bell)->notify();
+    region_->bell(slot_->requests.space_bell)->notify();
+  }
+  state_.store(State::CLOSED);
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include "client_connection.hpp"
+#include "types.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace ra2yrcpp::shm {
+class Region;
+class Ring;
+struct SlotHeader;
+}  // namespace ra2yrcpp::shm
+
+namespace ra2yrcpp::connection {
+
+///
+/// Client for ShmServer. Messages are exchanged through rings in shared
+/// memory, so uncontended sends and reads need no system calls. Responses can
+/// be parsed in place with read_message(). Sending and reading can be done
+/// concurrently from different threads.
+///
+class ClientShmConnection : public ClientConnection {
+ public:
+  /// @param name name of the server's shared memory region
+  explicit ClientShmConnection(std::string name);
+  ~ClientShmConnection() override;
+  /// Claim a free slot in the server's region and wait for the server to open
+  /// it.
+  /// @exception std::runtime_error if there are no free slots or the server
+  /// doesn't respond
+  void connect() override;
+  /// @exception std::runtime_error if the connection was closed, or the
+  /// server doesn't consume the data
+  void send_data(const vecu8& bytes) override;
+  /// Read next message. Blocks until a message has been received.
+  /// @exception std::runtime_error if the connection was closed
+  vecu8 read_data() override;
+  /// Read next message and pass it to fn without copying. The view is only
+  /// valid during the call.
+  /// @exception std::runtime_error if the connection was closed
+  void read_message(const std::function<void(std::string_view)>& fn) override;
+  /// Close the connection, which unblocks pending reads.
+  void stop() override;
+
+ private:
+  /// Return true if either side has closed the connection.
+  bool closed();
+
+  std::unique_ptr<shm::Region> region_;
+  shm::SlotHeader* slot_;
+  std::unique_ptr<shm::Ring> requests_;
+  std::unique_ptr<shm::Ring> responses_;
+  std::atomic_bool stopped_;
+  std::mutex mut_write_;
+  std::mutex mut_read_;
+};
+
+}  // namespace ra2yrcpp::connection
@@ -0,0 +1,421 @@
+#include "shm_server.hpp"
+
+#include "config.hpp"
+#include "logging.hpp"
+#include "shm_channel.hpp"
+#include "utility/thread_pool.hpp"
+#include "utility/time.hpp"
+
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <string_view>
+
+using namespace ra2yrcpp::shm_server;
+using ra2yrcpp::shm::Region;
+using ra2yrcpp::shm::Ring;
+
+namespace {
+/// First connection id. Chosen to not overlap with socket descriptors.
+constexpr int CONNECTION_ID_BASE = 1 << 20;
+/// Maximum number of requests read from a slot before serving other slots.
+constexpr int MAX_REQUESTS_PER_SLOT = 64;
+/// Interval of retrying writes to rings that were full.
+constexpr auto WRITE_RETRY_INTERVAL = std::chrono::milliseconds(1);
+}  // namespace
+
+///
+/// Server side state of a connection slot. Requests are read only by the
+/// server thread. Responses are queued from any thread, and written to the
+/// client's ring by the writer thread of the server, so that pool threads
+/// never wait for the client to make space in the ring.
+///
+class ShmServer::Connection {
+ public:
+  Connection(ShmServer* srv, const unsigned slot, const socket_t id)
+      : timestamp(util::current_time()),
+        id_(id),
+        srv_(srv),
+        slot_(srv->region_->slot(slot)),
+        region_(srv->region_->header()),
+        strand_(std::make_shared<utility::Strand>(srv->pool_)),
+        requests_(srv->region_.get(), &slot_->requests),
+        responses_(srv->region_.get(), &slot_->responses),
+        closed_(false),
+        blocked_(false) {}
+
+  ~Connection() { close(); }
+
+  /// Time when the connection was accepted
+  std::chrono::system_clock::time_point timestamp;
+
+  socket_t id() const { return id_; }
+
+  utility::Strand* strand() { return strand_.get(); }
+
+  Ring& requests() { return requests_; }
+
+  /// Return true if a response of given size can be sent without waiting.
+  bool writable(const std::size_t size) const {
+    return responses_.writable(size);
+  }
+
+  /// Reset the rings. Must be called before the slot is opened.
+  void open() {
+    requests_.reset();
+    responses_.reset();
+  }
+
+  /// Queue a response to be written to the client's ring. Never blocks. Can
+  /// be called from any thread.
+  void send(std::shared_ptr<const std::string> body) {
+    {
+      std::unique_lock<std::mutex> l(mut_q_);
+      if (closed_) {
+        return;
+      }
+      out_q_.emplace_back(std::move(body));
+    }
+    srv_->notify_writer();
+  }
+
+  /// Write queued responses until the ring is full. Called only by the writer
+  /// thread.
+  /// @return true if some responses are still waiting for space
+  bool flush() {
+    std::unique_lock<std::mutex> lr(mut_ring_);
+    auto stop = [this]() {
+      return closed_.load() || slot_->state.load() != shm::OPEN ||
+             region_->open.load() == 0U;
+    };
+    while (true) {
+      std::shared_ptr<const std::string> msg;
+      {
+        std::unique_lock<std::mutex> l(mut_q_);
+        if (closed_ || out_q_.empty()) {
+          blocked_ = false;
+          return false;
+        }
+        msg = out_q_.front();
+      }
+      if (!responses_.writable(msg->size())) {
+        const auto now = std::chrono::steady_clock::now();
+        if (!blocked_) {
+          blocked_ = true;
+          blocked_since_ = now;
+        } else if (now - blocked_since_ > cfg::SHM_TIMEOUT) {
+          discard("timed out waiting for space in response ring");
+          return false;
+        }
+        return true;
+      }
+      blocked_ = false;
+      try {
+        // Waits only if the message is split, until the client has read the
+        // previous parts.
+        responses_.write(*msg, stop);
+      } catch (const std::exception& e) {
+        // A partial message was written, so the following responses can't be
+        // delivered either.
+        discard(e.what());
+        return false;
+      }
+      std::unique_lock<std::mutex> l(mut_q_);
+      if (!out_q_.empty()) {
+        out_q_.pop_front();
+      }
+    }
+  }
+
+  /// Discard further responses. After return, no response is being written.
+  /// Must not be called from the writer thread.
+  void close() {
+    {
+      std::unique_lock<std::mutex> l(mut_q_);
+      closed_ = true;
+      out_q_.clear();
+    }
+    std::unique_lock<std::mutex> lr(mut_ring_);
+  }
+
+ private:
+  void discard(const char* reason) {
+    eprintf("shm connection {}: {}", id_, reason);
+    std::unique_lock<std::mutex> l(mut_q_);
+    closed_ = true;
+    out_q_.clear();
+  }
+
+  socket_t id_;
+  ShmServer* srv_;
+  shm::SlotHeader* slot_;
+  shm::RegionHeader* region_;
+  std::shared_ptr<utility::Strand> strand_;
+  Ring requests_;
+  Ring responses_;
+  std::mutex mut_q_;
+  /// Held while writing to the response ring
+  std::mutex mut_ring_;
+  std::deque<std::shared_ptr<const std::string>> out_q_;
+  std::atomic_bool closed_;
+  bool blocked_;
+  std::chrono::steady_clock::time_point blocked_since_;
+};
+
+ShmServer::ShmServer(ShmServer::Options o, utility::ThreadPool* pool,
+                     Callbacks cb, std::function<void()> on_start)
+    : opts_(o),
+      pool_(pool),
+      cb_(cb),
+      on_start_(on_start),
+      conns_(o.max_connections),
+      next_id_(CONNECTION_ID_BASE),
+      active_(false),
+      write_pending_(false),
+      writing_(false) {}
+
+ShmServer::~ShmServer() { shutdown(); }
+
+void ShmServer::start() {
+  dprintf("create shared memory, name={}", opts_.name);
+  region_ = std::make_unique<Region>(opts_.name, opts_.max_connections,
+                                     opts_.request_ring_size,
+                                     opts_.response_ring_size);
+  active_ = true;
+  writing_ = true;
+  writer_ = std::thread([this]() { write_responses(); });
+  thread_ = std::thread([this]() { run(); });
+}
+
+void ShmServer::shutdown() {
+  if (!active_.exchange(false)) {
+    return;
+  }
+  region_->header()->open.store(0U);
+  // Wake up the server thread and clients
+  for (u32 i = 0U; i < region_->header()->num_bells; i++) {
+    region_->bell(i)->notify();
+  }
+  thread_.join();
+  for (unsigned i = 0U; i < conns_.size(); i++) {
+    remove(i);
+  }
+  {
+    std::unique_lock<std::mutex> l(mut_write_);
+    writing_ = false;
+  }
+  cv_write_.notify_one();
+  writer_.join();
+}
+
+std::vector<ShmServer::connection_info_t> ShmServer::connections() {
+  std::vector<connection_info_t> res;
+  std::unique_lock<std::mutex> l(mut_conns_);
+  for (const auto& c : conns_) {
+    if (c != nullptr) {
+      res.emplace_back(c->id(), c->timestamp);
+    }
+  }
+  return res;
+}
+
+bool ShmServer::push(const socket_t id,
+                     std::shared_ptr<const std::string> msg) {
+  std::shared_ptr<Connection> c;
+  {
+    std::unique_lock<std::mutex> l(mut_conns_);
+    for (const auto& it : conns_) {
+      if (it != nullptr && it->id() == id) {
+        c = it;
+      }
+    }
+  }
+  if (c == nullptr || !c->writable(msg->size())) {
+    return false;
+  }
+  c->send(std::move(msg));
+  return true;
+}
+
+// conns_ is only modified by the server thread, so it's read here without
+// locking.
+bool ShmServer::has_work() {
+  for (unsigned i = 0U; i < conns_.size(); i++) {
+    const auto st = region_->slot(i)->state.load();
+    if (st == shm::CLAIMED || st == shm::CLOSING ||
+        (st == shm::OPEN && conns_[i] != nullptr &&
+         !conns_[i]->requests().empty())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ShmServer::run() {
+  if (on_start_ != nullptr) {
+    on_start_();
+  }
+  auto* bell = region_->bell(Region::server_bell);
+  auto last_reclaim = std::chrono::steady_clock::now();
+  while (active_) {
+    (void)bell->wait([this]() { return !active_ || has_work(); },
+                     cfg::SHM_POLL_INTERVAL);
+    const auto now = std::chrono::steady_clock::now();
+    if (now - last_reclaim >= cfg::SHM_POLL_INTERVAL) {
+      reclaim_slots();
+      last_reclaim = now;
+    }
+    for (unsigned i = 0U; active_ && i < conns_.size(); i++) {
+      switch (region_->slot(i)->state.load()) {
+        case shm::CLAIMED:
+          accept(i);
+          break;
+        case shm::CLOSING:
+          remove(i);
+          break;
+        case shm::OPEN:
+          if (conns_[i] != nullptr) {
+            read_requests(conns_[i]);
+          }
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+void ShmServer::reclaim_slots() {
+  for (unsigned i = 0U; i < conns_.size(); i++) {
+    auto* s = region_->slot(i);
+    u32 pid = s->client_pid.load();
+    if (pid == 0U || shm::process_alive(pid)) {
+      continue;
+    }
+    u32 st = s->state.load();
+    if (st == shm::FREE) {
+      // The client exited while claiming the slot
+      (void)s->client_pid.compare_exchange_strong(pid, 0U);
+    } else if (st == shm::CLAIMED || st == shm::OPEN) {
+      wrprintf("shm slot {}: client {} has exited", i, pid);
+      (void)s->state.compare_exchange_strong(st, shm::CLOSING);
+    }
+  }
+}
+
+void ShmServer::accept(const unsigned slot) {
+  auto* s = region_->slot(slot);
+  auto c = std::make_shared<Connection>(this, slot, next_id_++);
+  c->open();
+  u32 expected = shm::CLAIMED;
+  if (!s->state.compare_exchange_strong(expected, shm::OPEN)) {
+    // The client gave up waiting, or has exited
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> l(mut_conns_);
+    conns_[slot] = c;
+  }
+  try {
+    cb_.accept(c->id());
+  } catch (const std::exception& e) {
+    eprintf("accept: {}", e.what());
+  }
+  region_->bell(s->responses.data_bell)->notify();
+  iprintf("shm connection {} in slot {}", c->id(), slot);
+}
+
+void ShmServer::remove(const unsigned slot) {
+  std::shared_ptr<Connection> c;
+  {
+    std::unique_lock<std::mutex> l(mut_conns_);
+    c = std::move(conns_[slot]);
+  }
+  if (c != nullptr) {
+    c->close();
+    try {
+      cb_.close(c->id());
+    } catch (const std::exception& e) {
+      eprintf("close: {}", e.what());
+    }
+    iprintf("closed shm conn {}", c->id());
+  }
+  region_->slot(slot)->state.store(shm::FREE);
+  region_->slot(slot)->client_pid.store(0U);
+}
+
+void ShmServer::notify_writer() {
+  {
+    std::unique_lock<std::mutex> l(mut_write_);
+    write_pending_ = true;
+  }
+  cv_write_.notify_one();
+}
+
+void ShmServer::write_responses() {
+  bool blocked = false;
+  std::vector<std::shared_ptr<Connection>> cs;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> l(mut_write_);
+      auto ready = [this]() { return !writing_ || write_pending_; };
+      if (blocked) {
+        (void)cv_write_.wait_for(l, WRITE_RETRY_INTERVAL, ready);
+      } else {
+        cv_write_.wait(l, ready);
+      }
+      if (!writing_) {
+        break;
+      }
+      write_pending_ = false;
+    }
+    {
+      std::unique_lock<std::mutex> l(mut_conns_);
+      for (const auto& c : conns_) {
+        if (c != nullptr) {
+          cs.push_back(c);
+        }
+      }
+    }
+    blocked = false;
+    for (auto& c : cs) {
+      blocked = c->flush() || blocked;
+    }
+    cs.clear();
+  }
+}
+
+void ShmServer::read_requests(std::shared_ptr<Connection> c) {
+  try {
+    for (int i = 0; i < MAX_REQUESTS_PER_SLOT && !c->requests().empty();
+         i++) {
+      (void)c->requests().read(
+          [this, &c](std::string_view msg) {
+            dispatch(c, std::make_shared<std::string>(msg));
+          },
+          [this]() { return !active_; }, duration_t(0.0));
+    }
+  } catch (const std::exception& e) {
+    eprintf("shm connection {}: {}", c->id(), e.what());
+    for (unsigned i = 0U; i < conns_.size(); i++) {
+      if (conns_[i] == c) {
+        remove(i);
+      }
+    }
+  }
+}
+
+void ShmServer::dispatch(std::shared_ptr<Connection> c,
+                         std::shared_ptr<std::string> msg) {
+  auto task = [this, c, msg]() {
+    auto out = std::make_shared<std::string>();
+    cb_.receive(c->id(), *msg, out.get());
+    c->send(std::move(out));
+  };
+  auto* pool = cb_.executor != nullptr ? cb_.executor(c->id(), *msg) : nullptr;
+  if (cb_.ordered != nullptr && !cb_.ordered(c->id(), *msg)) {
+    (pool != nullptr ? pool : pool_)->post(task);
+  } else {
+    c->strand()->post(task, pool);
+  }
+}
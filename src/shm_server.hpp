@@ -0,0 +1,116 @@
+#pragma once
+#include "websocket_server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace utility {
+class ThreadPool;
+}
+
+namespace ra2yrcpp {
+
+namespace shm {
+class Region;
+}
+
+namespace shm_server {
+
+///
+/// Server for clients on the same host, exchanging messages through rings in
+/// a shared memory region (see shm::Region). Responses of all connections are
+/// written directly to the clients' rings by a single writer thread, and the
+/// clients read them in place. If a client doesn't make space for a response
+/// within cfg::SHM_TIMEOUT, further responses to it are discarded. A single
+/// thread waits for new connections and requests of all clients, and
+/// dispatches them to the same callbacks as with WebsocketServer.
+///
+/// Connections are closed explicitly by the client. Slots of clients whose
+/// process has exited are closed by the server.
+///
+class ShmServer {
+ public:
+  using socket_t = int;
+  using Callbacks = websocket_server::WebsocketServer::Callbacks;
+  using connection_info_t =
+      std::pair<socket_t, std::chrono::system_clock::time_point>;
+
+  struct Options {
+    /// Name of the shared memory region
+    std::string name;
+    unsigned max_connections;
+    unsigned request_ring_size;
+    unsigned response_ring_size;
+  };
+
+  ShmServer() = delete;
+  /// @param o options
+  /// @param pool pool executing the callbacks
+  /// @param cb callbacks
+  /// @param on_start invoked in the server thread when it starts
+  ShmServer(ShmServer::Options o, utility::ThreadPool* pool, Callbacks cb,
+            std::function<void()> on_start = nullptr);
+  ~ShmServer();
+
+  /// Create the shared memory region and start serving clients.
+  /// @exception ra2yrcpp::system_error if the region couldn't be created
+  void start();
+  /// Close all connections and remove the region.
+  void shutdown();
+  /// Return ids and connection times of active connections. The ids don't
+  /// overlap with socket descriptors of other servers.
+  std::vector<connection_info_t> connections();
+  /// Send a message to the given connection outside of the request/response
+  /// cycle. Can be called from any thread. The message is queued and written
+  /// to the client's ring by the writer thread.
+  /// @return false if the connection doesn't exist, or its ring doesn't have
+  /// space for the message
+  bool push(const socket_t id, std::shared_ptr<const std::string> msg);
+
+  class Connection;
+
+ private:
+  void run();
+  /// Return true if some slot needs attention.
+  bool has_work();
+  /// Close slots of clients that have exited.
+  void reclaim_slots();
+  /// Wake up the writer thread.
+  void notify_writer();
+  void write_responses();
+  void accept(const unsigned slot);
+  void remove(const unsigned slot);
+  void read_requests(std::shared_ptr<Connection> c);
+  void dispatch(std::shared_ptr<Connection> c,
+                std::shared_ptr<std::string> msg);
+
+  ShmServer::Options opts_;
+  utility::ThreadPool* pool_;
+  Callbacks cb_;
+  std::function<void()> on_start_;
+  std::unique_ptr<shm::Region> region_;
+  /// Connection of each slot, or nullptr if the slot isn't open
+  std::vector<std::shared_ptr<Connection>> conns_;
+  std::mutex mut_conns_;
+  socket_t next_id_;
+  std::atomic_bool active_;
+  std::thread thread_;
+  std::mutex mut_write_;
+  std::condition_variable cv_write_;
+  /// Set when responses have been queued since the writer last woke up
+  bool write_pending_;
+  bool writing_;
+  std::thread writer_;
+};
+
+}  // namespace shm_server
+
+}  // namespace ra2yrcpp
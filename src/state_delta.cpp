@@ -0,0 +1,267 @@
+#include "state_delta.hpp"
+
+#include "errors.hpp"
+#include "protocol/protocol.hpp"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <map>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace ra2yrcpp;
+using ra2yrproto::ra2yr::GameState;
+using ra2yrproto::ra2yr::GameStateDelta;
+using ra2yrproto::ra2yr::RepeatedFieldDelta;
+
+namespace {
+/// Repeated field whose elements are matched by a varint key field
+struct KeyedField {
+  u32 number;
+  u32 key;
+};
+
+const std::vector<KeyedField>& keyed_fields() {
+  static const std::vector<KeyedField> fields = []() {
+    std::vector<KeyedField> res;
+    const auto* D = GameState::descriptor();
+    for (const auto& [name, key] :
+         {std::pair{"objects", "pointer_self"}, std::pair{"houses", "self"},
+          std::pair{"factories", "object"}}) {
+      const auto* f = D->FindFieldByName(name);
+      const auto* k = f != nullptr && f->message_type() != nullptr
+                          ? f->message_type()->FindFieldByName(key)
+                          : nullptr;
+      if (k != nullptr && f->is_repeated() && !k->is_repeated() &&
+          k->cpp_type() != gpb::FieldDescriptor::CPPTYPE_MESSAGE &&
+          k->cpp_type() != gpb::FieldDescriptor::CPPTYPE_STRING) {
+        res.push_back({static_cast<u32>(f->number()),
+                       static_cast<u32>(k->number())});
+      }
+    }
+    return res;
+  }();
+  return fields;
+}
+
+u64 element_key(std::string_view element, const u32 key) {
+  u64 v = 0U;
+  if (!read_varint_field(element, key, &v)) {
+    throw ra2yrcpp::protocol_error("malformed element");
+  }
+  return v;
+}
+
+///
+/// Compute difference of elements of a repeated field. Elements that are
+/// present in both lists must be in the same relative order.
+///
+/// @return false if the elements can't be matched, or the difference isn't
+/// smaller than the current field
+///
+bool diff_elements(std::string_view prev, std::string_view cur,
+                   const KeyedField& kf, RepeatedFieldDelta* R) {
+  const auto P = split_records(prev);
+  const auto C = split_records(cur);
+  std::unordered_map<u64, u32> index;
+  for (u32 i = 0U; i < P.size(); i++) {
+    if (!index.try_emplace(element_key(P[i], kf.key), i).second) {
+      return false;
+    }
+  }
+  R->set_field(kf.number);
+  std::vector<bool> kept(P.size(), false);
+  std::size_t size = 0U;
+  u32 next = 0U;
+  for (u32 j = 0U; j < C.size(); j++) {
+    auto it = index.find(element_key(C[j], kf.key));
+    if (it == index.end()) {
+      R->add_added_indices(j);
+      R->add_added(C[j].data(), C[j].size());
+      size += C[j].size();
+      continue;
+    }
+    const u32 i = it->second;
+    // Duplicate, or the order of existing elements changed
+    if (kept[i] || i < next) {
+      return false;
+    }
+    kept[i] = true;
+    next = i + 1U;
+    if (P[i] != C[j]) {
+      R->add_changed_indices(j);
+      R->add_changed(C[j].data(), C[j].size());
+      size += C[j].size();
+    }
+  }
+  for (u32 i = 0U; i < P.size(); i++) {
+    if (!kept[i]) {
+      R->add_removed(i);
+    }
+  }
+  return size + 4U * (R->removed_size() + R->added_indices_size() +
+                      R->changed_indices_size()) <
+         cur.size();
+}
+
+/// Rebuild elements of a repeated field from the previous elements.
+void apply_elements(std::string_view prev, const RepeatedFieldDelta& R,
+                    std::string* out) {
+  const auto P = split_records(prev);
+  const auto n_kept = P.size() - std::min<std::size_t>(R.removed_size(),
+                                                       P.size());
+  const std::size_t n = n_kept + R.added_size();
+  if (R.added_size() != R.added_indices_size() ||
+      R.changed_size() != R.changed_indices_size()) {
+    throw ra2yrcpp::protocol_error("invalid element delta");
+  }
+  int ai = 0;
+  int ci = 0;
+  int ri = 0;
+  std::size_t pi = 0U;
+  for (std::size_t j = 0U; j < n; j++) {
+    if (ai < R.added_size() && R.added_indices(ai) == j) {
+      write_record(R.field(), R.added(ai++), out);
+      continue;
+    }
+    for (; ri < R.removed_size() && R.removed(ri) == pi; ri++) {
+      pi++;
+    }
+    if (pi >= P.size()) {
+      throw ra2yrcpp::protocol_error("invalid element delta");
+    }
+    std::string_view v = P[pi++];
+    if (ci < R.changed_size() && R.changed_indices(ci) == j) {
+      v = R.changed(ci++);
+    }
+    write_record(R.field(), v, out);
+  }
+  for (; ri < R.removed_size() && R.removed(ri) == pi; ri++) {
+    pi++;
+  }
+  if (ai != R.added_size() || ci != R.changed_size() ||
+      ri != R.removed_size() || pi != P.size()) {
+    throw ra2yrcpp::protocol_error("invalid element delta");
+  }
+}
+}  // namespace
+
+DeltaEncoder::DeltaEncoder(const u32 keyframe_interval)
+    : keyframe_interval_(keyframe_interval), num_deltas_(0U) {}
+
+void DeltaEncoder::encode(const frame_ptr& F, GameStateDelta* D) {
+  D->Clear();
+  if (prev_ == nullptr || num_deltas_ >= keyframe_interval_) {
+    D->set_keyframe(true);
+    D->set_changed(F->bytes());
+    num_deltas_ = 0U;
+    prev_ = F;
+    return;
+  }
+  const std::string_view prev = prev_->bytes();
+  const std::string_view cur = F->bytes();
+  const auto a = field_spans(prev);
+  const auto b = field_spans(cur);
+  auto view = [](std::string_view s, const FieldSpan& f) {
+    return s.substr(f.begin, f.end - f.begin);
+  };
+  std::size_t i = 0U;
+  for (const auto& f : b) {
+    for (; i < a.size() && a[i].number < f.number; i++) {
+      D->add_cleared_fields(a[i].number);
+    }
+    if (i < a.size() && a[i].number == f.number) {
+      const auto p = view(prev, a[i++]);
+      if (p == view(cur, f)) {
+        continue;
+      }
+      const auto& K = keyed_fields();
+      auto k = std::find_if(K.begin(), K.end(), [&f](const auto& v) {
+        return v.number == f.number;
+      });
+      if (k != K.end()) {
+        RepeatedFieldDelta R;
+        if (diff_elements(p, view(cur, f), *k, &R)) {
+          D->add_elements()->Swap(&R);
+          continue;
+        }
+      }
+    }
+    D->mutable_changed()->append(view(cur, f));
+  }
+  for (; i < a.size(); i++) {
+    D->add_cleared_fields(a[i].number);
+  }
+  D->set_base_frame(prev_->current_frame());
+  num_deltas_++;
+  prev_ = F;
+}
+
+void DeltaEncoder::reset() { prev_ = nullptr; }
+
+DeltaDecoder::DeltaDecoder() : current_frame_(0U), valid_(false) {}
+
+bool DeltaDecoder::apply(const GameStateDelta& D) {
+  if (D.keyframe()) {
+    bytes_ = D.changed();
+  } else {
+    if (!valid_ || D.base_frame() != current_frame_) {
+      return false;
+    }
+    // Sources of each field in the new state, in field number order
+    std::map<u32, std::pair<std::string_view, const RepeatedFieldDelta*>> res;
+    for (const auto& f : field_spans(bytes_)) {
+      res[f.number] = {
+          std::string_view(bytes_).substr(f.begin, f.end - f.begin), nullptr};
+    }
+    for (const auto n : D.cleared_fields()) {
+      res.erase(n);
+    }
+    for (const auto& R : D.elements()) {
+      auto it = res.find(R.field());
+      if (it == res.end()) {
+        throw ra2yrcpp::protocol_error(
+            fmt::format("element delta of missing field {}", R.field()));
+      }
+      it->second.second = &R;
+    }
+    const std::string_view changed = D.changed();
+    for (const auto& f : field_spans(changed)) {
+      res[f.number] = {changed.substr(f.begin, f.end - f.begin), nullptr};
+    }
+    std::string out;
+    out.reserve(bytes_.size());
+    for (const auto& [n, v] : res) {
+      if (v.second != nullptr) {
+        apply_elements(v.first, *v.second, &out);
+      } else {
+        out.append(v.first);
+      }
+    }
+    bytes_.swap(out);
+  }
+  u64 frame = 0U;
+  if (!read_varint_field(bytes_, GameState::kCurrentFrameFieldNumber,
+                         &frame)) {
+    valid_ = false;
+    throw ra2yrcpp::protocol_error("malformed GameState");
+  }
+  current_frame_ = static_cast<u32>(frame);
+  valid_ = true;
+  return true;
+}
+
+bool DeltaDecoder::valid() const { return valid_; }
+
+const std::string& DeltaDecoder::bytes() const { return bytes_; }
+
+u32 DeltaDecoder::current_frame() const { return current_frame_; }
+
+void DeltaDecoder::state(GameState* G) const {
+  if (!G->ParseFromString(bytes_)) {
+    throw ra2yrcpp::protocol_error("failed to parse GameState");
+  }
+}
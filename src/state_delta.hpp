@@ -0,0 +1,70 @@
+#pragma once
+#include "ra2yrproto/ra2yr.pb.h"
+
+#include "config.hpp"
+#include "frame_snapshot.hpp"
+#include "types.h"
+
+#include <string>
+
+namespace ra2yrcpp {
+
+///
+/// Encodes consecutive game state frames as GameStateDelta messages. Changed
+/// top-level fields are sent as a whole, except objects, houses and factories,
+/// whose elements are matched by their key (e.g. pointer_self), so that only
+/// added, changed and removed elements are sent. The first message, and every
+/// keyframe_interval'th message after it, is a keyframe containing the full
+/// state.
+///
+class DeltaEncoder {
+ public:
+  explicit DeltaEncoder(
+      const u32 keyframe_interval = cfg::SUBSCRIPTION_KEYFRAME_INTERVAL);
+
+  /// Encode F relative to the previously encoded frame.
+  /// @exception ra2yrcpp::protocol_error if the serialized state is malformed
+  void encode(const frame_ptr& F, ra2yrproto::ra2yr::GameStateDelta* D);
+  /// Make the next message a keyframe.
+  void reset();
+
+ private:
+  u32 keyframe_interval_;
+  u32 num_deltas_;
+  frame_ptr prev_;
+};
+
+///
+/// Reconstructs game state from GameStateDelta messages. The reconstructed
+/// state is byte for byte identical to the serialized frame that the delta was
+/// computed from.
+///
+class DeltaDecoder {
+ public:
+  DeltaDecoder();
+
+  ///
+  /// Apply D to the current state. Deltas that aren't based on the current
+  /// state, e.g. because the previous one was dropped, are ignored until the
+  /// next keyframe.
+  ///
+  /// @return true if D was applied
+  /// @exception ra2yrcpp::protocol_error if D is malformed
+  ///
+  bool apply(const ra2yrproto::ra2yr::GameStateDelta& D);
+  /// Return true if a keyframe has been applied.
+  bool valid() const;
+  /// Serialized current state.
+  const std::string& bytes() const;
+  u32 current_frame() const;
+  /// Parse current state to G.
+  /// @exception ra2yrcpp::protocol_error on parse error
+  void state(ra2yrproto::ra2yr::GameState* G) const;
+
+ private:
+  std::string bytes_;
+  u32 current_frame_;
+  bool valid_;
+};
+
+}  // namespace ra2yrcpp
@@ -0,0 +1,119 @@
+#include "state_publisher.hpp"
+
+#include "ra2yrproto/ra2yr.pb.h"
+
+#include "protocol/protocol.hpp"
+
+#include "config.hpp"
+#include "instrumentation_service.hpp"
+#include "logging.hpp"
+#include "ring_buffer.hpp"
+
+#include <exception>
+#include <stdexcept>
+#include <utility>
+
+using namespace ra2yrcpp;
+
+StatePublisher::StatePublisher(InstrumentationService* I)
+    : I_(I),
+      next_id_(1U),
+      active_(false),
+      frames_(ring_buffer::RingBuffer<frame_t>(cfg::PUBLISH_QUEUE_SIZE)),
+      thread_([this]() { run(); }),
+      close_callback_(I->add_close_callback(
+          [this](int connection_id) { unsubscribe(connection_id, 0U); })) {}
+
+StatePublisher::~StatePublisher() {
+  I_->remove_close_callback(close_callback_);
+  frames_.push(nullptr);
+  thread_.join();
+}
+
+u64 StatePublisher::subscribe(const int connection_id, const u32 interval,
+                              const bool delta) {
+  if (interval == 0U) {
+    throw std::invalid_argument("interval must be positive");
+  }
+  std::unique_lock<std::mutex> l(mut_);
+  auto it = subs_.begin();
+  while (it != subs_.end() &&
+         (it->second.interval != interval || it->second.delta != delta)) {
+    ++it;
+  }
+  if (it == subs_.end()) {
+    it = subs_.try_emplace(next_id_++,
+                           Subscription{interval, delta, {}, DeltaEncoder()})
+             .first;
+  }
+  if (it->second.connections.insert(connection_id).second) {
+    it->second.encoder.reset();
+  }
+  active_ = true;
+  return it->first;
+}
+
+void StatePublisher::unsubscribe(const int connection_id, const u64 id) {
+  std::unique_lock<std::mutex> l(mut_);
+  for (auto it = subs_.begin(); it != subs_.end();) {
+    if (id == 0U || it->first == id) {
+      (void)it->second.connections.erase(connection_id);
+    }
+    it = it->second.connections.empty() ? subs_.erase(it) : std::next(it);
+  }
+  active_ = !subs_.empty();
+}
+
+bool StatePublisher::active() const { return active_.load(); }
+
+void StatePublisher::publish(frame_t G) { frames_.push(std::move(G)); }
+
+void StatePublisher::run() {
+  while (true) {
+    auto v = frames_.pop(1, cfg::MAX_TIMEOUT);
+    if (v.empty()) {
+      continue;
+    }
+    if (v.front() == nullptr) {
+      break;
+    }
+    try {
+      publish_frame(v.front());
+    } catch (const std::exception& e) {
+      eprintf("publish frame: {}", e.what());
+    }
+  }
+}
+
+void StatePublisher::publish_frame(const frame_t& F) {
+  std::unique_lock<std::mutex> l(mut_);
+  for (auto it = subs_.begin(); it != subs_.end();) {
+    auto& S = it->second;
+    if (F->current_frame() % S.interval != 0U) {
+      ++it;
+      continue;
+    }
+    auto msg = make_message(it->first, &S, F);
+    for (auto c = S.connections.begin(); c != S.connections.end();) {
+      // Connection was closed
+      c = I_->push(*c, msg) ? std::next(c) : S.connections.erase(c);
+    }
+    it = S.connections.empty() ? subs_.erase(it) : std::next(it);
+  }
+  active_ = !subs_.empty();
+}
+
+std::shared_ptr<const std::string> StatePublisher::make_message(
+    const u64 id, Subscription* S, const frame_t& F) {
+  auto msg = std::make_shared<std::string>();
+  if (!S->delta) {
+    serialize_push(ra2yrproto::ra2yr::GameState::descriptor()->full_name(),
+                   F->bytes(), id, msg.get());
+    return msg;
+  }
+  ra2yrproto::ra2yr::GameStateDelta D;
+  S->encoder.encode(F, &D);
+  serialize_push(D.GetDescriptor()->full_name(), D.SerializeAsString(), id,
+                 msg.get());
+  return msg;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "async_queue.hpp"
+#include "frame_snapshot.hpp"
+#include "state_delta.hpp"
+#include "types.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+namespace ra2yrcpp {
+
+class InstrumentationService;
+
+///
+/// Pushes game state frames to subscribed connections. Frames are published
+/// from the game thread without blocking: they're serialized and sent by a
+/// background thread, and if it falls behind, the oldest unpublished frames
+/// are dropped. The message of a subscription is built from the frame's
+/// serialized state, and shared by all connections subscribed with the same
+/// parameters.
+///
+/// A subscription receives either full frames (GameState), or GameStateDelta
+/// messages containing the changes since the previous frame of the
+/// subscription (see DeltaEncoder). Every
+/// cfg::SUBSCRIPTION_KEYFRAME_INTERVAL'th delta, and the first one after a
+/// connection subscribes, is a keyframe containing all fields. A client that
+/// misses a delta, e.g. because it was dropped, must wait for the next
+/// keyframe. Clients can reconstruct the state with DeltaDecoder.
+///
+class StatePublisher {
+ public:
+  using frame_t = frame_ptr;
+
+  explicit StatePublisher(InstrumentationService* I);
+  ~StatePublisher();
+  StatePublisher(const StatePublisher&) = delete;
+  StatePublisher& operator=(const StatePublisher&) = delete;
+
+  ///
+  /// Subscribe a connection to frames whose number is divisible by interval.
+  /// Connections subscribing with the same parameters share the subscription.
+  /// Subscriptions are removed when the connection is closed.
+  ///
+  /// @param connection_id id of the client connection
+  /// @param interval frame interval
+  /// @param delta push GameStateDelta messages instead of full frames
+  /// @return subscription id, set in the pushed messages
+  /// @exception std::invalid_argument if interval is 0
+  ///
+  u64 subscribe(const int connection_id, const u32 interval, const bool delta);
+  /// Remove subscription of a connection. If id is 0, remove all of it's
+  /// subscriptions.
+  void unsubscribe(const int connection_id, const u64 id);
+  /// Return true if there are any subscriptions.
+  bool active() const;
+  /// Queue a frame to be published. Never blocks.
+  void publish(frame_t G);
+
+ private:
+  struct Subscription {
+    u32 interval;
+    bool delta;
+    std::set<int> connections;
+    DeltaEncoder encoder;
+  };
+
+  void run();
+  void publish_frame(const frame_t& F);
+  /// Return serialized message of subscription S for frame F.
+  std::shared_ptr<const std::string> make_message(const u64 id, Subscription* S,
+                                                  const frame_t& F);
+
+  InstrumentationService* I_;
+  std::mutex mut_;
+  std::map<u64, Subscription> subs_;
+  u64 next_id_;
+  std::atomic_bool active_;
+  async_queue::AsyncRandomAccessQueue<frame_t> frames_;
+  std::thread thread_;
+  /// Removes subscriptions of closed connections
+  u64 close_callback_;
+};
+
+}  // namespace ra2yrcpp
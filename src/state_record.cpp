@@ -0,0 +1,533 @@
+#include "state_record.hpp"
+
+#include "errors.hpp"
+#include "logging.hpp"
+#include "protocol/protocol.hpp"
+#include "shared_memory.hpp"
+
+#include <fmt/core.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/gzip_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include <cstring>
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+
+using namespace ra2yrcpp::record;
+namespace gio = google::protobuf::io;
+
+std::string ra2yrcpp::record::compress_block(std::string_view raw) {
+  std::string res;
+  gio::StringOutputStream so(&res);
+  gio::GzipOutputStream::Options opts;
+  opts.format = gio::GzipOutputStream::ZLIB;
+  gio::GzipOutputStream gz(&so, opts);
+  {
+    gio::CodedOutputStream co(&gz);
+    co.WriteRaw(raw.data(), static_cast<int>(raw.size()));
+    if (co.HadError()) {
+      throw ra2yrcpp::protocol_error("failed to compress block");
+    }
+  }
+  if (!gz.Close()) {
+    throw ra2yrcpp::protocol_error("failed to compress block");
+  }
+  return res;
+}
+
+std::string ra2yrcpp::record::decompress_block(std::string_view data,
+                                               const u32 raw_size) {
+  gio::ArrayInputStream ai(data.data(), static_cast<int>(data.size()));
+  gio::GzipInputStream gz(&ai, gio::GzipInputStream::ZLIB);
+  gio::CodedInputStream co(&gz);
+  std::string res;
+  if (!co.ReadString(&res, static_cast<int>(raw_size))) {
+    throw ra2yrcpp::protocol_error("corrupted block");
+  }
+  return res;
+}
+
+void ra2yrcpp::record::decode_block(std::string_view raw,
+                                    const u32 num_messages,
+                                    const frame_cb& cb) {
+  const auto* p = reinterpret_cast<const u8*>(raw.data());
+  std::size_t off = 0U;
+  DeltaDecoder D;
+  ra2yrproto::ra2yr::GameStateDelta M;
+  for (u32 i = 0U; i < num_messages; i++) {
+    u64 length = 0U;
+    const auto n = read_length_prefix(p + off, raw.size() - off, &length);
+    if (n == 0U || length > raw.size() - off - n) {
+      throw ra2yrcpp::protocol_error("truncated block");
+    }
+    off += n;
+    if (!M.ParseFromArray(p + off, static_cast<int>(length))) {
+      throw ra2yrcpp::protocol_error("failed to parse GameStateDelta");
+    }
+    off += length;
+    if (i == 0U && !M.keyframe()) {
+      throw ra2yrcpp::protocol_error("block doesn't start with a keyframe");
+    }
+    if (!D.apply(M)) {
+      throw ra2yrcpp::protocol_error(
+          fmt::format("invalid delta at message {}", i));
+    }
+    cb(D.current_frame(), D.bytes());
+  }
+}
+
+RecordWriter::RecordWriter(std::shared_ptr<std::ostream> os,
+                           const u32 block_frames, const unsigned num_threads)
+    : os_(std::move(os)),
+      block_frames_(std::max(block_frames, 1U)),
+      max_pending_(2U * num_threads),
+      encoder_(block_frames_),
+      header_{},
+      offset_(0U),
+      closed_(false),
+      pool_(num_threads > 0U
+                ? std::make_unique<utility::ThreadPool>(num_threads)
+                : nullptr) {
+  FileHeader h{};
+  std::memcpy(h.magic, FILE_MAGIC, sizeof(h.magic));
+  h.version = FILE_VERSION;
+  write_bytes(&h, sizeof(h));
+}
+
+RecordWriter::~RecordWriter() {
+  try {
+    close();
+  } catch (const std::exception& e) {
+    eprintf("close record: {}", e.what());
+  }
+}
+
+void RecordWriter::write(const frame_ptr& F) {
+  if (closed_) {
+    return;
+  }
+  encoder_.encode(F, &delta_);
+  const auto size = delta_.ByteSizeLong();
+  u8 prefix[MAX_LENGTH_PREFIX_SIZE];
+  block_.append(reinterpret_cast<const char*>(prefix),
+                write_length_prefix(prefix, size));
+  const auto off = block_.size();
+  block_.resize(off + size);
+  (void)delta_.SerializeWithCachedSizesToArray(
+      reinterpret_cast<u8*>(&block_[off]));
+
+  const auto frame = F->current_frame();
+  if (header_.num_messages == 0U) {
+    header_.first_frame = frame;
+    header_.last_frame = frame;
+  }
+  header_.first_frame = std::min(header_.first_frame, frame);
+  header_.last_frame = std::max(header_.last_frame, frame);
+  header_.num_messages++;
+  if (header_.num_messages >= block_frames_ ||
+      block_.size() >= cfg::RECORD_BLOCK_MAX_SIZE) {
+    flush();
+  }
+}
+
+void RecordWriter::close() {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  flush();
+  write_pending(0U);
+  const Trailer t{offset_, INDEX_MAGIC, 0U};
+  const IndexHeader h{INDEX_MAGIC, static_cast<u32>(index_.size())};
+  write_bytes(&h, sizeof(h));
+  write_bytes(index_.data(), index_.size() * sizeof(BlockInfo));
+  write_bytes(&t, sizeof(t));
+  os_->flush();
+}
+
+void RecordWriter::flush() {
+  if (header_.num_messages == 0U) {
+    return;
+  }
+  auto B = std::make_shared<PendingBlock>();
+  B->header = header_;
+  B->header.magic = BLOCK_MAGIC;
+  B->header.raw_size = static_cast<u32>(block_.size());
+  B->raw.swap(block_);
+  B->done = false;
+  block_.clear();
+  header_ = BlockHeader{};
+  // Next block starts with a keyframe
+  encoder_.reset();
+
+  if (pool_ == nullptr) {
+    B->data = compress_block(B->raw);
+    B->done = true;
+    write_block(*B);
+    return;
+  }
+  pending_.push_back(B);
+  pool_->post([this, B]() {
+    std::string data;
+    std::exception_ptr error;
+    try {
+      data = compress_block(B->raw);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    {
+      std::unique_lock<std::mutex> l(mut_);
+      B->data = std::move(data);
+      B->error = error;
+      B->done = true;
+    }
+    cv_.notify_all();
+  });
+  write_pending(max_pending_);
+}
+
+void RecordWriter::write_pending(const std::size_t max_pending) {
+  std::unique_lock<std::mutex> l(mut_);
+  while (!pending_.empty()) {
+    auto B = pending_.front();
+    if (!B->done) {
+      if (pending_.size() <= max_pending) {
+        break;
+      }
+      cv_.wait(l, [&B]() { return B->done; });
+    }
+    pending_.pop_front();
+    l.unlock();
+    write_block(*B);
+    l.lock();
+  }
+}
+
+void RecordWriter::write_block(const PendingBlock& B) {
+  if (B.error != nullptr) {
+    std::rethrow_exception(B.error);
+  }
+  BlockHeader h = B.header;
+  h.size = static_cast<u32>(B.data.size());
+  index_.push_back({offset_, h});
+  write_bytes(&h, sizeof(h));
+  write_bytes(B.data.data(), B.data.size());
+}
+
+u64 RecordWriter::size() const { return offset_; }
+
+void RecordWriter::write_bytes(const void* data, const std::size_t size) {
+  os_->write(static_cast<const char*>(data), size);
+  if (!os_->good()) {
+    throw std::runtime_error("failed to write record");
+  }
+  offset_ += size;
+}
+
+Recorder::Recorder(std::unique_ptr<RecordWriter> writer,
+                   const std::size_t queue_size)
+    : writer_(std::move(writer)),
+      queue_(queue_size),
+      frames_written_(0U),
+      frames_dropped_(0U),
+      frames_coalesced_(0U),
+      bytes_written_(writer_->size()),
+      queue_high_water_(0U),
+      active_(true),
+      thread_([this]() { run(); }) {}
+
+Recorder::~Recorder() {
+  {
+    std::unique_lock<std::mutex> l(mut_);
+    active_ = false;
+  }
+  cv_.notify_all();
+  thread_.join();
+  if (held_ != nullptr) {
+    write(held_);
+  }
+  try {
+    writer_->close();
+  } catch (const std::exception& e) {
+    eprintf("close record: {}", e.what());
+  }
+}
+
+void Recorder::push(frame_ptr F, const policy_t policy) {
+  // The held frame is older than F, so it goes first
+  if (held_ != nullptr) {
+    if (queue_.try_push(&held_)) {
+      held_ = nullptr;
+    } else if (policy == ra2yrproto::commands::RECORD_COALESCE) {
+      held_ = std::move(F);
+      frames_coalesced_.fetch_add(1U, std::memory_order_relaxed);
+      return;
+    } else {
+      // Policy was changed while a frame was held
+      held_ = nullptr;
+      frames_dropped_.fetch_add(1U, std::memory_order_relaxed);
+    }
+  }
+  if (!queue_.try_push(&F)) {
+    if (policy == ra2yrproto::commands::RECORD_COALESCE) {
+      held_ = std::move(F);
+    } else if (policy == ra2yrproto::commands::RECORD_DROP_OLDEST) {
+      frame_ptr oldest;
+      if (queue_.try_pop(&oldest)) {
+        frames_dropped_.fetch_add(1U, std::memory_order_relaxed);
+      }
+      // The consumer may have claimed the slot, but not released it yet
+      if (!queue_.try_push(&F)) {
+        frames_dropped_.fetch_add(1U, std::memory_order_relaxed);
+      }
+    } else {
+      frames_dropped_.fetch_add(1U, std::memory_order_relaxed);
+    }
+  }
+  const u64 n = queue_.size();
+  if (n > queue_high_water_.load(std::memory_order_relaxed)) {
+    queue_high_water_.store(n, std::memory_order_relaxed);
+  }
+  cv_.notify_one();
+}
+
+void Recorder::stats(ra2yrproto::commands::RecorderStats* S) const {
+  S->set_frames_written(frames_written_.load());
+  S->set_frames_dropped(frames_dropped_.load());
+  S->set_frames_coalesced(frames_coalesced_.load());
+  S->set_bytes_written(bytes_written_.load());
+  S->set_queue_high_water(queue_high_water_.load());
+  S->set_queue_size(queue_.capacity());
+}
+
+void Recorder::run() {
+  frame_ptr F;
+  while (true) {
+    if (queue_.try_pop(&F)) {
+      write(F);
+      F = nullptr;
+      continue;
+    }
+    std::unique_lock<std::mutex> l(mut_);
+    if (!active_) {
+      break;
+    }
+    // push() doesn't take the lock, so a wakeup can be missed
+    (void)cv_.wait_for(l, cfg::RECORD_POLL_INTERVAL, [this]() {
+      return queue_.size() > 0U || !active_;
+    });
+  }
+}
+
+void Recorder::write(const frame_ptr& F) {
+  try {
+    writer_->write(F);
+    frames_written_.fetch_add(1U);
+    bytes_written_.store(writer_->size());
+  } catch (const std::exception& e) {
+    eprintf("record frame {}: {}", F->current_frame(), e.what());
+  }
+}
+
+namespace {
+std::unique_ptr<ra2yrcpp::shm::MappedFile> map_file(const std::string& path) {
+  try {
+    return std::make_unique<ra2yrcpp::shm::MappedFile>(path);
+  } catch (const ra2yrcpp::system_error& e) {
+    throw std::runtime_error(e.what());
+  }
+}
+}  // namespace
+
+RecordReader::RecordReader(const std::string& path)
+    : file_(map_file(path)), indexed_(false) {
+  FileHeader h{};
+  if (!read_at(0U, &h, sizeof(h)) ||
+      std::memcmp(h.magic, FILE_MAGIC, sizeof(h.magic)) != 0) {
+    throw ra2yrcpp::protocol_error(
+        fmt::format("{} is not a record file", path));
+  }
+  if (h.version != FILE_VERSION) {
+    throw ra2yrcpp::protocol_error(
+        fmt::format("unsupported record version {}", h.version));
+  }
+  read_index();
+  if (!indexed_) {
+    wrprintf("{}: no index, scanning blocks", path);
+    scan_blocks();
+  }
+}
+
+bool RecordReader::read_at(const u64 offset, void* dst,
+                           const std::size_t size) const {
+  if (offset > file_->size() || size > file_->size() - offset) {
+    return false;
+  }
+  std::memcpy(dst, file_->data() + offset, size);
+  return true;
+}
+
+void RecordReader::read_index() {
+  const u64 size = file_->size();
+  Trailer t{};
+  if (size < sizeof(FileHeader) + sizeof(IndexHeader) + sizeof(Trailer) ||
+      !read_at(size - sizeof(t), &t, sizeof(t)) || t.magic != INDEX_MAGIC ||
+      t.index_offset < sizeof(FileHeader) ||
+      t.index_offset > size - sizeof(t) - sizeof(IndexHeader)) {
+    return;
+  }
+  IndexHeader h{};
+  if (!read_at(t.index_offset, &h, sizeof(h)) || h.magic != INDEX_MAGIC ||
+      t.index_offset + sizeof(h) + u64(h.num_blocks) * sizeof(BlockInfo) !=
+          size - sizeof(t)) {
+    return;
+  }
+  std::vector<BlockInfo> B(h.num_blocks);
+  if (!read_at(t.index_offset + sizeof(h), B.data(),
+               B.size() * sizeof(BlockInfo))) {
+    return;
+  }
+  for (const auto& b : B) {
+    if (b.header.magic != BLOCK_MAGIC ||
+        b.offset + sizeof(BlockHeader) + b.header.size > t.index_offset) {
+      return;
+    }
+  }
+  blocks_ = std::move(B);
+  indexed_ = true;
+}
+
+void RecordReader::scan_blocks() {
+  u64 off = sizeof(FileHeader);
+  BlockHeader h{};
+  while (read_at(off, &h, sizeof(h)) && h.magic == BLOCK_MAGIC) {
+    if (off + sizeof(h) + h.size > file_->size()) {
+      wrprintf("truncated block at offset {}", off);
+      break;
+    }
+    blocks_.push_back({off, h});
+    off += sizeof(h) + h.size;
+  }
+}
+
+const std::vector<BlockInfo>& RecordReader::blocks() const { return blocks_; }
+
+bool RecordReader::indexed() const { return indexed_; }
+
+std::string RecordReader::read_block(const BlockInfo& B) const {
+  const u64 off = B.offset + sizeof(BlockHeader);
+  if (off > file_->size() || B.header.size > file_->size() - off) {
+    throw ra2yrcpp::protocol_error(
+        fmt::format("truncated block at offset {}", B.offset));
+  }
+  return decompress_block(
+      std::string_view(reinterpret_cast<const char*>(file_->data() + off),
+                       B.header.size),
+      B.header.raw_size);
+}
+
+void RecordReader::read_frames(const u32 first, const u32 last,
+                               const frame_cb& cb) const {
+  for (const auto& B : blocks_) {
+    if (B.header.last_frame < first || B.header.first_frame > last) {
+      continue;
+    }
+    decode_block(read_block(B), B.header.num_messages,
+                 [&](const u32 frame, std::string_view state) {
+                   if (frame >= first && frame <= last) {
+                     cb(frame, state);
+                   }
+                 });
+  }
+}
+
+void RecordReader::convert_frames(const u32 first, const u32 last,
+                                  const convert_cb& convert,
+                                  const output_cb& output,
+                                  const unsigned num_threads) const {
+  auto convert_block = [&](const BlockInfo& B, std::string* out) {
+    decode_block(read_block(B), B.header.num_messages,
+                 [&](const u32 frame, std::string_view state) {
+                   if (frame >= first && frame <= last) {
+                     convert(frame, state, out);
+                   }
+                 });
+  };
+
+  if (num_threads == 0U) {
+    std::string out;
+    for (const auto& B : blocks_) {
+      if (B.header.last_frame >= first && B.header.first_frame <= last) {
+        out.clear();
+        convert_block(B, &out);
+        output(out);
+      }
+    }
+    return;
+  }
+
+  struct Pending {
+    std::string out;
+    std::exception_ptr error;
+    bool done;
+  };
+  const std::size_t max_pending = 2U * num_threads;
+  std::mutex mut;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<Pending>> pending;
+  // Destroyed first, so that running tasks can still notify cv
+  utility::ThreadPool pool(num_threads);
+
+  // Hand over converted blocks in file order
+  auto flush = [&](const std::size_t max_size) {
+    while (pending.size() > max_size) {
+      auto P = pending.front();
+      {
+        std::unique_lock<std::mutex> l(mut);
+        cv.wait(l, [&P]() { return P->done; });
+        pending.pop_front();
+      }
+      if (P->error) {
+        std::rethrow_exception(P->error);
+      }
+      output(P->out);
+    }
+  };
+
+  for (const auto& B : blocks_) {
+    if (B.header.last_frame < first || B.header.first_frame > last) {
+      continue;
+    }
+    flush(max_pending - 1U);
+    auto P = std::make_shared<Pending>();
+    P->done = false;
+    pending.push_back(P);
+    pool.post([&, P, B]() {
+      std::exception_ptr error;
+      try {
+        convert_block(B, &P->out);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      {
+        std::unique_lock<std::mutex> l(mut);
+        P->error = error;
+        P->done = true;
+      }
+      cv.notify_all();
+    });
+  }
+  flush(0U);
+}
+
+bool ra2yrcpp::record::is_record_file(const std::string& path) {
+  std::ifstream is(path, std::ios_base::in | std::ios_base::binary);
+  char magic[sizeof(FILE_MAGIC)] = {};
+  is.read(magic, sizeof(magic));
+  return is.gcount() == sizeof(magic) &&
+         std::memcmp(magic, FILE_MAGIC, sizeof(magic)) == 0;
+}
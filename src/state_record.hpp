@@ -0,0 +1,272 @@
+#pragma once
+#include "ra2yrproto/commands_yr.pb.h"
+
+#include "config.hpp"
+#include "frame_snapshot.hpp"
+#include "mpmc_queue.hpp"
+#include "shared_memory.hpp"
+#include "state_delta.hpp"
+#include "types.h"
+#include "utility/thread_pool.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace ra2yrcpp::record {
+
+///
+/// Game state record file format. The file consists of a header, independently
+/// compressed blocks of consecutive frames, and a trailing block index. Each
+/// block contains varint-delimited GameStateDelta messages, of which the first
+/// one is a keyframe, so a block can be decoded without reading the preceding
+/// ones. The index is written when the record is closed. If it's missing, e.g.
+/// because the game crashed, it's rebuilt by scanning the block headers.
+///
+/// All integers are stored in host (little endian) byte order.
+///
+constexpr char FILE_MAGIC[8] = {'R', 'A', '2', 'Y', 'R', 'R', 'E', 'C'};
+constexpr u32 FILE_VERSION = 1U;
+constexpr u32 BLOCK_MAGIC = 0x4b4c4252U;  // "RBLK"
+constexpr u32 INDEX_MAGIC = 0x58444952U;  // "RIDX"
+
+struct FileHeader {
+  char magic[8];
+  u32 version;
+  u32 reserved;
+};
+
+struct BlockHeader {
+  u32 magic;
+  /// Size of the compressed payload following the header
+  u32 size;
+  /// Size of the uncompressed payload
+  u32 raw_size;
+  u32 num_messages;
+  /// Smallest and largest frame number in the block
+  u32 first_frame;
+  u32 last_frame;
+};
+
+struct BlockInfo {
+  /// Offset of the block header from the start of the file
+  u64 offset;
+  BlockHeader header;
+};
+
+struct IndexHeader {
+  u32 magic;
+  u32 num_blocks;
+};
+
+/// Last bytes of a closed record file.
+struct Trailer {
+  u64 index_offset;
+  u32 magic;
+  u32 reserved;
+};
+
+static_assert(sizeof(FileHeader) == 16U);
+static_assert(sizeof(BlockHeader) == 24U);
+static_assert(sizeof(BlockInfo) == 32U);
+static_assert(sizeof(Trailer) == 16U);
+
+/// Compress a block payload.
+/// @exception ra2yrcpp::protocol_error on compression error
+std::string compress_block(std::string_view raw);
+/// Decompress a block payload of known uncompressed size.
+/// @exception ra2yrcpp::protocol_error if data is corrupted
+std::string decompress_block(std::string_view data, const u32 raw_size);
+
+/// Callback for decoded frames: frame number and serialized GameState.
+using frame_cb = std::function<void(const u32, std::string_view)>;
+
+///
+/// Decode frames of an uncompressed block payload.
+///
+/// @exception ra2yrcpp::protocol_error if the payload is malformed
+///
+void decode_block(std::string_view raw, const u32 num_messages,
+                  const frame_cb& cb);
+
+///
+/// Writes game state frames to a record file. Frames are delta encoded
+/// relative to the previous frame of the same block, and a block is
+/// completed when it has block_frames frames, or it's uncompressed size
+/// exceeds cfg::RECORD_BLOCK_MAX_SIZE.
+///
+/// Completed blocks are compressed in parallel by num_threads threads, and
+/// written in order by the thread calling write(). Up to 2 * num_threads
+/// blocks can be waiting for compression before write() blocks. If
+/// num_threads is 0, blocks are compressed by the calling thread.
+///
+class RecordWriter {
+ public:
+  /// @exception std::runtime_error if writing the file header fails
+  explicit RecordWriter(
+      std::shared_ptr<std::ostream> os,
+      const u32 block_frames = cfg::RECORD_BLOCK_FRAMES,
+      const unsigned num_threads = cfg::RECORD_COMPRESSION_THREADS);
+  /// Closes the record, ignoring errors.
+  ~RecordWriter();
+  RecordWriter(const RecordWriter&) = delete;
+  RecordWriter& operator=(const RecordWriter&) = delete;
+
+  /// @exception std::runtime_error if writing fails
+  void write(const frame_ptr& F);
+  /// Write the pending blocks and the index. Further writes are ignored.
+  /// @exception std::runtime_error if writing fails
+  void close();
+  /// Number of bytes written to the stream so far.
+  u64 size() const;
+
+ private:
+  struct PendingBlock {
+    BlockHeader header;
+    std::string raw;
+    std::string data;
+    std::exception_ptr error;
+    bool done;
+  };
+
+  void flush();
+  /// Write compressed blocks from the head of the queue, waiting until at
+  /// most max_pending blocks remain.
+  void write_pending(const std::size_t max_pending);
+  void write_block(const PendingBlock& B);
+  void write_bytes(const void* data, const std::size_t size);
+
+  std::shared_ptr<std::ostream> os_;
+  u32 block_frames_;
+  std::size_t max_pending_;
+  DeltaEncoder encoder_;
+  ra2yrproto::ra2yr::GameStateDelta delta_;
+  std::string block_;
+  BlockHeader header_;
+  std::vector<BlockInfo> index_;
+  u64 offset_;
+  bool closed_;
+  std::mutex mut_;
+  std::condition_variable cv_;
+  std::deque<std::shared_ptr<PendingBlock>> pending_;
+  // Destroyed first, so that running tasks can still notify cv_
+  std::unique_ptr<utility::ThreadPool> pool_;
+};
+
+///
+/// Random access reader for record files. The file is memory mapped, and only
+/// the blocks overlapping the requested frame range are decompressed and
+/// decoded. Reading functions can be called from multiple threads.
+///
+class RecordReader {
+ public:
+  ///
+  /// Convert a decoded frame and append the result to out. Called from worker
+  /// threads, concurrently for different blocks.
+  ///
+  using convert_cb =
+      std::function<void(const u32, std::string_view, std::string* out)>;
+  /// Receives the converted frames of a block.
+  using output_cb = std::function<void(std::string_view)>;
+
+  /// @exception std::runtime_error if the file can't be opened
+  /// @exception ra2yrcpp::protocol_error if the file isn't a record file
+  explicit RecordReader(const std::string& path);
+
+  const std::vector<BlockInfo>& blocks() const;
+  /// Return true if the index was read from the file instead of rebuilt.
+  bool indexed() const;
+  /// Decompress the payload of block B.
+  std::string read_block(const BlockInfo& B) const;
+  ///
+  /// Invoke cb for every frame whose number is in [first, last], in file
+  /// order.
+  ///
+  /// @exception ra2yrcpp::protocol_error if a block is corrupted
+  ///
+  void read_frames(const u32 first, const u32 last, const frame_cb& cb) const;
+  ///
+  /// Convert frames in [first, last]. Blocks are decoded and converted in
+  /// parallel by num_threads threads, at most 2 * num_threads blocks at a
+  /// time, and output is invoked for each block in file order by the calling
+  /// thread. If num_threads is 0, everything is done by the calling thread.
+  ///
+  /// @exception ra2yrcpp::protocol_error if a block is corrupted
+  /// @exception any exception thrown by convert or output
+  ///
+  void convert_frames(const u32 first, const u32 last,
+                      const convert_cb& convert, const output_cb& output,
+                      const unsigned num_threads) const;
+
+ private:
+  bool read_at(const u64 offset, void* dst, const std::size_t size) const;
+  void read_index();
+  void scan_blocks();
+
+  std::unique_ptr<ra2yrcpp::shm::MappedFile> file_;
+  std::vector<BlockInfo> blocks_;
+  bool indexed_;
+};
+
+///
+/// Writes frames to a record in a background thread. The frame queue is
+/// bounded, and pushing never blocks the calling thread. When the queue is
+/// full, frames are handled according to the drop policy:
+///
+/// - RECORD_DROP_NEWEST: the pushed frame is dropped
+/// - RECORD_DROP_OLDEST: the oldest queued frame is dropped
+/// - RECORD_COALESCE: the pushed frame is held until there's space, replacing
+///   the previously held frame. The record then contains a single delta
+///   covering the changes of all coalesced frames.
+///
+class Recorder {
+ public:
+  using policy_t = ra2yrproto::commands::RecordDropPolicy;
+
+  explicit Recorder(std::unique_ptr<RecordWriter> writer,
+                    const std::size_t queue_size = cfg::RECORD_QUEUE_SIZE);
+  /// Write queued and held frames, and close the record.
+  ~Recorder();
+  Recorder(const Recorder&) = delete;
+  Recorder& operator=(const Recorder&) = delete;
+
+  ///
+  /// Queue a frame for writing. Never blocks. Must not be called concurrently
+  /// from multiple threads.
+  ///
+  void push(frame_ptr F, const policy_t policy);
+  /// Get counters. Can be called from any thread.
+  void stats(ra2yrproto::commands::RecorderStats* S) const;
+
+ private:
+  void run();
+  void write(const frame_ptr& F);
+
+  std::unique_ptr<RecordWriter> writer_;
+  mpmc_queue::MPMCQueue<frame_ptr> queue_;
+  /// Frame waiting for space in the queue. Accessed only by push().
+  frame_ptr held_;
+  std::atomic<u64> frames_written_;
+  std::atomic<u64> frames_dropped_;
+  std::atomic<u64> frames_coalesced_;
+  std::atomic<u64> bytes_written_;
+  std::atomic<u64> queue_high_water_;
+  std::atomic_bool active_;
+  std::mutex mut_;
+  std::condition_variable cv_;
+  std::thread thread_;
+};
+
+/// Return true if the file at path starts with FILE_MAGIC.
+bool is_record_file(const std::string& path);
+
+}  // namespace ra2yrcpp::record
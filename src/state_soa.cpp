@@ -0,0 +1,468 @@
+#include "state_soa.hpp"
+
+#include "errors.hpp"
+#include "protocol/protocol.hpp"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <cstring>
+
+#include <algorithm>
+#include <string_view>
+#include <type_traits>
+
+using namespace ra2yrcpp;
+using google::protobuf::RepeatedPtrField;
+using google::protobuf::internal::WireFormatLite;
+using ra2yrproto::commands::GetGameState;
+using ra2yrproto::ra2yr::GameState;
+namespace gio = google::protobuf::io;
+
+namespace {
+template <typename... Ts>
+void reserve(const int n, Ts*... columns) {
+  (columns->Reserve(n), ...);
+}
+
+/// Resize columns to n elements, filled with default values.
+template <typename... Ts>
+void resize(const int n, Ts*... columns) {
+  (columns->Resize(n, {}), ...);
+}
+
+/// Append src in columnar form as field number to out.
+template <typename T, typename S>
+void write_columns(const u32 number, const S& src, std::string* out) {
+  T C;
+  ra2yrcpp::to_soa(src, &C);
+  ra2yrcpp::write_record(number, C.SerializeAsString(), out);
+}
+
+[[noreturn]] void malformed() {
+  throw ra2yrcpp::protocol_error("malformed record");
+}
+
+int field_number(const u32 tag) {
+  return WireFormatLite::GetTagFieldNumber(tag);
+}
+
+/// Read a scalar field value whose tag has just been read.
+template <typename T>
+T read_scalar(gio::CodedInputStream* is, const u32 tag) {
+  switch (WireFormatLite::GetTagWireType(tag)) {
+    case WireFormatLite::WIRETYPE_VARINT: {
+      u64 v = 0U;
+      if (!is->ReadVarint64(&v)) {
+        malformed();
+      }
+      return static_cast<T>(v);
+    }
+    case WireFormatLite::WIRETYPE_FIXED32: {
+      u32 v = 0U;
+      if (!is->ReadLittleEndian32(&v)) {
+        malformed();
+      }
+      if constexpr (std::is_floating_point_v<T>) {
+        float f = 0.0F;
+        std::memcpy(&f, &v, sizeof(f));
+        return static_cast<T>(f);
+      } else {
+        return static_cast<T>(v);
+      }
+    }
+    case WireFormatLite::WIRETYPE_FIXED64: {
+      u64 v = 0U;
+      if (!is->ReadLittleEndian64(&v)) {
+        malformed();
+      }
+      if constexpr (std::is_floating_point_v<T>) {
+        double f = 0.0;
+        std::memcpy(&f, &v, sizeof(f));
+        return static_cast<T>(f);
+      } else {
+        return static_cast<T>(v);
+      }
+    }
+    default:
+      malformed();
+  }
+}
+
+/// Read payload of a length-delimited field of msg, whose tag has just been
+/// read.
+std::string_view read_bytes(std::string_view msg, gio::CodedInputStream* is,
+                            const u32 tag) {
+  u32 size = 0U;
+  if (WireFormatLite::GetTagWireType(tag) !=
+          WireFormatLite::WIRETYPE_LENGTH_DELIMITED ||
+      !is->ReadVarint32(&size)) {
+    malformed();
+  }
+  const auto begin = static_cast<std::size_t>(is->CurrentPosition());
+  if (!is->Skip(static_cast<int>(size))) {
+    malformed();
+  }
+  return msg.substr(begin, size);
+}
+
+///
+/// Invoke f(tag, is) for each field of a serialized message, with is
+/// positioned at the field's value. f returns false if it didn't consume the
+/// value, in which case the field is skipped.
+///
+template <typename F>
+void for_each_field(std::string_view msg, F&& f) {
+  gio::CodedInputStream is(reinterpret_cast<const u8*>(msg.data()),
+                           static_cast<int>(msg.size()));
+  while (const u32 tag = is.ReadTag()) {
+    if (!f(tag, &is) && !WireFormatLite::SkipField(&is, tag)) {
+      malformed();
+    }
+  }
+  if (!is.ConsumedEntireMessage()) {
+    malformed();
+  }
+}
+
+///
+/// Decode element records to columns. set_field(i, element, tag, is) stores
+/// the field of the i'th element to it's column, and returns false for
+/// fields that don't have one.
+///
+template <typename F>
+void decode_columns(const std::vector<std::string_view>& elements,
+                    F&& set_field) {
+  for (std::size_t i = 0U; i < elements.size(); i++) {
+    for_each_field(elements[i], [&](const u32 tag, gio::CodedInputStream* is) {
+      return set_field(static_cast<int>(i), elements[i], tag, is);
+    });
+  }
+}
+
+/// Return a function that stores a field value to index i of a column.
+auto column_setter(const int i, const u32 tag, gio::CodedInputStream* is) {
+  return [=](auto* column) {
+    using T = typename std::remove_pointer_t<decltype(column)>::value_type;
+    column->Set(i, read_scalar<T>(is, tag));
+    return true;
+  };
+}
+}  // namespace
+
+void ra2yrcpp::to_soa(const RepeatedPtrField<ra2yrproto::ra2yr::Object>& src,
+                      ra2yrproto::ra2yr::ObjectsSoA* dst) {
+  dst->Clear();
+  reserve(src.size(), dst->mutable_pointer_self(),
+          dst->mutable_pointer_technotypeclass(), dst->mutable_pointer_house(),
+          dst->mutable_pointer_initial_owner(), dst->mutable_object_type(),
+          dst->mutable_health(), dst->mutable_x(), dst->mutable_y(),
+          dst->mutable_z(), dst->mutable_current_mission(),
+          dst->mutable_selected(), dst->mutable_in_limbo(),
+          dst->mutable_on_map(), dst->mutable_deployed(),
+          dst->mutable_deploying());
+  for (const auto& o : src) {
+    dst->add_pointer_self(o.pointer_self());
+    dst->add_pointer_technotypeclass(o.pointer_technotypeclass());
+    dst->add_pointer_house(o.pointer_house());
+    dst->add_pointer_initial_owner(o.pointer_initial_owner());
+    dst->add_object_type(o.object_type());
+    dst->add_health(o.health());
+    dst->add_x(o.coordinates().x());
+    dst->add_y(o.coordinates().y());
+    dst->add_z(o.coordinates().z());
+    dst->add_current_mission(o.current_mission());
+    dst->add_selected(o.selected());
+    dst->add_in_limbo(o.in_limbo());
+    dst->add_on_map(o.on_map());
+    dst->add_deployed(o.deployed());
+    dst->add_deploying(o.deploying());
+  }
+}
+
+void ra2yrcpp::to_soa(const RepeatedPtrField<ra2yrproto::ra2yr::House>& src,
+                      ra2yrproto::ra2yr::HousesSoA* dst) {
+  dst->Clear();
+  reserve(src.size(), dst->mutable_self(), dst->mutable_array_index(),
+          dst->mutable_type_array_index(), dst->mutable_money(),
+          dst->mutable_power_drain(), dst->mutable_power_output(),
+          dst->mutable_start_credits(), dst->mutable_current_player(),
+          dst->mutable_defeated(), dst->mutable_is_game_over(),
+          dst->mutable_is_loser(), dst->mutable_is_winner(),
+          dst->mutable_is_human_player(), dst->mutable_name());
+  for (const auto& h : src) {
+    dst->add_self(h.self());
+    dst->add_array_index(h.array_index());
+    dst->add_type_array_index(h.type_array_index());
+    dst->add_money(h.money());
+    dst->add_power_drain(h.power_drain());
+    dst->add_power_output(h.power_output());
+    dst->add_start_credits(h.start_credits());
+    dst->add_current_player(h.current_player());
+    dst->add_defeated(h.defeated());
+    dst->add_is_game_over(h.is_game_over());
+    dst->add_is_loser(h.is_loser());
+    dst->add_is_winner(h.is_winner());
+    dst->add_is_human_player(h.is_human_player());
+    dst->add_name(h.name());
+  }
+}
+
+void ra2yrcpp::to_soa(const RepeatedPtrField<ra2yrproto::ra2yr::Factory>& src,
+                      ra2yrproto::ra2yr::FactoriesSoA* dst) {
+  dst->Clear();
+  reserve(src.size(), dst->mutable_object(), dst->mutable_owner(),
+          dst->mutable_progress_timer(), dst->mutable_on_hold(),
+          dst->mutable_completed(), dst->mutable_queued_objects_count());
+  for (const auto& f : src) {
+    dst->add_object(f.object());
+    dst->add_owner(f.owner());
+    dst->add_progress_timer(f.progress_timer());
+    dst->add_on_hold(f.on_hold());
+    dst->add_completed(f.completed());
+    dst->add_queued_objects_count(f.queued_objects_size());
+    dst->mutable_queued_objects()->MergeFrom(f.queued_objects());
+  }
+}
+
+void ra2yrcpp::to_soa(std::string_view records,
+                      ra2yrproto::ra2yr::ObjectsSoA* dst) {
+  using ra2yrproto::ra2yr::Coordinates;
+  using ra2yrproto::ra2yr::Object;
+  const auto elements = split_records(records);
+  dst->Clear();
+  resize(static_cast<int>(elements.size()), dst->mutable_pointer_self(),
+         dst->mutable_pointer_technotypeclass(), dst->mutable_pointer_house(),
+         dst->mutable_pointer_initial_owner(), dst->mutable_object_type(),
+         dst->mutable_health(), dst->mutable_x(), dst->mutable_y(),
+         dst->mutable_z(), dst->mutable_current_mission(),
+         dst->mutable_selected(), dst->mutable_in_limbo(),
+         dst->mutable_on_map(), dst->mutable_deployed(),
+         dst->mutable_deploying());
+  decode_columns(elements, [dst](const int i, std::string_view o,
+                                 const u32 tag, gio::CodedInputStream* is) {
+    auto set = column_setter(i, tag, is);
+    switch (field_number(tag)) {
+      case Object::kPointerSelfFieldNumber:
+        return set(dst->mutable_pointer_self());
+      case Object::kPointerTechnotypeclassFieldNumber:
+        return set(dst->mutable_pointer_technotypeclass());
+      case Object::kPointerHouseFieldNumber:
+        return set(dst->mutable_pointer_house());
+      case Object::kPointerInitialOwnerFieldNumber:
+        return set(dst->mutable_pointer_initial_owner());
+      case Object::kObjectTypeFieldNumber:
+        return set(dst->mutable_object_type());
+      case Object::kHealthFieldNumber:
+        return set(dst->mutable_health());
+      case Object::kCurrentMissionFieldNumber:
+        return set(dst->mutable_current_mission());
+      case Object::kSelectedFieldNumber:
+        return set(dst->mutable_selected());
+      case Object::kInLimboFieldNumber:
+        return set(dst->mutable_in_limbo());
+      case Object::kOnMapFieldNumber:
+        return set(dst->mutable_on_map());
+      case Object::kDeployedFieldNumber:
+        return set(dst->mutable_deployed());
+      case Object::kDeployingFieldNumber:
+        return set(dst->mutable_deploying());
+      case Object::kCoordinatesFieldNumber:
+        for_each_field(read_bytes(o, is, tag),
+                       [&](const u32 t, gio::CodedInputStream* cs) {
+                         auto set_c = column_setter(i, t, cs);
+                         switch (field_number(t)) {
+                           case Coordinates::kXFieldNumber:
+                             return set_c(dst->mutable_x());
+                           case Coordinates::kYFieldNumber:
+                             return set_c(dst->mutable_y());
+                           case Coordinates::kZFieldNumber:
+                             return set_c(dst->mutable_z());
+                           default:
+                             return false;
+                         }
+                       });
+        return true;
+      default:
+        return false;
+    }
+  });
+}
+
+void ra2yrcpp::to_soa(std::string_view records,
+                      ra2yrproto::ra2yr::HousesSoA* dst) {
+  using ra2yrproto::ra2yr::House;
+  const auto elements = split_records(records);
+  const int n = static_cast<int>(elements.size());
+  dst->Clear();
+  resize(n, dst->mutable_self(), dst->mutable_array_index(),
+         dst->mutable_type_array_index(), dst->mutable_money(),
+         dst->mutable_power_drain(), dst->mutable_power_output(),
+         dst->mutable_start_credits(), dst->mutable_current_player(),
+         dst->mutable_defeated(), dst->mutable_is_game_over(),
+         dst->mutable_is_loser(), dst->mutable_is_winner(),
+         dst->mutable_is_human_player());
+  dst->mutable_name()->Reserve(n);
+  for (int i = 0; i < n; i++) {
+    dst->add_name();
+  }
+  decode_columns(elements, [dst](const int i, std::string_view h,
+                                 const u32 tag, gio::CodedInputStream* is) {
+    auto set = column_setter(i, tag, is);
+    switch (field_number(tag)) {
+      case House::kSelfFieldNumber:
+        return set(dst->mutable_self());
+      case House::kArrayIndexFieldNumber:
+        return set(dst->mutable_array_index());
+      case House::kTypeArrayIndexFieldNumber:
+        return set(dst->mutable_type_array_index());
+      case House::kMoneyFieldNumber:
+        return set(dst->mutable_money());
+      case House::kPowerDrainFieldNumber:
+        return set(dst->mutable_power_drain());
+      case House::kPowerOutputFieldNumber:
+        return set(dst->mutable_power_output());
+      case House::kStartCreditsFieldNumber:
+        return set(dst->mutable_start_credits());
+      case House::kCurrentPlayerFieldNumber:
+        return set(dst->mutable_current_player());
+      case House::kDefeatedFieldNumber:
+        return set(dst->mutable_defeated());
+      case House::kIsGameOverFieldNumber:
+        return set(dst->mutable_is_game_over());
+      case House::kIsLoserFieldNumber:
+        return set(dst->mutable_is_loser());
+      case House::kIsWinnerFieldNumber:
+        return set(dst->mutable_is_winner());
+      case House::kIsHumanPlayerFieldNumber:
+        return set(dst->mutable_is_human_player());
+      case House::kNameFieldNumber:
+        dst->mutable_name(i)->assign(read_bytes(h, is, tag));
+        return true;
+      default:
+        return false;
+    }
+  });
+}
+
+void ra2yrcpp::to_soa(std::string_view records,
+                      ra2yrproto::ra2yr::FactoriesSoA* dst) {
+  using ra2yrproto::ra2yr::Factory;
+  const auto elements = split_records(records);
+  dst->Clear();
+  resize(static_cast<int>(elements.size()), dst->mutable_object(),
+         dst->mutable_owner(), dst->mutable_progress_timer(),
+         dst->mutable_on_hold(), dst->mutable_completed(),
+         dst->mutable_queued_objects_count());
+  auto* queued = dst->mutable_queued_objects();
+  using queued_t = std::remove_pointer_t<decltype(queued)>::value_type;
+  decode_columns(elements, [&](const int i, std::string_view f, const u32 tag,
+                               gio::CodedInputStream* is) {
+    auto set = column_setter(i, tag, is);
+    switch (field_number(tag)) {
+      case Factory::kObjectFieldNumber:
+        return set(dst->mutable_object());
+      case Factory::kOwnerFieldNumber:
+        return set(dst->mutable_owner());
+      case Factory::kProgressTimerFieldNumber:
+        return set(dst->mutable_progress_timer());
+      case Factory::kOnHoldFieldNumber:
+        return set(dst->mutable_on_hold());
+      case Factory::kCompletedFieldNumber:
+        return set(dst->mutable_completed());
+      case Factory::kQueuedObjectsFieldNumber: {
+        const int n0 = queued->size();
+        if (WireFormatLite::GetTagWireType(tag) ==
+            WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+          // Packed
+          const auto p = read_bytes(f, is, tag);
+          gio::CodedInputStream ps(reinterpret_cast<const u8*>(p.data()),
+                                   static_cast<int>(p.size()));
+          const u32 vtag = WireFormatLite::MakeTag(
+              Factory::kQueuedObjectsFieldNumber,
+              WireFormatLite::WIRETYPE_VARINT);
+          while (!ps.ExpectAtEnd()) {
+            queued->Add(read_scalar<queued_t>(&ps, vtag));
+          }
+        } else {
+          queued->Add(read_scalar<queued_t>(is, tag));
+        }
+        auto* count = dst->mutable_queued_objects_count();
+        count->Set(i, count->Get(i) + (queued->size() - n0));
+        return true;
+      }
+      default:
+        return false;
+    }
+  });
+}
+
+void ra2yrcpp::serialize_game_state(const FrameSnapshot& F,
+                                    const GetGameState& args,
+                                    std::string* out) {
+  const auto& mask = args.fields();
+  std::string projected;
+  std::string_view state = F.bytes();
+  if (!args.columnar()) {
+    if (!mask.paths().empty()) {
+      projected = F.project(mask);
+      state = projected;
+    }
+    serialize_field(GetGameState::kStateFieldNumber, state, out);
+    return;
+  }
+
+  // Field masks can't select into repeated fields, so nested paths like
+  // "objects.health" select the whole top level field.
+  gpb::FieldMask top;
+  for (const auto& p : mask.paths()) {
+    top.add_paths(p.substr(0, p.find('.')));
+  }
+  if (!mask.paths().empty()) {
+    projected = F.project(top);
+    state = projected;
+  }
+  auto selected = [&top](const int number) {
+    const auto& name =
+        GameState::descriptor()->FindFieldByNumber(number)->name();
+    return top.paths().empty() ||
+           std::find(top.paths().begin(), top.paths().end(), name) !=
+               top.paths().end();
+  };
+  // Columns are decoded from the serialized records, and rest of the state
+  // is copied as is
+  std::string rest;
+  std::string_view objects;
+  std::string_view houses;
+  std::string_view factories;
+  for (const auto& f : field_spans(state)) {
+    const auto bytes = state.substr(f.begin, f.end - f.begin);
+    switch (f.number) {
+      case GameState::kObjectsFieldNumber:
+        objects = bytes;
+        break;
+      case GameState::kHousesFieldNumber:
+        houses = bytes;
+        break;
+      case GameState::kFactoriesFieldNumber:
+        factories = bytes;
+        break;
+      default:
+        rest.append(bytes);
+    }
+  }
+  serialize_field(GetGameState::kStateFieldNumber, rest, out);
+
+  if (selected(GameState::kObjectsFieldNumber)) {
+    write_columns<ra2yrproto::ra2yr::ObjectsSoA>(
+        GetGameState::kObjectsSoaFieldNumber, objects, out);
+  }
+  if (selected(GameState::kHousesFieldNumber)) {
+    write_columns<ra2yrproto::ra2yr::HousesSoA>(
+        GetGameState::kHousesSoaFieldNumber, houses, out);
+  }
+  if (selected(GameState::kFactoriesFieldNumber)) {
+    write_columns<ra2yrproto::ra2yr::FactoriesSoA>(
+        GetGameState::kFactoriesSoaFieldNumber, factories, out);
+  }
+}
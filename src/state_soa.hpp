@@ -0,0 +1,64 @@
+#pragma once
+#include "ra2yrproto/commands_yr.pb.h"
+#include "ra2yrproto/ra2yr.pb.h"
+
+#include "frame_snapshot.hpp"
+
+#include <google/protobuf/repeated_ptr_field.h>
+
+#include <string>
+#include <string_view>
+
+namespace ra2yrcpp {
+
+///
+/// Convert objects, houses and factories of the game state to columnar form
+/// (structure of arrays), where each field is a packed repeated column, and
+/// the i'th element of every column belongs to the i'th source element.
+/// Fields of submessages, such as coordinates, are flattened to their own
+/// columns. Unset submessages are stored as zeros. Previous contents of dst
+/// are replaced.
+///
+void to_soa(
+    const google::protobuf::RepeatedPtrField<ra2yrproto::ra2yr::Object>& src,
+    ra2yrproto::ra2yr::ObjectsSoA* dst);
+void to_soa(
+    const google::protobuf::RepeatedPtrField<ra2yrproto::ra2yr::House>& src,
+    ra2yrproto::ra2yr::HousesSoA* dst);
+///
+/// queued_objects of every factory are concatenated to one column, and
+/// queued_objects_count holds the number of queued objects of each factory.
+///
+void to_soa(
+    const google::protobuf::RepeatedPtrField<ra2yrproto::ra2yr::Factory>& src,
+    ra2yrproto::ra2yr::FactoriesSoA* dst);
+
+///
+/// Same as above, but the columns are decoded directly from serialized
+/// records of the repeated field, e.g. the objects of a serialized GameState,
+/// without parsing them to messages first.
+///
+/// @exception ra2yrcpp::protocol_error if the records are malformed
+///
+void to_soa(std::string_view records, ra2yrproto::ra2yr::ObjectsSoA* dst);
+void to_soa(std::string_view records, ra2yrproto::ra2yr::HousesSoA* dst);
+void to_soa(std::string_view records, ra2yrproto::ra2yr::FactoriesSoA* dst);
+
+///
+/// Serialize GetGameState result for frame F. If args.fields is set, only
+/// the selected fields of the state are included. If args.columnar is set,
+/// the selected objects, houses and factories are returned in columnar form
+/// instead of the state. In columnar mode, nested paths such as
+/// "objects.health" select the whole top level field. The frame is never
+/// parsed.
+///
+/// @param F the frame
+/// @param args command arguments
+/// @param out destination buffer, whose contents are replaced
+/// @exception std::invalid_argument if the mask is invalid
+///
+void serialize_game_state(const FrameSnapshot& F,
+                          const ra2yrproto::commands::GetGameState& args,
+                          std::string* out);
+
+}  // namespace ra2yrcpp
@@ -0,0 +1,90 @@
+#include "tcp_connection.hpp"
+
+#include "protocol/protocol.hpp"
+
+#include "asio_utils.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+
+using namespace ra2yrcpp::connection;
+
+ClientTcpConnection::ClientTcpConnection(
+    std::string host, std::string port,
+    ra2yrcpp::asio_utils::IOService* io_service)
+    : ClientConnection(host, port),
+      socket_(std::make_unique<ra2yrcpp::asio_utils::AsioSocket>(io_service)),
+      buf_(cfg::DEFAULT_BUFLEN),
+      begin_(0U),
+      end_(0U) {}
+
+ClientTcpConnection::~ClientTcpConnection() {}
+
+void ClientTcpConnection::connect() {
+  state_.store(State::CONNECTING);
+  try {
+    socket_->connect(host, port);
+  } catch (const std::exception& e) {
+    state_.store(State::CLOSED);
+    throw std::runtime_error(fmt::format("failed to connect: {}", e.what()));
+  }
+  state_.store(State::OPEN);
+}
+
+void ClientTcpConnection::send_data(const vecu8& bytes) {
+  u8 header[ra2yrcpp::MAX_LENGTH_PREFIX_SIZE];
+  const auto n = ra2yrcpp::write_length_prefix(header, bytes.size());
+  std::unique_lock<std::mutex> l(mut_write_);
+  (void)socket_->write(
+      {std::string_view(reinterpret_cast<const char*>(header), n),
+       std::string_view(reinterpret_cast<const char*>(bytes.data()),
+                        bytes.size())});
+}
+
+vecu8 ClientTcpConnection::read_data() {
+  std::unique_lock<std::mutex> l(mut_read_);
+  std::size_t need = 1U;
+  while (true) {
+    u64 length = 0U;
+    const auto n = ra2yrcpp::read_length_prefix(buf_.data() + begin_,
+                                                end_ - begin_, &length);
+    if (n > 0U) {
+      if (length > cfg::MAX_MESSAGE_LENGTH) {
+        throw ra2yrcpp::protocol_error(
+            fmt::format("message too long: {}", length));
+      }
+      if (end_ - begin_ >= n + length) {
+        const auto* p = buf_.data() + begin_ + n;
+        vecu8 res(p, p + length);
+        begin_ += n + length;
+        if (begin_ == end_) {
+          begin_ = end_ = 0U;
+        }
+        return res;
+      }
+      need = n + length - (end_ - begin_);
+    }
+
+    // Move unconsumed bytes to the start and make room for the rest
+    if (begin_ > 0U) {
+      std::memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+      end_ -= begin_;
+      begin_ = 0U;
+    }
+    if (buf_.size() - end_ < need) {
+      buf_.resize(end_ + std::max<std::size_t>(need, cfg::DEFAULT_BUFLEN));
+    }
+    end_ += socket_->read_some(buf_.data() + end_, buf_.size() - end_);
+  }
+}
+
+void ClientTcpConnection::stop() {
+  socket_->shutdown();
+  state_.store(State::CLOSED);
+}
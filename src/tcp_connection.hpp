@@ -0,0 +1,50 @@
+#pragma once
+#include "client_connection.hpp"
+#include "types.h"
+
+#include <cstddef>
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace ra2yrcpp {
+namespace asio_utils {
+class IOService;
+struct AsioSocket;
+}  // namespace asio_utils
+}  // namespace ra2yrcpp
+
+namespace ra2yrcpp::connection {
+
+///
+/// Client for TcpServer. Messages are sent and received with a varint length
+/// prefix over a plain TCP connection. Sending and reading can be done
+/// concurrently from different threads.
+///
+class ClientTcpConnection : public ClientConnection {
+ public:
+  ClientTcpConnection(std::string host, std::string port,
+                      ra2yrcpp::asio_utils::IOService* io_service);
+  ~ClientTcpConnection() override;
+  void connect() override;
+  void send_data(const vecu8& bytes) override;
+  /// Read next message. Blocks until a complete message has been received.
+  /// @exception std::runtime_error on read failure or if the connection was
+  /// closed
+  /// @exception ra2yrcpp::protocol_error on invalid length prefix
+  vecu8 read_data() override;
+  /// Shutdown the connection, which unblocks pending reads.
+  void stop() override;
+
+ private:
+  std::unique_ptr<ra2yrcpp::asio_utils::AsioSocket> socket_;
+  std::mutex mut_write_;
+  std::mutex mut_read_;
+  /// Received bytes that haven't been consumed yet are in [begin_, end_)
+  vecu8 buf_;
+  std::size_t begin_;
+  std::size_t end_;
+};
+
+}  // namespace ra2yrcpp::connection
@@ -0,0 +1,379 @@
+#include "tcp_server.hpp"
+
+#include "protocol/protocol.hpp"
+
+#include "asio_utils.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+#include "logging.hpp"
+#include "utility/thread_pool.hpp"
+#include "utility/time.hpp"
+
+#include <fmt/core.h>
+#include <websocketpp/common/asio.hpp>
+
+#include <cstddef>
+#include <cstring>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <regex>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace ra2yrcpp::tcp_server;
+namespace lib = websocketpp::lib;
+using tcp = lib::asio::ip::tcp;
+using ios_t = lib::asio::io_context;
+
+class TcpServer::acceptor_impl : public tcp::acceptor {
+ public:
+  explicit acceptor_impl(ios_t& io) : tcp::acceptor(io) {}  // NOLINT
+};
+
+///
+/// State of a single client connection. Socket operations are serialized with
+/// an asio strand, and ordered messages are executed with a Strand of the
+/// server's thread pool.
+///
+class TcpServer::Connection : public std::enable_shared_from_this<Connection> {
+ public:
+  Connection(TcpServer* srv, ios_t& io)  // NOLINT
+      : srv_(srv),
+        socket_(io),
+        io_strand_(io),
+        strand_(std::make_shared<utility::Strand>(srv->pool_)),
+        id_(-1),
+        buf_(cfg::DEFAULT_BUFLEN),
+        begin_(0U),
+        end_(0U),
+        need_(0U),
+        pending_(0U),
+        closed_(false) {}
+
+  /// Time when the connection was accepted
+  std::chrono::system_clock::time_point timestamp;
+
+  tcp::socket& socket() { return socket_; }
+
+  socket_t id() const { return id_; }
+
+  utility::Strand* strand() { return strand_.get(); }
+
+  /// Initialize accepted socket.
+  void open() {
+    timestamp = util::current_time();
+    id_ = static_cast<socket_t>(socket_.native_handle());
+    socket_.set_option(tcp::no_delay(true));
+  }
+
+  /// Start reading messages.
+  void start() {
+    auto self = shared_from_this();
+    lib::asio::post(io_strand_, [this, self]() { read(); });
+  }
+
+  /// Queue a message to be sent. Can be called from any thread.
+  void send(std::shared_ptr<const std::string> body) {
+    auto self = shared_from_this();
+    pending_ += body->size();
+    lib::asio::post(io_strand_, [this, self, body]() {
+      if (closed_) {
+        pending_ -= body->size();
+        return;
+      }
+      out_q_.push_back({{}, 0U, body});
+      auto& f = out_q_.back();
+      f.header_size = ra2yrcpp::write_length_prefix(f.header.data(),
+                                                    body->size());
+      if (out_q_.size() == 1U) {
+        write();
+      }
+    });
+  }
+
+  /// Number of bytes queued but not yet sent.
+  std::size_t pending() const { return pending_.load(); }
+
+  /// Close the connection. Can be called from any thread.
+  void stop() {
+    auto self = shared_from_this();
+    lib::asio::post(io_strand_, [this, self]() { close(); });
+  }
+
+ private:
+  struct Frame {
+    std::array<u8, ra2yrcpp::MAX_LENGTH_PREFIX_SIZE> header;
+    std::size_t header_size;
+    std::shared_ptr<const std::string> body;
+  };
+
+  void read() {
+    // Move unconsumed bytes to the start and make room for the rest
+    if (begin_ > 0U) {
+      std::memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+      end_ -= begin_;
+      begin_ = 0U;
+    }
+    if (buf_.size() - end_ < need_ || buf_.size() == end_) {
+      buf_.resize(end_ + std::max<std::size_t>(need_, cfg::DEFAULT_BUFLEN));
+    }
+    auto self = shared_from_this();
+    socket_.async_read_some(
+        lib::asio::buffer(buf_.data() + end_, buf_.size() - end_),
+        lib::asio::bind_executor(
+            io_strand_,
+            [this, self](const lib::error_code& ec, std::size_t count) {
+              if (ec) {
+                close();
+                return;
+              }
+              end_ += count;
+              try {
+                while (parse_message()) {
+                }
+              } catch (const std::exception& e) {
+                eprintf("connection {}: {}", id_, e.what());
+                close();
+                return;
+              }
+              read();
+            }));
+  }
+
+  /// Dispatch next complete message from the buffer. Returns false if there's
+  /// no complete message.
+  bool parse_message() {
+    if (closed_) {
+      return false;
+    }
+    u64 length = 0U;
+    const auto n = ra2yrcpp::read_length_prefix(buf_.data() + begin_,
+                                                end_ - begin_, &length);
+    need_ = 0U;
+    if (n == 0U) {
+      return false;
+    }
+    if (length > cfg::MAX_MESSAGE_LENGTH) {
+      throw ra2yrcpp::protocol_error(
+          fmt::format("message too long: {}", length));
+    }
+    if (end_ - begin_ < n + length) {
+      need_ = n + length - (end_ - begin_);
+      return false;
+    }
+    auto msg = std::make_shared<std::string>(
+        reinterpret_cast<const char*>(buf_.data() + begin_ + n), length);
+    begin_ += n + length;
+    if (begin_ == end_) {
+      begin_ = end_ = 0U;
+    }
+    srv_->dispatch(shared_from_this(), std::move(msg));
+    return true;
+  }
+
+  void write() {
+    auto& f = out_q_.front();
+    std::array<lib::asio::const_buffer, 2> b{
+        lib::asio::buffer(f.header.data(), f.header_size),
+        lib::asio::buffer(*f.body)};
+    auto self = shared_from_this();
+    lib::asio::async_write(
+        socket_, b,
+        lib::asio::bind_executor(
+            io_strand_, [this, self](const lib::error_code& ec, std::size_t) {
+              if (ec) {
+                close();
+                return;
+              }
+              // close() may have cleared the queue while this was pending
+              if (closed_ || out_q_.empty()) {
+                return;
+              }
+              pending_ -= out_q_.front().body->size();
+              out_q_.pop_front();
+              if (!out_q_.empty()) {
+                write();
+              }
+            }));
+  }
+
+  void close() {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    for (const auto& f : out_q_) {
+      pending_ -= f.body->size();
+    }
+    out_q_.clear();
+    // The id is the socket descriptor, which may be reused for a new
+    // connection as soon as the socket is closed.
+    srv_->remove(id_);
+    lib::error_code ec;
+    socket_.shutdown(tcp::socket::shutdown_both, ec);
+    socket_.close(ec);
+  }
+
+  TcpServer* srv_;
+  tcp::socket socket_;
+  ios_t::strand io_strand_;
+  std::shared_ptr<utility::Strand> strand_;
+  socket_t id_;
+  /// Received bytes that haven't been consumed yet are in [begin_, end_)
+  std::vector<u8> buf_;
+  std::size_t begin_;
+  std::size_t end_;
+  /// Number of bytes missing from the current message
+  std::size_t need_;
+  std::deque<Frame> out_q_;
+  std::atomic<std::size_t> pending_;
+  bool closed_;
+};
+
+TcpServer::TcpServer(TcpServer::Options o,
+                     ra2yrcpp::asio_utils::IOService* service,
+                     utility::ThreadPool* pool, Callbacks cb)
+    : opts_(o),
+      service_(service),
+      pool_(pool),
+      cb_(cb),
+      acceptor_(std::make_unique<acceptor_impl>(
+          *reinterpret_cast<ios_t*>(service->get_service()))),
+      accepting_(false) {}
+
+TcpServer::~TcpServer() {}
+
+void TcpServer::start() {
+  dprintf("listen tcp, host={} port={}", opts_.host, opts_.port);
+  tcp::resolver resolver(*reinterpret_cast<ios_t*>(service_->get_service()));
+  const tcp::endpoint ep =
+      resolver
+          .resolve(opts_.host, std::to_string(opts_.port),
+                   tcp::resolver::passive | tcp::resolver::numeric_service)
+          .begin()
+          ->endpoint();
+  acceptor_->open(ep.protocol());
+  acceptor_->set_option(tcp::acceptor::reuse_address(true));
+  acceptor_->bind(ep);
+  acceptor_->listen();
+  accepting_.store(true);
+  accept();
+}
+
+void TcpServer::accept() {
+  auto c = std::make_shared<Connection>(
+      this, *reinterpret_cast<ios_t*>(service_->get_service()));
+  acceptor_->async_accept(c->socket(), [this, c](const lib::error_code& ec) {
+    if (ec == lib::asio::error::operation_aborted || !acceptor_->is_open()) {
+      accepting_.store(false);
+      return;
+    }
+    if (ec) {
+      eprintf("accept: {}", ec.message());
+      accept();
+      return;
+    }
+    try {
+      lib::error_code e;
+      const auto remote = c->socket().remote_endpoint(e).address().to_string();
+      std::smatch match;
+      if (!std::regex_search(remote, match,
+                             std::regex(opts_.allowed_hosts_regex))) {
+        iprintf("reject connection from {}", remote);
+      } else {
+        std::unique_lock<std::mutex> l(mut_conns_);
+        if (conns_.size() >= opts_.max_connections) {
+          eprintf("max connections {} exceeded", conns_.size());
+        } else {
+          c->open();
+          conns_[c->id()] = c;
+          l.unlock();
+          iprintf("tcp connection from {}", remote);
+          cb_.accept(c->id());
+          c->start();
+        }
+      }
+    } catch (const std::exception& e) {
+      eprintf("accept: {}", e.what());
+    }
+    accept();
+  });
+}
+
+void TcpServer::dispatch(std::shared_ptr<Connection> c,
+                         std::shared_ptr<std::string> msg) {
+  auto task = [this, c, msg]() {
+    auto out = std::make_shared<std::string>();
+    cb_.receive(c->id(), *msg, out.get());
+    c->send(std::move(out));
+  };
+  auto* pool = cb_.executor != nullptr ? cb_.executor(c->id(), *msg) : nullptr;
+  if (cb_.ordered != nullptr && !cb_.ordered(c->id(), *msg)) {
+    (pool != nullptr ? pool : pool_)->post(task);
+  } else {
+    c->strand()->post(task, pool);
+  }
+}
+
+bool TcpServer::push(const socket_t id,
+                     std::shared_ptr<const std::string> msg) {
+  std::shared_ptr<Connection> c;
+  {
+    std::unique_lock<std::mutex> l(mut_conns_);
+    auto it = conns_.find(id);
+    if (it == conns_.end()) {
+      return false;
+    }
+    c = it->second;
+  }
+  if (c->pending() > cfg::PUSH_MAX_PENDING_BYTES) {
+    return false;
+  }
+  c->send(std::move(msg));
+  return true;
+}
+
+void TcpServer::remove(const socket_t id) {
+  try {
+    cb_.close(id);
+  } catch (const std::exception& e) {
+    eprintf("close: {}", e.what());
+  }
+  std::unique_lock<std::mutex> l(mut_conns_);
+  (void)conns_.erase(id);
+  cv_conns_.notify_all();
+  iprintf("closed tcp conn {}", id);
+}
+
+std::vector<TcpServer::connection_info_t> TcpServer::connections() {
+  std::vector<connection_info_t> res;
+  std::unique_lock<std::mutex> l(mut_conns_);
+  for (const auto& [k, v] : conns_) {
+    res.emplace_back(k, v->timestamp);
+  }
+  return res;
+}
+
+void TcpServer::shutdown() {
+  service_->post(
+      [this]() {
+        lib::error_code ec;
+        acceptor_->close(ec);
+      },
+      true);
+  // Wait for the aborted accept handler, which references the acceptor
+  accepting_.wait(false);
+  std::unique_lock<std::mutex> l(mut_conns_);
+  for (auto& [k, v] : conns_) {
+    v->stop();
+  }
+  if (!cv_conns_.wait_for(l, cfg::SERVER_SHUTDOWN_TIMEOUT,
+                          [this]() { return conns_.empty(); })) {
+    wrprintf("{} connections were not closed", conns_.size());
+  }
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include "utility/sync.hpp"
+#include "websocket_server.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ra2yrcpp {
+namespace asio_utils {
+class IOService;
+}
+}  // namespace ra2yrcpp
+
+namespace utility {
+class ThreadPool;
+}
+
+namespace ra2yrcpp {
+
+namespace tcp_server {
+
+///
+/// Server for plain TCP connections, where each message is prefixed with it's
+/// length as a varint. Avoids the framing and handshake overhead of websockets
+/// for clients on the same host. Messages are dispatched to the same callbacks
+/// as with WebsocketServer.
+///
+class TcpServer {
+ public:
+  using socket_t = int;
+  using Callbacks = websocket_server::WebsocketServer::Callbacks;
+  using connection_info_t =
+      std::pair<socket_t, std::chrono::system_clock::time_point>;
+
+  struct Options {
+    std::string host;
+    unsigned port;
+    unsigned max_connections;
+    std::string allowed_hosts_regex;
+  };
+
+  TcpServer() = delete;
+  /// @param o options
+  /// @param service service used for socket I/O
+  /// @param pool pool executing the callbacks
+  /// @param cb callbacks
+  TcpServer(TcpServer::Options o, ra2yrcpp::asio_utils::IOService* service,
+            utility::ThreadPool* pool, Callbacks cb);
+  ~TcpServer();
+
+  /// Start accepting connections on opts.host and opts.port.
+  /// @exception std::system_error if the address can't be resolved or bound
+  void start();
+  /// Stop accepting new connections and close existing ones. Returns when
+  /// all connections have been closed.
+  void shutdown();
+  /// Return socket ids and connection times of active connections.
+  std::vector<connection_info_t> connections();
+  /// Send a message to the given connection outside of the request/response
+  /// cycle. Can be called from any thread.
+  /// @return false if the connection doesn't exist, or has too much unsent
+  /// data
+  bool push(const socket_t id, std::shared_ptr<const std::string> msg);
+
+  class Connection;
+
+ private:
+  void accept();
+  void dispatch(std::shared_ptr<Connection> c,
+                std::shared_ptr<std::string> msg);
+  void remove(const socket_t id);
+
+  TcpServer::Options opts_;
+  ra2yrcpp::asio_utils::IOService* service_;
+  utility::ThreadPool* pool_;
+  Callbacks cb_;
+  class acceptor_impl;
+  std::unique_ptr<acceptor_impl> acceptor_;
+  /// Set while an accept operation is pending
+  util::AtomicVariable<bool> accepting_;
+  std::map<socket_t, std::shared_ptr<Connection>> conns_;
+  std::mutex mut_conns_;
+  std::condition_variable cv_conns_;
+};
+
+}  // namespace tcp_server
+
+}  // namespace ra2yrcpp
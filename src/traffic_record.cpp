@@ -0,0 +1,180 @@
+#include "traffic_record.hpp"
+
+#include "errors.hpp"
+#include "logging.hpp"
+#include "protocol/helpers.hpp"
+#include "shared_memory.hpp"
+
+#include <fmt/core.h>
+
+#include <cstring>
+
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+using namespace ra2yrcpp::traffic;
+
+namespace {
+u64 timestamp_us() {
+  return static_cast<u64>(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count());
+}
+}  // namespace
+
+TrafficRecorder::TrafficRecorder(std::shared_ptr<std::ostream> os,
+                                 const std::size_t queue_size)
+    : os_(std::move(os)),
+      queue_(queue_size),
+      buffers_(queue_size),
+      written_(0U),
+      dropped_(0U),
+      failed_(false),
+      active_(true) {
+  FileHeader h{};
+  std::memcpy(h.magic, FILE_MAGIC, sizeof(h.magic));
+  h.version = FILE_VERSION;
+  os_->write(reinterpret_cast<const char*>(&h), sizeof(h));
+  if (!os_->good()) {
+    throw std::runtime_error("failed to write traffic record header");
+  }
+  thread_ = std::thread([this]() { run(); });
+}
+
+TrafficRecorder::~TrafficRecorder() {
+  {
+    std::unique_lock<std::mutex> l(mut_);
+    active_ = false;
+  }
+  cv_.notify_all();
+  thread_.join();
+  if (dropped_ > 0U) {
+    wrprintf("dropped {} packets", dropped_.load());
+  }
+}
+
+void TrafficRecorder::push(const u32 source, const u32 destination,
+                           const void* data, const std::size_t size) {
+  Packet P;
+  // Reuse capacity of an already written packet to avoid allocating
+  (void)buffers_.try_pop(&P.data);
+  P.data.assign(static_cast<const char*>(data), size);
+  P.header.timestamp = timestamp_us();
+  P.header.size = static_cast<u32>(size);
+  P.header.source = static_cast<u16>(source);
+  P.header.destination = static_cast<u16>(destination);
+  if (!queue_.try_push(&P)) {
+    dropped_.fetch_add(1U, std::memory_order_relaxed);
+  }
+}
+
+u64 TrafficRecorder::written() const { return written_.load(); }
+
+u64 TrafficRecorder::dropped() const { return dropped_.load(); }
+
+void TrafficRecorder::run() {
+  std::string batch;
+  while (true) {
+    write_queued(&batch);
+    std::unique_lock<std::mutex> l(mut_);
+    if (!active_) {
+      break;
+    }
+    // Packets are collected for a while instead of waking up for each one
+    (void)cv_.wait_for(l, cfg::TRAFFIC_FLUSH_INTERVAL,
+                       [this]() { return !active_; });
+  }
+  // Packets pushed while shutting down
+  write_queued(&batch);
+}
+
+void TrafficRecorder::write_queued(std::string* batch) {
+  Packet P;
+  bool more = true;
+  while (more) {
+    batch->clear();
+    u64 n = 0U;
+    while (batch->size() < cfg::TRAFFIC_BATCH_SIZE) {
+      if (!queue_.try_pop(&P)) {
+        more = false;
+        break;
+      }
+      batch->append(reinterpret_cast<const char*>(&P.header),
+                    sizeof(P.header));
+      batch->append(P.data);
+      n++;
+      (void)buffers_.try_push(&P.data);
+    }
+    if (n == 0U) {
+      continue;
+    }
+    if (failed_) {
+      dropped_.fetch_add(n, std::memory_order_relaxed);
+      continue;
+    }
+    os_->write(batch->data(), batch->size());
+    os_->flush();
+    if (!os_->good()) {
+      eprintf("failed to write traffic record, further packets are dropped");
+      failed_ = true;
+      dropped_.fetch_add(n, std::memory_order_relaxed);
+      continue;
+    }
+    written_.fetch_add(n, std::memory_order_relaxed);
+  }
+}
+
+void ra2yrcpp::traffic::read_traffic(const std::string& path,
+                                     const packet_cb& cb) {
+  std::unique_ptr<ra2yrcpp::shm::MappedFile> F;
+  try {
+    F = std::make_unique<ra2yrcpp::shm::MappedFile>(path);
+  } catch (const ra2yrcpp::system_error& e) {
+    throw std::runtime_error(e.what());
+  }
+  ra2yrproto::ra2yr::TunnelPacket P;
+  if (F->size() < sizeof(FileHeader) ||
+      std::memcmp(F->data(), FILE_MAGIC, sizeof(FILE_MAGIC)) != 0) {
+    F = nullptr;
+    ra2yrcpp::protocol::MessageIstream MS(
+        std::make_shared<std::ifstream>(
+            path, std::ios_base::in | std::ios_base::binary),
+        true);
+    while (MS.read(&P)) {
+      cb(P);
+    }
+    return;
+  }
+
+  FileHeader h{};
+  std::memcpy(&h, F->data(), sizeof(h));
+  if (h.version != FILE_VERSION) {
+    throw std::runtime_error(
+        fmt::format("unsupported traffic record version {}", h.version));
+  }
+  std::size_t off = sizeof(h);
+  while (off < F->size()) {
+    PacketHeader ph{};
+    if (F->size() - off < sizeof(ph)) {
+      wrprintf("truncated packet at offset {}", off);
+      break;
+    }
+    std::memcpy(&ph, F->data() + off, sizeof(ph));
+    off += sizeof(ph);
+    if (F->size() - off < ph.size) {
+      wrprintf("truncated packet at offset {}", off - sizeof(ph));
+      break;
+    }
+    P.set_timestamp(ph.timestamp);
+    P.set_source(ph.source);
+    P.set_destination(ph.destination);
+    P.mutable_data()->assign(
+        reinterpret_cast<const char*>(F->data() + off), ph.size);
+    off += ph.size;
+    cb(P);
+  }
+}
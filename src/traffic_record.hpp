@@ -0,0 +1,104 @@
+#pragma once
+#include "ra2yrproto/ra2yr.pb.h"
+
+#include "config.hpp"
+#include "mpmc_queue.hpp"
+#include "types.h"
+
+#include <cstddef>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+namespace ra2yrcpp::traffic {
+
+///
+/// Tunnel traffic record file format. The file header is followed by packets,
+/// each consisting of a PacketHeader and the raw packet data. All integers
+/// are stored in host (little endian) byte order.
+///
+constexpr char FILE_MAGIC[8] = {'R', 'A', '2', 'Y', 'R', 'T', 'R', 'F'};
+constexpr u32 FILE_VERSION = 1U;
+
+struct FileHeader {
+  char magic[8];
+  u32 version;
+  u32 reserved;
+};
+
+struct PacketHeader {
+  /// Microseconds since the epoch
+  u64 timestamp;
+  /// Size of the packet data following the header
+  u32 size;
+  u16 source;
+  u16 destination;
+};
+
+static_assert(sizeof(FileHeader) == 16U);
+static_assert(sizeof(PacketHeader) == 16U);
+
+///
+/// Records tunnel packets to a stream. Packets are copied to a bounded
+/// lock-free queue, and written in batches by a background thread, so
+/// recording never blocks the network thread. If the queue is full, the
+/// packet is dropped.
+///
+class TrafficRecorder {
+ public:
+  /// @exception std::runtime_error if writing the file header fails
+  explicit TrafficRecorder(
+      std::shared_ptr<std::ostream> os,
+      const std::size_t queue_size = cfg::TRAFFIC_QUEUE_SIZE);
+  /// Write the queued packets and flush the stream.
+  ~TrafficRecorder();
+  TrafficRecorder(const TrafficRecorder&) = delete;
+  TrafficRecorder& operator=(const TrafficRecorder&) = delete;
+
+  /// Queue a copy of a packet. Never blocks. Can be called from any thread.
+  void push(const u32 source, const u32 destination, const void* data,
+            const std::size_t size);
+  u64 written() const;
+  u64 dropped() const;
+
+ private:
+  struct Packet {
+    PacketHeader header;
+    std::string data;
+  };
+
+  void run();
+  /// Write queued packets in batches of up to cfg::TRAFFIC_BATCH_SIZE bytes.
+  void write_queued(std::string* batch);
+
+  std::shared_ptr<std::ostream> os_;
+  mpmc_queue::MPMCQueue<Packet> queue_;
+  /// Data buffers of written packets, reused by push()
+  mpmc_queue::MPMCQueue<std::string> buffers_;
+  std::atomic<u64> written_;
+  std::atomic<u64> dropped_;
+  bool failed_;
+  std::atomic_bool active_;
+  std::mutex mut_;
+  std::condition_variable cv_;
+  std::thread thread_;
+};
+
+using packet_cb = std::function<void(const ra2yrproto::ra2yr::TunnelPacket&)>;
+
+///
+/// Invoke cb for each packet of a traffic record. Gzip compressed streams of
+/// TunnelPacket messages written by older versions are also accepted; their
+/// packets don't have a timestamp.
+///
+/// @exception std::runtime_error if the file can't be read
+///
+void read_traffic(const std::string& path, const packet_cb& cb);
+
+}  // namespace ra2yrcpp::traffic
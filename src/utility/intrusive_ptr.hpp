@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+
+#include <utility>
+
+namespace utility {
+
+///
+/// Smart pointer to an object with embedded reference count. T must provide
+/// add_ref(), release() and use_count() member functions. release() is
+/// responsible for disposing the object once the count drops to zero, which
+/// allows objects to be recycled instead of deleted.
+///
+template <typename T>
+class IntrusivePtr {
+ public:
+  using element_type = T;
+
+  IntrusivePtr() : p_(nullptr) {}
+
+  IntrusivePtr(std::nullptr_t) : p_(nullptr) {}  // NOLINT
+
+  /// @param p pointer to the object
+  /// @param add_ref if false, adopt an existing reference
+  explicit IntrusivePtr(T* p, const bool add_ref = true) : p_(p) {
+    if (p_ != nullptr && add_ref) {
+      p_->add_ref();
+    }
+  }
+
+  IntrusivePtr(const IntrusivePtr& o) : IntrusivePtr(o.p_) {}
+
+  IntrusivePtr(IntrusivePtr&& o) noexcept : p_(o.p_) { o.p_ = nullptr; }
+
+  ~IntrusivePtr() { reset(); }
+
+  IntrusivePtr& operator=(const IntrusivePtr& o) {
+    IntrusivePtr(o).swap(*this);
+    return *this;
+  }
+
+  IntrusivePtr& operator=(IntrusivePtr&& o) noexcept {
+    IntrusivePtr(std::move(o)).swap(*this);
+    return *this;
+  }
+
+  void reset() {
+    if (p_ != nullptr) {
+      auto* p = p_;
+      p_ = nullptr;
+      p->release();
+    }
+  }
+
+  /// Give up ownership without releasing the reference.
+  T* detach() {
+    auto* p = p_;
+    p_ = nullptr;
+    return p;
+  }
+
+  void swap(IntrusivePtr& o) noexcept { std::swap(p_, o.p_); }
+
+  T* get() const { return p_; }
+
+  T& operator*() const { return *p_; }
+
+  T* operator->() const { return p_; }
+
+  explicit operator bool() const { return p_ != nullptr; }
+
+  std::size_t use_count() const { return p_ != nullptr ? p_->use_count() : 0U; }
+
+  bool operator==(const IntrusivePtr& o) const { return p_ == o.p_; }
+
+  bool operator!=(const IntrusivePtr& o) const { return p_ != o.p_; }
+
+  bool operator==(std::nullptr_t) const { return p_ == nullptr; }
+
+  bool operator!=(std::nullptr_t) const { return p_ != nullptr; }
+
+ private:
+  T* p_;
+};
+
+}  // namespace utility
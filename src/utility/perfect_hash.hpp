@@ -0,0 +1,140 @@
+#pragma once
+#include "types.h"
+
+#include <cstddef>
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace utility {
+
+///
+/// Immutable hash table for a fixed set of string keys, built with the
+/// "hash, displace" method. Keys are grouped to buckets by a first hash, and
+/// each bucket gets a seed for a second hash that maps all of it's keys to
+/// free slots. A lookup computes two hashes and compares the key in a single
+/// slot, without probing.
+///
+template <typename V>
+class PerfectHashTable {
+ public:
+  using item_t = std::pair<std::string, V>;
+
+  PerfectHashTable() = default;
+
+  /// @param items key-value pairs. Keys must be unique.
+  /// @throws std::invalid_argument on duplicate keys
+  explicit PerfectHashTable(std::vector<item_t> items) {
+    const std::size_t n = items.size();
+    if (n == 0U) {
+      return;
+    }
+    std::size_t m = 1U;
+    while (m < 2U * n) {
+      m <<= 1U;
+    }
+    mask_ = static_cast<u32>(m - 1U);
+    seeds_.resize(n, 0U);
+    slots_.resize(m);
+
+    // Place largest buckets first, when there's most room available.
+    std::vector<std::vector<std::size_t>> buckets(n);
+    for (std::size_t i = 0U; i < n; i++) {
+      buckets[bucket(items[i].first)].push_back(i);
+    }
+    std::vector<std::size_t> order(n);
+    std::iota(order.begin(), order.end(), 0U);
+    std::stable_sort(order.begin(), order.end(),
+                     [&buckets](auto a, auto b) {
+                       return buckets[a].size() > buckets[b].size();
+                     });
+
+    std::vector<std::size_t> pos;
+    for (auto b : order) {
+      const auto& keys = buckets[b];
+      if (keys.empty()) {
+        break;
+      }
+      u32 seed = 1U;
+      for (; seed < max_seed; seed++) {
+        if (try_place(items, keys, seed, &pos)) {
+          break;
+        }
+      }
+      if (seed == max_seed) {
+        throw std::invalid_argument(
+            "failed to build hash table: duplicate keys?");
+      }
+      seeds_[b] = seed;
+      for (std::size_t i = 0U; i < keys.size(); i++) {
+        slots_[pos[i]] = {true, std::move(items[keys[i]])};
+      }
+    }
+  }
+
+  /// Return pointer to the value of key, or nullptr if the key doesn't exist.
+  const V* find(const std::string_view key) const {
+    if (slots_.empty()) {
+      return nullptr;
+    }
+    const auto& s = slots_[slot(key, seeds_[bucket(key)])];
+    return s.used && s.item.first == key ? &s.item.second : nullptr;
+  }
+
+  std::size_t size() const { return seeds_.size(); }
+
+ private:
+  static constexpr u32 max_seed = 1U << 20U;
+
+  struct Slot {
+    bool used;
+    item_t item;
+  };
+
+  /// Seeded FNV-1a with a final avalanche step.
+  static u32 hash(const std::string_view s, const u32 seed) {
+    u32 h = 2166136261U ^ (seed * 0x9e3779b9U);
+    for (const char c : s) {
+      h ^= static_cast<unsigned char>(c);
+      h *= 16777619U;
+    }
+    h ^= h >> 16U;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13U;
+    return h;
+  }
+
+  std::size_t bucket(const std::string_view key) const {
+    return hash(key, 0U) % seeds_.size();
+  }
+
+  std::size_t slot(const std::string_view key, const u32 seed) const {
+    return hash(key, seed) & mask_;
+  }
+
+  bool try_place(const std::vector<item_t>& items,
+                 const std::vector<std::size_t>& keys, const u32 seed,
+                 std::vector<std::size_t>* pos) const {
+    pos->clear();
+    for (auto i : keys) {
+      const auto p = slot(items[i].first, seed);
+      if (slots_[p].used ||
+          std::find(pos->begin(), pos->end(), p) != pos->end()) {
+        return false;
+      }
+      pos->push_back(p);
+    }
+    return true;
+  }
+
+  u32 mask_{0U};
+  std::vector<u32> seeds_;
+  std::vector<Slot> slots_;
+};
+
+}  // namespace utility
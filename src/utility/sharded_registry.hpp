@@ -0,0 +1,122 @@
+#pragma once
+#include "types.h"
+
+#include <cstddef>
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+namespace utility {
+
+///
+/// Map of shared objects split into N shards. Each shard holds an immutable
+/// snapshot of it's map, which is replaced on every update (copy-on-write).
+/// Readers only load the current snapshot, so lookups never wait for inserts
+/// or removals. Updates are serialized per shard with a timed mutex, and
+/// failed acquire attempts are counted in stats().
+///
+/// Intended for maps that are read frequently but updated rarely.
+///
+template <typename K, typename V, std::size_t N = 16U>
+class ShardedRegistry {
+ public:
+  using value_ptr = std::shared_ptr<V>;
+  using map_t = std::map<K, value_ptr>;
+
+  struct Stats {
+    /// Number of inserts and removals
+    std::size_t updates;
+    /// Number of updates that had to wait for the shard lock
+    std::size_t update_waits;
+  };
+
+  explicit ShardedRegistry(const duration_t update_timeout)
+      : update_timeout_(update_timeout), updates_(0U), update_waits_(0U) {
+    for (auto& s : shards_) {
+      s.map = std::make_shared<const map_t>();
+    }
+  }
+
+  ShardedRegistry(const ShardedRegistry&) = delete;
+  ShardedRegistry& operator=(const ShardedRegistry&) = delete;
+
+  /// Return the object with given key, or nullptr if it doesn't exist.
+  value_ptr find(const K& k) const {
+    auto m = snapshot(shard(k));
+    auto it = m->find(k);
+    return it != m->end() ? it->second : nullptr;
+  }
+
+  /// Insert object with given key. Returns false if the key already exists.
+  bool insert(const K& k, value_ptr v) {
+    return update(k, [&](map_t* m) { return m->try_emplace(k, v).second; });
+  }
+
+  /// Remove object with given key. Returns false if the key doesn't exist.
+  bool erase(const K& k) {
+    return update(k, [&](map_t* m) { return m->erase(k) > 0U; });
+  }
+
+  /// Invoke fn(key, value) for every object. Shards are visited one at a time,
+  /// so concurrent updates to other shards may or may not be visible.
+  void for_each(std::function<void(const K&, const value_ptr&)> fn) const {
+    for (const auto& s : shards_) {
+      auto m = snapshot(s);
+      for (const auto& [k, v] : *m) {
+        fn(k, v);
+      }
+    }
+  }
+
+  Stats stats() const { return {updates_.load(), update_waits_.load()}; }
+
+ private:
+  struct Shard {
+    std::shared_ptr<const map_t> map;
+    std::timed_mutex m;
+  };
+
+  Shard& shard(const K& k) { return shards_[std::hash<K>()(k) % N]; }
+
+  const Shard& shard(const K& k) const {
+    return shards_[std::hash<K>()(k) % N];
+  }
+
+  static std::shared_ptr<const map_t> snapshot(const Shard& s) {
+    return std::atomic_load(&s.map);
+  }
+
+  /// Apply fn to a copy of the shard's map, and publish the copy if fn
+  /// returns true.
+  template <typename Fn>
+  bool update(const K& k, Fn fn) {
+    auto& s = shard(k);
+    std::unique_lock<std::timed_mutex> l(s.m, std::try_to_lock);
+    if (!l.owns_lock()) {
+      update_waits_++;
+      if (!l.try_lock_for(update_timeout_)) {
+        throw std::runtime_error("failed to acquire registry shard");
+      }
+    }
+    auto m = std::make_shared<map_t>(*snapshot(s));
+    if (!fn(m.get())) {
+      return false;
+    }
+    std::atomic_store(&s.map, std::shared_ptr<const map_t>(std::move(m)));
+    updates_++;
+    return true;
+  }
+
+  duration_t update_timeout_;
+  std::array<Shard, N> shards_;
+  std::atomic<std::size_t> updates_;
+  std::atomic<std::size_t> update_waits_;
+};
+
+}  // namespace utility
@@ -1,6 +1,7 @@
 #pragma once
 #include "types.h"
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
@@ -89,6 +90,14 @@ class AtomicVariable {
     return v_;
   }
 
+  /// Modify the value with fn(T*) and notify waiters.
+  template <typename Fn>
+  void update(Fn fn) {
+    std::unique_lock<MutexT> l(m_);
+    fn(&v_);
+    cv_.notify_all();
+  }
+
   auto acquire() { return util::acquire(&v_, &m_); }
 
  private:
@@ -97,4 +106,105 @@ class AtomicVariable {
   std::condition_variable cv_;
 };
 
+///
+/// Lightweight thread parking primitive for a single waiting thread. park()
+/// blocks until another thread calls unpark(). An unpark() that happens before
+/// park() is remembered, so wakeups are never lost. unpark() only touches the
+/// mutex if the consumer is actually parked.
+///
+class Parker {
+  enum State : int { EMPTY = 0, PARKED, NOTIFIED };
+
+ public:
+  Parker() : state_(EMPTY) {}
+
+  void park() {
+    // Fast path: consume pending notification
+    if (state_.exchange(EMPTY, std::memory_order_acquire) == NOTIFIED) {
+      return;
+    }
+    std::unique_lock<std::mutex> l(m_);
+    int expected = EMPTY;
+    if (!state_.compare_exchange_strong(expected, PARKED,
+                                        std::memory_order_acq_rel)) {
+      // Notified between the exchange and taking the lock
+      state_.store(EMPTY, std::memory_order_release);
+      return;
+    }
+    cv_.wait(l, [this]() {
+      return state_.load(std::memory_order_acquire) == NOTIFIED;
+    });
+    state_.store(EMPTY, std::memory_order_release);
+  }
+
+  void unpark() {
+    if (state_.exchange(NOTIFIED, std::memory_order_release) == PARKED) {
+      // Synchronize with the parked thread before notifying
+      std::unique_lock<std::mutex> l(m_);
+      l.unlock();
+      cv_.notify_one();
+    }
+  }
+
+ private:
+  std::atomic<int> state_;
+  std::mutex m_;
+  std::condition_variable cv_;
+};
+
+///
+/// Shared mutex that prefers exclusive owners. Once a thread waits in lock(),
+/// new shared owners wait until it has released the lock, so that a steady
+/// stream of shared owners can't starve it. Meets the SharedMutex
+/// requirements, so it can be used with std::unique_lock and
+/// std::shared_lock.
+///
+class WriterPreferringMutex {
+ public:
+  WriterPreferringMutex()
+      : readers_(0U), writers_waiting_(0U), writer_(false) {}
+  WriterPreferringMutex(const WriterPreferringMutex&) = delete;
+  WriterPreferringMutex& operator=(const WriterPreferringMutex&) = delete;
+
+  void lock() {
+    std::unique_lock<std::mutex> l(m_);
+    writers_waiting_++;
+    cv_.wait(l, [this]() { return !writer_ && readers_ == 0U; });
+    writers_waiting_--;
+    writer_ = true;
+  }
+
+  void unlock() {
+    {
+      std::unique_lock<std::mutex> l(m_);
+      writer_ = false;
+    }
+    cv_.notify_all();
+  }
+
+  void lock_shared() {
+    std::unique_lock<std::mutex> l(m_);
+    cv_.wait(l, [this]() { return !writer_ && writers_waiting_ == 0U; });
+    readers_++;
+  }
+
+  void unlock_shared() {
+    bool notify = false;
+    {
+      std::unique_lock<std::mutex> l(m_);
+      notify = --readers_ == 0U && writers_waiting_ > 0U;
+    }
+    if (notify) {
+      cv_.notify_all();
+    }
+  }
+
+ private:
+  std::mutex m_;
+  std::condition_variable cv_;
+  unsigned readers_;
+  unsigned writers_waiting_;
+  bool writer_;
+};
+
 }  // namespace util
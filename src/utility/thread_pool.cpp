@@ -0,0 +1,154 @@
+#include "utility/thread_pool.hpp"
+
+#include "logging.hpp"
+
+#include <exception>
+#include <utility>
+
+using namespace utility;
+
+namespace {
+// Identifies the pool and worker index of the current thread
+thread_local ThreadPool* tl_pool = nullptr;
+thread_local std::size_t tl_index = 0U;
+}  // namespace
+
+ThreadPool::ThreadPool(const std::size_t num_threads)
+    : next_(0U), pending_(0U), idle_(0U), active_(true) {
+  const std::size_t n = num_threads > 0U ? num_threads : 1U;
+  for (std::size_t i = 0U; i < n; i++) {
+    workers_.emplace_back(std::make_unique<Worker>());
+  }
+  for (std::size_t i = 0U; i < n; i++) {
+    threads_.emplace_back([this, i]() { worker(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> l(sleep_m_);
+    active_ = false;
+  }
+  sleep_cv_.notify_all();
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+void ThreadPool::post(task_t task) {
+  const std::size_t i =
+      tl_pool == this ? tl_index : (next_++ % workers_.size());
+  // Increment before publishing, so that pending_ never underflows
+  pending_++;
+  {
+    auto& w = *workers_[i];
+    std::unique_lock<std::mutex> l(w.m);
+    w.q.emplace_back(std::move(task));
+  }
+  if (idle_.load() > 0U) {
+    std::unique_lock<std::mutex> l(sleep_m_);
+    l.unlock();
+    sleep_cv_.notify_one();
+  }
+}
+
+std::size_t ThreadPool::size() const { return workers_.size(); }
+
+bool ThreadPool::try_pop(const std::size_t index, task_t* dst) {
+  // Own queue first (oldest task), then steal newest tasks from others.
+  for (std::size_t k = 0U; k < workers_.size(); k++) {
+    auto& w = *workers_[(index + k) % workers_.size()];
+    std::unique_lock<std::mutex> l(w.m);
+    if (w.q.empty()) {
+      continue;
+    }
+    if (k == 0U) {
+      *dst = std::move(w.q.front());
+      w.q.pop_front();
+    } else {
+      *dst = std::move(w.q.back());
+      w.q.pop_back();
+    }
+    pending_--;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::worker(const std::size_t index) {
+  tl_pool = this;
+  tl_index = index;
+  task_t task;
+  while (true) {
+    if (try_pop(index, &task)) {
+      try {
+        task();
+      } catch (const std::exception& e) {
+        eprintf("task: {}", e.what());
+      }
+      task = nullptr;
+      continue;
+    }
+    std::unique_lock<std::mutex> l(sleep_m_);
+    idle_++;
+    sleep_cv_.wait(l, [this]() { return pending_.load() > 0U || !active_; });
+    idle_--;
+    if (!active_ && pending_.load() == 0U) {
+      break;
+    }
+  }
+}
+
+Strand::Strand(ThreadPool* pool)
+    : pool_(pool), current_(pool), scheduled_(false) {}
+
+void Strand::post(ThreadPool::task_t task, ThreadPool* pool) {
+  std::unique_lock<std::mutex> l(m_);
+  q_.emplace_back(std::move(task), pool);
+  if (!scheduled_) {
+    scheduled_ = true;
+    self_ = shared_from_this();
+    current_ = pool != nullptr ? pool : pool_;
+    auto* p = current_;
+    l.unlock();
+    p->post([this]() { run(); });
+  }
+}
+
+void Strand::run() {
+  for (std::size_t n = 0U; n < max_batch; n++) {
+    ThreadPool::task_t task;
+    {
+      std::unique_lock<std::mutex> l(m_);
+      if (q_.empty()) {
+        scheduled_ = false;
+        // May destroy this object
+        auto keep = std::move(self_);
+        l.unlock();
+        return;
+      }
+      auto* pool = q_.front().second;
+      if (pool != nullptr && pool != current_) {
+        // Continue in the pool requested by the task
+        current_ = pool;
+        l.unlock();
+        pool->post([this]() { run(); });
+        return;
+      }
+      task = std::move(q_.front().first);
+      q_.pop_front();
+    }
+    try {
+      task();
+    } catch (const std::exception& e) {
+      eprintf("strand task: {}", e.what());
+    }
+  }
+  // Let other strands run, then continue
+  ThreadPool* pool = nullptr;
+  {
+    std::unique_lock<std::mutex> l(m_);
+    pool = current_;
+  }
+  pool->post([this]() { run(); });
+}
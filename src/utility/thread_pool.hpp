@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace utility {
+
+///
+/// Fixed size work-stealing thread pool. Each worker has it's own task deque.
+/// Tasks posted from a worker thread go to that worker's deque, other tasks
+/// are distributed round-robin. Idle workers steal tasks from the others.
+///
+/// The destructor finishes all queued tasks before joining the workers.
+///
+class ThreadPool {
+ public:
+  using task_t = std::function<void()>;
+
+  explicit ThreadPool(const std::size_t num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /// Submit a task for execution. Can be called from any thread.
+  void post(task_t task);
+
+  std::size_t size() const;
+
+ private:
+  struct Worker {
+    std::mutex m;
+    std::deque<task_t> q;
+  };
+
+  void worker(const std::size_t index);
+  bool try_pop(const std::size_t index, task_t* dst);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::atomic<std::size_t> next_;
+  std::atomic<std::size_t> pending_;
+  std::atomic<std::size_t> idle_;
+  std::atomic_bool active_;
+  std::mutex sleep_m_;
+  std::condition_variable sleep_cv_;
+};
+
+///
+/// Executes tasks posted to it in order, one at a time, using threads from a
+/// ThreadPool. Different strands can run in parallel. Must be held in a
+/// shared_ptr, since scheduled tasks keep a reference to the strand.
+///
+class Strand : public std::enable_shared_from_this<Strand> {
+ public:
+  /// Maximum number of tasks to run before yielding the pool thread to other
+  /// strands.
+  static constexpr std::size_t max_batch = 32U;
+
+  explicit Strand(ThreadPool* pool);
+
+  ///
+  /// Post a task. If pool is set, the task is executed in that pool instead
+  /// of the strand's own, still in order with the other tasks. The strand
+  /// then keeps running in that pool until it runs out of tasks, so a pool
+  /// must not be destroyed before the pools posting to it.
+  ///
+  void post(ThreadPool::task_t task, ThreadPool* pool = nullptr);
+
+ private:
+  void run();
+
+  ThreadPool* pool_;
+  std::mutex m_;
+  /// Tasks and the pool they must run in, if any
+  std::deque<std::pair<ThreadPool::task_t, ThreadPool*>> q_;
+  /// Pool the strand is scheduled in
+  ThreadPool* current_;
+  bool scheduled_;
+  // Keeps the strand alive while it's scheduled. Avoids capturing shared_ptr
+  // in the pool task, which would not fit in std::function's local storage.
+  std::shared_ptr<Strand> self_;
+};
+
+}  // namespace utility
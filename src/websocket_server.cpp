@@ -1,7 +1,9 @@
 #include "websocket_server.hpp"
 
 #include "asio_utils.hpp"
+#include "config.hpp"
 #include "logging.hpp"
+#include "utility/thread_pool.hpp"
 #include "utility/time.hpp"
 
 #include <websocketpp/common/asio.hpp>
@@ -14,7 +16,9 @@
 #include <exception>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <regex>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -47,11 +51,12 @@ struct WSReplyImpl : public WSReply {
 
 WebsocketServer::WebsocketServer(WebsocketServer::Options o,
                                  ra2yrcpp::asio_utils::IOService* service,
-                                 Callbacks cb)
+                                 utility::ThreadPool* pool, Callbacks cb)
     : opts(o),
       service_(service),
       cb_(cb),
-      server_(std::make_unique<server_impl>()) {
+      server_(std::make_unique<server_impl>()),
+      pool_(pool) {
   auto& s = *server_.get();
   s.set_message_handler([&](connection_hdl h, auto msg) {
     if (msg->get_opcode() == websocketpp::frame::opcode::text) {
@@ -59,8 +64,7 @@ WebsocketServer::WebsocketServer(WebsocketServer::Options o,
       return;
     }
     try {
-      WSReplyImpl R(msg);
-      send_response(h, &R);
+      send_response(h, std::make_shared<WSReplyImpl>(msg));
     } catch (const std::exception& e) {
       eprintf("error while handling message: {}", e.what());
     }
@@ -86,6 +90,7 @@ WebsocketServer::WebsocketServer(WebsocketServer::Options o,
 
   s.set_validate_handler([&](connection_hdl) {
     try {
+      std::unique_lock<std::mutex> l(mut_conns_);
       if (ws_conns.size() >= opts.max_connections) {
         eprintf("max connections {} exceeded", ws_conns.size());
         return false;
@@ -102,6 +107,7 @@ WebsocketServer::WebsocketServer(WebsocketServer::Options o,
     try {
       const auto socket_id = s.get_socket_id(h);
       cb_.close(socket_id);
+      std::unique_lock<std::mutex> l(mut_conns_);
       (void)ws_conns.erase(socket_id);
       iprintf("closed conn {}", socket_id);
     } catch (const std::exception& e) {
@@ -109,7 +115,6 @@ WebsocketServer::WebsocketServer(WebsocketServer::Options o,
     }
   });
 
-  // TODO(shmocz): thread safety
   s.set_open_handler([&](connection_hdl h) {
     try {
       add_connection(h);
@@ -119,10 +124,9 @@ WebsocketServer::WebsocketServer(WebsocketServer::Options o,
     }
   });
 
-  // TODO(shmocz): thread safety
   s.set_interrupt_handler([&](connection_hdl h) {
-    std::size_t count = 0;
-    if ((count = ws_conns.erase(s.get_socket_id(h))) < 1) {
+    std::unique_lock<std::mutex> l(mut_conns_);
+    if (ws_conns.erase(s.get_socket_id(h)) < 1U) {
       wrprintf("got interrupt, but no connections were removed");
     }
   });
@@ -131,31 +135,36 @@ WebsocketServer::WebsocketServer(WebsocketServer::Options o,
   s.set_http_handler([&](connection_hdl h) {
     auto con = s.get_con_from_hdl(h);
     const auto id = s.get_socket_id(h);
-    if (ws_conns.find(id) != ws_conns.end()) {
+    if (strand(id) != nullptr) {
       eprintf("duplicate connection {}", id);
       return;
     }
     add_connection(h);
     cb_.accept(id);
 
-    ws_conns[id].buffer = con->get_request_body();
     con->defer_http_response();
-    ws_conns[id].executor->push(0, [this, con, id](int) {
-      auto resp = cb_.receive(id, &ws_conns[id].buffer);
-      service_->post(
-          [this, con, resp, id]() {
-            try {
-              con->set_body(resp);
-              con->set_status(websocketpp::http::status_code::ok);
-              con->send_http_response();
-              cb_.close(id);
-            } catch (const std::exception& e) {
-              eprintf("couldn't send http response: {}", e.what());
-            }
-            con->interrupt();
-          },
-          true);
-    });
+    auto* pool = cb_.executor != nullptr
+                     ? cb_.executor(id, con->get_request_body())
+                     : nullptr;
+    strand(id)->post(
+        [this, con, id]() {
+          std::string resp;
+          cb_.receive(id, con->get_request_body(), &resp);
+          service_->post(
+              [this, con, resp = std::move(resp), id]() {
+                try {
+                  con->set_body(resp);
+                  con->set_status(websocketpp::http::status_code::ok);
+                  con->send_http_response();
+                  cb_.close(id);
+                } catch (const std::exception& e) {
+                  eprintf("couldn't send http response: {}", e.what());
+                }
+                con->interrupt();
+              },
+              true);
+        },
+        pool);
   });
 
   s.clear_access_channels(websocketpp::log::alevel::frame_payload |
@@ -175,35 +184,78 @@ void WebsocketServer::shutdown() {
 
   // Close WebSocket connections
   service_->post([&]() {
-    for (auto& [k, v] : ws_conns) {
+    std::map<unsigned int, SocketEntry> conns;
+    {
+      // Closing may invoke the close handler, so don't hold the lock.
+      std::unique_lock<std::mutex> l(mut_conns_);
+      conns.swap(ws_conns);
+    }
+    for (auto& [k, v] : conns) {
       auto cptr = server_->get_con_from_hdl(v.hdl);
       if (cptr->get_state() == websocketpp::session::state::open) {
         server_->close(v.hdl, websocketpp::close::status::normal, "");
       }
     }
-    ws_conns.clear();
   });
 }
 
-void WebsocketServer::send_response(connection_hdl h, WSReply* msg) {
+void WebsocketServer::send_response(connection_hdl h,
+                                    std::shared_ptr<WSReply> msg) {
   auto op = static_cast<websocketpp::frame::opcode::value>(msg->get_opcode());
   auto id = server_->get_socket_id(h);
+  // The response is written directly to the outgoing message's buffer
+  auto out = server_->get_con_from_hdl(h)->get_message(op, 0U);
 
-  ws_conns[id].buffer = msg->get_payload();
-
-  ws_conns[id].executor->push(0, [this, op, id](int) {
-    auto& c = ws_conns[id];
-    auto resp = cb_.receive(id, &c.buffer);
+  auto task = [this, h, id, msg, out]() {
+    cb_.receive(id, msg->get_payload(), &out->get_raw_payload());
     service_->post(
-        [this, &c, resp, op]() {
+        [this, h, out]() {
           try {
-            server_->send(c.hdl, resp, op);
+            server_->send(h, out);
           } catch (...) {
             eprintf("failed to send");
           }
         },
         true);
-  });
+  };
+  auto* pool =
+      cb_.executor != nullptr ? cb_.executor(id, msg->get_payload()) : nullptr;
+  if (cb_.ordered != nullptr && !cb_.ordered(id, msg->get_payload())) {
+    (pool != nullptr ? pool : pool_)->post(task);
+  } else if (auto st = strand(id)) {
+    st->post(task, pool);
+  } else {
+    eprintf("no such connection {}", id);
+  }
+}
+
+bool WebsocketServer::push(const socket_t id,
+                           std::shared_ptr<const std::string> msg) {
+  connection_hdl h;
+  {
+    std::unique_lock<std::mutex> l(mut_conns_);
+    auto it = ws_conns.find(id);
+    if (it == ws_conns.end()) {
+      return false;
+    }
+    h = it->second.hdl;
+  }
+  lib::error_code ec;
+  auto con = server_->get_con_from_hdl(h, ec);
+  if (ec || con->get_buffered_amount() > cfg::PUSH_MAX_PENDING_BYTES) {
+    return false;
+  }
+  service_->post(
+      [this, h, msg]() {
+        lib::error_code ec;
+        server_->send(h, msg->data(), msg->size(),
+                      websocketpp::frame::opcode::binary, ec);
+        if (ec) {
+          eprintf("failed to push: {}", ec.message());
+        }
+      },
+      true);
+  return true;
 }
 
 void WebsocketServer::start() {
@@ -216,13 +268,20 @@ void WebsocketServer::start() {
 }
 
 void WebsocketServer::add_connection(connection_hdl h) {
-  ws_conns[server_->get_socket_id(h)] = {
-      h, util::current_time(), "",
-      std::make_unique<utility::worker_util<int>>(nullptr, 5)};
+  const auto id = server_->get_socket_id(h);
+  std::unique_lock<std::mutex> l(mut_conns_);
+  ws_conns[id] = {h, util::current_time(),
+                  std::make_shared<utility::Strand>(pool_)};
+}
+
+std::shared_ptr<utility::Strand> WebsocketServer::strand(const socket_t id) {
+  std::unique_lock<std::mutex> l(mut_conns_);
+  auto it = ws_conns.find(id);
+  return it != ws_conns.end() ? it->second.strand : nullptr;
 }
 
 std::unique_ptr<WebsocketServer> ra2yrcpp::websocket_server::create_server(
     WebsocketServer::Options o, ra2yrcpp::asio_utils::IOService* service,
-    WebsocketServer::Callbacks cb) {
-  return std::make_unique<WebsocketServer>(o, service, cb);
+    utility::ThreadPool* pool, WebsocketServer::Callbacks cb) {
+  return std::make_unique<WebsocketServer>(o, service, pool, cb);
 }
@@ -1,11 +1,11 @@
 #pragma once
-#include "auto_thread.hpp"
-
 #include <chrono>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 
 namespace ra2yrcpp {
 namespace asio_utils {
@@ -13,6 +13,11 @@ class IOService;
 }
 }  // namespace ra2yrcpp
 
+namespace utility {
+class ThreadPool;
+class Strand;
+}  // namespace utility
+
 namespace ra2yrcpp {
 
 namespace websocket_server {
@@ -30,8 +35,8 @@ struct WSReply {
 struct SocketEntry {
   connection_hdl hdl;
   std::chrono::system_clock::time_point timestamp;
-  std::string buffer;
-  std::unique_ptr<utility::worker_util<int>> executor;
+  /// Executes ordered messages of this connection in the shared thread pool.
+  std::shared_ptr<utility::Strand> strand;
 };
 
 class WebsocketServer {
@@ -43,41 +48,80 @@ class WebsocketServer {
     unsigned port;
     unsigned max_connections;
     std::string allowed_hosts_regex;
+    /// Number of threads running the asio service
+    unsigned io_threads;
+    /// Number of threads processing messages of all connections. The pool is
+    /// owned by InstrumentationService and shared with other listeners.
+    unsigned worker_threads;
+    /// Number of threads processing requests that wait for command results,
+    /// shared by all connections.
+    unsigned blocking_threads;
   };
 
   struct Callbacks {
-    std::function<std::string(socket_t, std::string*)> receive;
+    /// Handle a received message and write the response to the given buffer.
+    /// The message is only valid for the duration of the call.
+    std::function<void(socket_t, std::string_view, std::string*)> receive;
     std::function<void(socket_t)> accept;
     std::function<void(socket_t)> close;
+    /// Return true if the message must be processed in order with respect to
+    /// other ordered messages of the same connection. Other messages are
+    /// processed concurrently and their responses may be sent in any order.
+    /// If not set, all messages are ordered.
+    std::function<bool(socket_t, std::string_view)> ordered;
+    /// Return the pool executing the message, or nullptr to use the server's
+    /// pool. Lets messages that may block for a long time, such as waits for
+    /// command results, run without holding up the other messages. If not
+    /// set, the server's pool is used.
+    std::function<utility::ThreadPool*(socket_t, std::string_view)> executor;
   };
 
   WebsocketServer() = delete;
+  /// @param o options
+  /// @param service service used for socket I/O
+  /// @param pool pool executing the callbacks
+  /// @param cb callbacks
   WebsocketServer(WebsocketServer::Options o,
-                  ra2yrcpp::asio_utils::IOService* service, Callbacks cb);
+                  ra2yrcpp::asio_utils::IOService* service,
+                  utility::ThreadPool* pool, Callbacks cb);
   ~WebsocketServer();
 
   ///
   void start();
   /// Shutdown all active connections and stop accepting new connections.
   void shutdown();
-  /// Send a reply for a previously received message. Must be used within
-  /// io_service's thread.
-  void send_response(connection_hdl h, WSReply* msg);
+  /// Send a reply for a previously received message. The message is kept
+  /// alive until it's been processed, so it's payload isn't copied. Must be
+  /// used within io_service's thread.
+  void send_response(connection_hdl h, std::shared_ptr<WSReply> msg);
+
+  /// Send a message to the given connection outside of the request/response
+  /// cycle. Can be called from any thread.
+  /// @return false if the connection doesn't exist, or has too much unsent
+  /// data
+  bool push(const socket_t id, std::shared_ptr<const std::string> msg);
 
   /// Add a recently accepted connection to internal connection list.
   void add_connection(connection_hdl h);
+  /// Return strand of the given connection, or nullptr if it doesn't exist.
+  std::shared_ptr<utility::Strand> strand(const socket_t id);
 
   WebsocketServer::Options opts;
+  /// Handlers may run in multiple io threads, so access is guarded by
+  /// mut_conns_.
   std::map<unsigned int, SocketEntry> ws_conns;
+  std::mutex mut_conns_;
   ra2yrcpp::asio_utils::IOService* service_;
   Callbacks cb_;
   class server_impl;
   std::unique_ptr<server_impl> server_;
+  /// Executes messages of all connections.
+  utility::ThreadPool* pool_;
 };
 
 std::unique_ptr<WebsocketServer> create_server(
     WebsocketServer::Options o, ra2yrcpp::asio_utils::IOService* service,
-    WebsocketServer::Callbacks cb);
+    utility::ThreadPool* pool, WebsocketServer::Callbacks cb);
 }  // namespace websocket_server
 
 }  // namespace ra2yrcpp
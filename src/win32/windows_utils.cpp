@@ -11,6 +11,8 @@
 typedef void* HWND;
 
 #include <direct.h>
+#include <errhandlingapi.h>
+#include <fileapi.h>
 #include <handleapi.h>
 #include <libloaderapi.h>
 #include <malloc.h>
@@ -21,6 +23,7 @@ typedef void* HWND;
 #include <synchapi.h>
 #include <tlhelp32.h>
 #include <winbase.h>
+#include <winerror.h>
 
 #include <functional>
 #include <memory>
@@ -150,6 +153,69 @@ int windows_utils::read_memory(void* handle, void* dest, const void* src,
 
 int windows_utils::close_handle(void* handle) { return CloseHandle(handle); }
 
+void* windows_utils::create_file_mapping(const std::string name,
+                                         const std::size_t size) {
+  const auto s = static_cast<unsigned long long>(size);
+  return CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                            static_cast<DWORD>(s >> 32U),
+                            static_cast<DWORD>(s & 0xFFFFFFFFU), name.c_str());
+}
+
+void* windows_utils::open_file_mapping(const std::string name) {
+  return OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+}
+
+void* windows_utils::map_view_of_file(void* handle, std::size_t* size) {
+  auto* p = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+  MEMORY_BASIC_INFORMATION mbi{};
+  if (p != nullptr && VirtualQuery(p, &mbi, sizeof(mbi)) != 0U) {
+    *size = mbi.RegionSize;
+  }
+  return p;
+}
+
+int windows_utils::unmap_view_of_file(void* address) {
+  return UnmapViewOfFile(address);
+}
+
+void* windows_utils::open_file_read(const std::string path, std::size_t* size) {
+  auto* h = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (h == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+  LARGE_INTEGER s{};
+  if (GetFileSizeEx(h, &s) == 0) {
+    CloseHandle(h);
+    return nullptr;
+  }
+  *size = static_cast<std::size_t>(s.QuadPart);
+  return h;
+}
+
+void* windows_utils::create_file_mapping_read(void* file) {
+  return CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+}
+
+void* windows_utils::map_view_of_file_read(void* handle) {
+  return MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0);
+}
+
+void* windows_utils::create_event(const std::string name) {
+  return CreateEventA(nullptr, FALSE, FALSE, name.c_str());
+}
+
+void* windows_utils::open_event(const std::string name) {
+  return OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, name.c_str());
+}
+
+int windows_utils::set_event(void* handle) { return SetEvent(handle); }
+
+bool windows_utils::wait_for_object(void* handle,
+                                    const unsigned long timeout_ms) {
+  return WaitForSingleObject(handle, timeout_ms) == WAIT_OBJECT_0;
+}
+
 static DWORD vprotect(void* address, const std::size_t size,
                       const DWORD protection) {
   DWORD prot_old{};
@@ -187,6 +253,17 @@ unsigned long windows_utils::get_pid(void* handle) {
   return GetProcessId(handle);
 }
 
+bool windows_utils::process_alive(unsigned long pid) {
+  void* h = OpenProcess(SYNCHRONIZE, FALSE, pid);
+  if (h == nullptr) {
+    // Other errors, such as access denied, mean that the process exists
+    return GetLastError() != ERROR_INVALID_PARAMETER;
+  }
+  const bool exited = WaitForSingleObject(h, 0U) == WAIT_OBJECT_0;
+  CloseHandle(h);
+  return !exited;
+}
+
 void windows_utils::for_each_thread(
     std::function<void(ThreadEntry*)> callback) {
   void* hSnapshot =
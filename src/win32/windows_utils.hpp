@@ -68,6 +68,26 @@ int write_memory(void* handle, void* dest, const void* src,
                  const std::size_t size);
 int write_memory_local(void* dest, const void* src, const std::size_t size);
 unsigned long get_pid(void* handle);
+/// Return true unless the process with given id is known to have exited.
+bool process_alive(unsigned long pid);
 void for_each_thread(std::function<void(ThreadEntry*)> callback);
+/// Create a named, pagefile backed file mapping.
+void* create_file_mapping(const std::string name, const std::size_t size);
+void* open_file_mapping(const std::string name);
+/// Map whole file mapping to the address space and return the view's size.
+void* map_view_of_file(void* handle, std::size_t* size);
+int unmap_view_of_file(void* address);
+/// Open an existing file for reading and get it's size.
+void* open_file_read(const std::string path, std::size_t* size);
+/// Create an unnamed read-only mapping of an open file.
+void* create_file_mapping_read(void* file);
+/// Map whole read-only file mapping to the address space.
+void* map_view_of_file_read(void* handle);
+/// Create a named auto-reset event.
+void* create_event(const std::string name);
+void* open_event(const std::string name);
+int set_event(void* handle);
+/// Wait until object is signaled. Returns false on timeout or failure.
+bool wait_for_object(void* handle, const unsigned long timeout_ms);
 
 }  // namespace windows_utils
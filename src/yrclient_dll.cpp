@@ -10,16 +10,30 @@
 
 static void* g_context = nullptr;
 
+/// Read an unsigned value from environment, or return default_value if the
+/// variable isn't set.
+static unsigned env_unsigned(const char* name, const unsigned default_value) {
+  const auto* v = std::getenv(name);
+  return v != nullptr ? static_cast<unsigned>(std::stoul(v)) : default_value;
+}
+
 void ra2yrcpp::initialize(const unsigned int max_clients,
                           const unsigned int port, const bool no_init_hooks) {
   static std::mutex g_lock;
   g_lock.lock();
   auto* h = std::getenv("RA2YRCPP_ALLOWED_HOSTS_REGEX");
+  auto* shm_name = std::getenv("RA2YRCPP_SHM_NAME");
   if (g_context == nullptr) {
     ra2yrcpp::InstrumentationService::Options O{
         {cfg::SERVER_ADDRESS, port, max_clients,
-         (h != nullptr ? h : cfg::ALLOWED_HOSTS_REGEX)},
-        no_init_hooks};
+         (h != nullptr ? h : cfg::ALLOWED_HOSTS_REGEX),
+         env_unsigned("RA2YRCPP_IO_THREADS", cfg::SERVER_IO_THREADS),
+         env_unsigned("RA2YRCPP_WORKER_THREADS", cfg::SERVER_WORKER_THREADS),
+         env_unsigned("RA2YRCPP_BLOCKING_THREADS",
+                      cfg::SERVER_BLOCKING_THREADS)},
+        no_init_hooks,
+        env_unsigned("RA2YRCPP_TCP_PORT", cfg::TCP_SERVER_PORT),
+        (shm_name != nullptr ? shm_name : cfg::SHM_TRANSPORT_NAME)};
     g_context = is_context::get_context(O);
   }
 
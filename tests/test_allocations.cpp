@@ -0,0 +1,89 @@
+#include "command/command_manager.hpp"
+#include "command/is_command.hpp"
+#include "config.hpp"
+#include "logging.hpp"
+#include "types.h"
+
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdlib>
+
+#include <atomic>
+#include <memory>
+#include <new>
+
+using namespace ra2yrcpp;
+
+// The global allocation functions are replaced to count allocations, so this
+// test lives in its own executable.
+
+namespace {
+// Number of calls to global operator new
+std::atomic<std::size_t> n_allocations{0U};
+}  // namespace
+
+void* operator new(std::size_t n) {
+  n_allocations++;
+  if (void* p = std::malloc(n == 0U ? 1U : n)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+class AllocationTest : public ::testing::Test {
+ public:
+  using cmd_d_t = decltype(command::ISArg::M);
+  using manager_t = command::CommandManager<cmd_d_t>;
+  using cmdtype = typename manager_t::command_t;
+  std::unique_ptr<manager_t> M;
+
+ protected:
+  void SetUp() override {
+    M = std::make_unique<manager_t>();
+    M->add_command("noop", [](cmdtype*) {});
+    M->start();
+  }
+
+  void TearDown() override {
+    M->shutdown();
+    M = nullptr;
+  }
+};
+
+TEST_F(AllocationTest, SteadyStateAllocations) {
+  constexpr u64 queue_id = 1;
+  constexpr int n_warmup = 500;
+  constexpr int n_commands = 2000;
+  (void)M->execute_create_queue(queue_id, cfg::RESULT_QUEUE_SIZE);
+
+  auto run = [&](const int count) {
+    for (int j = 0; j < count; j++) {
+      auto C = M->enqueue_command(M->make_command("noop", cmd_d_t(), queue_id));
+      C->result_code().wait_pred(
+          [](command::ResultCode v) { return v != command::ResultCode::NONE; });
+    }
+    // Results are evicted from the bounded queue instead of flushed, so that
+    // the result vector doesn't count as a per-command allocation.
+  };
+
+  run(n_warmup);
+  const auto s0 = M->pool_stats();
+  const std::size_t a0 = n_allocations.load();
+  run(n_commands);
+  const std::size_t a1 = n_allocations.load();
+  const auto s1 = M->pool_stats();
+
+  const double per_command = static_cast<double>(a1 - a0) / n_commands;
+  iprintf("commands={} allocations={} per_command={:.2f} created={} reused={}",
+          n_commands, a1 - a0, per_command, s1.created - s0.created,
+          s1.reused - s0.reused);
+  // Command objects are reused in steady state. A few may be created if a
+  // result is still referenced by the worker when the next command is made.
+  ASSERT_LT(s1.created - s0.created, n_commands / 100U);
+  ASSERT_LT(per_command, 1.5);
+}
@@ -0,0 +1,590 @@
+#include "async_queue.hpp"
+#include "gtest/gtest.h"
+#include "logging.hpp"
+#include "mpmc_queue.hpp"
+#include "mpsc_queue.hpp"
+#include "ring_buffer.hpp"
+#include "shm_channel.hpp"
+#include "types.h"
+#include "utility/perfect_hash.hpp"
+#include "utility/sharded_registry.hpp"
+#include "utility/sync.hpp"
+#include "utility/thread_pool.hpp"
+#include "utility/time.hpp"
+
+#include <cstddef>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using async_queue::AsyncRandomAccessQueue;
+using mpmc_queue::MPMCQueue;
+using mpsc_queue::MPSCQueue;
+using namespace std::chrono_literals;
+using ring_buffer::RingBuffer;
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+/// Previous vector based implementation, kept as a baseline for benchmarks.
+template <typename T>
+class VectorRingBuffer {
+ public:
+  explicit VectorRingBuffer(const std::size_t max_size = -1u)
+      : max_size_(max_size) {}
+
+  void emplace(T&& t) {
+    if (size() >= max_size_) {
+      q_.erase(q_.begin());
+    }
+    q_.emplace_back(std::move(t));
+  }
+
+  void pop() { q_.pop_back(); }
+
+  T& front() { return q_.back(); }
+
+  std::size_t size() const { return q_.size(); }
+
+ private:
+  std::vector<T> q_;
+  std::size_t max_size_;
+};
+
+template <typename Q>
+double bench_push_pop(const std::size_t max_size, const std::size_t count) {
+  using item_t = std::shared_ptr<int>;
+  Q q(max_size);
+  auto item = std::make_shared<int>(0);
+  const auto t0 = std::chrono::steady_clock::now();
+  for (std::size_t i = 0U; i < count; i++) {
+    q.emplace(item_t(item));
+  }
+  while (q.size() > 0U) {
+    q.pop();
+  }
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - t0)
+      .count();
+}
+
+struct WorkItem {
+  int producer;
+  int seq;
+  clock_type::time_point ts;
+};
+
+/// Mutex + priority_queue + notify_all work queue, as previously used in
+/// CommandManager.
+struct LockedWorkQueue {
+  // Lowest producer first. Must be a strict weak ordering.
+  struct Compare {
+    bool operator()(const WorkItem& a, const WorkItem& b) const {
+      return b.producer < a.producer;
+    }
+  };
+
+  void push(WorkItem w) {
+    std::unique_lock<std::mutex> l(m);
+    q.push(w);
+    cv.notify_all();
+  }
+
+  WorkItem pop() {
+    std::unique_lock<std::mutex> l(m);
+    cv.wait(l, [this]() { return !q.empty(); });
+    auto w = q.top();
+    q.pop();
+    return w;
+  }
+
+  std::priority_queue<WorkItem, std::vector<WorkItem>, Compare> q;
+  std::mutex m;
+  std::condition_variable cv;
+};
+
+struct ParkingWorkQueue {
+  void push(WorkItem w) {
+    q.push(w);
+    p.unpark();
+  }
+
+  WorkItem pop() {
+    WorkItem w;
+    while (!q.try_pop(&w)) {
+      p.park();
+    }
+    return w;
+  }
+
+  MPSCQueue<WorkItem> q;
+  util::Parker p;
+};
+
+struct LatencyResult {
+  double mean_us;
+  double max_us;
+  double total_ms;
+};
+
+/// Measure enqueue-to-dequeue latency and total drain time with concurrent
+/// producers.
+template <typename Q>
+LatencyResult bench_latency(const int n_producers, const int n_items) {
+  Q q;
+  const auto t0 = clock_type::now();
+  std::vector<std::thread> producers;
+  for (int i = 0; i < n_producers; i++) {
+    producers.emplace_back([&q, i, n_items]() {
+      for (int j = 0; j < n_items; j++) {
+        q.push({i, j, clock_type::now()});
+        if (j % 16 == 0) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  double total = 0.0;
+  double max = 0.0;
+  for (int k = 0; k < n_producers * n_items; k++) {
+    auto w = q.pop();
+    const double l = std::chrono::duration<double, std::micro>(
+                         clock_type::now() - w.ts)
+                         .count();
+    total += l;
+    max = std::max(max, l);
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  return {total / (n_producers * n_items), max,
+          std::chrono::duration<double, std::milli>(clock_type::now() - t0)
+              .count()};
+}
+
+}  // namespace
+
+TEST(RingBufferTest, FIFOOrderAndEviction) {
+  constexpr std::size_t max_size = 5U;
+  RingBuffer<int> R(max_size);
+  ASSERT_EQ(R.capacity(), 8U);
+
+  for (int i = 0; i < 12; i++) {
+    R.push(i);
+  }
+  ASSERT_EQ(R.size(), max_size);
+  ASSERT_EQ(R.evicted(), 7U);
+  ASSERT_EQ(R.back(), 11);
+
+  for (int i = 7; i < 12; i++) {
+    ASSERT_EQ(R.front(), i);
+    R.pop();
+  }
+  ASSERT_TRUE(R.empty());
+
+  // Wrap around after partial drain
+  for (int i = 0; i < 3; i++) {
+    R.push(i);
+  }
+  R.pop();
+  R.push(3);
+  ASSERT_EQ(R.front(), 1);
+  ASSERT_EQ(R.size(), 3U);
+}
+
+TEST(RingBufferTest, EmptyAndZeroSize) {
+  RingBuffer<int> R(0U);
+  ASSERT_THROW(R.pop(), std::out_of_range);
+  ASSERT_THROW(R.pop_back(), std::out_of_range);
+  R.push(1);
+  ASSERT_TRUE(R.empty());
+  ASSERT_EQ(R.evicted(), 1U);
+  ASSERT_THROW(R.pop(), std::out_of_range);
+}
+
+TEST(RingBufferTest, UnboundedGrowth) {
+  RingBuffer<int> R;
+  const std::size_t c0 = R.capacity();
+  const int count = static_cast<int>(c0) * 4 + 3;
+
+  // Offset head so that growth has to unwrap the buffer
+  R.push(-1);
+  R.pop();
+  for (int i = 0; i < count; i++) {
+    R.push(i);
+  }
+  ASSERT_EQ(R.evicted(), 0U);
+  ASSERT_EQ(R.size(), static_cast<std::size_t>(count));
+  ASSERT_GT(R.capacity(), c0);
+  for (int i = 0; i < count; i++) {
+    ASSERT_EQ(R.front(), i);
+    R.pop();
+  }
+}
+
+TEST(RingBufferTest, BenchmarkAgainstVector) {
+  constexpr std::size_t count = 100000U;
+  for (std::size_t max_size : {32U, 1024U, 4096U}) {
+    const double t_vec =
+        bench_push_pop<VectorRingBuffer<std::shared_ptr<int>>>(max_size, count);
+    const double t_ring =
+        bench_push_pop<RingBuffer<std::shared_ptr<int>>>(max_size, count);
+    iprintf("max_size={} count={} vector={:.3f}ms ring={:.3f}ms", max_size,
+            count, t_vec, t_ring);
+  }
+}
+
+TEST(MPSCQueueTest, ProducerOrderIsPreserved) {
+  constexpr int n_producers = 8;
+  constexpr int n_items = 10000;
+  MPSCQueue<WorkItem> q;
+  std::vector<std::thread> producers;
+  for (int i = 0; i < n_producers; i++) {
+    producers.emplace_back([&q, i]() {
+      for (int j = 0; j < n_items; j++) {
+        q.push({i, j, {}});
+      }
+    });
+  }
+
+  std::vector<int> next(n_producers, 0);
+  WorkItem w;
+  for (int k = 0; k < n_producers * n_items;) {
+    if (!q.try_pop(&w)) {
+      std::this_thread::yield();
+      continue;
+    }
+    ASSERT_EQ(w.seq, next[w.producer]);
+    next[w.producer]++;
+    k++;
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  ASSERT_TRUE(q.empty());
+}
+
+TEST(MPSCQueueTest, BenchmarkLatency16Producers) {
+  constexpr int n_producers = 16;
+  constexpr int n_items = 5000;
+  auto L = bench_latency<LockedWorkQueue>(n_producers, n_items);
+  auto P = bench_latency<ParkingWorkQueue>(n_producers, n_items);
+  iprintf(
+      "producers={} items={} locked: mean={:.2f}us max={:.2f}us "
+      "total={:.2f}ms, mpsc: mean={:.2f}us max={:.2f}us total={:.2f}ms",
+      n_producers, n_items, L.mean_us, L.max_us, L.total_ms, P.mean_us,
+      P.max_us, P.total_ms);
+}
+
+TEST(MPMCQueueTest, BoundedFIFO) {
+  MPMCQueue<std::unique_ptr<int>> q(3U);
+  ASSERT_EQ(q.capacity(), 4U);
+  for (int i = 0; i < 4; i++) {
+    auto v = std::make_unique<int>(i);
+    ASSERT_TRUE(q.try_push(&v));
+    ASSERT_EQ(v, nullptr);
+  }
+  // Value is kept if the queue is full
+  auto v = std::make_unique<int>(4);
+  ASSERT_FALSE(q.try_push(&v));
+  ASSERT_EQ(*v, 4);
+  ASSERT_EQ(q.size(), 4U);
+
+  std::unique_ptr<int> w;
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(q.try_pop(&w));
+    ASSERT_EQ(*w, i);
+    // Wrap around
+    ASSERT_TRUE(q.try_push(&v));
+    v = std::make_unique<int>(i + 5);
+  }
+  for (int i = 4; i < 8; i++) {
+    ASSERT_TRUE(q.try_pop(&w));
+    ASSERT_EQ(*w, i);
+  }
+  ASSERT_FALSE(q.try_pop(&w));
+  ASSERT_EQ(q.size(), 0U);
+}
+
+TEST(MPMCQueueTest, ConcurrentProducersAndConsumers) {
+  constexpr int n_threads = 4;
+  constexpr int n_items = 10000;
+  MPMCQueue<WorkItem> q(64U);
+  std::vector<std::thread> producers;
+  std::vector<std::thread> consumers;
+  std::vector<std::vector<WorkItem>> received(n_threads);
+  std::atomic_int remaining(n_threads * n_items);
+
+  for (int i = 0; i < n_threads; i++) {
+    producers.emplace_back([&q, i]() {
+      for (int j = 0; j < n_items; j++) {
+        WorkItem w{i, j, {}};
+        while (!q.try_push(&w)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+    consumers.emplace_back([&q, &remaining, &out = received[i]]() {
+      WorkItem w;
+      while (remaining.load() > 0) {
+        if (q.try_pop(&w)) {
+          out.push_back(w);
+          remaining.fetch_sub(1);
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  for (auto& t : consumers) {
+    t.join();
+  }
+
+  // Every item is received once, and each consumer sees the items of a
+  // producer in order
+  std::vector<int> count(n_threads, 0);
+  for (const auto& items : received) {
+    std::vector<int> last(n_threads, -1);
+    for (const auto& w : items) {
+      ASSERT_GT(w.seq, last[w.producer]);
+      last[w.producer] = w.seq;
+      count[w.producer]++;
+    }
+  }
+  for (int c : count) {
+    ASSERT_EQ(c, n_items);
+  }
+}
+
+TEST(AsyncRandomAccessQueueTest, StableExtract) {
+  AsyncRandomAccessQueue<int> q;
+  for (int i = 0; i < 10; i++) {
+    q.push(i);
+  }
+  auto odd = q.pop(0U, 0.0s, [](int& v) { return v % 2 == 1; });
+  ASSERT_EQ(odd, std::vector<int>({1, 3, 5, 7, 9}));
+  ASSERT_EQ(q.size(), 5U);
+
+  auto first = q.pop(2U);
+  ASSERT_EQ(first, std::vector<int>({0, 2}));
+  q.push(10);
+  auto rest = q.pop(0U);
+  ASSERT_EQ(rest, std::vector<int>({4, 6, 8, 10}));
+  ASSERT_TRUE(q.empty());
+}
+
+TEST(AsyncRandomAccessQueueTest, BlockingPopAndPush) {
+  AsyncRandomAccessQueue<int> q(2U);
+  // Consumer blocks until an item arrives
+  auto f = std::async(std::launch::async, [&q]() { return q.pop(1U, 5.0s); });
+  std::this_thread::sleep_for(20ms);
+  q.push(1);
+  ASSERT_EQ(f.get(), std::vector<int>({1}));
+
+  // Producer blocks until there's free space
+  q.push(2);
+  q.push(3);
+  auto p = std::async(std::launch::async, [&q]() { q.push(4); });
+  ASSERT_EQ(p.wait_for(20ms), std::future_status::timeout);
+  ASSERT_EQ(q.pop(1U), std::vector<int>({2}));
+  p.get();
+  ASSERT_EQ(q.pop(0U), std::vector<int>({3, 4}));
+
+  // Timeout with no items
+  ASSERT_TRUE(q.pop(1U, 0.01s).empty());
+}
+
+TEST(AsyncRandomAccessQueueTest, NotifyReevaluatesPredicate) {
+  AsyncRandomAccessQueue<int> q;
+  std::atomic<int> wanted(-1);
+  q.push(1);
+  auto f = std::async(std::launch::async, [&]() {
+    return q.pop(1U, 5.0s, [&wanted](int& v) { return v == wanted; });
+  });
+  std::this_thread::sleep_for(20ms);
+  wanted = 1;
+  q.notify();
+  ASSERT_EQ(f.wait_for(1s), std::future_status::ready);
+  ASSERT_EQ(f.get(), std::vector<int>({1}));
+}
+
+TEST(ShardedRegistryTest, LookupsDuringUpdates) {
+  utility::ShardedRegistry<u64, int, 4U> R(1.0s);
+  constexpr u64 n_keys = 64U;
+  for (u64 i = 0U; i < n_keys; i += 2U) {
+    ASSERT_TRUE(R.insert(i, std::make_shared<int>(static_cast<int>(i))));
+  }
+  ASSERT_FALSE(R.insert(0U, std::make_shared<int>(-1)));
+  ASSERT_EQ(*R.find(0U), 0);
+
+  // Readers see either the old or the new snapshot, and previously obtained
+  // values stay valid after removal.
+  std::atomic_bool done{false};
+  auto reader = std::async(std::launch::async, [&]() {
+    std::size_t found = 0U;
+    do {
+      for (u64 i = 0U; i < n_keys; i++) {
+        auto v = R.find(i);
+        if (v != nullptr) {
+          EXPECT_EQ(*v, static_cast<int>(i));
+          found++;
+        }
+      }
+    } while (!done);
+    return found;
+  });
+  for (u64 i = 1U; i < n_keys; i += 2U) {
+    ASSERT_TRUE(R.insert(i, std::make_shared<int>(static_cast<int>(i))));
+    ASSERT_TRUE(R.erase(i));
+  }
+  done = true;
+  ASSERT_GT(reader.get(), 0U);
+  ASSERT_FALSE(R.erase(1U));
+
+  std::size_t count = 0U;
+  R.for_each([&count](const u64&, const std::shared_ptr<int>&) { count++; });
+  ASSERT_EQ(count, n_keys / 2U);
+  ASSERT_EQ(R.stats().updates, n_keys / 2U + n_keys);
+}
+
+TEST(PerfectHashTableTest, FindAllKeys) {
+  std::vector<std::pair<std::string, u32>> items;
+  for (u32 i = 0U; i < 300U; i++) {
+    items.emplace_back(fmt::format("ra2yrproto.commands.Command{}", i), i);
+  }
+  utility::PerfectHashTable<u32> T(items);
+  ASSERT_EQ(T.size(), items.size());
+  for (const auto& [k, v] : items) {
+    const auto* p = T.find(k);
+    ASSERT_NE(p, nullptr);
+    ASSERT_EQ(*p, v);
+  }
+  ASSERT_EQ(T.find("ra2yrproto.commands.Command300"), nullptr);
+  ASSERT_EQ(T.find(""), nullptr);
+  ASSERT_EQ(utility::PerfectHashTable<u32>().find("a"), nullptr);
+
+  items.push_back(items.front());
+  ASSERT_THROW(utility::PerfectHashTable<u32>{items}, std::invalid_argument);
+}
+
+TEST(WriterPreferringMutexTest, WriterIsNotStarved) {
+  util::WriterPreferringMutex m;
+  std::atomic_bool writer_locked{false};
+  std::atomic_bool reader_locked{false};
+
+  std::shared_lock<util::WriterPreferringMutex> first(m);
+  std::thread writer([&]() {
+    std::unique_lock<util::WriterPreferringMutex> l(m);
+    writer_locked = true;
+    // The second reader must not get in while the writer holds the lock
+    util::sleep_ms(20);
+    ASSERT_FALSE(reader_locked.load());
+  });
+  // Let the writer start waiting
+  util::sleep_ms(50);
+  std::thread reader([&]() {
+    std::shared_lock<util::WriterPreferringMutex> l(m);
+    reader_locked = true;
+  });
+  util::sleep_ms(50);
+  // Waiting writer blocks new readers
+  ASSERT_FALSE(writer_locked.load());
+  ASSERT_FALSE(reader_locked.load());
+  first.unlock();
+  writer.join();
+  reader.join();
+  ASSERT_TRUE(writer_locked.load());
+  ASSERT_TRUE(reader_locked.load());
+}
+
+TEST(StrandTest, OrderAcrossPools) {
+  utility::ThreadPool pool(1U);
+  utility::ThreadPool other(1U);
+  auto st = std::make_shared<utility::Strand>(&pool);
+  std::vector<int> order;
+  std::atomic<bool> blocked(false);
+  std::promise<void> release;
+  auto released = release.get_future().share();
+  std::promise<void> done;
+  st->post([&]() { order.push_back(0); });
+  // Blocks a thread of the other pool, not of the strand's pool
+  st->post(
+      [&, released]() {
+        blocked = true;
+        released.wait();
+        order.push_back(1);
+      },
+      &other);
+  st->post([&]() { order.push_back(2); });
+  st->post([&]() {
+    order.push_back(3);
+    done.set_value();
+  });
+  while (!blocked) {
+    std::this_thread::sleep_for(1ms);
+  }
+  // Strand's pool is still available
+  std::promise<void> idle;
+  pool.post([&idle]() { idle.set_value(); });
+  ASSERT_EQ(idle.get_future().wait_for(1s), std::future_status::ready);
+  release.set_value();
+  done.get_future().wait();
+  ASSERT_EQ(order, std::vector<int>({0, 1, 2, 3}));
+}
+
+TEST(ShmRingTest, WrapAndSplitMessages) {
+  using namespace ra2yrcpp::shm;
+  constexpr u32 capacity = 4096U;
+  Region server("test_containers_ring", 1U, capacity, capacity);
+  Region client("test_containers_ring");
+  ASSERT_EQ(client.num_slots(), 1U);
+  auto* slot = client.slot(0U);
+  ASSERT_EQ(slot->requests.capacity, capacity);
+
+  // Sizes that wrap around the data area, and ones that have to be split
+  std::vector<std::string> messages;
+  for (std::size_t i = 0U; i < 200U; i++) {
+    const std::size_t size = (i * 397U) % (capacity * 3U);
+    messages.emplace_back(size, static_cast<char>('a' + i % 26U));
+  }
+
+  Ring writer(&client, &slot->requests);
+  Ring reader(&server, &server.slot(0U)->requests);
+  auto never = []() { return false; };
+  auto f = std::async(std::launch::async, [&]() {
+    for (const auto& m : messages) {
+      writer.write(m, never);
+    }
+  });
+  const auto* data = server.at(slot->requests.data_offset);
+  for (const auto& m : messages) {
+    ASSERT_TRUE(reader.read(
+        [&](std::string_view v) {
+          ASSERT_EQ(v, m);
+          // Messages that weren't split are read directly from the ring
+          const auto* p = reinterpret_cast<const u8*>(v.data());
+          const bool in_place = p >= data && p < data + capacity;
+          ASSERT_EQ(in_place, m.size() <= capacity / 2U - 8U);
+        },
+        never, 5.0s));
+  }
+  f.get();
+  ASSERT_TRUE(reader.empty());
+  ASSERT_FALSE(reader.read([](auto) {}, never, 0.0s));
+}
@@ -12,7 +12,9 @@
 #include "instrumentation_client.hpp"
 #include "instrumentation_service.hpp"
 #include "logging.hpp"
+#include "process.hpp"
 #include "protocol/helpers.hpp"
+#include "tcp_connection.hpp"
 #include "types.h"
 #include "util_proto.hpp"
 #include "util_string.hpp"
@@ -21,6 +23,7 @@
 #include "websocket_connection.hpp"
 
 #include <fmt/core.h>
+#include <google/protobuf/wrappers.pb.h>
 #include <gtest/gtest.h>
 #include <websocketpp/common/asio.hpp>
 #include <websocketpp/common/thread.hpp>
@@ -28,15 +31,19 @@
 
 #include <cstddef>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <exception>
 #include <functional>
 #include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 using namespace ra2yrcpp;
@@ -64,6 +71,7 @@ class InstrumentationServiceTest : public ::testing::Test {
 
 void InstrumentationServiceTest::SetUp() {
   InstrumentationService::Options O = default_options;
+  O.tcp_port = O.server.port + 1U;
 
   srv = std::make_unique<asio_utils::IOService>();
   I = std::unique_ptr<InstrumentationService>(InstrumentationService::create(
@@ -189,6 +197,208 @@ TEST_F(NewCommandsTest, BasicCommandTest) {
   ASSERT_EQ(cmds.result().results().size(), 1);
 }
 
+TEST_F(NewCommandsTest, PipelinedRequests) {
+  constexpr int count = 32;
+  constexpr u64 poll_timeout_ms = 5000U;
+  const auto t0 = std::chrono::steady_clock::now();
+  // The blocking poll is sent first, but can only complete after the
+  // following commands have been processed.
+  ra2yrproto::PollResults P;
+  P.mutable_args()->set_timeout(poll_timeout_ms);
+  const auto poll_id =
+      client->send_command_async(P, ra2yrproto::POLL_BLOCKING);
+  std::vector<u64> ids;
+  for (int i = 0; i < count; i++) {
+    ids.push_back(client->send_command_async(
+        StoreValue::create({fmt::format("{}{}", key, i), val}),
+        ra2yrproto::CLIENT_COMMAND));
+  }
+  for (auto it = ids.rbegin(); it != ids.rend(); it++) {
+    auto r = client->wait_response(*it);
+    ASSERT_EQ(r.request_id(), *it);
+    ASSERT_EQ(r.code(), ra2yrproto::ResponseCode::OK);
+    ASSERT_TRUE(r.body().Is<ra2yrproto::RunCommandAck>());
+  }
+  auto r = client->wait_response(poll_id);
+  ASSERT_EQ(r.request_id(), poll_id);
+  auto R = protocol::from_any<ra2yrproto::PollResults>(r.body());
+  ASSERT_GT(R.result().results_size(), 0);
+  ASSERT_LT(std::chrono::steady_clock::now() - t0,
+            std::chrono::milliseconds(poll_timeout_ms));
+  ASSERT_THROW(client->wait_response(poll_id), std::runtime_error);
+
+  // Interleaved blocking commands get their own results
+  std::vector<std::pair<u64, std::string>> blocking;
+  for (int i = 0; i < count; i++) {
+    const auto k = fmt::format("blocking{}", i);
+    auto C = create_command(StoreValue::create({k, val}),
+                            ra2yrproto::CLIENT_COMMAND);
+    C.set_blocking(true);
+    blocking.emplace_back(client->send_command_async(C), k);
+  }
+  for (const auto& [id, k] : blocking) {
+    auto b = client->wait_response(id);
+    ASSERT_EQ(b.code(), ra2yrproto::ResponseCode::OK);
+    auto B = protocol::from_any<ra2yrproto::PollResults>(b.body());
+    ASSERT_EQ(B.result().results_size(), 1);
+    auto S = protocol::from_any<ra2yrproto::commands::StoreValue>(
+        B.result().results(0).result());
+    ASSERT_EQ(S.key(), k);
+  }
+}
+
+TEST_F(NewCommandsTest, BlockingPollsDontStallCommands) {
+  // More blocking polls than there are workers
+  const unsigned n_pollers = I->opts().server.worker_threads + 2U;
+  constexpr u64 poll_timeout_ms = 2000U;
+  ra2yrproto::PollResults P;
+  P.mutable_args()->set_timeout(poll_timeout_ms);
+  std::vector<std::unique_ptr<InstrumentationClient>> pollers;
+  std::vector<u64> ids;
+  for (unsigned i = 0U; i < n_pollers; i++) {
+    auto c = std::make_shared<connection::ClientTcpConnection>(
+        I->opts().server.host, std::to_string(I->opts().tcp_port), srv.get());
+    c->connect();
+    pollers.push_back(std::make_unique<InstrumentationClient>(c));
+    ids.push_back(
+        pollers.back()->send_command_async(P, ra2yrproto::POLL_BLOCKING));
+  }
+  util::sleep_ms(100U);
+
+  const auto t0 = std::chrono::steady_clock::now();
+  auto r = client->send_command(StoreValue::create({key, val}),
+                                ra2yrproto::CLIENT_COMMAND);
+  ASSERT_EQ(r.code(), ra2yrproto::ResponseCode::OK);
+  ASSERT_LT(std::chrono::steady_clock::now() - t0,
+            std::chrono::milliseconds(poll_timeout_ms / 2U));
+  for (unsigned i = 0U; i < n_pollers; i++) {
+    ASSERT_EQ(pollers[i]->wait_response(ids[i]).code(),
+              ra2yrproto::ResponseCode::OK);
+  }
+}
+
+TEST_F(NewCommandsTest, BenchmarkStoreGetValue) {
+  constexpr int count = 500;
+  for (std::size_t sz : {16U, 4096U}) {
+    const std::string v(sz, 'X');
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+      (void)cs->run(StoreValue::create({key, v}));
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+      auto r = cs->run(GetValue::create({key, ""}));
+      ASSERT_EQ(r.value().size(), sz);
+    }
+    const auto t2 = std::chrono::steady_clock::now();
+    using sec = std::chrono::duration<double>;
+    iprintf("value_size={} StoreValue={:.1f} req/s GetValue={:.1f} req/s", sz,
+            count / sec(t1 - t0).count(), count / sec(t2 - t1).count());
+  }
+}
+
+TEST_F(NewCommandsTest, BenchmarkWebsocketVsTcp) {
+  auto tcp_conn = std::make_shared<connection::ClientTcpConnection>(
+      I->opts().server.host, std::to_string(I->opts().tcp_port), srv.get());
+  tcp_conn->connect();
+  InstrumentationClient tcp_client(tcp_conn);
+  using us = std::chrono::duration<double, std::micro>;
+
+  // Small commands: round trip of a single ACK
+  auto bench_ack = [&](InstrumentationClient* C, const int count) {
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+      auto r = C->send_command(StoreValue::create({key, val}),
+                               ra2yrproto::CLIENT_COMMAND);
+      EXPECT_EQ(r.code(), ra2yrproto::ResponseCode::OK);
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+    (void)C->poll_blocking(1.0s);
+    return us(t1 - t0).count() / count;
+  };
+
+  // Large responses: command and poll of the result
+  auto bench_get = [&](InstrumentationClient* C, const std::size_t size,
+                       const int count) {
+    (void)client_utils::run_one(
+        StoreValue::create({key, std::string(size, 'X')}), C);
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+      auto r = client_utils::run(GetValue::create({key, ""}), C);
+      EXPECT_EQ(r.value().size(), size);
+    }
+    return us(std::chrono::steady_clock::now() - t0).count() / count;
+  };
+
+  constexpr int count = 500;
+  iprintf("ACK round trip: websocket={:.1f}us tcp={:.1f}us",
+          bench_ack(client.get(), count), bench_ack(&tcp_client, count));
+  for (std::size_t size : {16U, 1U << 20U}) {
+    const int n = size > 4096U ? 20 : count;
+    iprintf("GetValue value_size={}: websocket={:.1f}us tcp={:.1f}us", size,
+            bench_get(client.get(), size, n), bench_get(&tcp_client, size, n));
+  }
+}
+
+TEST_F(NewCommandsTest, CommandBatch) {
+  ra2yrproto::commands::CommandBatch B;
+  B.add_commands()->PackFrom(StoreValue::create({key, val}));
+  B.add_commands()->PackFrom(GetValue::create({key, ""}));
+  // Nested batches are rejected
+  B.add_commands()->PackFrom(ra2yrproto::commands::CommandBatch());
+
+  // Single ACK and single result for the whole batch
+  auto resp = client->send_command(B, ra2yrproto::CLIENT_COMMAND);
+  ASSERT_EQ(resp.code(), ra2yrproto::ResponseCode::OK);
+  auto P = client->poll_blocking(5.0s);
+  ASSERT_EQ(P.result().results_size(), 1);
+
+  auto r = protocol::from_any<ra2yrproto::commands::CommandBatch>(
+      P.result().results(0).result());
+  ASSERT_EQ(r.commands_size(), 0);
+  ASSERT_EQ(r.results_size(), 3);
+  ASSERT_EQ(r.results(0).result_code(), RESPONSE_OK);
+  auto G = protocol::from_any<ra2yrproto::commands::GetValue>(
+      r.results(1).result());
+  ASSERT_EQ(G.value(), val);
+  ASSERT_EQ(r.results(2).result_code(), RESPONSE_ERROR);
+}
+
+TEST_F(NewCommandsTest, CommandBatchAsync) {
+  // Async command that completes outside of the batch's deferred work
+  std::vector<std::future<void>> tasks;
+  auto e = command::get_async_cmd<google::protobuf::StringValue>([&](auto* Q) {
+    auto* c = Q->c;
+    c->set_async_handler([](auto* cmd) {
+      google::protobuf::StringValue v;
+      v.set_value("done");
+      cmd->command_data()->M.PackFrom(v);
+    });
+    tasks.emplace_back(std::async(std::launch::async, [c]() {
+      util::sleep_ms(50);
+      c->run_async_handler();
+    }));
+  });
+  (void)I->cmd_manager().add_command(e.first, e.second);
+
+  ra2yrproto::commands::CommandBatch B;
+  B.add_commands()->PackFrom(google::protobuf::StringValue());
+  B.add_commands()->PackFrom(StoreValue::create({key, val}));
+  auto resp = client->send_command(B, ra2yrproto::CLIENT_COMMAND);
+  ASSERT_EQ(resp.code(), ra2yrproto::ResponseCode::OK);
+  auto P = client->poll_blocking(5.0s);
+  ASSERT_EQ(P.result().results_size(), 1);
+
+  auto r = protocol::from_any<ra2yrproto::commands::CommandBatch>(
+      P.result().results(0).result());
+  ASSERT_EQ(r.results_size(), 2);
+  ASSERT_EQ(r.results(0).result_code(), RESPONSE_OK);
+  auto V = protocol::from_any<google::protobuf::StringValue>(
+      r.results(0).result());
+  ASSERT_EQ(V.value(), "done");
+  ASSERT_EQ(r.results(1).result_code(), RESPONSE_OK);
+}
+
 TEST_F(IServiceTest, TestHTTPRequest) {
 #if 0
   B("ra2yrproto.commands.GetSystemState");
@@ -242,6 +452,35 @@ TEST_F(IServiceTest, TestHTTPRequest) {
   iprintf("exit test");
 }
 
+TEST_F(NewCommandsTest, ThreadCountIndependentOfConnections) {
+  auto count_threads = []() {
+    std::size_t n = 0U;
+    process::get_current_process().for_each_thread(
+        [&n](auto*, void*) { n++; }, nullptr);
+    return n;
+  };
+  ASSERT_EQ(I->get_connection_threads().size(), cfg::SERVER_IO_THREADS);
+  const auto n0 = count_threads();
+  if (n0 == 0U) {
+    GTEST_SKIP() << "thread enumeration not supported";
+  }
+
+  // Client connections share the fixture's IOService, so they don't add
+  // threads either.
+  std::vector<std::unique_ptr<InstrumentationClient>> clients;
+  for (unsigned i = 1U; i < I->opts().server.max_connections; i++) {
+    auto c = std::make_shared<connection::ClientWebsocketConnection>(
+        I->opts().server.host, std::to_string(I->opts().server.port),
+        srv.get());
+    c->connect();
+    clients.push_back(std::make_unique<InstrumentationClient>(c));
+    auto r = clients.back()->send_command(StoreValue::create({key, val}),
+                                          ra2yrproto::CLIENT_COMMAND);
+    ASSERT_EQ(r.code(), ra2yrproto::ResponseCode::OK);
+  }
+  ASSERT_EQ(count_threads(), n0);
+}
+
 class CommandTest : public ::testing::Test {
  public:
   using cmd_d_t = decltype(command::ISArg::M);
@@ -500,3 +739,180 @@ TEST_F(CommandTest, AsyncTest) {
     ASSERT_EQ(s, "");
   }
 }
+
+TEST_F(CommandTest, QueueOrderAndSerialCommands) {
+  constexpr u64 queue_count = 4;
+  constexpr int n_commands = 50;
+  std::mutex m;
+  std::map<u64, std::vector<u64>> executed;
+  std::atomic<int> active(0);
+  std::atomic<int> max_active(0);
+  std::atomic<int> serial_violations(0);
+
+  auto enter = [&]() {
+    const int a = ++active;
+    int prev = max_active.load();
+    while (prev < a && !max_active.compare_exchange_weak(prev, a)) {
+    }
+    return a;
+  };
+  auto record = [&](cmdtype* c) {
+    {
+      std::unique_lock<std::mutex> l(m);
+      executed[c->queue_id()].push_back(c->task_id());
+    }
+    util::sleep_ms(1);
+    active--;
+  };
+  M->add_command("parallel", [&](cmdtype* c) {
+    (void)enter();
+    record(c);
+  });
+  M->add_command(
+      "serial",
+      [&](cmdtype* c) {
+        if (enter() != 1) {
+          serial_violations++;
+        }
+        record(c);
+      },
+      true);
+
+  auto producer = [&](const u64 qid) {
+    (void)M->execute_create_queue(qid);
+    std::vector<manager_t::command_ptr_t> cmds;
+    for (int j = 0; j < n_commands; j++) {
+      cmds.push_back(M->enqueue_command(
+          create_cmd(qid, j % 10 == 9 ? "serial" : "parallel")));
+    }
+    for (auto& C : cmds) {
+      C->result_code().wait_pred(
+          [](command::ResultCode v) { return v != command::ResultCode::NONE; });
+    }
+  };
+
+  std::vector<std::future<void>> tasks;
+  for (u64 i = 0; i < queue_count; i++) {
+    tasks.emplace_back(std::async(std::launch::async, producer, i));
+  }
+  for (auto& t : tasks) {
+    t.get();
+  }
+
+  ASSERT_EQ(serial_violations.load(), 0);
+  ASSERT_GT(max_active.load(), 1);
+  ASSERT_EQ(executed.size(), queue_count);
+  for (auto& [qid, ids] : executed) {
+    ASSERT_EQ(ids.size(), static_cast<std::size_t>(n_commands));
+    ASSERT_TRUE(std::is_sorted(ids.begin(), ids.end()));
+  }
+}
+
+TEST_F(CommandTest, PendingCommandsAreTracked) {
+  constexpr u64 queue_id = 1;
+  constexpr int n_commands = 20;
+  (void)M->execute_create_queue(queue_id);
+
+  std::vector<u64> ids;
+  for (int j = 0; j < n_commands; j++) {
+    auto C = make_async_cmd(queue_id);
+    ids.push_back(C->task_id());
+    // Discarded results must not leave stale entries either
+    if (j % 4 == 0) {
+      auto D = create_cmd(queue_id, "test_async", true);
+      D->discard_result().store(true);
+      (void)M->enqueue_command(D);
+    }
+  }
+
+  std::vector<u64> res;
+  while (res.size() < ids.size()) {
+    for (auto& c : flush(queue_id)) {
+      ASSERT_FALSE(c->pending().get());
+      res.push_back(c->task_id());
+    }
+  }
+  // Commands complete while flushing, so results may be out of order
+  std::sort(res.begin(), res.end());
+  ASSERT_EQ(res, ids);
+  // The last discarded command may still be running
+  for (int i = 0; i < 100 && M->pending_count() > 0U; i++) {
+    util::sleep_ms(10);
+  }
+  ASSERT_EQ(M->pending_count(), 0U);
+}
+
+TEST_F(CommandTest, AddCommandsWhileExecuting) {
+  constexpr u64 queue_id = 1;
+  constexpr int n_added = 100;
+  (void)M->execute_create_queue(queue_id);
+  std::map<std::string, manager_t::entry_t> bulk;
+  for (int i = 0; i < n_added; i++) {
+    bulk.try_emplace(fmt::format("bulk_{}", i),
+                     [](cmdtype* c) { set_command_data(c); });
+  }
+
+  std::thread t([&]() {
+    M->add_commands(bulk);
+    for (int i = 0; i < n_added; i++) {
+      (void)M->add_command(fmt::format("added_{}", i),
+                           [](cmdtype* c) { set_command_data(c); });
+    }
+  });
+  for (int i = 0; i < n_added; i++) {
+    auto C = M->enqueue_command(create_cmd(queue_id, "test"));
+    C->result_code().wait_pred(
+        [](command::ResultCode v) { return v != command::ResultCode::NONE; });
+    ASSERT_EQ(C->result_code().get(), command::ResultCode::OK);
+  }
+  t.join();
+
+  for (int i = 0; i < n_added; i++) {
+    for (const auto* pfx : {"bulk", "added"}) {
+      auto C = M->enqueue_command(
+          create_cmd(queue_id, fmt::format("{}_{}", pfx, i)));
+      C->result_code().wait_pred(
+          [](command::ResultCode v) { return v != command::ResultCode::NONE; });
+      ASSERT_EQ(C->result_code().get(), command::ResultCode::OK);
+    }
+  }
+}
+
+TEST_F(CommandTest, BenchmarkEnqueueLatency) {
+  constexpr u64 queue_id = 1;
+  constexpr int n_producers = 16;
+  constexpr int n_commands = 500;
+  using clock_type = std::chrono::steady_clock;
+  (void)M->execute_create_queue(queue_id, cfg::RESULT_QUEUE_SIZE);
+
+  // Each producer mimics a connection thread that submits commands one at a
+  // time and waits for their completion.
+  auto producer = [&]() {
+    double total = 0.0;
+    for (int j = 0; j < n_commands; j++) {
+      const auto t0 = clock_type::now();
+      auto C = make_cmd(queue_id);
+      C->result_code().wait_pred(
+          [](command::ResultCode v) { return v != command::ResultCode::NONE; });
+      total += std::chrono::duration<double, std::micro>(clock_type::now() - t0)
+                   .count();
+    }
+    return total;
+  };
+
+  std::vector<std::future<double>> tasks;
+  const auto t_start = clock_type::now();
+  for (int i = 0; i < n_producers; i++) {
+    tasks.emplace_back(std::async(std::launch::async, producer));
+  }
+  double total = 0.0;
+  for (auto& t : tasks) {
+    total += t.get();
+  }
+  const double elapsed =
+      std::chrono::duration<double, std::milli>(clock_type::now() - t_start)
+          .count();
+  iprintf("producers={} commands={} mean_latency={:.2f}us elapsed={:.2f}ms",
+          n_producers, n_producers * n_commands,
+          total / (n_producers * n_commands), elapsed);
+}
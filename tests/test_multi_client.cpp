@@ -1,14 +1,22 @@
 #include "ra2yrproto/commands_builtin.pb.h"
 #include "ra2yrproto/core.pb.h"
+#include "ra2yrproto/ra2yr.pb.h"
 
 #include "client_utils.hpp"
 #include "commands_builtin.hpp"
 #include "common_multi.hpp"
+#include "frame_snapshot.hpp"
 #include "gtest/gtest.h"
 #include "instrumentation_service.hpp"
 #include "multi_client.hpp"
 #include "protocol/helpers.hpp"
+#include "shm_connection.hpp"
+#include "state_delta.hpp"
+#include "state_publisher.hpp"
 #include "util_proto.hpp"
+#include "utility/time.hpp"
+
+#include <google/protobuf/util/message_differencer.h>
 
 #include <chrono>
 #include <memory>
@@ -26,6 +34,7 @@ class MultiClientTest : public ::testing::Test {
  protected:
   void SetUp() override {
     InstrumentationService::Options opts = default_options;
+    opts.shm_name = "test_multi_client";
 
     I = std::unique_ptr<InstrumentationService>(InstrumentationService::create(
         opts, commands_builtin::get_commands(), nullptr));
@@ -72,3 +81,106 @@ TEST_F(MultiClientTest, RunCommandsAndVerify) {
     ASSERT_EQ(r2.value(), k1);
   }
 }
+
+TEST_F(MultiClientTest, SharedMemoryTransport) {
+  auto o = multi_client::default_options;
+  o.command_timeout = 5.0s;
+  const auto name = I->opts().shm_name;
+  multi_client::AutoPollClient C(
+      [name]() {
+        return std::make_shared<connection::ClientShmConnection>(name);
+      },
+      o);
+  C.start();
+  client_utils::CommandSender S([&](auto& msg) {
+    auto r = C.send_command(msg);
+    return protocol::from_any<ra2yrproto::CommandResult>(r.body());
+  });
+
+  ra2yrproto::commands::GetSystemState cmd;
+  auto r = S.run(cmd);
+  ASSERT_EQ(r.state().connections().size(), 4);
+
+  // Large enough to be split in both directions
+  const std::string key = "tdata";
+  std::string k1(3U << 20U, 'x');
+  (void)S.run(StoreValue::create({key, k1}));
+  auto r2 = S.run(GetValue::create({key, ""}));
+  ASSERT_EQ(r2.value(), k1);
+}
+
+TEST_F(MultiClientTest, GameStateSubscription) {
+  using multi_client::ClientType;
+  using ra2yrproto::ra2yr::GameState;
+  auto& C = *ctx->clients[0];
+  const auto conn = static_cast<int>(C.get_queue_id(ClientType::COMMAND));
+  auto* client = C.get_client(ClientType::COMMAND);
+  gpb::util::MessageDifferencer D;
+
+  StatePublisher P(I.get());
+  ASSERT_FALSE(P.active());
+  const u64 id_full = P.subscribe(conn, 2U, false);
+  const u64 id_delta = P.subscribe(conn, 1U, true);
+  ASSERT_NE(id_full, id_delta);
+  ASSERT_EQ(P.subscribe(conn, 2U, false), id_full);
+  ASSERT_TRUE(P.active());
+
+  GameState G;
+  DeltaDecoder S;
+  for (u32 frame = 1U; frame <= 50U; frame++) {
+    G.set_current_frame(frame);
+    if (frame % 3U == 0U) {
+      G.clear_objects();
+    }
+    auto* o = G.add_objects();
+    o->set_pointer_self(frame);
+    o->set_health(100);
+    P.publish(std::make_shared<const FrameSnapshot>(G));
+    for (u32 i = 0U; i < (frame % 2U == 0U ? 2U : 1U); i++) {
+      auto R = client->wait_push();
+      if (R.subscription_id() == id_full) {
+        ASSERT_TRUE(D.Equals(protocol::from_any<GameState>(R.body()), G));
+        continue;
+      }
+      ASSERT_EQ(R.subscription_id(), id_delta);
+      auto M =
+          protocol::from_any<ra2yrproto::ra2yr::GameStateDelta>(R.body());
+      ASSERT_EQ(M.keyframe(), frame == 1U);
+      ASSERT_TRUE(S.apply(M));
+      ASSERT_EQ(S.bytes(), G.SerializeAsString());
+    }
+  }
+  P.unsubscribe(conn, 0U);
+  ASSERT_FALSE(P.active());
+}
+
+TEST_F(MultiClientTest, SubscriptionRemovedOnClose) {
+  using multi_client::ClientType;
+  StatePublisher P(I.get());
+  const auto old_conn =
+      static_cast<int>(ctx->clients[0]->get_queue_id(ClientType::COMMAND));
+  const u64 old_id = P.subscribe(old_conn, 1U, true);
+
+  // Closing the connection removes it's subscriptions
+  ctx->clients.clear();
+  const auto deadline = std::chrono::steady_clock::now() + 5s;
+  while (P.active() && std::chrono::steady_clock::now() < deadline) {
+    util::sleep_ms(10U);
+  }
+  ASSERT_FALSE(P.active());
+
+  // New connection, which may reuse the old id, only gets it's own frames
+  ctx->create_client(multi_client::default_options);
+  auto& C = *ctx->clients[0];
+  const auto conn = static_cast<int>(C.get_queue_id(ClientType::COMMAND));
+  const u64 id = P.subscribe(conn, 1U, false);
+  ASSERT_NE(id, old_id);
+  ra2yrproto::ra2yr::GameState G;
+  for (u32 frame = 1U; frame <= 3U; frame++) {
+    G.set_current_frame(frame);
+    P.publish(std::make_shared<const FrameSnapshot>(G));
+    auto R = C.get_client(ClientType::COMMAND)->wait_push();
+    ASSERT_EQ(R.subscription_id(), id);
+  }
+  P.unsubscribe(conn, 0U);
+}
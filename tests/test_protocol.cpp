@@ -1,23 +1,46 @@
+#include "ra2yrproto/commands_builtin.pb.h"
+#include "ra2yrproto/commands_yr.pb.h"
+#include "ra2yrproto/core.pb.h"
 #include "ra2yrproto/ra2yr.pb.h"
 
+#include "errors.hpp"
+#include "frame_snapshot.hpp"
 #include "gtest/gtest.h"
 #include "logging.hpp"
 #include "protocol/helpers.hpp"
+#include "protocol/protocol.hpp"
+#include "state_delta.hpp"
+#include "state_record.hpp"
+#include "state_soa.hpp"
+#include "traffic_record.hpp"
 
+#include <fmt/core.h>
+#include <google/protobuf/field_mask.pb.h>
 #include <google/protobuf/util/message_differencer.h>
 
 #include <cstdio>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <memory>
+#include <ostream>
+#include <random>
+#include <sstream>
 #include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 namespace fs = std::filesystem;
 namespace gpb = google::protobuf;
 using namespace ra2yrcpp;
+using namespace std::chrono_literals;
 
 class TemporaryDirectoryTest : public ::testing::Test {
  protected:
@@ -83,3 +106,895 @@ TEST_F(TemporaryDirectoryTest, ProtocolTest) {
   ASSERT_EQ(G0.houses().size(), n_empty_messages);
   G0.clear_houses();
 }
+
+TEST_F(TemporaryDirectoryTest, FrameSnapshot) {
+  gpb::util::MessageDifferencer D;
+  ra2yrproto::ra2yr::GameState G;
+  G.set_current_frame(123U);
+  for (int i = 0; i < 8; i++) {
+    auto* o = G.add_objects();
+    o->set_pointer_self(0x1000 + i);
+    o->set_health(100 - i);
+  }
+  const auto F = std::make_shared<const FrameSnapshot>(G);
+  ASSERT_EQ(F->current_frame(), G.current_frame());
+  ASSERT_EQ(F->bytes(), G.SerializeAsString());
+  ASSERT_TRUE(D.Equals(F->state(), G));
+
+  // Embedded as command result
+  std::string res;
+  serialize_field(ra2yrproto::commands::GetGameState::kStateFieldNumber,
+                  F->bytes(), &res);
+  ra2yrproto::commands::GetGameState R;
+  ASSERT_TRUE(R.ParseFromString(res));
+  ASSERT_TRUE(D.Equals(R.state(), G));
+
+  // Written to record
+  fs::path record_path = temp_dir_path_;
+  record_path /= "record.pb.gz";
+  {
+    auto record_out = std::make_shared<std::ofstream>(
+        record_path.string(), std::ios_base::out | std::ios_base::binary);
+    protocol::MessageOstream MS(record_out, true);
+    ASSERT_TRUE(MS.write(F->bytes()));
+    ASSERT_TRUE(MS.write(G));
+  }
+  std::vector<std::string> messages_out;
+  protocol::dump_messages(
+      record_path.string(), ra2yrproto::ra2yr::GameState(),
+      [&](auto* M) { messages_out.push_back(M->SerializeAsString()); });
+  ASSERT_GE(messages_out.size(), 2U);
+  for (std::size_t i = 0U; i < 2U; i++) {
+    ASSERT_EQ(messages_out[i], F->bytes());
+  }
+}
+
+namespace {
+ra2yrproto::ra2yr::GameState make_game_state(const int n_objects) {
+  ra2yrproto::ra2yr::GameState G;
+  G.set_current_frame(1000U);
+  G.set_crc(0xdeadbeefU);
+  for (int i = 0; i < 8; i++) {
+    auto* h = G.add_houses();
+    h->set_self(0x1000 + i);
+    h->set_money(1000 * i);
+  }
+  for (int i = 0; i < n_objects; i++) {
+    auto* o = G.add_objects();
+    o->set_pointer_self(0x10000 + i);
+    o->set_health(i % 100);
+  }
+  for (int i = 0; i < n_objects / 20; i++) {
+    auto* f = G.add_factories();
+    f->set_object(0x10000 + i);
+    f->set_owner(0x1000 + i % 8);
+    f->set_progress_timer(i);
+  }
+  for (int i = 0; i < n_objects * 4; i++) {
+    auto* c = G.add_cells_difference();
+    c->set_index(i);
+    c->set_height(i % 16);
+  }
+  return G;
+}
+
+gpb::FieldMask make_mask(std::vector<std::string> paths) {
+  gpb::FieldMask M;
+  for (auto& p : paths) {
+    M.add_paths(p);
+  }
+  return M;
+}
+}  // namespace
+
+TEST(FieldMaskTest, ProjectFrame) {
+  gpb::util::MessageDifferencer D;
+  const auto G = make_game_state(100);
+  const FrameSnapshot F(G);
+
+  ra2yrproto::ra2yr::GameState P;
+  ASSERT_TRUE(P.ParseFromString(F.project(make_mask({"objects", "houses"}))));
+  ra2yrproto::ra2yr::GameState E;
+  E.mutable_objects()->CopyFrom(G.objects());
+  E.mutable_houses()->CopyFrom(G.houses());
+  ASSERT_TRUE(D.Equals(P, E));
+  ASSERT_TRUE(F.project(make_mask({})).empty());
+
+  // Paths can't refer to fields of repeated messages
+  ASSERT_THROW(F.project(make_mask({"houses.money"})), std::invalid_argument);
+  ASSERT_THROW(F.project(make_mask({"objects", "nonexistent"})),
+               std::invalid_argument);
+
+  ra2yrproto::ra2yr::StorageValue S;
+  S.mutable_game_state()->CopyFrom(G);
+  S.mutable_initial_game_state()->set_current_frame(1U);
+  ra2yrproto::ra2yr::StorageValue R;
+  protocol::copy_fields(&R, S, make_mask({"game_state.factories"}));
+  ASSERT_FALSE(R.has_initial_game_state());
+  ASSERT_TRUE(R.game_state().objects().empty());
+  ASSERT_TRUE(D.Equals(R.game_state(), [&G]() {
+    ra2yrproto::ra2yr::GameState C;
+    C.mutable_factories()->CopyFrom(G.factories());
+    return C;
+  }()));
+  ASSERT_THROW(protocol::copy_fields(&R, S, make_mask({"game_state.x"})),
+               std::invalid_argument);
+}
+
+TEST(FieldMaskTest, BenchmarkProjection) {
+  using ms = std::chrono::duration<double, std::milli>;
+  constexpr int iterations = 50;
+  ra2yrproto::ra2yr::StorageValue S;
+  *S.mutable_game_state() = make_game_state(4000);
+  const FrameSnapshot F(S.game_state());
+
+  // Previous implementation: full copy under the storage lock, serialized
+  // for each client.
+  auto t0 = std::chrono::steady_clock::now();
+  std::size_t size = 0U;
+  for (int i = 0; i < iterations; i++) {
+    ra2yrproto::ra2yr::GameState C;
+    C.CopyFrom(S.game_state());
+    size = C.SerializeAsString().size();
+  }
+  const auto t_copy = ms(std::chrono::steady_clock::now() - t0) / iterations;
+  iprintf("mask=none size={} copy_under_lock={:.3f}ms", size, t_copy.count());
+
+  for (const auto& paths : std::vector<std::vector<std::string>>{
+           {"objects", "houses"}, {"factories"}, {"current_frame", "crc"}}) {
+    // ReadValue: only the selected fields are copied under the lock
+    const auto mask = make_mask(paths);
+    gpb::FieldMask sv_mask;
+    for (const auto& p : paths) {
+      sv_mask.add_paths("game_state." + p);
+    }
+    t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      ra2yrproto::ra2yr::StorageValue R;
+      protocol::copy_fields(&R, S, sv_mask);
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+    // GetGameState: projected from the shared snapshot, outside the lock
+    for (int i = 0; i < iterations; i++) {
+      size = F.project(mask).size();
+    }
+    const auto t2 = std::chrono::steady_clock::now();
+    iprintf("mask={} size={} read_value_under_lock={:.3f}ms "
+            "get_game_state_project={:.3f}ms",
+            mask.ShortDebugString(), size, (ms(t1 - t0) / iterations).count(),
+            (ms(t2 - t1) / iterations).count());
+    ASSERT_LT(size, F.bytes().size());
+  }
+}
+
+TEST(SoATest, ColumnarGameState) {
+  auto G = make_game_state(100);
+  for (int i = 0; i < G.objects_size(); i++) {
+    auto* c = G.mutable_objects(i)->mutable_coordinates();
+    c->set_x(i * 256);
+    c->set_y(i * 128);
+  }
+  G.mutable_objects(1)->mutable_coordinates()->set_z(-5);
+  G.mutable_houses(2)->set_name("house");
+  G.mutable_factories(1)->add_queued_objects(1U);
+  G.mutable_factories(1)->add_queued_objects(2U);
+  const FrameSnapshot F(G);
+
+  ra2yrproto::ra2yr::ObjectsSoA O;
+  to_soa(G.objects(), &O);
+  ASSERT_EQ(O.pointer_self_size(), G.objects_size());
+  ASSERT_EQ(O.z_size(), G.objects_size());
+  for (int i = 0; i < G.objects_size(); i++) {
+    ASSERT_EQ(O.pointer_self(i), G.objects(i).pointer_self());
+    ASSERT_EQ(O.health(i), G.objects(i).health());
+    ASSERT_EQ(O.x(i), G.objects(i).coordinates().x());
+    ASSERT_EQ(O.y(i), G.objects(i).coordinates().y());
+    ASSERT_EQ(O.z(i), G.objects(i).coordinates().z());
+  }
+  ra2yrproto::ra2yr::FactoriesSoA FS;
+  to_soa(G.factories(), &FS);
+  ASSERT_EQ(FS.object_size(), G.factories_size());
+  ASSERT_EQ(FS.queued_objects_count(1), 2U);
+  ASSERT_EQ(FS.queued_objects_size(), 2);
+  ra2yrproto::ra2yr::HousesSoA HS;
+  to_soa(G.houses(), &HS);
+
+  ra2yrproto::commands::GetGameState A;
+  std::string res;
+  serialize_game_state(F, A, &res);
+  ra2yrproto::commands::GetGameState R;
+  ASSERT_TRUE(R.ParseFromString(res));
+  ASSERT_EQ(R.state().SerializeAsString(), F.bytes());
+  ASSERT_FALSE(R.has_objects_soa());
+
+  // Objects, houses and factories are replaced by columns
+  A.set_columnar(true);
+  serialize_game_state(F, A, &res);
+  ASSERT_TRUE(R.ParseFromString(res));
+  ASSERT_TRUE(R.state().objects().empty());
+  ASSERT_TRUE(R.state().factories().empty());
+  ASSERT_EQ(R.state().cells_difference_size(), G.cells_difference_size());
+  ASSERT_EQ(R.objects_soa().SerializeAsString(), O.SerializeAsString());
+  ASSERT_EQ(R.houses_soa().SerializeAsString(), HS.SerializeAsString());
+  ASSERT_EQ(R.houses_soa().name(2), "house");
+  ASSERT_EQ(R.factories_soa().SerializeAsString(), FS.SerializeAsString());
+
+  // Only the selected fields
+  *A.mutable_fields() = make_mask({"current_frame", "objects"});
+  serialize_game_state(F, A, &res);
+  ASSERT_TRUE(R.ParseFromString(res));
+  ASSERT_EQ(R.state().current_frame(), G.current_frame());
+  ASSERT_TRUE(R.state().cells_difference().empty());
+  ASSERT_TRUE(R.has_objects_soa());
+  ASSERT_FALSE(R.has_houses_soa());
+  ASSERT_FALSE(R.has_factories_soa());
+
+  // Nested paths select the top level field
+  *A.mutable_fields() = make_mask({"objects.health"});
+  serialize_game_state(F, A, &res);
+  ASSERT_TRUE(R.ParseFromString(res));
+  ASSERT_TRUE(R.state().objects().empty());
+  ASSERT_EQ(R.state().current_frame(), 0U);
+  ASSERT_EQ(R.objects_soa().SerializeAsString(), O.SerializeAsString());
+  ASSERT_FALSE(R.has_houses_soa());
+  ASSERT_FALSE(R.has_factories_soa());
+}
+
+namespace {
+ra2yrproto::PollResults make_poll_results(const std::size_t count,
+                                          const std::size_t value_size) {
+  ra2yrproto::PollResults P;
+  ra2yrproto::commands::StoreValue S;
+  S.set_key("key");
+  S.set_value(std::string(value_size, 'X'));
+  for (std::size_t i = 0U; i < count; i++) {
+    auto* r = P.mutable_result()->add_results();
+    r->set_command_id(i + 1U);
+    r->mutable_result()->PackFrom(S);
+  }
+  return P;
+}
+}  // namespace
+
+TEST(ResponseTest, SerializeResponseMatchesMakeResponse) {
+  gpb::util::MessageDifferencer D;
+  auto P = make_poll_results(3U, 100U);
+  for (auto code : {RESPONSE_OK, RESPONSE_ERROR}) {
+    auto bytes = serialize_response(P, code);
+    ra2yrproto::Response R;
+    ASSERT_TRUE(R.ParseFromArray(bytes.data(), bytes.size()));
+    ASSERT_TRUE(D.Equals(R, make_response(ra2yrproto::PollResults(P), code)));
+    ra2yrproto::PollResults P1;
+    ASSERT_TRUE(R.body().UnpackTo(&P1));
+    ASSERT_TRUE(D.Equals(P, P1));
+    // Serializing into an existing buffer replaces it's contents
+    std::string out(10U, 'X');
+    serialize_response(P, code, 0U, &out);
+    ASSERT_EQ(out, std::string(bytes.begin(), bytes.end()));
+    // Request id is echoed back
+    constexpr u64 request_id = 1234567U;
+    bytes = serialize_response(P, code, request_id);
+    ASSERT_TRUE(R.ParseFromArray(bytes.data(), bytes.size()));
+    ASSERT_EQ(R.request_id(), request_id);
+    ASSERT_TRUE(D.Equals(
+        R, make_response(ra2yrproto::PollResults(P), code, request_id)));
+  }
+  // Pushed message with a pre-serialized body
+  std::string out;
+  serialize_push(P.GetDescriptor()->full_name(), P.SerializeAsString(), 7U,
+                 &out);
+  ra2yrproto::Response R0;
+  ASSERT_TRUE(R0.ParseFromString(out));
+  ASSERT_EQ(R0.subscription_id(), 7U);
+  ASSERT_EQ(R0.request_id(), 0U);
+  ra2yrproto::PollResults P0;
+  ASSERT_TRUE(R0.body().UnpackTo(&P0));
+  ASSERT_TRUE(D.Equals(P, P0));
+  // Empty body
+  auto bytes = serialize_response(ra2yrproto::RunCommandAck());
+  ra2yrproto::Response R;
+  ASSERT_TRUE(R.ParseFromArray(bytes.data(), bytes.size()));
+  ASSERT_TRUE(R.body().Is<ra2yrproto::RunCommandAck>());
+}
+
+TEST(ResponseTest, BenchmarkSerializeResponse) {
+  constexpr int iterations = 500;
+  for (std::size_t value_size : {16U, 1024U, 65536U}) {
+    auto P = make_poll_results(8U, value_size);
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      auto b = to_vecu8(make_response(ra2yrproto::PollResults(P)));
+      ASSERT_FALSE(b.empty());
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      auto b = serialize_response(P);
+      ASSERT_FALSE(b.empty());
+    }
+    const auto t2 = std::chrono::steady_clock::now();
+    using ms = std::chrono::duration<double, std::milli>;
+    iprintf("value_size={} iterations={} make_response={:.2f}ms "
+            "serialize_response={:.2f}ms",
+            value_size, iterations, ms(t1 - t0).count(),
+            ms(t2 - t1).count());
+  }
+}
+
+TEST(RequestTest, PeekRequestId) {
+  auto C = create_command(make_poll_results(2U, 100U), ra2yrproto::POLL);
+  auto peek = [](const vecu8& b) {
+    return peek_request_id(
+        std::string_view(reinterpret_cast<const char*>(b.data()), b.size()));
+  };
+  ASSERT_EQ(peek(to_vecu8(C)), 0U);
+  C.set_request_id(1U << 20U);
+  C.set_blocking(true);
+  auto bytes = to_vecu8(C);
+  ASSERT_EQ(peek(bytes), 1U << 20U);
+  // Truncated message
+  bytes.pop_back();
+  ASSERT_EQ(peek(bytes), 0U);
+  ASSERT_EQ(peek_request_id(R"({"requestId": "1"})"), 0U);
+}
+
+TEST(RequestTest, IsBlockingRequest) {
+  auto blocking = [](const ra2yrproto::Command& C) {
+    return is_blocking_request(C.SerializeAsString());
+  };
+  auto P = make_poll_results(2U, 100U);
+  ASSERT_TRUE(blocking(create_command(P, ra2yrproto::POLL)));
+  ASSERT_TRUE(blocking(create_command(P, ra2yrproto::POLL_BLOCKING)));
+  auto C = create_command(P, ra2yrproto::CLIENT_COMMAND);
+  ASSERT_FALSE(blocking(C));
+  C.set_blocking(true);
+  ASSERT_TRUE(blocking(C));
+  ASSERT_FALSE(blocking(create_command(P, ra2yrproto::SHUTDOWN)));
+  ASSERT_FALSE(is_blocking_request(R"({"commandType": "POLL"})"));
+}
+
+TEST(RequestTest, LengthPrefix) {
+  std::array<u8, MAX_LENGTH_PREFIX_SIZE> buf;
+  for (u64 length : {0ULL, 127ULL, 128ULL, 300ULL, 1ULL << 35U, ~0ULL}) {
+    const auto n = write_length_prefix(buf.data(), length);
+    u64 v = 0U;
+    ASSERT_EQ(read_length_prefix(buf.data(), n, &v), n);
+    ASSERT_EQ(v, length);
+    // Incomplete prefix
+    ASSERT_EQ(read_length_prefix(buf.data(), n - 1U, &v), 0U);
+  }
+  buf.fill(0xFFU);
+  u64 v = 0U;
+  ASSERT_THROW(read_length_prefix(buf.data(), buf.size(), &v), protocol_error);
+}
+
+TEST(DeltaTest, FieldDiffRoundTrip) {
+  gpb::util::MessageDifferencer D;
+  ra2yrproto::ra2yr::GameState G0;
+  G0.set_current_frame(1U);
+  G0.set_crc(1234U);
+  for (int i = 0; i < 3; i++) {
+    auto* h = G0.add_houses();
+    h->set_self(0x1000 + i);
+    h->set_money(1000 * i);
+    h->set_name(fmt::format("house{}", i));
+  }
+  for (int i = 0; i < 16; i++) {
+    auto* o = G0.add_objects();
+    o->set_pointer_self(0x2000 + i);
+    o->set_health(100);
+  }
+
+  auto G1 = G0;
+  G1.set_current_frame(2U);
+  G1.mutable_objects(3)->set_health(50);
+  auto G2 = G1;
+  G2.set_current_frame(3U);
+  G2.clear_crc();
+  G2.clear_objects();
+  auto G3 = G2;
+  G3.set_current_frame(4U);
+  G3.mutable_houses(0)->set_money(500);
+  G3.set_crc(1U);
+
+  std::string changed;
+  std::vector<u32> cleared;
+  ra2yrproto::ra2yr::GameState S;
+  std::string prev;
+  for (const auto* cur : {&G0, &G1, &G2, &G3, &G3}) {
+    auto bytes = cur->SerializeAsString();
+    diff_fields(prev, bytes, &changed, &cleared);
+    apply_field_diff(&S, changed, cleared);
+    ASSERT_TRUE(D.Equals(S, *cur));
+    ASSERT_LE(changed.size(), bytes.size());
+    prev = bytes;
+  }
+  // Unchanged message has an empty difference
+  ASSERT_TRUE(changed.empty());
+  ASSERT_TRUE(cleared.empty());
+
+  // Only changed fields are included
+  diff_fields(G0.SerializeAsString(), G1.SerializeAsString(), &changed,
+              &cleared);
+  ra2yrproto::ra2yr::GameState C;
+  ASSERT_TRUE(C.ParseFromString(changed));
+  ASSERT_EQ(C.current_frame(), 2U);
+  ASSERT_EQ(C.objects_size(), G1.objects_size());
+  ASSERT_TRUE(C.houses().empty());
+  diff_fields(G1.SerializeAsString(), G2.SerializeAsString(), &changed,
+              &cleared);
+  ASSERT_EQ(cleared.size(), 2U);
+
+  ASSERT_THROW(diff_fields("", "\xff", &changed, &cleared), protocol_error);
+}
+
+namespace {
+/// Advance a game where objects and factories come and go, and some of them
+/// change on each frame.
+void advance_game_state(ra2yrproto::ra2yr::GameState* G, const u32 frame,
+                        std::mt19937* rng, u32* next_id) {
+  G->set_current_frame(frame);
+  G->set_crc((*rng)());
+  auto* O = G->mutable_objects();
+  for (int i = 0; i < 5; i++) {
+    O->Mutable((*rng)() % O->size())->set_health((*rng)() % 100);
+  }
+  if (frame % 3U == 0U) {
+    O->DeleteSubrange((*rng)() % O->size(), 1);
+    auto* o = G->add_objects();
+    o->set_pointer_self((*next_id)++);
+    o->set_health(100);
+  }
+  G->mutable_houses(frame % 8U)->set_money((*rng)() % 10000);
+  if (frame % 7U == 0U && !G->factories().empty()) {
+    G->mutable_factories()->RemoveLast();
+  }
+  if (frame % 50U == 0U) {
+    // Reordered objects are sent as a whole
+    std::swap(*O->Mutable(0), *O->Mutable(O->size() - 1));
+  }
+  G->clear_cells_difference();
+  for (u32 i = 0U; i < frame % 4U; i++) {
+    G->add_cells_difference()->set_index((*rng)() % 10000U);
+  }
+}
+}  // namespace
+
+TEST_F(TemporaryDirectoryTest, DeltaReconstructRecording) {
+  using ra2yrproto::ra2yr::GameState;
+  fs::path record_path = temp_dir_path_;
+  record_path /= "record.pb.gz";
+  constexpr u32 n_frames = 200U;
+  constexpr u32 keyframe_interval = 30U;
+
+  {
+    auto record_out = std::make_shared<std::ofstream>(
+        record_path.string(), std::ios_base::out | std::ios_base::binary);
+    protocol::MessageOstream MS(record_out, true);
+    std::mt19937 rng(1234U);
+    auto G = make_game_state(500);
+    u32 next_id = 0x20000U;
+    for (u32 frame = 1U; frame <= n_frames; frame++) {
+      advance_game_state(&G, frame, &rng, &next_id);
+      ASSERT_TRUE(MS.write(G));
+    }
+  }
+
+  auto is = std::make_shared<std::ifstream>(
+      record_path.string(), std::ios_base::in | std::ios_base::binary);
+  protocol::MessageIstream MS(is, true);
+  DeltaEncoder E(keyframe_interval);
+  DeltaDecoder D;
+  GameState G;
+  ra2yrproto::ra2yr::GameStateDelta M;
+  std::size_t full_size = 0U;
+  std::size_t delta_size = 0U;
+  u32 count = 0U;
+  for (; MS.read(&G); count++) {
+    const auto F = std::make_shared<const FrameSnapshot>(G);
+    E.encode(F, &M);
+    ASSERT_EQ(M.keyframe(), count % (keyframe_interval + 1U) == 0U);
+    if (G.current_frame() % 50U == 0U && !M.keyframe()) {
+      ASSERT_TRUE(std::none_of(
+          M.elements().begin(), M.elements().end(), [](const auto& R) {
+            return R.field() == GameState::kObjectsFieldNumber;
+          }));
+    }
+    // Through the wire
+    ra2yrproto::ra2yr::GameStateDelta W;
+    ASSERT_TRUE(W.ParseFromString(M.SerializeAsString()));
+    ASSERT_TRUE(D.apply(W));
+    ASSERT_EQ(D.current_frame(), G.current_frame());
+    ASSERT_EQ(D.bytes(), F->bytes());
+    full_size += F->bytes().size();
+    delta_size += M.ByteSizeLong();
+  }
+  ASSERT_EQ(count, n_frames);
+  iprintf("frames={} full_size={} delta_size={}", count, full_size,
+          delta_size);
+  ASSERT_LT(delta_size * 4U, full_size);
+
+  // Deltas after a dropped one are ignored until the next keyframe
+  DeltaEncoder E2(keyframe_interval);
+  DeltaDecoder D2;
+  GameState S;
+  for (u32 frame = 1U; frame <= keyframe_interval + 2U; frame++) {
+    S.set_current_frame(frame);
+    S.add_objects()->set_pointer_self(frame);
+    E2.encode(std::make_shared<const FrameSnapshot>(S), &M);
+    if (frame == 2U) {
+      continue;
+    }
+    ASSERT_EQ(D2.apply(M), frame == 1U || M.keyframe());
+  }
+  ASSERT_EQ(D2.current_frame(), keyframe_interval + 2U);
+  GameState R;
+  D2.state(&R);
+  ASSERT_EQ(R.objects_size(), S.objects_size());
+}
+
+TEST_F(TemporaryDirectoryTest, RecordRandomAccess) {
+  using ms = std::chrono::duration<double, std::milli>;
+  const auto record_path = (temp_dir_path_ / "record.bin").string();
+  const auto legacy_path = (temp_dir_path_ / "record.pb.gz").string();
+  constexpr u32 n_frames = 1000U;
+  constexpr u32 block_frames = 64U;
+
+  std::vector<std::string> frames;
+  {
+    std::mt19937 rng(1234U);
+    auto G = make_game_state(500);
+    u32 next_id = 0x20000U;
+    record::RecordWriter W(
+        std::make_shared<std::ofstream>(
+            record_path, std::ios_base::out | std::ios_base::binary),
+        block_frames);
+    protocol::MessageOstream MS(
+        std::make_shared<std::ofstream>(
+            legacy_path, std::ios_base::out | std::ios_base::binary),
+        true);
+    for (u32 frame = 1U; frame <= n_frames; frame++) {
+      advance_game_state(&G, frame, &rng, &next_id);
+      auto F = std::make_shared<const FrameSnapshot>(G);
+      W.write(F);
+      ASSERT_TRUE(MS.write(F->bytes()));
+      frames.push_back(F->bytes());
+    }
+  }
+  ASSERT_TRUE(record::is_record_file(record_path));
+  ASSERT_FALSE(record::is_record_file(legacy_path));
+
+  auto read_range = [&](record::RecordReader* R, const u32 first,
+                        const u32 last) {
+    u32 next = first;
+    R->read_frames(first, last, [&](const u32 frame, std::string_view s) {
+      ASSERT_EQ(frame, next++);
+      ASSERT_EQ(s, frames.at(frame - 1U));
+    });
+    ASSERT_EQ(next, std::min(last, n_frames) + 1U);
+  };
+
+  record::RecordReader R(record_path);
+  ASSERT_TRUE(R.indexed());
+  ASSERT_EQ(R.blocks().size(), (n_frames + block_frames - 1U) / block_frames);
+  auto t0 = std::chrono::steady_clock::now();
+  read_range(&R, 900U, 920U);
+  const auto t_range = ms(std::chrono::steady_clock::now() - t0);
+  read_range(&R, 1U, n_frames);
+  read_range(&R, 64U, 65U);
+
+  // Parallel conversion preserves frame order
+  for (const unsigned threads : {0U, 1U, 4U}) {
+    std::string out;
+    std::size_t n_blocks = 0U;
+    t0 = std::chrono::steady_clock::now();
+    R.convert_frames(
+        100U, 900U,
+        [](const u32 frame, std::string_view s, std::string* dst) {
+          dst->append(fmt::format("{}:{};", frame, s.size()));
+        },
+        [&](std::string_view s) {
+          out.append(s);
+          n_blocks++;
+        },
+        threads);
+    const auto t_convert = ms(std::chrono::steady_clock::now() - t0);
+    std::string expected;
+    for (u32 frame = 100U; frame <= 900U; frame++) {
+      expected.append(
+          fmt::format("{}:{};", frame, frames.at(frame - 1U).size()));
+    }
+    ASSERT_EQ(out, expected);
+    ASSERT_EQ(n_blocks, 899U / block_frames - 99U / block_frames + 1U);
+    iprintf("threads={} convert={:.3f}ms", threads, t_convert.count());
+  }
+  // Conversion errors are propagated to the caller
+  ASSERT_THROW(R.convert_frames(
+                   1U, n_frames,
+                   [](const u32 frame, std::string_view, std::string*) {
+                     if (frame == 500U) {
+                       throw std::runtime_error("convert");
+                     }
+                   },
+                   [](std::string_view) {}, 2U),
+               std::runtime_error);
+
+  t0 = std::chrono::steady_clock::now();
+  u32 count = 0U;
+  protocol::dump_messages(legacy_path, ra2yrproto::ra2yr::GameState(),
+                          [&count](auto* M) {
+                            (void)M;
+                            count++;
+                          });
+  const auto t_legacy = ms(std::chrono::steady_clock::now() - t0);
+  ASSERT_EQ(count, n_frames);
+  iprintf("frames={} record_size={} legacy_size={} range={:.3f}ms "
+          "legacy_full_read={:.3f}ms",
+          n_frames, fs::file_size(record_path), fs::file_size(legacy_path),
+          t_range.count(), t_legacy.count());
+
+  // Without index, e.g. after a crash, blocks are found by scanning
+  const auto last = R.blocks().back();
+  fs::resize_file(record_path, last.offset + sizeof(record::BlockHeader) +
+                                   last.header.size);
+  record::RecordReader R2(record_path);
+  ASSERT_FALSE(R2.indexed());
+  ASSERT_EQ(R2.blocks().size(), R.blocks().size());
+  read_range(&R2, 500U, 700U);
+  // Truncated last block is skipped
+  fs::resize_file(record_path, last.offset + 100U);
+  record::RecordReader R3(record_path);
+  ASSERT_EQ(R3.blocks().size(), R.blocks().size() - 1U);
+  ASSERT_THROW(record::RecordReader((temp_dir_path_ / "nonexistent").string()),
+               std::runtime_error);
+  ASSERT_THROW(record::RecordReader{legacy_path}, ra2yrcpp::protocol_error);
+}
+
+namespace {
+/// Output stream whose writes block while the gate is closed, to simulate a
+/// slow disk.
+class GatedStream : public std::ostream {
+  class Buf : public std::streambuf {
+   public:
+    std::string data;
+    std::atomic_bool closed{false};
+    std::atomic_bool waiting{false};
+
+   protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+      while (closed) {
+        waiting = true;
+        std::this_thread::sleep_for(1ms);
+      }
+      waiting = false;
+      data.append(s, n);
+      return n;
+    }
+
+    int_type overflow(int_type c) override {
+      if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        const char ch = traits_type::to_char_type(c);
+        (void)xsputn(&ch, 1);
+      }
+      return traits_type::not_eof(c);
+    }
+  };
+
+ public:
+  GatedStream() : std::ostream(nullptr) { rdbuf(&buf_); }
+
+  void close_gate() { buf_.closed = true; }
+
+  void open_gate() { buf_.closed = false; }
+
+  bool waiting() const { return buf_.waiting; }
+
+  const std::string& data() const { return buf_.data; }
+
+ private:
+  Buf buf_;
+};
+}  // namespace
+
+TEST_F(TemporaryDirectoryTest, RecorderDropPolicy) {
+  constexpr u32 n_frames = 20U;
+  constexpr std::size_t queue_size = 4U;
+  std::vector<frame_ptr> frames;
+  {
+    std::mt19937 rng(1234U);
+    auto G = make_game_state(100);
+    u32 next_id = 0x20000U;
+    for (u32 frame = 1U; frame <= n_frames; frame++) {
+      advance_game_state(&G, frame, &rng, &next_id);
+      frames.push_back(std::make_shared<const FrameSnapshot>(G));
+    }
+  }
+
+  struct Case {
+    record::Recorder::policy_t policy;
+    std::vector<u32> expected;
+    u64 dropped;
+    u64 coalesced;
+  };
+  const std::vector<Case> cases = {
+      {ra2yrproto::commands::RECORD_DROP_NEWEST, {1, 2, 3, 4, 5}, 15U, 0U},
+      {ra2yrproto::commands::RECORD_DROP_OLDEST, {1, 17, 18, 19, 20}, 15U, 0U},
+      {ra2yrproto::commands::RECORD_COALESCE, {1, 2, 3, 4, 5, 20}, 0U, 14U}};
+
+  for (const auto& C : cases) {
+    const auto path = (temp_dir_path_ / "record.bin").string();
+    auto os = std::make_shared<GatedStream>();
+    {
+      record::Recorder R(std::make_unique<record::RecordWriter>(os, 1U, 0U),
+                         queue_size);
+      // Block the writer thread on the first frame
+      os->close_gate();
+      R.push(frames[0], C.policy);
+      while (!os->waiting()) {
+        std::this_thread::sleep_for(1ms);
+      }
+      for (u32 i = 1U; i < n_frames; i++) {
+        R.push(frames[i], C.policy);
+      }
+      os->open_gate();
+
+      ra2yrproto::commands::RecorderStats S;
+      const u64 n_queued = C.expected.size() - (C.coalesced > 0U ? 1U : 0U);
+      while (S.frames_written() < n_queued) {
+        std::this_thread::sleep_for(1ms);
+        R.stats(&S);
+      }
+      ASSERT_EQ(S.frames_dropped(), C.dropped);
+      ASSERT_EQ(S.frames_coalesced(), C.coalesced);
+      ASSERT_EQ(S.queue_high_water(), queue_size);
+      ASSERT_EQ(S.queue_size(), queue_size);
+      ASSERT_GT(S.bytes_written(), 0U);
+    }
+    {
+      std::ofstream f(path, std::ios_base::out | std::ios_base::binary);
+      f << os->data();
+    }
+
+    std::vector<u32> written;
+    record::RecordReader RR(path);
+    ASSERT_TRUE(RR.indexed());
+    RR.read_frames(0U, n_frames, [&](const u32 frame, std::string_view s) {
+      ASSERT_EQ(s, frames.at(frame - 1U)->bytes());
+      written.push_back(frame);
+    });
+    ASSERT_EQ(written, C.expected);
+  }
+}
+
+TEST(RecordTest, BenchmarkParallelCompression) {
+  using ms = std::chrono::duration<double, std::milli>;
+  constexpr u32 n_frames = 256U;
+  constexpr u32 block_frames = 16U;
+
+  // Frames with lots of changing map data
+  std::vector<frame_ptr> frames;
+  std::size_t raw_size = 0U;
+  {
+    std::mt19937 rng(1234U);
+    auto G = make_game_state(4000);
+    u32 next_id = 0x20000U;
+    for (u32 frame = 1U; frame <= n_frames; frame++) {
+      advance_game_state(&G, frame, &rng, &next_id);
+      for (int i = 0; i < 4000; i++) {
+        auto* c = G.add_cells_difference();
+        c->set_index(rng() % 40000U);
+        c->set_height(rng() % 16U);
+        c->set_tiberium_value(rng() % 8U);
+      }
+      frames.push_back(std::make_shared<const FrameSnapshot>(G));
+      raw_size += frames.back()->bytes().size();
+    }
+  }
+
+  std::string expected;
+  for (const unsigned threads : {0U, 1U, 2U, 4U}) {
+    auto os = std::make_shared<std::ostringstream>();
+    const auto t0 = std::chrono::steady_clock::now();
+    {
+      record::RecordWriter W(os, block_frames, threads);
+      for (const auto& F : frames) {
+        W.write(F);
+      }
+    }
+    const auto t = ms(std::chrono::steady_clock::now() - t0);
+    iprintf("threads={} frames={} raw_size={} size={} time={:.3f}ms "
+            "throughput={:.1f}MB/s",
+            threads, n_frames, raw_size, os->str().size(), t.count(),
+            raw_size / 1e3 / t.count());
+    // Blocks are written in order regardless of the number of threads
+    if (expected.empty()) {
+      expected = os->str();
+    }
+    ASSERT_EQ(os->str(), expected);
+  }
+}
+
+TEST_F(TemporaryDirectoryTest, TrafficRecord) {
+  using ra2yrproto::ra2yr::TunnelPacket;
+  const auto path = (temp_dir_path_ / "traffic.bin").string();
+  constexpr u32 n_threads = 4U;
+  constexpr u32 n_packets = 1000U;
+
+  auto payload = [](const u32 thread, const u32 seq) {
+    return fmt::format("{}:{}:{}", thread, seq, std::string(seq % 300U, 'x'));
+  };
+  {
+    traffic::TrafficRecorder T(
+        std::make_shared<std::ofstream>(
+            path, std::ios_base::out | std::ios_base::binary),
+        n_threads * n_packets);
+    std::vector<std::thread> threads;
+    for (u32 i = 0U; i < n_threads; i++) {
+      threads.emplace_back([&T, &payload, i]() {
+        for (u32 j = 0U; j < n_packets; j++) {
+          const auto p = payload(i, j);
+          T.push(j % 2U, (j + 1U) % 2U, p.data(), p.size());
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+
+  // Packets of each thread are read in order
+  std::vector<u32> next(n_threads, 0U);
+  std::vector<u64> last_ts(n_threads, 0U);
+  std::size_t n_read = 0U;
+  traffic::read_traffic(path, [&](const TunnelPacket& P) {
+    const u32 i = std::stoul(P.data().substr(0, P.data().find(':')));
+    ASSERT_LT(i, n_threads);
+    const u32 j = next[i]++;
+    ASSERT_EQ(P.data(), payload(i, j));
+    ASSERT_EQ(P.source(), j % 2U);
+    ASSERT_EQ(P.destination(), (j + 1U) % 2U);
+    ASSERT_GE(P.timestamp(), last_ts[i]);
+    last_ts[i] = P.timestamp();
+    n_read++;
+  });
+  ASSERT_EQ(n_read, n_threads * n_packets);
+
+  // Truncated last packet is skipped
+  fs::resize_file(path, fs::file_size(path) - 1U);
+  n_read = 0U;
+  traffic::read_traffic(path, [&](const TunnelPacket&) { n_read++; });
+  ASSERT_EQ(n_read, n_threads * n_packets - 1U);
+
+  // Packets are dropped instead of blocking if the queue is full
+  {
+    traffic::TrafficRecorder T(std::make_shared<std::ostringstream>(), 4U);
+    for (u32 j = 0U; j < 100U; j++) {
+      T.push(0U, 1U, "abc", 3U);
+    }
+    ASSERT_GT(T.dropped(), 0U);
+    while (T.written() + T.dropped() < 100U) {
+      std::this_thread::sleep_for(1ms);
+    }
+  }
+
+  // Traffic dumps of older versions are still readable
+  const auto legacy_path = (temp_dir_path_ / "traffic.pb.gz").string();
+  {
+    protocol::MessageOstream MS(
+        std::make_shared<std::ofstream>(
+            legacy_path, std::ios_base::out | std::ios_base::binary),
+        true);
+    for (u32 j = 0U; j < 10U; j++) {
+      TunnelPacket P;
+      P.set_source(1U);
+      P.set_data(payload(0U, j));
+      ASSERT_TRUE(MS.write(P));
+    }
+  }
+  n_read = 0U;
+  traffic::read_traffic(legacy_path, [&](const TunnelPacket& P) {
+    ASSERT_EQ(P.data(), payload(0U, n_read));
+    ASSERT_EQ(P.timestamp(), 0U);
+    n_read++;
+  });
+  ASSERT_EQ(n_read, 10U);
+}